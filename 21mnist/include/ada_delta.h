@@ -6,6 +6,124 @@
 
 #include "mnist_util.h"
 #include "tensor.h"
+#include "checkpoint.h"
+
+/**
+   @brief AdaDelta update of a single element
+   @param (w) the parameter
+   @param (g) its gradient (already multiplied by grad_scale)
+   @param (v) the running average of g^2
+   @param (u) the running average of Δx^2
+   @details does for an element what the element-wise tensor
+   operations of the original update did (in the same order, so
+   results are identical), keeping intermediates in registers; an
+   update is thus a single sweep over w, gw, u and v
+*/
+__device__ __host__
+static inline void ada_delta_step(real& w, real g, real& v, real& u,
+                                  real lr, real rho, real eps) {
+  v = v * rho;
+  v += (1 - rho) * g * g;                        //  v(t) = ρv(t-1) + (1-ρ)g(t)^2
+  const real std = sqrt(v + eps);                //   std = √(v(t)+ε)
+  real dx = sqrt(u + eps);
+  dx = dx / std;
+  dx = dx * g;                                   //   Δx = √(u(t)+ε) /√(v(t)+ε) g(t)
+  u = u * rho;
+  u += (1 - rho) * dx * dx;                      //  u(t) = ρu(t-1) + (1-ρ)Δx^2
+  w += -lr * dx;                                 // θ(t) = θ(t-1) - γΔx
+}
+
+/**
+   @brief parameter tensors of a network updated together
+   (multi-tensor apply)
+   @details each entry has the addresses of the elements of a
+   parameter, its gradient and its optimizer state (host or device
+   addresses) and the hyper parameters of its optimizer.
+   update_cpu updates all of them in a single OpenMP parallel
+   region and update_cuda in a single kernel launch, whose threads
+   stride over the concatenation of all entries; the list is passed
+   to the kernel by value, so it need not be on the device.
+   @sa AdaDelta::add_to
+*/
+struct ada_delta_list {
+  static const int max_tensors = 16; /**< the maximum number of entries */
+  /**
+     @brief an entry
+  */
+  struct item_t {
+    real * w;                   /**< parameter */
+    real * gw;                  /**< gradient */
+    real * v;                   /**< AdaDelta v */
+    real * u;                   /**< AdaDelta u */
+    real lr;                    /**< learning rate */
+    real rho;                   /**< ρ */
+    real eps;                   /**< ε */
+    real grad_scale;            /**< multiplied to gradients */
+  };
+  item_t items[max_tensors];    /**< entries */
+  long begin[max_tensors + 1];  /**< entry i has elements begin[i] ... begin[i+1]-1 of the concatenation */
+  int n;                        /**< the number of entries */
+  /**
+     @brief make the list empty
+  */
+  void init() {
+    n = 0;
+    begin[0] = 0;
+  }
+  /**
+     @brief add an entry
+  */
+  void add(item_t it, long n_elems) {
+    assert(n < max_tensors);
+    items[n] = it;
+    begin[n + 1] = begin[n] + n_elems;
+    n++;
+  }
+  /**
+     @brief update all entries with host addresses on CPU
+  */
+  void update_cpu() {
+#pragma omp parallel
+    for (int i = 0; i < n; i++) {
+      item_t it = items[i];
+      const long m = begin[i + 1] - begin[i];
+#pragma omp for simd nowait
+      for (long k = 0; k < m; k++) {
+        ada_delta_step(it.w[k], it.gw[k] * it.grad_scale, it.v[k], it.u[k],
+                       it.lr, it.rho, it.eps);
+      }
+    }
+  }
+#if __CUDACC__
+  /**
+     @brief the device function of update_cuda (a thread)
+  */
+  __device__
+  void update_cuda_device() {
+    const long nt = (long)gridDim.x * blockDim.x;
+    int i = 0;
+    for (long k = (long)blockIdx.x * blockDim.x + threadIdx.x; k < begin[n]; k += nt) {
+      while (begin[i + 1] <= k) i++;
+      const item_t& it = items[i];
+      const long e = k - begin[i];
+      ada_delta_step(it.w[e], it.gw[e] * it.grad_scale, it.v[e], it.u[e],
+                     it.lr, it.rho, it.eps);
+    }
+  }
+#endif
+  /**
+     @brief update all entries with device addresses in a single kernel
+  */
+  void update_cuda() {
+#if __CUDACC__
+    const int n_threads = 256;
+    const long n_blocks = (begin[n] + n_threads - 1) / n_threads;
+    launch_and_sync((update_multi_cuda_global<<<(n_blocks < 1024 ? n_blocks : 1024),n_threads>>>(*this)));
+#else
+    err_cuda_code_non_cuda_compiler("update_cuda");
+#endif
+  }
+};
 
 template<idx_t N0,idx_t N1=1,idx_t N2=1,idx_t N3=1>
 struct AdaDelta {
@@ -14,19 +132,17 @@ struct AdaDelta {
 #endif
   tensor<real,N0,N1,N2,N3> v;
   tensor<real,N0,N1,N2,N3> u;
-  tensor<real,N0,N1,N2,N3> std;
-  tensor<real,N0,N1,N2,N3> dx;
   real lr;
   real rho;
   real eps;
+  real grad_scale;              /**< gradients are multiplied by this before use (1/loss scale) */
   void init(real lr_, real rho_=0.9, real eps_=1.0e-6) {
     lr = lr_;
     rho = rho_;
     eps = eps_;
+    grad_scale = 1.0;
     u.init_const(N0, 0.0);
     v.init_const(N0, 0.0);
-    std.set_n0(N0);
-    dx.set_n0(N0);
   }
   /**
      @brief set the device pointer for this and all subobjects
@@ -44,14 +160,88 @@ struct AdaDelta {
     (void)dev;
 #endif
   }
+  /**
+     @brief set the factor by which gradients are multiplied before use
+     @param (s) the factor; 1/S when the loss is scaled by S (--loss-scale)
+  */
+  void set_grad_scale(real s) {
+    grad_scale = s;
+  }
+  /**
+     @brief update w with its gradient gw (serially)
+     @sa ada_delta_step
+  */
   __device__ __host__
   void update(tensor<real,N0,N1,N2,N3>& w, tensor<real,N0,N1,N2,N3>& gw) {
     assert(w.n0 == N0);
-    v.mul_(rho).addcmul_(1 - rho, gw, gw);     //  v(t) = ρv(t-1) + (1-ρ)g(t)^2
-    v.add(eps, std).sqrt_();                   //   std = √v(t)+ε
-    u.add(eps, dx).sqrt_().div_(std).mul_(gw); //   Δx = (√u(t)+ε) /(√v(t)+ε) g(t)
-    u.mul_(rho).addcmul_(1 - rho, dx, dx);     //  u(t) = ρu(t-1) + (1-ρ)Δx^2
-    w.add_(-lr, dx);                           // θ(t) = θ(t-1) - γΔx
+    const long m = (long)N0 * N1 * N2 * N3;
+    real * wp = &w.w[0][0][0][0];
+    real * gp = &gw.w[0][0][0][0];
+    real * vp = &v.w[0][0][0][0];
+    real * up = &u.w[0][0][0][0];
+    for (long k = 0; k < m; k++) {
+      ada_delta_step(wp[k], gp[k] * grad_scale, vp[k], up[k], lr, rho, eps);
+    }
+  }
+  /**
+     @brief update w with its gradient gw (with OpenMP threads and SIMD)
+     @sa ada_delta_step
+  */
+  void update_cpu_omp(tensor<real,N0,N1,N2,N3>& w, tensor<real,N0,N1,N2,N3>& gw) {
+    assert(w.n0 == N0);
+    const long m = (long)N0 * N1 * N2 * N3;
+    real * wp = &w.w[0][0][0][0];
+    real * gp = &gw.w[0][0][0][0];
+    real * vp = &v.w[0][0][0][0];
+    real * up = &u.w[0][0][0][0];
+#pragma omp parallel for simd
+    for (long k = 0; k < m; k++) {
+      ada_delta_step(wp[k], gp[k] * grad_scale, vp[k], up[k], lr, rho, eps);
+    }
+  }
+  /**
+     @brief add the update of w to a list updated together
+     @param (l) the list
+     @param (w) the parameter this optimizer updates
+     @param (gw) its gradient
+     @param (cuda) 1 if the list gets device addresses (for update_cuda)
+  */
+  void add_to(ada_delta_list& l, tensor<real,N0,N1,N2,N3>& w,
+              tensor<real,N0,N1,N2,N3>& gw, int cuda) {
+    ada_delta_list::item_t it;
+    if (cuda) {
+#if __CUDACC__
+      it.w = &w.dev->w[0][0][0][0];
+      it.gw = &gw.dev->w[0][0][0][0];
+      it.v = &dev->v.w[0][0][0][0];
+      it.u = &dev->u.w[0][0][0][0];
+#else
+      err_cuda_code_non_cuda_compiler("add_to");
+#endif
+    } else {
+      it.w = &w.w[0][0][0][0];
+      it.gw = &gw.w[0][0][0][0];
+      it.v = &v.w[0][0][0][0];
+      it.u = &u.w[0][0][0][0];
+    }
+    it.lr = lr;
+    it.rho = rho;
+    it.eps = eps;
+    it.grad_scale = grad_scale;
+    l.add(it, (long)N0 * N1 * N2 * N3);
+  }
+  /**
+     @brief add the state (v and u) to a checkpoint
+     @param (l) the checkpoint
+     @param (layer) the name of the layer
+     @param (param) the name of the parameter this optimizer updates (e.g., "w")
+  */
+  void add_state(checkpoint_list& l, const char * layer, const char * param) {
+    char v_name[16], u_name[16];
+    snprintf(v_name, sizeof(v_name), "%s.v", param);
+    snprintf(u_name, sizeof(u_name), "%s.u", param);
+    l.add(layer, v_name, v);
+    l.add(layer, u_name, u);
   }
 };
 
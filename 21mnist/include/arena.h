@@ -0,0 +1,298 @@
+/**
+   @file arena.h
+   @brief a memory arena whose offsets are planned from buffer lifetimes
+ */
+#pragma once
+
+#include "mnist_util.h"
+#include "tensor.h"
+#include "numa_util.h"
+
+/**
+   @brief a set of buffers placed in a single slab, where buffers
+   whose lifetimes do not overlap may share memory
+
+   @details the life of a computation is divided into steps
+   (e.g., forward of each layer, then backward of each layer,
+   see arena_add_chain) and a buffer is live at a set of steps
+   (a bit mask; at most 64 steps).  plan() places buffers
+   so that two buffers live at a common step never overlap.  it is
+   a greedy first-fit in decreasing order of sizes.
+   after plan(), alloc() allocates the slab and ptr(i) gives the
+   address of buffer i.  copies of an arena_t share the slab.
+
+   usage:
+   int i = a.add("conv1", "col", bytes, arena_t::steps(0, 0) | arena_t::steps(21, 21));
+   ...
+   a.plan(); a.alloc();
+   p = a.ptr(i);
+ */
+struct arena_t {
+  static const int max_bufs = 64;   /**< the maximum number of buffers */
+  /**
+     @brief a buffer
+   */
+  struct buf_t {
+    const char * owner;         /**< name of the owner (for logging) */
+    const char * name;          /**< name (for logging) */
+    size_t bytes;               /**< size (rounded up to TENSOR_ALIGN) */
+    uint64_t live;              /**< bit i is set if the buffer is live at step i */
+    size_t offset;              /**< offset in the slab (set by plan) */
+  };
+  buf_t bufs[max_bufs];         /**< buffers */
+  int n_bufs;                   /**< the number of buffers */
+  size_t peak;                  /**< the size of the slab (set by plan) */
+  char * slab;                  /**< the slab (set by alloc) */
+  /**
+     @brief initialize an empty arena
+  */
+  void init() {
+    n_bufs = 0;
+    peak = 0;
+    slab = 0;
+  }
+  /**
+     @brief the mask of steps a, a+1, ..., b
+  */
+  static uint64_t steps(int a, int b) {
+    assert(0 <= a);
+    assert(a <= b);
+    assert(b < 64);
+    uint64_t hi = (b == 63 ? ~0UL : (1UL << (b + 1)) - 1);
+    uint64_t lo = (1UL << a) - 1;
+    return hi & ~lo;
+  }
+  /**
+     @brief add a buffer
+     @param (owner) the name of the owner of the buffer (e.g., a layer)
+     @param (name) the name of the buffer
+     @param (bytes) the size of the buffer
+     @param (live) the mask of steps at which the buffer is live
+     @returns the index of the buffer
+  */
+  int add(const char * owner, const char * name, size_t bytes, uint64_t live) {
+    assert(n_bufs < max_bufs);
+    assert(!slab);
+    buf_t& b = bufs[n_bufs];
+    b.owner = owner;
+    b.name = name;
+    b.bytes = (bytes + TENSOR_ALIGN - 1) / TENSOR_ALIGN * TENSOR_ALIGN;
+    b.live = live;
+    b.offset = 0;
+    return n_bufs++;
+  }
+  /**
+     @brief make buffer i live also at step t
+  */
+  void use(int i, int t) {
+    assert(0 <= i && i < n_bufs);
+    bufs[i].live |= steps(t, t);
+  }
+  /**
+     @brief make buffer i live at all steps between its first and last steps
+  */
+  void fill(int i) {
+    assert(0 <= i && i < n_bufs);
+    uint64_t m = bufs[i].live;
+    if (m) {
+      int a = __builtin_ctzl(m);
+      int b = 63 - __builtin_clzl(m);
+      bufs[i].live = steps(a, b);
+    }
+  }
+  /**
+     @brief the total size of buffers (i.e., without sharing)
+  */
+  size_t naive() const {
+    size_t s = 0;
+    for (int i = 0; i < n_bufs; i++) {
+      s += bufs[i].bytes;
+    }
+    return s;
+  }
+  /**
+     @brief assign offsets to buffers and set peak
+  */
+  void plan() {
+    /* buffers in the decreasing order of sizes */
+    int order[max_bufs];
+    for (int i = 0; i < n_bufs; i++) {
+      order[i] = i;
+    }
+    for (int i = 1; i < n_bufs; i++) {
+      for (int j = i; j > 0 && bufs[order[j - 1]].bytes < bufs[order[j]].bytes; j--) {
+        int t = order[j]; order[j] = order[j - 1]; order[j - 1] = t;
+      }
+    }
+    peak = 0;
+    for (int k = 0; k < n_bufs; k++) {
+      buf_t& b = bufs[order[k]];
+      /* candidates: 0 and the ends of already placed buffers
+         live together with b; take the lowest one that fits */
+      size_t best = (size_t)-1;
+      for (int c = -1; c < k; c++) {
+        size_t off = 0;
+        if (c >= 0) {
+          buf_t& o = bufs[order[c]];
+          if (!(o.live & b.live)) continue;
+          off = o.offset + o.bytes;
+        }
+        if (off >= best) continue;
+        int ok = 1;
+        for (int d = 0; d < k; d++) {
+          buf_t& o = bufs[order[d]];
+          if ((o.live & b.live)
+              && off < o.offset + o.bytes && o.offset < off + b.bytes) {
+            ok = 0;
+            break;
+          }
+        }
+        if (ok) best = off;
+      }
+      b.offset = best;
+      if (b.offset + b.bytes > peak) {
+        peak = b.offset + b.bytes;
+      }
+    }
+  }
+  /**
+     @brief allocate the slab (zero-filled) after plan()
+     @param (first_touch) 1 if it is zero-filled by all threads
+     (numa_first_touch; --numa 1)
+  */
+  void alloc(int first_touch = 0) {
+    assert(!slab);
+    if (peak > 0) {
+      slab = (char *)aligned_alloc(TENSOR_ALIGN, peak);
+      if (!slab) {
+        perror("aligned_alloc"); bail();
+      }
+      if (first_touch) {
+        numa_first_touch(slab, peak);
+      } else {
+        memset(slab, 0, peak);
+      }
+    }
+  }
+  /**
+     @brief the address of buffer i
+  */
+  void * ptr(int i) {
+    assert(0 <= i && i < n_bufs);
+    assert(slab);
+    return slab + bufs[i].offset;
+  }
+  /**
+     @brief log the plan (each buffer at level 2, the total at level 1)
+     @param (lgr) logger
+     @param (what) the name of the arena
+  */
+  void log(logger * lgr, const char * what) {
+    for (int i = 0; i < n_bufs; i++) {
+      buf_t& b = bufs[i];
+      int a = (b.live ? __builtin_ctzl(b.live) : 0);
+      int z = (b.live ? 63 - __builtin_clzl(b.live) : 0);
+      lgr->log(2, "%s: %s.%s %ld bytes at offset %ld, steps %d-%d",
+               what, b.owner, b.name, (long)b.bytes, (long)b.offset, a, z);
+    }
+    lgr->log(1, "%s: %d buffers, %ld bytes planned (%ld bytes without reuse)",
+             what, n_bufs, (long)peak, (long)naive());
+  }
+};
+
+/**
+   @brief description of a layer in a chain given to arena_add_chain
+ */
+struct arena_layer_t {
+  const char * name;            /**< name of the layer */
+  size_t y_bytes;               /**< size of the output */
+  size_t gx_bytes;              /**< size of the gradient wrt the input */
+  size_t aux_bytes;             /**< size of the state kept from forward to backward (e.g., argmax) */
+  int bw_reads_x;               /**< 1 if backward reads the input */
+  int bw_reads_y;               /**< 1 if backward reads the output */
+  int inplace;                  /**< 1 if y overwrites the input and gx overwrites gy */
+};
+
+/**
+   @brief add activations and gradients of a chain of n layers to an arena
+   @param (a) the arena
+   @param (L) the layers in the order of forward
+   @param (n) the number of layers (<= 31)
+   @param (yb) if not null, yb[k] gets the buffer of the output of layer k
+   @param (gb) if not null, gb[k] gets the buffer of the gradient wrt the input of layer k
+   @param (ab) if not null, ab[k] gets the buffer of the state of layer k (-1 if none)
+   @details forward of layer k is step k and backward of layer k
+   is step 2n-1-k.  the output of layer k is live from its forward
+   to the last step it is read (forward of layer k+1, backward of
+   layer k+1 if it reads its input, backward of layer k if it reads
+   its output, or the end for the last layer); the gradient wrt its
+   input is live from its backward till backward of layer k-1.
+   the state is live from forward to backward of the layer, or to
+   the end for the last layer (the losses are summed after backward).
+   an in-place layer shares the buffer of its input and that of
+   the gradient wrt its output.
+ */
+__attribute__((unused))
+static void arena_add_chain(arena_t& a, arena_layer_t * L, int n,
+                            int * yb = 0, int * gb = 0, int * ab = 0) {
+  assert(2 * n <= 64);
+  const int last = 2 * n - 1;
+  const int i0 = a.n_bufs;
+  int yb_[32];
+  int gb_[32];
+  int ab_[32];
+  if (!yb) yb = yb_;
+  if (!gb) gb = gb_;
+  if (!ab) ab = ab_;
+  for (int k = 0; k < n; k++) {
+    const int f = k, b = last - k;
+    if (L[k].inplace && k > 0) {
+      yb[k] = yb[k - 1];
+    } else {
+      yb[k] = a.add(L[k].name, "y", L[k].y_bytes, 0);
+    }
+    a.use(yb[k], f);
+    if (k + 1 < n) {
+      a.use(yb[k], f + 1);
+      if (L[k + 1].bw_reads_x) a.use(yb[k], b - 1);
+    } else {
+      a.use(yb[k], last);
+    }
+    if (L[k].bw_reads_y) a.use(yb[k], b);
+    ab[k] = -1;
+    if (L[k].aux_bytes) {
+      ab[k] = a.add(L[k].name, "aux", L[k].aux_bytes, arena_t::steps(f, (k + 1 < n ? b : last)));
+    }
+  }
+  for (int k = n - 1; k >= 0; k--) {
+    const int b = last - k;
+    if (L[k].inplace && k < n - 1) {
+      gb[k] = gb[k + 1];
+    } else {
+      gb[k] = a.add(L[k].name, "gx", L[k].gx_bytes, 0);
+    }
+    a.use(gb[k], b);
+    if (k > 0) a.use(gb[k], b + 1);
+  }
+  for (int i = i0; i < a.n_bufs; i++) {
+    a.fill(i);
+  }
+}
+
+#if TENSOR_HEAP
+/**
+   @brief let tensor a use buffer i of arena ar, from byte off, for n0 rows
+   @param (a) the tensor
+   @param (ar) the arena (after alloc)
+   @param (i) the index of the buffer
+   @param (off) the offset in the buffer (e.g., for the second of
+   the tensors of a state)
+   @param (n0) the number of rows
+ */
+template<typename T,idx_t N0,idx_t N1,idx_t N2,idx_t N3>
+static void arena_attach(tensor<T,N0,N1,N2,N3>& a, arena_t& ar, int i, size_t off, idx_t n0) {
+  assert(0 <= i && i < ar.n_bufs);
+  assert(off + a.bytes(n0) <= ar.bufs[i].bytes);
+  a.attach((T *)((char *)ar.ptr(i) + off), n0);
+}
+#endif
@@ -0,0 +1,320 @@
+/**
+   @file autotune.h
+   @brief --algo auto: choose the algorithm of each layer by measuring
+   the candidates, with the choices cached in a file
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "mnist_util.h"
+#include "tensor.h"
+#include "bench.h"
+
+/**
+   @brief chooses the algorithm of each layer of a network (--algo auto)
+   @details choose and choose_loss return the option a layer should
+   be initialized with.  unless --algo auto, it is just the option
+   given.  otherwise the algorithm is looked up in the tuning file
+   (--tune-file) under a key of the processor (CPU or GPU model), the
+   number of threads, the batch size and real; if it is not there,
+   the candidates (all algorithms of the same kind (CPU or CUDA) as
+   the build, except those of reduced precision or in the blocked
+   layout, which must be used by all layers) are measured with
+   bench_phases on a layer of their own, the one whose forward,
+   backward and update take the least time in total is chosen and
+   appended to the file.  a layer keeps its algorithm in all phases,
+   because they share state (e.g., im2col or Winograd buffers of
+   the forward are used by the backward).  all candidates run on the
+   same weights and inputs, and one whose (inference) forward output
+   differs from that of the first candidate (the baseline) by a
+   relative error above max_rel_err is not chosen.  only algorithms a
+   layer implements itself (T::has_algo) are measured, and a candidate
+   replaces the fastest so far only if it is faster by more than
+   min_gain, so a layer stays with the baseline unless another
+   algorithm is clearly faster
+ */
+struct autotuner {
+  static constexpr double max_rel_err = 1.0e-3; /**< candidates whose outputs differ from the baseline more than this are rejected */
+  static constexpr double min_gain = 0.05; /**< a candidate must be faster than the fastest so far by this fraction to replace it */
+  cmdline_opt opt;              /**< command line option */
+  logger * lgr;                 /**< the logger of the network (choices are logged to it) */
+  logger quiet;                 /**< the logger candidates run with (so they are not in the kernel profile) */
+  rnd_gen_t rg;                 /**< random numbers for candidates (not to disturb those of the network) */
+  idx_t B;                      /**< batch size to measure with */
+  char key[256];                /**< the key of choices in the tuning file */
+  algo_t cands[algo_invalid];   /**< candidates */
+  int n_cands;                  /**< the number of candidates */
+  /**
+     @brief write the model name of the processor to buf
+  */
+  static void processor_name(int cuda, char * buf, size_t sz) {
+    snprintf(buf, sz, "unknown");
+    if (cuda) {
+#if __CUDACC__
+      struct cudaDeviceProp prop[1];
+      int dev = 0;
+      check_api_error(cudaGetDevice(&dev));
+      check_api_error(cudaGetDeviceProperties(prop, dev));
+      snprintf(buf, sz, "%s", prop->name);
+#endif
+      return;
+    }
+    FILE * fp = fopen("/proc/cpuinfo", "rb");
+    if (!fp) return;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+      /* "model name" on x86, "CPU part" (and no model name) on arm */
+      if (strncmp(line, "model name", 10) == 0 || strncmp(line, "CPU part", 8) == 0) {
+        char * v = strchr(line, ':');
+        if (!v) continue;
+        v++;
+        while (*v == ' ' || *v == '\t') v++;
+        v[strcspn(v, "\n")] = 0;
+        snprintf(buf, sz, "%s", v);
+        if (line[0] == 'm') break;
+      }
+    }
+    fclose(fp);
+  }
+  /**
+     @brief initialize
+     @param (opt) command line option
+     @param (lgr) logger
+     @param (B) the batch size the network runs with
+  */
+  void init(cmdline_opt opt, logger * lgr, idx_t B) {
+    this->opt = opt;
+    this->lgr = lgr;
+    this->B = B;
+    n_cands = 0;
+    if (opt.algo != algo_auto) return;
+    char proc[128];
+    processor_name(opt.cuda_algo, proc, sizeof(proc));
+#ifdef _OPENMP
+    const int nth = omp_get_max_threads();
+#else
+    const int nth = 1;
+#endif
+    snprintf(key, sizeof(key), "%s|threads=%d|B=%ld|real=%d",
+             proc, (opt.cuda_algo ? 0 : nth), (long)B, (int)sizeof(real));
+    for (int a = 0; a < (int)algo_invalid; a++) {
+      if (a == algo_auto || algo_is_reduced_precision((algo_t)a)) continue;
+      if (algo_is_inference_only((algo_t)a)) continue; // training layers do not have it
+      if (algo_is_blocked((algo_t)a)) continue; // the layout is for all layers or none
+      if (algo_is_cuda(algo_name((algo_t)a), (algo_t)a) != opt.cuda_algo) continue;
+      cands[n_cands++] = (algo_t)a;
+    }
+    quiet.opt = opt;
+    quiet.opt.kernel_log = 0;
+    quiet.opt.verbose = -1;
+    quiet.log_fp = 0;
+    quiet.t0 = get_tsc();
+    quiet.prof.init(0);
+    lgr->log(1, "autotune: key %s, %d candidates, file %s", key, n_cands, opt.tune_file);
+  }
+  /**
+     @brief release resources
+  */
+  void fini() {
+    if (opt.algo == algo_auto) quiet.prof.fini();
+  }
+  /**
+     @brief look up the choice for a layer in the tuning file
+     @returns the algorithm (algo_invalid if it is not there)
+     @details lines are "key<TAB>layer<TAB>algorithm"; the last
+     matching line wins
+  */
+  algo_t lookup(const char * layer) {
+    algo_t a = algo_invalid;
+    if (!strlen(opt.tune_file)) return a;
+    FILE * fp = fopen(opt.tune_file, "rb");
+    if (!fp) return a;
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+      line[strcspn(line, "\n")] = 0;
+      char * l = strchr(line, '\t');
+      if (!l) continue;
+      *l++ = 0;
+      char * s = strchr(l, '\t');
+      if (!s) continue;
+      *s++ = 0;
+      if (strcmp(line, key) == 0 && strcmp(l, layer) == 0) {
+        algo_t b = parse_algo(s);
+        if (b != algo_invalid && b != algo_auto) a = b;
+      }
+    }
+    fclose(fp);
+    return a;
+  }
+  /**
+     @brief append the choice for a layer to the tuning file
+  */
+  void store(const char * layer, algo_t a) {
+    if (!strlen(opt.tune_file)) return;
+    FILE * fp = fopen(opt.tune_file, "ab");
+    if (!fp) {
+      warn("%s", opt.tune_file);
+      return;
+    }
+    fprintf(fp, "%s\t%s\t%s\n", key, layer, algo_name(a));
+    fclose(fp);
+  }
+  /**
+     @brief the option of candidate algorithm a, measured with
+     --tune-reps repetitions after a warm-up
+  */
+  cmdline_opt cand_opt(algo_t a) {
+    cmdline_opt o = bench_sweep::with_algo(opt, a);
+    o.bench_warmup = 1;
+    o.bench_reps = (opt.tune_reps > 0 ? opt.tune_reps : 1);
+    return o;
+  }
+  /**
+     @brief the total of medians of the phases measured
+  */
+  static double total_ns(const bench_stat * st, int n_phases) {
+    double t = 0.0;
+    for (int p = 0; p < n_phases; p++) t += st[p].median_ns;
+    return t;
+  }
+  /**
+     @brief compare the forward output of a candidate with that of the baseline
+     @param (y) the output of the candidate
+     @param (w) the layer of the candidate
+     @param (o) the option of the candidate
+     @param (y0) the output of the baseline (set from y if null)
+     @returns the relative error |y - y0| / |y0|
+  */
+  template<typename T, typename O>
+  static double rel_err(O& y, T * w, cmdline_opt o, O *& y0) {
+    to_host(w, o.cuda_algo);
+    if (!y0) {
+      y0 = new O(y);
+      return 0.0;
+    }
+    O * d = new O(y);
+    d->add_(-1.0, *y0);
+    const double e = sqrt(d->dot(*d) / fmax(y0->dot(*y0), 1.0e-30));
+    delete d;
+    return e;
+  }
+  /**
+     @brief take the choice for a layer from the file, or measure
+     the candidates with f and choose the fastest
+     @param (f) f(o) measures a layer with option o and returns its
+     time (negative if its outputs are wrong)
+  */
+  template<typename T, typename F>
+  cmdline_opt choose_(const char * layer, F f) {
+    if (opt.algo != algo_auto) return opt;
+    algo_t best = lookup(layer);
+    if (best != algo_invalid) {
+      lgr->log(1, "autotune: %s uses %s (from %s)", layer, algo_name(best), opt.tune_file);
+      return bench_sweep::with_algo(opt, best);
+    }
+    double best_ns = 0.0;
+    for (int i = 0; i < n_cands; i++) {
+      if (!T::has_algo(cands[i])) continue;
+      const double ns = f(cand_opt(cands[i]));
+      if (ns < 0) {
+        lgr->log(1, "autotune: %s %s rejected (its output differs from the baseline)",
+                 layer, algo_name(cands[i]));
+        continue;
+      }
+      lgr->log(2, "autotune: %s %s %.0f ns", layer, algo_name(cands[i]), ns);
+      if (best == algo_invalid || ns < best_ns * (1.0 - min_gain)) {
+        best = cands[i];
+        best_ns = ns;
+      }
+    }
+    if (best == algo_invalid) errx(1, "autotune: no candidate algorithms for %s", layer);
+    lgr->log(1, "autotune: %s uses %s (%.0f ns per step)", layer, algo_name(best), best_ns);
+    store(layer, best);
+    return bench_sweep::with_algo(opt, best);
+  }
+  /**
+     @brief the option a layer T (input I, output O) should be initialized with
+     @param (layer) the name of the layer (e.g., "conv1")
+     @param (cfg) the configuration of the layer
+  */
+  template<typename T, typename I, typename O, typename C>
+  cmdline_opt choose(const char * layer, C cfg) {
+    O * y0 = 0;
+    cmdline_opt r = choose_<T>(layer, [&](cmdline_opt o) {
+        rg.seed(opt.weight_seed);
+        T * w = new T();
+        w->init(o, &quiet, rg, cfg);
+        I * x = new I();
+        x->init_uniform(B, rg, -1.0, 1.0);
+        O * gy = new O();
+        gy->init_uniform(B, rg, -1.0, 1.0);
+        to_dev(w, o.cuda_algo);
+        to_dev(x, o.cuda_algo);
+        to_dev(gy, o.cuda_algo);
+        const double e = rel_err(w->forward(*x, 0), w, o, y0);
+        bench_stat st[bench_n_phases];
+        int n_phases = (e > max_rel_err ? 0 :
+                        bench_phases(o, &quiet,
+                                     [&] { w->forward(*x, 1); },
+                                     [&] { w->backward(*gy); },
+                                     [&] { return bench_update(w, 0); }, st));
+        del_dev(w, o.cuda_algo);
+        del_dev(x, o.cuda_algo);
+        del_dev(gy, o.cuda_algo);
+        delete w;
+        delete x;
+        delete gy;
+        return (n_phases ? total_ns(st, n_phases) : -1.0);
+      });
+    delete y0;
+    return r;
+  }
+  /**
+     @brief the option a layer taking true labels (nll_softmax) should be initialized with
+     @sa choose
+  */
+  template<typename T, typename I0, typename I1, typename O, typename C>
+  cmdline_opt choose_loss(const char * layer, C cfg, idx_t nC) {
+    O * y0 = 0;
+    cmdline_opt r = choose_<T>(layer, [&](cmdline_opt o) {
+        rg.seed(opt.weight_seed);
+        T * w = new T();
+        w->init(o, &quiet, rg, cfg);
+        I0 * x = new I0();
+        x->init_uniform(B, rg, -1.0, 1.0);
+        I1 * t = new I1();
+        t->init_uniform_i(B, rg, 0, nC);
+        O * gy = new O();
+        gy->init_uniform(B, rg, -1.0, 1.0);
+        to_dev(w, o.cuda_algo);
+        to_dev(x, o.cuda_algo);
+        to_dev(t, o.cuda_algo);
+        to_dev(gy, o.cuda_algo);
+        const double e = rel_err(w->forward(*x, *t, 0), w, o, y0);
+        bench_stat st[bench_n_phases];
+        int n_phases = (e > max_rel_err ? 0 :
+                        bench_phases(o, &quiet,
+                                     [&] { w->forward(*x, *t, 1); },
+                                     [&] { w->backward(*gy, *t); },
+                                     [&] { return bench_update(w, 0); }, st));
+        del_dev(w, o.cuda_algo);
+        del_dev(x, o.cuda_algo);
+        del_dev(t, o.cuda_algo);
+        del_dev(gy, o.cuda_algo);
+        delete w;
+        delete x;
+        delete t;
+        delete gy;
+        return (n_phases ? total_ns(st, n_phases) : -1.0);
+      });
+    delete y0;
+    return r;
+  }
+};
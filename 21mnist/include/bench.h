@@ -0,0 +1,392 @@
+/**
+   @file bench.h
+   @brief micro benchmark of layers (--bench of *_main functions)
+ */
+
+#pragma once
+
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include "mnist_util.h"
+#include "tensor.h"
+
+/**
+   @brief statistics of the times of repeated calls
+ */
+struct bench_stat {
+  double median_ns;             /**< the median */
+  double stddev_ns;             /**< the standard deviation */
+  double flops;                 /**< flops of a call (from the profiler's cost model) */
+  double bytes;                 /**< bytes of a call (from the profiler's cost model) */
+};
+
+/**
+   @brief compute the median and the standard deviation of times
+   @param (ns) times of reps calls (sorted on return)
+   @param (reps) the number of calls
+ */
+static bench_stat bench_summarize(double * ns, int reps, double flops, double bytes) {
+  qsort(ns, reps, sizeof(double), [](const void * a, const void * b) {
+      double x = *(const double *)a, y = *(const double *)b;
+      return (x < y ? -1 : (x > y ? 1 : 0));
+    });
+  double s = 0.0, s2 = 0.0;
+  for (int r = 0; r < reps; r++) {
+    s += ns[r];
+    s2 += ns[r] * ns[r];
+  }
+  const double avg = s / reps;
+  const double median = (reps % 2 ? ns[reps / 2] : (ns[reps / 2 - 1] + ns[reps / 2]) / 2);
+  return { median, sqrt(fmax(s2 / reps - avg * avg, 0.0)), flops, bytes };
+}
+
+/**
+   @brief call T::update if the layer has one
+   @returns 1 if it did
+ */
+template<typename T>
+static auto bench_update(T * w, int) -> decltype(w->update(), 1) {
+  w->update();
+  return 1;
+}
+
+/**
+   @brief the layer has no update (e.g., relu)
+ */
+template<typename T>
+static int bench_update(T * w, long) {
+  (void)w;
+  return 0;
+}
+
+/**
+   @brief the maximum number of threads (1 without OpenMP)
+ */
+static int bench_max_threads() {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+/**
+   @brief set the number of threads (nothing without OpenMP)
+ */
+static void bench_set_threads(int th) {
+#ifdef _OPENMP
+  omp_set_num_threads(th);
+#else
+  (void)th;
+#endif
+}
+
+/**
+   @brief the phases a configuration measures
+ */
+enum { bench_forward, bench_backward, bench_update_, bench_n_phases };
+
+/**
+   @brief a sweep of --bench: configurations and the output file
+   @details the algorithms (--bench-algos or all algorithms of
+   algo_t this build can run), except those layer T does not
+   implement (T::has_algo; it would run its baseline under their
+   names), batch sizes 1, 2, 4, ..., maxB (and
+   maxB) and, for CPU algorithms, thread counts 1, 2, 4, ...,
+   bench_max_threads() (and the max).  each row of the CSV is a
+   phase of a configuration
+ */
+struct bench_sweep {
+  FILE * fp;                    /**< the CSV file */
+  algo_t algos[algo_invalid];   /**< algorithms */
+  int n_algos;                  /**< the number of algorithms */
+  /**
+     @brief open the file (appending) and make the list of algorithms
+     @param (opt) command line option
+     @param (layer) the name of the layer in the results
+   */
+  template<typename T>
+  void init(cmdline_opt opt, const char * layer) {
+    fp = fopen(opt.bench, "ab");
+    if (!fp) err(1, "%s", opt.bench);
+    if (ftell(fp) == 0) {
+      fprintf(fp, "layer,algo,B,threads,phase,reps,median_ns,stddev_ns,gflops,gbs\n");
+    }
+    n_algos = 0;
+    if (strlen(opt.bench_algos)) {
+      char * s = strdup(opt.bench_algos);
+      for (char * tok = strtok(s, ","); tok; tok = strtok(0, ",")) {
+        algo_t a = parse_algo(tok);
+        if (a == algo_invalid) errx(1, "--bench-algos: invalid algorithm (%s)", tok);
+        if (!T::has_algo(a)) {
+          warnx("--bench-algos: %s does not implement %s, skipped", layer, tok);
+          continue;
+        }
+        algos[n_algos++] = a;
+      }
+      free(s);
+    } else {
+      for (int a = 0; a < (int)algo_invalid; a++) {
+        if (a == algo_auto || !T::has_algo((algo_t)a)) continue;
+#if !__CUDACC__
+        if (algo_is_cuda(algo_name((algo_t)a), (algo_t)a)) continue;
+#endif
+        algos[n_algos++] = (algo_t)a;
+      }
+    }
+  }
+  /**
+     @brief close the file
+   */
+  void fini() {
+    if (fclose(fp)) err(1, "fclose");
+  }
+  /**
+     @brief the option an algorithm runs with
+   */
+  static cmdline_opt with_algo(cmdline_opt opt, algo_t a) {
+    opt.algo = a;
+    opt.algo_s = algo_name(a);
+    opt.cuda_algo = algo_is_cuda(opt.algo_s, a);
+    return opt;
+  }
+  /**
+     @brief the next batch size after B (0 after maxB)
+   */
+  static idx_t next_batch(idx_t B, idx_t maxB) {
+    if (B == maxB) return 0;
+    return (2 * B < maxB ? 2 * B : maxB);
+  }
+  /**
+     @brief the next thread count after t (0 after the max)
+   */
+  static int next_threads(int t, int cuda_algo) {
+    const int max_t = (cuda_algo ? 1 : bench_max_threads());
+    if (t == max_t) return 0;
+    return (2 * t < max_t ? 2 * t : max_t);
+  }
+  /**
+     @brief write a row and show it
+   */
+  void row(const char * layer, cmdline_opt opt, idx_t B, int threads,
+           const char * phase, bench_stat st) {
+    const double gflops = (st.median_ns > 0 ? st.flops / st.median_ns : 0.0);
+    const double gbs = (st.median_ns > 0 ? st.bytes / st.median_ns : 0.0);
+    fprintf(fp, "%s,%s,%ld,%d,%s,%d,%.0f,%.0f,%.3f,%.3f\n",
+            layer, opt.algo_s, (long)B, threads, phase, opt.bench_reps,
+            st.median_ns, st.stddev_ns, gflops, gbs);
+    printf("%-12s %-14s B=%-3ld threads=%-3d %-8s %12.0f ns (sd %10.0f) %8.3f GFLOP/s %8.3f GB/s\n",
+           layer, opt.algo_s, (long)B, threads, phase,
+           st.median_ns, st.stddev_ns, gflops, gbs);
+    fflush(stdout);
+  }
+};
+
+/**
+   @brief measure forward, backward and update of a layer of a configuration
+   @param (opt) command line option (the algorithm to measure)
+   @param (fwd) forward of the layer (a callable)
+   @param (bwd) backward of the layer (a callable)
+   @param (upd) update of the layer (a callable returning 0 if the layer has no update)
+   @param (st) statistics of the phases
+   @returns the number of phases measured (2 or 3)
+   @details each repetition calls forward, backward and update in this
+   order, as training does, but times them separately.  flops and
+   bytes are what the layers reported to the profiler (log_end_kernel)
+   during the call
+ */
+template<typename F, typename G, typename U>
+static int bench_phases(cmdline_opt opt, logger * lgr, F fwd, G bwd, U upd,
+                        bench_stat st[bench_n_phases]) {
+  const int reps = (opt.bench_reps > 0 ? opt.bench_reps : 1);
+  double * ns[bench_n_phases];
+  double flops[bench_n_phases] = {};
+  double bytes[bench_n_phases] = {};
+  for (int p = 0; p < bench_n_phases; p++) {
+    ns[p] = (double *)malloc(sizeof(double) * reps);
+  }
+  int has_update = 1;
+  for (int r = -opt.bench_warmup; r < reps; r++) {
+    for (int p = 0; p < bench_n_phases; p++) {
+      if (p == bench_update_ && !has_update) continue;
+      const double f0 = lgr->prof.total_flops, b0 = lgr->prof.total_bytes;
+      tsc_t t0 = get_tsc();
+      switch (p) {
+      case bench_forward: fwd(); break;
+      case bench_backward: bwd(); break;
+      default: has_update = upd(); break;
+      }
+#if __CUDACC__
+      if (opt.cuda_algo) dev_sync();
+#endif
+      tsc_t t1 = get_tsc();
+      if (r >= 0) {
+        ns[p][r] = t1.ns - t0.ns;
+        flops[p] = lgr->prof.total_flops - f0;
+        bytes[p] = lgr->prof.total_bytes - b0;
+      }
+    }
+  }
+  const int n_phases = (has_update ? 3 : 2);
+  for (int p = 0; p < n_phases; p++) {
+    st[p] = bench_summarize(ns[p], reps, flops[p], bytes[p]);
+  }
+  for (int p = 0; p < bench_n_phases; p++) {
+    free(ns[p]);
+  }
+  return n_phases;
+}
+
+/**
+   @brief show and write the results of a configuration
+ */
+static void bench_report(bench_sweep& sw, const char * layer, cmdline_opt opt,
+                         idx_t B, int threads, bench_stat * st, int n_phases) {
+  static const char * const names[bench_n_phases] = { "forward", "backward", "update" };
+  for (int p = 0; p < n_phases; p++) {
+    sw.row(layer, opt, B, threads, names[p], st[p]);
+  }
+}
+
+/**
+   @brief benchmark a layer (the counterpart of grad_check)
+   @param (opt) command line option
+   @param (lgr) logger
+   @param (rg) random number generator
+   @param (cfg) configuration of the layer
+   @param (layer) the name of the layer in the results
+   @returns 0
+   @sa grad_check
+   @sa bench_sweep
+ */
+template<typename T, typename I, typename O, typename C>
+static int bench_layer(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, C cfg,
+                       const char * layer, idx_t maxB) {
+  bench_sweep sw;
+  sw.init<T>(opt, layer);
+  for (int i = 0; i < sw.n_algos; i++) {
+    cmdline_opt o = bench_sweep::with_algo(opt, sw.algos[i]);
+    for (int th = 1; th; th = bench_sweep::next_threads(th, o.cuda_algo)) {
+      bench_set_threads(th);
+      for (idx_t B = 1; B; B = bench_sweep::next_batch(B, maxB)) {
+        T * w = new T();
+        w->init(o, lgr, rg, cfg);
+        I * x = new I();
+        x->init_uniform(B, rg, -1.0, 1.0);
+        O * gy = new O();
+        gy->init_uniform(B, rg, -1.0, 1.0);
+        to_dev(w, o.cuda_algo);
+        to_dev(x, o.cuda_algo);
+        to_dev(gy, o.cuda_algo);
+        bench_stat st[bench_n_phases];
+        int n_phases = bench_phases(o, lgr,
+                                    [&] { w->forward(*x, 1); },
+                                    [&] { w->backward(*gy); },
+                                    [&] { return bench_update(w, 0); }, st);
+        bench_report(sw, layer, o, B, th, st, n_phases);
+        del_dev(w, o.cuda_algo);
+        del_dev(x, o.cuda_algo);
+        del_dev(gy, o.cuda_algo);
+        delete w;
+        delete x;
+        delete gy;
+      }
+    }
+  }
+  sw.fini();
+  return 0;
+}
+
+/**
+   @brief benchmark a layer that takes true labels (nll_softmax or the
+   entire MNIST; the counterpart of grad_check_loss)
+   @sa bench_layer
+   @sa grad_check_loss
+ */
+template<typename T, typename I0, typename I1, typename O, typename C>
+static int bench_layer_loss(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, C cfg,
+                            const char * layer, idx_t maxB, idx_t nC) {
+  bench_sweep sw;
+  sw.init<T>(opt, layer);
+  for (int i = 0; i < sw.n_algos; i++) {
+    cmdline_opt o = bench_sweep::with_algo(opt, sw.algos[i]);
+    for (int th = 1; th; th = bench_sweep::next_threads(th, o.cuda_algo)) {
+      bench_set_threads(th);
+      for (idx_t B = 1; B; B = bench_sweep::next_batch(B, maxB)) {
+        T * w = new T();
+        w->init(o, lgr, rg, cfg);
+        I0 * x = new I0();
+        x->init_uniform(B, rg, -1.0, 1.0);
+        I1 * t = new I1();
+        t->init_uniform_i(B, rg, 0, nC);
+        O * gy = new O();
+        gy->init_uniform(B, rg, -1.0, 1.0);
+        to_dev(w, o.cuda_algo);
+        to_dev(x, o.cuda_algo);
+        to_dev(t, o.cuda_algo);
+        to_dev(gy, o.cuda_algo);
+        bench_stat st[bench_n_phases];
+        int n_phases = bench_phases(o, lgr,
+                                    [&] { w->forward(*x, *t, 1); },
+                                    [&] { w->backward(*gy, *t); },
+                                    [&] { return bench_update(w, 0); }, st);
+        bench_report(sw, layer, o, B, th, st, n_phases);
+        del_dev(w, o.cuda_algo);
+        del_dev(x, o.cuda_algo);
+        del_dev(t, o.cuda_algo);
+        del_dev(gy, o.cuda_algo);
+        delete w;
+        delete x;
+        delete t;
+        delete gy;
+      }
+    }
+  }
+  sw.fini();
+  return 0;
+}
+
+/**
+   @brief benchmark inference (forward with training = 0 and no
+   labels, i.e., T::infer) of a network; the training MNIST or the
+   inference-only MNIST<...,0>
+   @sa bench_layer
+ */
+template<typename T, typename I, typename C>
+static int bench_infer(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, C cfg,
+                       const char * layer, idx_t maxB) {
+  bench_sweep sw;
+  sw.init<T>(opt, layer);
+  for (int i = 0; i < sw.n_algos; i++) {
+    cmdline_opt o = bench_sweep::with_algo(opt, sw.algos[i]);
+    for (int th = 1; th; th = bench_sweep::next_threads(th, o.cuda_algo)) {
+      bench_set_threads(th);
+      for (idx_t B = 1; B; B = bench_sweep::next_batch(B, maxB)) {
+        T * w = new T();
+        w->init(o, lgr, rg, cfg);
+        I * x = new I();
+        x->init_uniform(B, rg, -1.0, 1.0);
+        to_dev(w, o.cuda_algo);
+        to_dev(x, o.cuda_algo);
+        bench_stat st[bench_n_phases];
+        bench_phases(o, lgr,
+                     [&] { w->infer(*x, w->pred); },
+                     [&] { },
+                     [&] { return 0; }, st);
+        bench_report(sw, layer, o, B, th, st, 1);
+        del_dev(w, o.cuda_algo);
+        del_dev(x, o.cuda_algo);
+        delete w;
+        delete x;
+      }
+    }
+  }
+  sw.fini();
+  return 0;
+}
@@ -0,0 +1,206 @@
+/**
+   @file checkpoint.h
+   @brief checkpoints: weights and optimizer states of a network in a file
+ */
+#pragma once
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mnist_util.h"
+#include "tensor.h"
+
+/**
+   @brief the version of the checkpoint format; bump it when the layout changes
+ */
+static const int checkpoint_version = 1;
+
+/**
+   @brief the header of a checkpoint file
+   @details a checkpoint file is this header, n checkpoint_entry's
+   and then the data of entries, each at a 64-byte aligned offset
+ */
+struct checkpoint_header {
+  char magic[8];                /**< "MNISTCKP" */
+  int version;                  /**< checkpoint_version */
+  int real_sz;                  /**< sizeof(real) */
+  int n;                        /**< the number of entries */
+  int pad;                      /**< 0 */
+  long epoch;                   /**< the number of epochs trained */
+};
+
+/**
+   @brief a tensor in a checkpoint file
+ */
+struct checkpoint_entry {
+  char name[32];                /**< e.g., "conv1.w", "conv1.w.v" */
+  long shape[4];                /**< N0 x N1 x N2 x N3 of the tensor */
+  long off;                     /**< the offset of its data in the file */
+};
+
+/**
+   @brief the tensors of a network that go into a checkpoint
+   @details layers add their weights and optimizer states
+   (add_state) by names; save writes them to a file and load
+   reads them back from a mapped file, checking that the file has
+   every tensor under the same name and with the same shape
+   (template parameters).  with cuda, tensors are the device
+   shadows, so save takes them from the device and load copies
+   them from the mapped file straight to the device
+ */
+struct checkpoint_list {
+  static const int max_items = 32; /**< the maximum number of tensors */
+  /**
+     @brief a tensor
+  */
+  struct item_t {
+    char name[32];              /**< name */
+    long shape[4];              /**< shape */
+    real * p;                   /**< the address (device address if cuda) */
+  };
+  item_t items[max_items];      /**< tensors */
+  int n;                        /**< the number of tensors */
+  int cuda;                     /**< 1 if addresses are on the device */
+  /**
+     @brief make the list empty
+     @param (cuda) 1 if tensors are the device shadows
+  */
+  void init(int cuda) {
+    this->cuda = cuda;
+    n = 0;
+  }
+  /**
+     @brief add a tensor named "<layer>.<name>"
+  */
+  template<idx_t N0,idx_t N1,idx_t N2,idx_t N3>
+  void add(const char * layer, const char * name, tensor<real,N0,N1,N2,N3>& t) {
+    assert(n < max_items);
+    item_t& it = items[n++];
+    snprintf(it.name, sizeof(it.name), "%s.%s", layer, name);
+    it.shape[0] = N0;
+    it.shape[1] = N1;
+    it.shape[2] = N2;
+    it.shape[3] = N3;
+    if (cuda) {
+#if __CUDACC__
+      it.p = &t.dev->w[0][0][0][0];
+#else
+      err_cuda_code_non_cuda_compiler("checkpoint_list::add");
+#endif
+    } else {
+      it.p = &t.w[0][0][0][0];
+    }
+  }
+  /**
+     @brief the number of elements of a shape
+  */
+  static long n_elems(const long * shape) {
+    return shape[0] * shape[1] * shape[2] * shape[3];
+  }
+  /**
+     @brief write all tensors to a file
+     @param (path) the file name
+     @param (epoch) the number of epochs trained
+     @details the file is written to a temporary file and renamed,
+     so a run killed while saving leaves the previous checkpoint
+  */
+  void save(const char * path, long epoch) {
+    checkpoint_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "MNISTCKP", 8);
+    h.version = checkpoint_version;
+    h.real_sz = sizeof(real);
+    h.n = n;
+    h.epoch = epoch;
+    checkpoint_entry e[max_items];
+    memset(e, 0, sizeof(e));
+    long off = sizeof(h) + sizeof(checkpoint_entry) * n;
+    for (int i = 0; i < n; i++) {
+      memcpy(e[i].name, items[i].name, sizeof(e[i].name));
+      memcpy(e[i].shape, items[i].shape, sizeof(e[i].shape));
+      off = (off + 63) / 64 * 64;
+      e[i].off = off;
+      off += sizeof(real) * n_elems(items[i].shape);
+    }
+    char tmp[strlen(path) + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE * fp = fopen(tmp, "wb");
+    if (!fp) err(1, "%s", tmp);
+    if (fwrite(&h, sizeof(h), 1, fp) != 1) err(1, "fwrite");
+    if (fwrite(e, sizeof(checkpoint_entry), n, fp) != (size_t)n) err(1, "fwrite");
+    for (int i = 0; i < n; i++) {
+      const size_t sz = sizeof(real) * n_elems(items[i].shape);
+      real * buf = items[i].p;
+      if (cuda) {
+#if __CUDACC__
+        buf = (real *)malloc(sz);
+        if (!buf) err(1, "malloc");
+        ::to_host(buf, items[i].p, sz);
+#endif
+      }
+      if (fseek(fp, e[i].off, SEEK_SET)) err(1, "fseek");
+      if (fwrite(buf, sz, 1, fp) != 1) err(1, "fwrite");
+      if (buf != items[i].p) free(buf);
+    }
+    if (fclose(fp)) err(1, "fclose");
+    if (rename(tmp, path) == -1) err(1, "rename %s", path);
+  }
+  /**
+     @brief read all tensors from a file written by save
+     @param (path) the file name
+     @returns the number of epochs trained recorded in the file
+     @details the file is mapped and each tensor is copied from the
+     mapping to its place (to the device if cuda).  it exits if the
+     file is not a checkpoint of this version and real, or lacks any
+     tensor or has it in another shape
+  */
+  long load(const char * path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) err(1, "%s", path);
+    struct stat st;
+    if (fstat(fd, &st) == -1) err(1, "%s", path);
+    const size_t sz = st.st_size;
+    if (sz < sizeof(checkpoint_header)) errx(1, "%s: not a checkpoint", path);
+    void * base = mmap(0, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) err(1, "mmap %s", path);
+    close(fd);
+    const char * p = (const char *)base;
+    const checkpoint_header * h = (const checkpoint_header *)p;
+    if (memcmp(h->magic, "MNISTCKP", 8) != 0) {
+      errx(1, "%s: not a checkpoint", path);
+    }
+    if (h->version != checkpoint_version || h->real_sz != (int)sizeof(real)) {
+      errx(1, "%s: checkpoint version %d with %d-byte reals (expected %d with %d-byte reals)",
+           path, h->version, h->real_sz, checkpoint_version, (int)sizeof(real));
+    }
+    if (h->n < 0 || sizeof(*h) + sizeof(checkpoint_entry) * h->n > sz) {
+      errx(1, "%s: truncated", path);
+    }
+    const checkpoint_entry * e = (const checkpoint_entry *)(p + sizeof(*h));
+    for (int i = 0; i < n; i++) {
+      const item_t& it = items[i];
+      int j = 0;
+      while (j < h->n && strncmp(e[j].name, it.name, sizeof(e[j].name)) != 0) j++;
+      if (j == h->n) errx(1, "%s: no %s", path, it.name);
+      if (memcmp(e[j].shape, it.shape, sizeof(it.shape)) != 0) {
+        errx(1, "%s: %s is %ldx%ldx%ldx%ld, not %ldx%ldx%ldx%ld", path, it.name,
+             e[j].shape[0], e[j].shape[1], e[j].shape[2], e[j].shape[3],
+             it.shape[0], it.shape[1], it.shape[2], it.shape[3]);
+      }
+      const size_t bytes = sizeof(real) * n_elems(it.shape);
+      if (e[j].off < 0 || (size_t)e[j].off + bytes > sz) errx(1, "%s: truncated", path);
+      if (cuda) {
+#if __CUDACC__
+        ::to_dev(it.p, (void *)(p + e[j].off), bytes);
+#endif
+      } else {
+        memcpy(it.p, p + e[j].off, bytes);
+      }
+    }
+    const long epoch = h->epoch;
+    munmap(base, sz);
+    return epoch;
+  }
+};
@@ -8,6 +8,11 @@
 #include "tensor.h"
 #include "ada_delta.h"
 #include "grad_check.h"
+#include "bench.h"
+#include "gemm.h"
+#include "winograd.h"
+#include "arena.h"
+#include "tc_gemm.h"
 #include <stdio.h>
 
 /**
@@ -37,10 +42,12 @@ template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t K,idx_t OC>
 struct Convolution2D {
 #if __CUDACC__
   Convolution2D<maxB,IC,H,W,K,OC> * dev; /**< device shadow */
-  int T_b = 1024, W_b = 32, N_b_fw = 2304;
-  int N_b_bw_L1=1024, N_b_bw_L2=1, N_b_bw_L3=3000;
-  
 #endif
+  static const idx_t cf_tx = 16;   /**< cuda_fast: tile width (output pixels along j per block) */
+  static const idx_t cf_ty = 8;    /**< cuda_fast: tile height (output pixels along i per block) */
+  static const idx_t cf_oc = 8;    /**< cuda_fast: channels a thread computes (output channels in forward, input channels in backward) */
+  static const idx_t cf_c = 8;     /**< cuda_fast: channels staged in shared memory at a time */
+  static const idx_t cf_gw_threads = 256; /**< cuda_fast: threads per block computing gw */
   cmdline_opt opt;                 /**< command line option  */
   logger * lgr;                    /**< logger */
   tensor<real,maxB,IC,H,W>* x_ptr;    /**< pointer to the input to forward (x) */
@@ -52,6 +59,12 @@ struct Convolution2D {
   tensor<real,maxB,IC,H,W> gx;        /**< ∂L/∂x */
   AdaDelta<OC,IC,K,K> opt_w;          /**< optimizer for w */
   AdaDelta<OC> opt_b;                 /**< optimizer for b */
+  heap_tensor<real,IC*K*K,1,1,(H-K+1)*(W-K+1)> col; /**< im2col buffer (cpu_gemm); rows are col.ld apart */
+  Convolution2DWinograd<maxB,IC,H,W,K,OC> wino; /**< Winograd state (cpu_winograd) */
+  heap_tensor<real,1,1,1,OC*IC*K*K> wblk; /**< w rearranged for the blocked layout (cpu_nchwc) */
+  int col_id;                         /**< index of col in the scratch arena (or -1) */
+  int wblk_id;                        /**< index of wblk in the scratch arena (or -1) */
+  gemm_kernel_t gemm_kern;            /**< micro-kernel of the packed gemm (cpu_blas_like, cpu_intrin) */
   /**
      @brief initialize the layer
      @param (opt) command line options
@@ -70,6 +83,44 @@ struct Convolution2D {
     /* init optimizers */
     opt_w.init(opt.lr);
     opt_b.init(opt.lr);
+    opt_w.set_grad_scale(1.0 / opt.loss_scale);
+    opt_b.set_grad_scale(1.0 / opt.loss_scale);
+    /* cpu-only work buffers */
+    if (!opt.cuda_algo) {
+      col.alloc(IC * K * K);
+    }
+    if (opt.algo == algo_cpu_winograd) {
+      wino.init();
+      wino.transform_weights(w);
+    }
+    if (opt.algo == algo_cpu_nchwc) {
+      wblk.alloc(1);
+    }
+    gemm_kern = gemm_kernel_for(opt);
+  }
+  /**
+     @brief add cpu-only work buffers (col, wblk and those of wino) to an arena
+     @param (a) the arena
+     @param (owner) the name of this layer
+     @param (live) steps at which this layer runs (forward and backward)
+     @details the buffers hold nothing across calls, so they can
+     share memory with those of layers that do not run at the same time
+     @sa attach_scratch
+  */
+  void plan_scratch(arena_t& a, const char * owner, uint64_t live) {
+    col_id = (col.cap0 ? a.add(owner, "col", col.bytes(col.cap0), live) : -1);
+    wblk_id = (wblk.cap0 ? a.add(owner, "wblk", wblk.bytes(wblk.cap0), live) : -1);
+    wino.plan_scratch(a, owner, live);
+  }
+  /**
+     @brief move the work buffers into an arena after it is allocated
+     @param (a) the arena
+     @sa plan_scratch
+  */
+  void attach_scratch(arena_t& a) {
+    if (col_id >= 0) col.attach((real *)a.ptr(col_id), col.cap0);
+    if (wblk_id >= 0) wblk.attach((real *)a.ptr(wblk_id), wblk.cap0);
+    wino.attach_scratch(a);
   }
   /**
      @brief set the device pointer for this and all subobjects
@@ -152,6 +203,45 @@ struct Convolution2D {
   void update_cpu_base() {
     update_base();
   }
+  /**
+     @brief add the updates of w and b to a list updated together
+     @param (l) the list
+     @param (cuda) 1 if the list gets device addresses
+     @sa ada_delta_list
+  */
+  void add_params(ada_delta_list& l, int cuda) {
+    opt_w.add_to(l, w, gw, cuda);
+    opt_b.add_to(l, b, gb, cuda);
+  }
+  /**
+     @brief add w, b and their optimizer states to a checkpoint
+     @param (l) the checkpoint
+     @param (name) the name of this layer (e.g., "conv1")
+  */
+  void add_state(checkpoint_list& l, const char * name) {
+    l.add(name, "w", w);
+    l.add(name, "b", b);
+    opt_w.add_state(l, name, "w");
+    opt_b.add_state(l, name, "b");
+  }
+  /**
+     @brief called after w has been overwritten on the host (e.g.,
+     loaded from a file) so that cpu_winograd transforms it again
+  */
+  void weights_changed() {
+    if (opt.algo == algo_cpu_winograd) {
+      wino.transform_weights(w);
+    }
+  }
+  /**
+     @brief update followed by the Winograd weight transform,
+     so that forward/backward see U = G w G^T of the new w
+     @sa update
+  */
+  void update_cpu_winograd() {
+    update_base();
+    wino.transform_weights(w);
+  }
   /**
      @brief update weights of all sublayers with gradients
      that must have been computed
@@ -168,6 +258,8 @@ struct Convolution2D {
     tsc_t t0 = get_tsc();
     switch (opt.algo) {
       /* add case for your implementations here */
+    case algo_cpu_winograd:
+      update_cpu_winograd(); break;
     case algo_cpu_base:
       update_cpu_base(); break;
     case algo_cuda_base:
@@ -182,7 +274,9 @@ struct Convolution2D {
       break;
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_update, 0,
+                   10.0 * OC * (IC * K * K + 1),
+                   7.0 * sizeof(real) * OC * (IC * K * K + 1));
   }
   /**
      @brief the baseline (serial) implementation of forward
@@ -226,43 +320,153 @@ struct Convolution2D {
       }
     }
   }
+  /**
+     @brief a cuda implementation of forward with shared-memory tiles
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @details a block of cf_ty x cf_tx threads computes a
+     cf_ty x cf_tx tile of output pixels of a sample for cf_oc output
+     channels (each thread computes one pixel of cf_oc channels).
+     input channels are processed cf_c at a time; their tile of x (with
+     the K-1 halo) and the corresponding filters are staged in shared
+     memory.  the grid covers maxB samples, since the actual batch
+     size (x.n0) is on the device; blocks of samples >= x.n0 quit
+     right away
+     @sa forward_cuda_fast_device
+  */
   void forward_cuda_fast(tensor<real,maxB,IC,H,W>& x, int training) {
 #if __CUDACC__
-    launch_and_sync((forward_cuda_fast_global<<<N_b_fw,T_b>>>(dev, x.dev, training)));
+    const idx_t n_ocg = (OC + cf_oc - 1) / cf_oc;
+    dim3 grid(((W - K + 1) + cf_tx - 1) / cf_tx, ((H - K + 1) + cf_ty - 1) / cf_ty, maxB * n_ocg);
+    dim3 block(cf_tx, cf_ty);
+    launch_and_sync((forward_cuda_fast_global<<<grid,block>>>(dev, x.dev, training)));
 #else
     (void)x;
     (void)training;
     err_cuda_code_non_cuda_compiler(opt.algo_s);
 #endif
-}
-  __device__  
+  }
+#if __CUDACC__
+  /**
+     @brief the device function of forward_cuda_fast (a block)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @sa forward_cuda_fast
+  */
+  __device__
   void forward_cuda_fast_device(tensor<real,maxB,IC,H,W>& x, int training) {
     (void)training;
-    idx_t B = x.n0;             // batch size
-    y.set_n0(B);
-    x_ptr = &x;                 // save pointer to input for backward
-
-    int n = blockDim.x * blockIdx.x + threadIdx.x, s, oc, i, j;
-    int H2 = H-K+1, W2 = W-K+1;
-    s=(((n/W2)/H2)/OC)%B;
-    oc=((n/W2)/H2)%OC;
-    i=(n/W2)%H2;
-    j=n%W2;
-    // printf("hello I am CUDA thread %d out of %d: (s,oc,i,j)=(%d,%d,%d,%d), (B,OC,H2,W2)=(%d,%d,%d,%d)\n", n, blockDim.x*gridDim.x, s,oc,i,j, B,OC,H2,W2);
-
-    if (n < B*OC*H2*W2) {
-      // calculate a single output pixel
-      real v = 0.0;
-      for (idx_t ic = 0; ic < IC; ic++) { // input channel
+    const idx_t OH = H - K + 1, OW = W - K + 1;
+    const idx_t SH = cf_ty + K - 1, SW = cf_tx + K - 1;
+    const idx_t n_ocg = (OC + cf_oc - 1) / cf_oc;
+    const idx_t nt = cf_tx * cf_ty;
+    __shared__ real xs[cf_c][SH][SW];
+    __shared__ real ws[cf_oc][cf_c][K][K];
+    const idx_t B = x.n0;       // batch size
+    const idx_t s = blockIdx.z / n_ocg;
+    const idx_t oc0 = (blockIdx.z % n_ocg) * cf_oc;
+    const idx_t i0 = blockIdx.y * cf_ty, j0 = blockIdx.x * cf_tx;
+    const idx_t ty = threadIdx.y, tx = threadIdx.x;
+    const idx_t tid = ty * cf_tx + tx;
+    if (blockIdx.x == 0 && blockIdx.y == 0 && blockIdx.z == 0 && tid == 0) {
+      y.set_n0(B);
+      x_ptr = &x;               // save pointer to input for backward
+    }
+    if (s >= B) return;
+    real v[cf_oc];
+    for (idx_t o = 0; o < cf_oc; o++) {
+      v[o] = 0.0;
+    }
+    for (idx_t ic0 = 0; ic0 < IC; ic0 += cf_c) {
+      /* stage cf_c channels of the input tile and their filters */
+      for (idx_t k = tid; k < cf_c * SH * SW; k += nt) {
+        const idx_t c = k / (SH * SW), ii = (k / SW) % SH, jj = k % SW;
+        const idx_t ic = ic0 + c, i = i0 + ii, j = j0 + jj;
+        xs[c][ii][jj] = (ic < IC && i < H && j < W ? x.w[s][ic][i][j] : 0.0);
+      }
+      for (idx_t k = tid; k < cf_oc * cf_c * K * K; k += nt) {
+        const idx_t o = k / (cf_c * K * K), c = (k / (K * K)) % cf_c;
+        const idx_t di = (k / K) % K, dj = k % K;
+        const idx_t oc = oc0 + o, ic = ic0 + c;
+        ws[o][c][di][dj] = (oc < OC && ic < IC ? w.w[oc][ic][di][dj] : 0.0);
+      }
+      __syncthreads();
+      for (idx_t c = 0; c < cf_c; c++) {
         for (idx_t di = 0; di < K; di++) {
           for (idx_t dj = 0; dj < K; dj++) {
-            v += w(oc,ic,di,dj) * x(s,ic,i+di,j+dj);
+            const real xv = xs[c][ty + di][tx + dj];
+            for (idx_t o = 0; o < cf_oc; o++) {
+              v[o] += ws[o][c][di][dj] * xv;
+            }
           }
         }
       }
-      y(s,oc,i,j) = v + b(oc);
-    }        
+      __syncthreads();
+    }
+    const idx_t i = i0 + ty, j = j0 + tx;
+    if (i < OH && j < OW) {
+      for (idx_t o = 0; o < cf_oc && oc0 + o < OC; o++) {
+        y.w[s][oc0 + o][i][j] = v[o] + b.w[oc0 + o][0][0][0];
+      }
+    }
   }
+#endif
+  /**
+     @brief a cuda implementation of forward on tensor cores (cuda_tc)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @details an implicit GEMM, y(s,oc,i,j) = Σ_r w(oc,r) col(r,(s,i,j)),
+     where r = (ic,di,dj) and col is im2col of the batch, which is
+     never formed; tc_gemm_block reads it from x as it stages tiles.
+     operands are rounded to FP16 (BF16 with -DTC_BF16=1) and
+     accumulated in FP32; w itself stays FP32.  the grid covers maxB
+     samples as in forward_cuda_fast
+     @sa forward_cuda_tc_device
+     @sa tc_gemm_block
+  */
+  void forward_cuda_tc(tensor<real,maxB,IC,H,W>& x, int training) {
+#if __CUDACC__
+    const idx_t P = (H - K + 1) * (W - K + 1);
+    launch_and_sync((forward_cuda_tc_global<<<tc_grid(OC, maxB * P),tc_threads>>>(dev, x.dev, training)));
+#else
+    (void)x;
+    (void)training;
+    err_cuda_code_non_cuda_compiler(opt.algo_s);
+#endif
+  }
+#if __CUDACC__
+  /**
+     @brief the device function of forward_cuda_tc (a block)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @sa forward_cuda_tc
+  */
+  __device__
+  void forward_cuda_tc_device(tensor<real,maxB,IC,H,W>& x, int training) {
+    (void)training;
+    const idx_t OH = H - K + 1, OW = W - K + 1, P = OH * OW;
+    const idx_t R = IC * K * K;
+    const idx_t B = x.n0;
+    if (blockIdx.x == 0 && blockIdx.y == 0 && threadIdx.x == 0) {
+      y.set_n0(B);
+      x_ptr = &x;               // save pointer to input for backward
+    }
+    const real * wp = &w.w[0][0][0][0];
+    tc_gemm_block(OC, B * P, R,
+                  [&](idx_t oc, idx_t r) {
+                    return wp[oc * R + r];
+                  },
+                  [&](idx_t r, idx_t q) {
+                    const idx_t s = q / P, i = (q / OW) % OH, j = q % OW;
+                    const idx_t ic = r / (K * K), di = (r / K) % K, dj = r % K;
+                    return x.w[s][ic][i + di][j + dj];
+                  },
+                  [&](idx_t oc, idx_t q, real v) {
+                    const idx_t s = q / P, i = (q / OW) % OH, j = q % OW;
+                    y.w[s][oc][i][j] = v + b.w[oc][0][0][0];
+                  });
+  }
+#endif
 
   
   void forward_cpu_omp(tensor<real,maxB,IC,H,W>& x, int training) {
@@ -300,7 +504,8 @@ struct Convolution2D {
   void forward_cpu_simd(tensor<real,maxB,IC,H,W>& x, int training) {
     (void)training;
     idx_t B = x.n0;             // batch size
-                     // save pointer to input for backward
+    y.set_n0(B);
+    x_ptr = &x;                 // save pointer to input for backward
     for (idx_t s = 0; s < B; s++) {       // for each sample
       for (idx_t oc = 0; oc < OC; oc++) { // for each output channel
         for (idx_t i = 0; i < H - K + 1; i++) {   // for each output pixel
@@ -388,6 +593,233 @@ struct Convolution2D {
       }
     }
   }
+  /**
+     @brief lay out the receptive fields of sample s of x as columns
+     of an (IC*K*K) x ((H-K+1)*(W-K+1)) row-major matrix (im2col)
+     @param (x) input images
+     @param (s) the sample
+     @param (c) the matrix; element (r,p) for r = (ic*K+di)*K+dj
+     and p = i*(W-K+1)+j is c[r * col.ld + p] = x(s,ic,i+di,j+dj)
+     @sa forward_cpu_gemm
+  */
+  void im2col(tensor<real,maxB,IC,H,W>& x, idx_t s, real * c) {
+    const idx_t OH = H - K + 1, OW = W - K + 1;
+#pragma omp parallel for collapse(3)
+    for (idx_t ic = 0; ic < IC; ic++) {
+      for (idx_t di = 0; di < K; di++) {
+        for (idx_t dj = 0; dj < K; dj++) {
+          real * c_r = c + ((ic * K + di) * K + dj) * col.ld;
+          for (idx_t i = 0; i < OH; i++) {
+#pragma omp simd
+            for (idx_t j = 0; j < OW; j++) {
+              c_r[i * OW + j] = x(s,ic,i+di,j+dj);
+            }
+          }
+        }
+      }
+    }
+  }
+  /**
+     @brief the transpose of im2col; a ((H-K+1)*(W-K+1)) x (IC*K*K) matrix
+     @param (x) input images
+     @param (s) the sample
+     @param (c) the matrix; element (p,r) is element (r,p) of im2col
+     @sa backward_cpu_gemm
+  */
+  void im2col_t(tensor<real,maxB,IC,H,W>& x, idx_t s, real * c) {
+    const idx_t OH = H - K + 1, OW = W - K + 1;
+    const idx_t R = IC * K * K;
+    for (idx_t i = 0; i < OH; i++) {
+      for (idx_t j = 0; j < OW; j++) {
+        real * c_p = c + (i * OW + j) * R;
+        for (idx_t ic = 0; ic < IC; ic++) {
+          for (idx_t di = 0; di < K; di++) {
+            for (idx_t dj = 0; dj < K; dj++) {
+              c_p[(ic * K + di) * K + dj] = x(s,ic,i+di,j+dj);
+            }
+          }
+        }
+      }
+    }
+  }
+  /**
+     @brief add up an im2col-shaped matrix into sample s of gx (col2im)
+     @param (c) (IC*K*K) x ((H-K+1)*(W-K+1)) matrix laid out as in im2col (rows col.ld apart)
+     @param (s) the sample
+     @details each row of gx gathers from the (H-K+1)*(W-K+1) columns
+     it contributed to, so rows can be computed in parallel
+     @sa backward_cpu_gemm
+  */
+  void col2im(const real * c, idx_t s) {
+    const idx_t OH = H - K + 1, OW = W - K + 1;
+#pragma omp parallel for collapse(2)
+    for (idx_t ic = 0; ic < IC; ic++) {
+      for (idx_t i = 0; i < H; i++) {
+        real * g = &gx.w[s][ic][i][0];
+        for (idx_t j = 0; j < W; j++) {
+          g[j] = 0.0;
+        }
+        for (idx_t di = 0; di < K; di++) {
+          const idx_t ii = i - di;
+          if (ii < 0 || ii >= OH) continue;
+          for (idx_t dj = 0; dj < K; dj++) {
+            const real * c_r = c + ((ic * K + di) * K + dj) * col.ld + ii * OW;
+#pragma omp simd
+            for (idx_t jj = 0; jj < OW; jj++) {
+              g[jj + dj] += c_r[jj];
+            }
+          }
+        }
+      }
+    }
+  }
+  /**
+     @brief forward lowered to matrix multiply (im2col + GEMM)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @details for each sample, y_s (OC x OH*OW) = W (OC x IC*K*K)
+     col_s (IC*K*K x OH*OW) + b, with the bias preloaded into y_s
+     @sa im2col
+     @sa gemm_blocked
+  */
+  void forward_cpu_gemm(tensor<real,maxB,IC,H,W>& x, int training) {
+    (void)training;
+    idx_t B = x.n0;             // batch size
+    y.set_n0(B);
+    x_ptr = &x;                 // save pointer to input for backward
+    const idx_t P = (H - K + 1) * (W - K + 1);
+    const idx_t R = IC * K * K;
+    real * c = col.w;
+    const real * w_ = &w.w[0][0][0][0];
+    for (idx_t s = 0; s < B; s++) {
+      real * y_s = &y.w[s][0][0][0];
+      im2col(x, s, c);
+      for (idx_t oc = 0; oc < OC; oc++) {
+        const real b_oc = b(oc);
+#pragma omp simd
+        for (idx_t p = 0; p < P; p++) {
+          y_s[oc * P + p] = b_oc;
+        }
+      }
+      gemm_blocked(OC, P, R, w_, R, 1, c, col.ld, y_s, P, 1);
+    }
+  }
+  /**
+     @brief forward with the packed, parallel gemm
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @details the same lowering as forward_cpu_gemm
+     @sa forward_cpu_gemm
+     @sa gemm
+  */
+  void forward_cpu_blas_like(tensor<real,maxB,IC,H,W>& x, int training) {
+    (void)training;
+    idx_t B = x.n0;             // batch size
+    y.set_n0(B);
+    x_ptr = &x;                 // save pointer to input for backward
+    const idx_t P = (H - K + 1) * (W - K + 1);
+    const idx_t R = IC * K * K;
+    real * c = col.w;
+    const real * w_ = &w.w[0][0][0][0];
+    for (idx_t s = 0; s < B; s++) {
+      real * y_s = &y.w[s][0][0][0];
+      im2col(x, s, c);
+#pragma omp parallel for
+      for (idx_t oc = 0; oc < OC; oc++) {
+        const real b_oc = b(oc);
+#pragma omp simd
+        for (idx_t p = 0; p < P; p++) {
+          y_s[oc * P + p] = b_oc;
+        }
+      }
+      gemm<OC,P,R>(OC, P, R, w_, R, 1, c, col.ld, 1, y_s, P, 1, gemm_kern);
+    }
+  }
+  /**
+     @brief forward by Winograd F(2x2,3x3) (baseline if K != 3)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @sa Convolution2DWinograd
+  */
+  void forward_cpu_winograd(tensor<real,maxB,IC,H,W>& x, int training) {
+    if (!wino.supported) {
+      forward_base(x, training);
+      return;
+    }
+    idx_t B = x.n0;             // batch size
+    y.set_n0(B);
+    x_ptr = &x;                 // save pointer to input for backward
+    wino.forward(x, b, y);
+  }
+  /**
+     @brief forward on activations in the blocked layout (cpu_nchwc)
+     @param (x) input images (blocked; tensor::blk)
+     @param (training) 1 if it is called in training not testing
+     @details w is first rearranged into wblk as
+     [OC/OB][IC/IB][K][K][IB][OB] (IB = x.CB, OB = y.CB), so that an
+     output pixel accumulates its OB channels in a vector, adding
+     the OB contiguous weights of an input channel times the input
+     value; both the weights and the outputs are unit-stride
+  */
+  void forward_cpu_nchwc(tensor<real,maxB,IC,H,W>& x, int training) {
+    (void)training;
+    idx_t B = x.n0;             // batch size
+    y.set_n0(B);
+    x_ptr = &x;                 // save pointer to input for backward
+    const idx_t OH = H - K + 1, OW = W - K + 1;
+    const idx_t IB = tensor<real,maxB,IC,H,W>::CB;
+    const idx_t OB = tensor<real,maxB,OC,H-K+1,W-K+1>::CB;
+    real * wb = wblk.w;
+#pragma omp parallel for collapse(2)
+    for (idx_t ocb = 0; ocb < OC / OB; ocb++) {
+      for (idx_t icb = 0; icb < IC / IB; icb++) {
+        for (idx_t di = 0; di < K; di++) {
+          for (idx_t dj = 0; dj < K; dj++) {
+            real * wp = wb + (((ocb * (IC / IB) + icb) * K + di) * K + dj) * IB * OB;
+            for (idx_t ic = 0; ic < IB; ic++) {
+              for (idx_t oc = 0; oc < OB; oc++) {
+                wp[ic * OB + oc] = w(ocb * OB + oc, icb * IB + ic, di, dj);
+              }
+            }
+          }
+        }
+      }
+    }
+#pragma omp parallel for collapse(3)
+    for (idx_t s = 0; s < B; s++) {
+      for (idx_t ocb = 0; ocb < OC / OB; ocb++) {
+        for (idx_t i = 0; i < OH; i++) {
+          for (idx_t j = 0; j < OW; j++) {
+            real v[OB];
+#pragma omp simd
+            for (idx_t oc = 0; oc < OB; oc++) {
+              v[oc] = b(ocb * OB + oc);
+            }
+            for (idx_t icb = 0; icb < IC / IB; icb++) {
+              for (idx_t di = 0; di < K; di++) {
+                for (idx_t dj = 0; dj < K; dj++) {
+                  const real * xp = x.blk_ptr(s, icb, i + di, j + dj);
+                  const real * wp = wb + (((ocb * (IC / IB) + icb) * K + di) * K + dj) * IB * OB;
+                  for (idx_t ic = 0; ic < IB; ic++) {
+                    const real x_ = xp[ic];
+#pragma omp simd
+                    for (idx_t oc = 0; oc < OB; oc++) {
+                      v[oc] += wp[ic * OB + oc] * x_;
+                    }
+                  }
+                }
+              }
+            }
+            real * yp = y.blk_ptr(s, ocb, i, j);
+#pragma omp simd
+            for (idx_t oc = 0; oc < OB; oc++) {
+              yp[oc] = v[oc];
+            }
+          }
+        }
+      }
+    }
+  }
   /**
      @brief the device function of forward called from the 
      global (non-member) function
@@ -433,6 +865,31 @@ struct Convolution2D {
     forward_base(x, training);
   }
   
+  /**
+     @brief 1 if this layer has its own implementation of algorithm a
+     @details forward and backward fall back to the baseline for
+     others; when you add a case for your algorithm to them, add it
+     here too (--algo auto measures only these)
+  */
+  static int has_algo(algo_t a) {
+    switch (a) {
+    case algo_cpu_base:
+    case algo_cuda_base:
+    case algo_cpu_omp:
+    case algo_cpu_simd:
+    case algo_cpu_omp_simd:
+    case algo_cpu_gemm:
+    case algo_cpu_blas_like:
+    case algo_cpu_winograd:
+    case algo_cpu_nchwc:
+    case algo_cpu_intrin:
+    case algo_cuda_fast:
+    case algo_cuda_tc:
+      return 1;
+    default:
+      return 0;
+    }
+  }
   /**
      @brief forward phase of the layer
      @param (x) input images
@@ -450,6 +907,15 @@ struct Convolution2D {
     tsc_t t0 = get_tsc();
     switch (opt.algo) {
       /* add case for your implementations here */
+    case algo_cpu_winograd:
+      forward_cpu_winograd(x, training); break;
+    case algo_cpu_nchwc:
+      forward_cpu_nchwc(x, training); break;
+    case algo_cpu_blas_like:
+    case algo_cpu_intrin:       // with the intrinsic gemm kernel (gemm_kern)
+      forward_cpu_blas_like(x, training); break;
+    case algo_cpu_gemm:
+      forward_cpu_gemm(x, training); break;
     case algo_cpu_omp_simd:
       forward_cpu_omp_simd(x, training); break;
     case algo_cpu_simd:
@@ -462,6 +928,8 @@ struct Convolution2D {
       forward_cuda_base(x, training); break;
     case algo_cuda_fast:
       forward_cuda_fast(x, training); break;
+    case algo_cuda_tc:
+      forward_cuda_tc(x, training); break;
     default:
       if (opt.cuda_algo) {
         forward_cuda_base(x, training);
@@ -470,7 +938,9 @@ struct Convolution2D {
       }        
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_forward, x.n0,
+                   2.0 * x.n0 * OC * (H-K+1) * (W-K+1) * IC * K * K,
+                   sizeof(real) * (1.0 * x.n0 * (IC * H * W + OC * (H-K+1) * (W-K+1)) + OC * (IC * K * K + 1)));
     return y;
   }
   /**
@@ -545,89 +1015,249 @@ struct Convolution2D {
     }
   }
 
+  /**
+     @brief a cuda implementation of backward with shared-memory tiles
+     @param (gy) gradient of loss with respect to the output
+     @details two kernels.
+     backward_w_cuda_fast_device: a block of cf_gw_threads threads per
+     (oc,ic) computes the K x K gradients gw(oc,ic,:,:) (and gb(oc) when
+     ic = 0); threads take (s,i,j)'s in turns, accumulate in registers
+     and the partial sums are reduced by warp shuffles and then
+     across warps through shared memory.
+     backward_x_cuda_fast_device: computes gx just like the forward
+     kernel computes y, with the roles of output and input channels
+     swapped and filters flipped; a block computes a cf_ty x cf_tx tile
+     of gx of a sample for cf_oc input channels, staging gy tiles (with
+     the K-1 halo) and filters of cf_c output channels at a time.
+     as in forward_cuda_fast, the grid covers maxB samples
+     @sa backward_w_cuda_fast_device
+     @sa backward_x_cuda_fast_device
+  */
   void backward_cuda_fast(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
 #if __CUDACC__
-    idx_t B = gy.n0;
-    printf("%d %d %d\n", gy.n0, gy.n0, gy.n0);
-    gw.set_n0(OC);
-    gb.set_n0(OC);
-    gx.set_n0(B);
-    tensor<real,maxB,IC,H,W>& x = *x_ptr;
-    launch_and_sync((__L1__backward_cuda_fast_global<<<N_b_bw_L1,T_b>>>(dev, gy.dev)));
-    launch_and_sync((__L2__backward_cuda_fast_global<<<N_b_bw_L2,T_b>>>(dev, gy.dev)));
-    launch_and_sync((__L3__backward_cuda_fast_global<<<N_b_bw_L3,T_b>>>(dev, gy.dev)));
-
+    const idx_t n_icg = (IC + cf_oc - 1) / cf_oc;
+    dim3 grid_x((W + cf_tx - 1) / cf_tx, (H + cf_ty - 1) / cf_ty, maxB * n_icg);
+    dim3 block_x(cf_tx, cf_ty);
+    launch_and_sync((backward_w_cuda_fast_global<<<OC * IC,cf_gw_threads>>>(dev, gy.dev)));
+    launch_and_sync((backward_x_cuda_fast_global<<<grid_x,block_x>>>(dev, gy.dev)));
 #else
-    (void)x;
-    (void)training;
+    (void)gy;
     err_cuda_code_non_cuda_compiler(opt.algo_s);
 #endif
   }
-  __device__  
-  void __L1__backward_cuda_fast_device(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
-    int n = blockDim.x * blockIdx.x + threadIdx.x, oc, ic, di, dj;
-    idx_t B = gy.n0;
+#if __CUDACC__
+  /**
+     @brief the device function computing gw and gb in backward_cuda_fast (a block)
+     @param (gy) gradient of loss with respect to the output
+     @sa backward_cuda_fast
+  */
+  __device__
+  void backward_w_cuda_fast_device(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
+    static_assert(cf_gw_threads % 32 == 0, "cf_gw_threads must be a multiple of warp size");
+    static_assert(K * K + 1 <= cf_gw_threads, "too few threads for K");
+    const idx_t OH = H - K + 1, OW = W - K + 1;
+    const idx_t n_warps = cf_gw_threads / 32;
+    __shared__ real part[n_warps][K * K + 1];
+    const idx_t B = gy.n0;
     tensor<real,maxB,IC,H,W>& x = *x_ptr;
-    oc=(((n/K)/K)/OC)%B;
-    ic=((n/K)/K)%OC;
-    di=(n/K)%K;
-    dj=n%K;
-    
-    if(n < OC*IC*K*K){
-      real v = 0.0;
-      for (idx_t s = 0; s < B; s++) { // training samples
-        for (idx_t i = 0; i < H - K + 1; i++) { // sample pixel
-          for (idx_t j = 0; j < W - K + 1; j++) { // sample pixel
-            v += gy(s,oc,i,j) * x(s,ic,i+di,j+dj);
-          }
+    const idx_t oc = blockIdx.x / IC, ic = blockIdx.x % IC;
+    const idx_t lane = threadIdx.x % 32, wid = threadIdx.x / 32;
+    if (blockIdx.x == 0 && threadIdx.x == 0) {
+      gw.set_n0(OC);
+      gb.set_n0(OC);
+    }
+    /* acc[di*K+dj] for gw(oc,ic,di,dj), acc[K*K] for gb(oc) */
+    real acc[K * K + 1];
+    for (idx_t q = 0; q < K * K + 1; q++) {
+      acc[q] = 0.0;
+    }
+    for (idx_t k = threadIdx.x; k < B * OH * OW; k += cf_gw_threads) {
+      const idx_t s = k / (OH * OW), i = (k / OW) % OH, j = k % OW;
+      const real g = gy.w[s][oc][i][j];
+      for (idx_t di = 0; di < K; di++) {
+        for (idx_t dj = 0; dj < K; dj++) {
+          acc[di * K + dj] += g * x.w[s][ic][i + di][j + dj];
         }
       }
-      gw(oc,ic,di,dj) = v;
+      acc[K * K] += g;
+    }
+    for (idx_t q = 0; q < K * K + 1; q++) {
+      real a = acc[q];
+      for (int d = 16; d > 0; d /= 2) {
+        a += __shfl_down_sync(0xffffffffu, a, d);
+      }
+      if (lane == 0) part[wid][q] = a;
+    }
+    __syncthreads();
+    const idx_t q = threadIdx.x;
+    if (q < K * K + 1) {
+      real a = 0.0;
+      for (idx_t u = 0; u < n_warps; u++) {
+        a += part[u][q];
+      }
+      if (q < K * K) {
+        gw.w[oc][ic][q / K][q % K] = a;
+      } else if (ic == 0) {
+        gb.w[oc][0][0][0] = a;
+      }
     }
   }
-  __device__  
-  void __L2__backward_cuda_fast_device(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
-    int n = blockDim.x * blockIdx.x + threadIdx.x, oc;
-    idx_t B = gy.n0;
-    tensor<real,maxB,IC,H,W>& x = *x_ptr;
-    oc = n % OC;
-    if(n < OC){
-      real v = 0.0;
-      for (idx_t s = 0; s < B; s++) {
-        for (idx_t i = 0; i < H - K + 1; i++) {
-          for (idx_t j = 0; j < W - K + 1; j++) {
-            v += gy(s,oc,i,j);
+  /**
+     @brief the device function computing gx in backward_cuda_fast (a block)
+     @param (gy) gradient of loss with respect to the output
+     @sa backward_cuda_fast
+  */
+  __device__
+  void backward_x_cuda_fast_device(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
+    const idx_t OH = H - K + 1, OW = W - K + 1;
+    const idx_t SH = cf_ty + K - 1, SW = cf_tx + K - 1;
+    const idx_t n_icg = (IC + cf_oc - 1) / cf_oc;
+    const idx_t nt = cf_tx * cf_ty;
+    __shared__ real gs[cf_c][SH][SW];
+    __shared__ real ws[cf_c][cf_oc][K][K];
+    const idx_t B = gy.n0;
+    const idx_t s = blockIdx.z / n_icg;
+    const idx_t ic0 = (blockIdx.z % n_icg) * cf_oc;
+    const idx_t i0 = blockIdx.y * cf_ty, j0 = blockIdx.x * cf_tx;
+    const idx_t ty = threadIdx.y, tx = threadIdx.x;
+    const idx_t tid = ty * cf_tx + tx;
+    if (blockIdx.x == 0 && blockIdx.y == 0 && blockIdx.z == 0 && tid == 0) {
+      gx.set_n0(B);
+    }
+    if (s >= B) return;
+    real v[cf_oc];
+    for (idx_t o = 0; o < cf_oc; o++) {
+      v[o] = 0.0;
+    }
+    for (idx_t oc0 = 0; oc0 < OC; oc0 += cf_c) {
+      /* gs[c][ii][jj] = gy(s,oc0+c,i0-(K-1)+ii,j0-(K-1)+jj) (0 outside) */
+      for (idx_t k = tid; k < cf_c * SH * SW; k += nt) {
+        const idx_t c = k / (SH * SW), ii = (k / SW) % SH, jj = k % SW;
+        const idx_t oc = oc0 + c, i = i0 + ii - (K - 1), j = j0 + jj - (K - 1);
+        gs[c][ii][jj] = (oc < OC && 0 <= i && i < OH && 0 <= j && j < OW ? gy.w[s][oc][i][j] : 0.0);
+      }
+      for (idx_t k = tid; k < cf_c * cf_oc * K * K; k += nt) {
+        const idx_t c = k / (cf_oc * K * K), o = (k / (K * K)) % cf_oc;
+        const idx_t di = (k / K) % K, dj = k % K;
+        const idx_t oc = oc0 + c, ic = ic0 + o;
+        ws[c][o][di][dj] = (oc < OC && ic < IC ? w.w[oc][ic][di][dj] : 0.0);
+      }
+      __syncthreads();
+      for (idx_t c = 0; c < cf_c; c++) {
+        for (idx_t di = 0; di < K; di++) {
+          for (idx_t dj = 0; dj < K; dj++) {
+            const real g = gs[c][ty + (K - 1) - di][tx + (K - 1) - dj];
+            for (idx_t o = 0; o < cf_oc; o++) {
+              v[o] += ws[c][o][di][dj] * g;
+            }
           }
         }
       }
-      gb(oc) = v;
+      __syncthreads();
+    }
+    const idx_t i = i0 + ty, j = j0 + tx;
+    if (i < H && j < W) {
+      for (idx_t o = 0; o < cf_oc && ic0 + o < IC; o++) {
+        gx.w[s][ic0 + o][i][j] = v[o];
+      }
     }
   }
-  __device__  
-  void __L3__backward_cuda_fast_device(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
-    int n = blockDim.x * blockIdx.x + threadIdx.x, s, ic, i, j;
-    idx_t B = gy.n0;
+#endif
+  /**
+     @brief a cuda implementation of backward on tensor cores (cuda_tc)
+     @param (gy) gradient of loss with respect to the output
+     @details two implicit GEMMs as in forward_cuda_tc.
+     gw(oc,r) = Σ_(s,i,j) gy(s,oc,i,j) col(r,(s,i,j)) (the inner
+     dimension is the batch), and gx(s,ic,i,j) = Σ_(oc,di,dj)
+     w(oc,ic,di,dj) gy(s,oc,i-di,j-dj) (gy being 0 outside).  gb is summed
+     in FP32 by the blocks of the first column of the gw kernel.
+     gy is rounded like other operands, so under --loss-scale S
+     (gy scaled by S) small gradients survive the rounding to FP16
+     @sa backward_w_cuda_tc_device
+     @sa backward_x_cuda_tc_device
+  */
+  void backward_cuda_tc(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
+#if __CUDACC__
+    launch_and_sync((backward_w_cuda_tc_global<<<tc_grid(OC, IC * K * K),tc_threads>>>(dev, gy.dev)));
+    launch_and_sync((backward_x_cuda_tc_global<<<tc_grid(IC, maxB * H * W),tc_threads>>>(dev, gy.dev)));
+#else
+    (void)gy;
+    err_cuda_code_non_cuda_compiler(opt.algo_s);
+#endif
+  }
+#if __CUDACC__
+  /**
+     @brief the device function computing gw and gb in backward_cuda_tc (a block)
+     @param (gy) gradient of loss with respect to the output
+     @sa backward_cuda_tc
+  */
+  __device__
+  void backward_w_cuda_tc_device(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
+    const idx_t OH = H - K + 1, OW = W - K + 1, P = OH * OW;
+    const idx_t R = IC * K * K;
+    const idx_t B = gy.n0;
     tensor<real,maxB,IC,H,W>& x = *x_ptr;
-    s=(((n/W)/H)/IC)%B;
-    ic=((n/W)/H)%IC;
-    i=(n/W)%H;
-    j=n%W;
-
-    if(n < B*IC*H*W){
-      real v = 0.0;
-      for (idx_t oc = 0; oc < OC; oc++) {
-        for (idx_t di = 0; di < K; di++) {
-          for (idx_t dj = 0; dj < K; dj++) {
-            if (0 <= i - di && i - di < H - K + 1
-                && 0 <= j - dj && j - dj < W - K + 1) {
-              v += gy(s,oc,i-di,j-dj) * w(oc,ic,di,dj);
+    if (blockIdx.x == 0 && blockIdx.y == 0 && threadIdx.x == 0) {
+      gw.set_n0(OC);
+      gb.set_n0(OC);
+    }
+    real * gwp = &gw.w[0][0][0][0];
+    tc_gemm_block(OC, R, B * P,
+                  [&](idx_t oc, idx_t q) {
+                    const idx_t s = q / P, i = (q / OW) % OH, j = q % OW;
+                    return gy.w[s][oc][i][j];
+                  },
+                  [&](idx_t q, idx_t r) {
+                    const idx_t s = q / P, i = (q / OW) % OH, j = q % OW;
+                    const idx_t ic = r / (K * K), di = (r / K) % K, dj = r % K;
+                    return x.w[s][ic][i + di][j + dj];
+                  },
+                  [&](idx_t oc, idx_t r, real v) {
+                    gwp[oc * R + r] = v;
+                  });
+    if (blockIdx.x == 0) {
+      const idx_t oc_end = min_i(OC, (blockIdx.y + 1) * tc_bm);
+      for (idx_t oc = blockIdx.y * tc_bm + threadIdx.x; oc < oc_end; oc += tc_threads) {
+        real v = 0.0;
+        for (idx_t s = 0; s < B; s++) {
+          for (idx_t i = 0; i < OH; i++) {
+            for (idx_t j = 0; j < OW; j++) {
+              v += gy.w[s][oc][i][j];
             }
           }
         }
+        gb.w[oc][0][0][0] = v;
       }
-      gx(s,ic,i,j) = v;
     }
   }
+  /**
+     @brief the device function computing gx in backward_cuda_tc (a block)
+     @param (gy) gradient of loss with respect to the output
+     @sa backward_cuda_tc
+  */
+  __device__
+  void backward_x_cuda_tc_device(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
+    const idx_t OH = H - K + 1, OW = W - K + 1;
+    const idx_t B = gy.n0;
+    if (blockIdx.x == 0 && blockIdx.y == 0 && threadIdx.x == 0) {
+      gx.set_n0(B);
+    }
+    tc_gemm_block(IC, B * H * W, OC * K * K,
+                  [&](idx_t ic, idx_t r) {
+                    const idx_t oc = r / (K * K), di = (r / K) % K, dj = r % K;
+                    return w.w[oc][ic][di][dj];
+                  },
+                  [&](idx_t r, idx_t q) {
+                    const idx_t oc = r / (K * K), di = (r / K) % K, dj = r % K;
+                    const idx_t s = q / (H * W), i = (q / W) % H - di, j = q % W - dj;
+                    return (0 <= i && i < OH && 0 <= j && j < OW ? gy.w[s][oc][i][j] : (real)0);
+                  },
+                  [&](idx_t ic, idx_t q, real v) {
+                    const idx_t s = q / (H * W), i = (q / W) % H, j = q % W;
+                    gx.w[s][ic][i][j] = v;
+                  });
+  }
+#endif
   void backward_cpu_omp(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
     idx_t B = gy.n0;
     gw.set_n0(OC);
@@ -962,6 +1592,241 @@ struct Convolution2D {
       }
     }
   }
+  /**
+     @brief backward lowered to matrix multiply
+     @param (gy) gradient of loss with respect to the output
+     @details for each sample, gw += gy_s (OC x OH*OW) col_s^T
+     (OH*OW x IC*K*K) and gx_s = col2im(W^T (IC*K*K x OC) gy_s);
+     gb is a plain reduction
+     @sa im2col_t
+     @sa col2im
+     @sa gemm_blocked
+  */
+  void backward_cpu_gemm(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
+    idx_t B = gy.n0;
+    gw.set_n0(OC);
+    gb.set_n0(OC);
+    gx.set_n0(B);
+    tensor<real,maxB,IC,H,W>& x = *x_ptr;
+    const idx_t P = (H - K + 1) * (W - K + 1);
+    const idx_t R = IC * K * K;
+    real * c = col.w;
+    real * gw_ = &gw.w[0][0][0][0];
+    const real * w_ = &w.w[0][0][0][0];
+    for (idx_t oc = 0; oc < OC; oc++) {
+      real v = 0.0;
+      for (idx_t s = 0; s < B; s++) {
+        const real * gy_so = &gy.w[s][oc][0][0];
+#pragma omp simd reduction(+:v)
+        for (idx_t p = 0; p < P; p++) {
+          v += gy_so[p];
+        }
+      }
+      gb(oc) = v;
+    }
+    if (B == 0) {
+      gw.init_const(OC, 0.0);
+    }
+    for (idx_t s = 0; s < B; s++) {
+      const real * gy_s = &gy.w[s][0][0][0];
+      /* gw (+)= gy_s col_s^T */
+      im2col_t(x, s, c);
+      gemm_blocked(OC, R, P, gy_s, P, 1, c, R, gw_, R, s > 0);
+      /* col = W^T gy_s, then scatter it to gx_s */
+      gemm_blocked(R, P, OC, w_, 1, R, gy_s, P, c, col.ld, 0);
+      col2im(c, s);
+    }
+  }
+  /**
+     @brief backward with the packed, parallel gemm
+     @param (gy) gradient of loss with respect to the output
+     @details the same lowering as backward_cpu_gemm, except that
+     col^T is given to gemm as strides instead of being materialized
+     @sa backward_cpu_gemm
+     @sa gemm
+  */
+  void backward_cpu_blas_like(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
+    idx_t B = gy.n0;
+    gw.set_n0(OC);
+    gb.set_n0(OC);
+    gx.set_n0(B);
+    tensor<real,maxB,IC,H,W>& x = *x_ptr;
+    const idx_t P = (H - K + 1) * (W - K + 1);
+    const idx_t R = IC * K * K;
+    real * c = col.w;
+    real * gw_ = &gw.w[0][0][0][0];
+    const real * w_ = &w.w[0][0][0][0];
+#pragma omp parallel for
+    for (idx_t oc = 0; oc < OC; oc++) {
+      real v = 0.0;
+      for (idx_t s = 0; s < B; s++) {
+        const real * gy_so = &gy.w[s][oc][0][0];
+#pragma omp simd reduction(+:v)
+        for (idx_t p = 0; p < P; p++) {
+          v += gy_so[p];
+        }
+      }
+      gb(oc) = v;
+    }
+    if (B == 0) {
+      gw.init_const(OC, 0.0);
+    }
+    for (idx_t s = 0; s < B; s++) {
+      const real * gy_s = &gy.w[s][0][0][0];
+      /* gw (+)= gy_s col_s^T */
+      im2col(x, s, c);
+      gemm<OC,R,P>(OC, R, P, gy_s, P, 1, c, 1, col.ld, gw_, R, s > 0, gemm_kern);
+      /* col = W^T gy_s, then add it up into gx_s */
+      gemm<R,P,OC>(R, P, OC, w_, 1, R, gy_s, P, 1, c, col.ld, 0, gemm_kern);
+      col2im(c, s);
+    }
+  }
+  /**
+     @brief backward by Winograd F(2x2,3x3) (baseline if K != 3)
+     @param (gy) gradient of loss with respect to the output
+     @sa Convolution2DWinograd
+  */
+  void backward_cpu_winograd(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
+    if (!wino.supported) {
+      backward_base(gy);
+      return;
+    }
+    idx_t B = gy.n0;
+    gw.set_n0(OC);
+    gb.set_n0(OC);
+    gx.set_n0(B);
+    wino.backward(*x_ptr, gy, gw, gb, gx);
+  }
+  /**
+     @brief backward on activations in the blocked layout (cpu_nchwc)
+     @param (gy) gradient of loss with respect to the output (blocked)
+     @details gw of a block pair (ocb,icb) and a kernel pixel is an
+     IB x OB outer product summed over samples and pixels.  gx gathers
+     from the output pixels each input pixel contributed to, with w
+     rearranged into wblk as [IC/IB][OC/OB][K][K][OB][IB], so the IB
+     channels of an input pixel are computed in a vector
+     @sa forward_cpu_nchwc
+  */
+  void backward_cpu_nchwc(tensor<real,maxB,OC,H-K+1,W-K+1>& gy) {
+    idx_t B = gy.n0;
+    gw.set_n0(OC);
+    gb.set_n0(OC);
+    gx.set_n0(B);
+    tensor<real,maxB,IC,H,W>& x = *x_ptr;
+    const idx_t OH = H - K + 1, OW = W - K + 1;
+    const idx_t IB = tensor<real,maxB,IC,H,W>::CB;
+    const idx_t OB = tensor<real,maxB,OC,H-K+1,W-K+1>::CB;
+#pragma omp parallel for
+    for (idx_t ocb = 0; ocb < OC / OB; ocb++) {
+      real v[OB];
+#pragma omp simd
+      for (idx_t oc = 0; oc < OB; oc++) {
+        v[oc] = 0.0;
+      }
+      for (idx_t s = 0; s < B; s++) {
+        for (idx_t i = 0; i < OH; i++) {
+          for (idx_t j = 0; j < OW; j++) {
+            const real * gp = gy.blk_ptr(s, ocb, i, j);
+#pragma omp simd
+            for (idx_t oc = 0; oc < OB; oc++) {
+              v[oc] += gp[oc];
+            }
+          }
+        }
+      }
+      for (idx_t oc = 0; oc < OB; oc++) {
+        gb(ocb * OB + oc) = v[oc];
+      }
+    }
+#pragma omp parallel for collapse(4)
+    for (idx_t ocb = 0; ocb < OC / OB; ocb++) {
+      for (idx_t icb = 0; icb < IC / IB; icb++) {
+        for (idx_t di = 0; di < K; di++) {
+          for (idx_t dj = 0; dj < K; dj++) {
+            real v[IB][OB];
+            for (idx_t ic = 0; ic < IB; ic++) {
+#pragma omp simd
+              for (idx_t oc = 0; oc < OB; oc++) {
+                v[ic][oc] = 0.0;
+              }
+            }
+            for (idx_t s = 0; s < B; s++) {
+              for (idx_t i = 0; i < OH; i++) {
+                for (idx_t j = 0; j < OW; j++) {
+                  const real * gp = gy.blk_ptr(s, ocb, i, j);
+                  const real * xp = x.blk_ptr(s, icb, i + di, j + dj);
+                  for (idx_t ic = 0; ic < IB; ic++) {
+                    const real x_ = xp[ic];
+#pragma omp simd
+                    for (idx_t oc = 0; oc < OB; oc++) {
+                      v[ic][oc] += gp[oc] * x_;
+                    }
+                  }
+                }
+              }
+            }
+            for (idx_t ic = 0; ic < IB; ic++) {
+              for (idx_t oc = 0; oc < OB; oc++) {
+                gw(ocb * OB + oc, icb * IB + ic, di, dj) = v[ic][oc];
+              }
+            }
+          }
+        }
+      }
+    }
+    real * wb = wblk.w;
+#pragma omp parallel for collapse(2)
+    for (idx_t icb = 0; icb < IC / IB; icb++) {
+      for (idx_t ocb = 0; ocb < OC / OB; ocb++) {
+        for (idx_t di = 0; di < K; di++) {
+          for (idx_t dj = 0; dj < K; dj++) {
+            real * wp = wb + (((icb * (OC / OB) + ocb) * K + di) * K + dj) * OB * IB;
+            for (idx_t oc = 0; oc < OB; oc++) {
+              for (idx_t ic = 0; ic < IB; ic++) {
+                wp[oc * IB + ic] = w(ocb * OB + oc, icb * IB + ic, di, dj);
+              }
+            }
+          }
+        }
+      }
+    }
+#pragma omp parallel for collapse(3)
+    for (idx_t s = 0; s < B; s++) {
+      for (idx_t icb = 0; icb < IC / IB; icb++) {
+        for (idx_t i = 0; i < H; i++) {
+          for (idx_t j = 0; j < W; j++) {
+            real v[IB];
+#pragma omp simd
+            for (idx_t ic = 0; ic < IB; ic++) {
+              v[ic] = 0.0;
+            }
+            for (idx_t ocb = 0; ocb < OC / OB; ocb++) {
+              for (idx_t di = 0; di < K; di++) {
+                if (i - di < 0 || i - di >= OH) continue;
+                for (idx_t dj = 0; dj < K; dj++) {
+                  if (j - dj < 0 || j - dj >= OW) continue;
+                  const real * gp = gy.blk_ptr(s, ocb, i - di, j - dj);
+                  const real * wp = wb + (((icb * (OC / OB) + ocb) * K + di) * K + dj) * OB * IB;
+                  for (idx_t oc = 0; oc < OB; oc++) {
+                    const real g = gp[oc];
+#pragma omp simd
+                    for (idx_t ic = 0; ic < IB; ic++) {
+                      v[ic] += wp[oc * IB + ic] * g;
+                    }
+                  }
+                }
+              }
+            }
+            real * gxp = gx.blk_ptr(s, icb, i, j);
+#pragma omp simd
+            for (idx_t ic = 0; ic < IB; ic++) {
+              gxp[ic] = v[ic];
+            }
+          }
+        }
+      }
+    }
+  }
   /**
      @brief the device function of backward called from the 
      global (non-member) function
@@ -1023,6 +1888,15 @@ struct Convolution2D {
     tsc_t t0 = get_tsc();
     switch (opt.algo) {
       /* add case for your implementations here */
+    case algo_cpu_winograd:
+      backward_cpu_winograd(gy); break;
+    case algo_cpu_nchwc:
+      backward_cpu_nchwc(gy); break;
+    case algo_cpu_blas_like:
+    case algo_cpu_intrin:       // with the intrinsic gemm kernel (gemm_kern)
+      backward_cpu_blas_like(gy); break;
+    case algo_cpu_gemm:
+      backward_cpu_gemm(gy); break;
     case algo_cpu_omp_simd:
       backward_cpu_omp_simd(gy); break;
     case algo_cpu_simd:
@@ -1035,6 +1909,8 @@ struct Convolution2D {
       backward_cuda_base(gy); break;
     case algo_cuda_fast:
       backward_cuda_fast(gy); break;
+    case algo_cuda_tc:
+      backward_cuda_tc(gy); break;
     default:
       if (opt.cuda_algo) {
         backward_cuda_base(gy);
@@ -1043,7 +1919,9 @@ struct Convolution2D {
       }        
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_backward, gy.n0,
+                   4.0 * gy.n0 * OC * (H-K+1) * (W-K+1) * IC * K * K,
+                   sizeof(real) * (1.0 * gy.n0 * (2 * IC * H * W + OC * (H-K+1) * (W-K+1)) + 2 * OC * (IC * K * K + 1)));
     return gx;
   }
   /* member functions below assume data are on the host.
@@ -1075,6 +1953,9 @@ struct Convolution2D {
   void add_grad(real alpha) {
     w.add_(alpha, gw);
     b.add_(alpha, gb);
+    if (opt.algo == algo_cpu_winograd) {
+      wino.transform_weights(w);
+    }
   }
   /**
      @brief take the inner product of gradients
@@ -1120,6 +2001,14 @@ int convolution_main(int argc, char ** argv) {
   double max_e = 0.0;
   double sum_e = 0.0;
   Convolution2DCfg cfg;
+  if (strlen(opt.bench)) {
+    int r = bench_layer<Convolution2D<maxB,IC,H,W,K,OC>,
+                        tensor<real,maxB,IC,H,W>,
+                        tensor<real,maxB,OC,H-K+1,W-K+1>,
+                        Convolution2DCfg>(opt, &lgr, rg, cfg, "convolution", maxB);
+    lgr.end_log();
+    return r;
+  }
   for (int iter = 0; iter < n_checks; iter++) {
     printf("==== %d ====\n", iter);
     double e = grad_check<Convolution2D<maxB,IC,H,W,K,OC>,
@@ -1132,5 +2021,5 @@ int convolution_main(int argc, char ** argv) {
   printf("max relative error = %.9f\n", max_e);
   printf("avg relative error = %.9f\n", sum_e / n_checks);
   lgr.end_log();
-  return 0;
+  return grad_check_verdict(opt, max_e);
 }
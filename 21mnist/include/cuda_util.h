@@ -41,11 +41,32 @@ static void check_launch_error_(const char * msg, const char * file, int line) {
   }
 }
 
+/**
+   @brief signal a fatal error if the (per-thread default) stream is
+   being captured into a CUDA graph (--cuda-exec 2)
+   @param (what) the operation that must not be captured
+   @details a synchronous copy or wait while capturing invalidates
+   the capture, which otherwise shows up only as an obscure error of
+   cudaStreamEndCapture. queue such an operation on the stream
+   (e.g., to_dev_async) or do it outside the captured step
+*/
+static void check_not_capturing(const char * what) {
+  cudaStreamCaptureStatus st = cudaStreamCaptureStatusNone;
+  check_api_error(cudaStreamIsCapturing(cudaStreamPerThread, &st));
+  if (st != cudaStreamCaptureStatusNone) {
+    fprintf(stderr,
+            "error: %s called while a training step is captured into a CUDA graph (--cuda-exec 2)\n",
+            what);
+    exit(1);
+  }
+}
+
 /**
    @brief wrap cudaDeviceSynchronize with error check
 */
 
 static void dev_sync() {
+  check_not_capturing("dev_sync");
   check_api_error(cudaDeviceSynchronize());
 }
 
@@ -59,12 +80,20 @@ static void dev_sync() {
 #define check_launch_error(exp) do { exp; check_launch_error_(#exp, __FILE__, __LINE__); } while (0)
 
 /**
-   @brief launch a kernel and wait for its completion
+   @brief 1 if launch_and_sync waits for the completion of each kernel.
+   set to 0 for stream-ordered execution (--cuda-exec 1/2), in which
+   kernels just queue up and the host only waits when it copies results back
+ */
+__attribute__((unused))
+static int launch_sync = 1;
+
+/**
+   @brief launch a kernel and wait for its completion (unless launch_sync is 0)
    @details usage: launch_and_sync((kernel-launch-expression)). for example,
    launch_and_sync((your_gpu_kernel<<<n_blocks,block_sz>>>(a,b,c))). 
    note that you need to put parens around the expression.
  */
-#define launch_and_sync(exp) do { exp; check_launch_error_(#exp, __FILE__, __LINE__); dev_sync(); } while (0)
+#define launch_and_sync(exp) do { exp; check_launch_error_(#exp, __FILE__, __LINE__); if (launch_sync) dev_sync(); } while (0)
 
 /**
    @brief get SM executing the caller
@@ -108,6 +137,7 @@ static void dev_free(void * a) {
    @brief wrap cudaMemcpy to copy from device to host (and check an error if any)
  */
 void to_host(void * dst, void * src, size_t sz) {
+  check_not_capturing("to_host");
   check_api_error(cudaMemcpy(dst, src, sz, cudaMemcpyDeviceToHost));
 }
 
@@ -115,9 +145,35 @@ void to_host(void * dst, void * src, size_t sz) {
    @brief wrap cudaMemcpy to copy from host to device (and check an error if any)
  */
 static void to_dev(void * dst, void * src, size_t sz) {
+  check_not_capturing("to_dev");
   check_api_error(cudaMemcpy(dst, src, sz, cudaMemcpyHostToDevice));
 }
 
+/**
+   @brief wrap cudaMemcpyAsync to copy from host to device on a stream
+   (and check an error if any). src should be pinned (host_malloc)
+   for the copy to overlap with the caller
+ */
+static void to_dev_async(void * dst, void * src, size_t sz, cudaStream_t s) {
+  check_api_error(cudaMemcpyAsync(dst, src, sz, cudaMemcpyHostToDevice, s));
+}
+
+/**
+   @brief wrap cudaMallocHost.  allocate page-locked (pinned) host memory
+ */
+static void * host_malloc(size_t sz) {
+  void * a = 0;
+  check_api_error(cudaMallocHost(&a, sz));
+  return a;
+}
+
+/**
+   @brief wrap cudaFreeHost
+ */
+static void host_free(void * a) {
+  cudaFreeHost(a);
+}
+
 /**
    @brief thread ID along x-dimension
  */
@@ -214,6 +270,16 @@ __global__ void forward_cuda_fast_global(T* dev, I0* x_dev, I1* t_dev, int train
   dev->forward_cuda_fast_device(*x_dev, *t_dev, training);
 }
 
+/**
+   @brief a global CUDA function that starts a forward with the
+   counter-based generator (e.g., Dropout::next_key) on the device
+   @param (dev) the address of the device shadow of the object
+  */
+template<typename T>
+__global__ void next_key_global(T* dev) {
+  dev->next_key();
+}
+
 /**
    @brief a global CUDA function that implements the baseline 
    backward function for GPU
@@ -232,6 +298,33 @@ __global__ void backward_cuda_base_global(T* dev, O* gy_dev, I1* t_dev) {
   dev->backward_cuda_base_device(*gy_dev, *t_dev);
 }
 
+template<typename T, typename O>
+__global__ void backward_cuda_fast_global(T* dev, O* gy_dev) {
+  dev->backward_cuda_fast_device(*gy_dev);
+}
+
+template<typename T, typename O>
+__global__ void backward_w_cuda_fast_global(T* dev, O* gy_dev) {
+  dev->backward_w_cuda_fast_device(*gy_dev);
+}
+template<typename T, typename O>
+__global__ void backward_x_cuda_fast_global(T* dev, O* gy_dev) {
+  dev->backward_x_cuda_fast_device(*gy_dev);
+}
+
+template<typename T, typename I>
+__global__ void forward_cuda_tc_global(T* dev, I* x_dev, int training) {
+  dev->forward_cuda_tc_device(*x_dev, training);
+}
+template<typename T, typename O>
+__global__ void backward_w_cuda_tc_global(T* dev, O* gy_dev) {
+  dev->backward_w_cuda_tc_device(*gy_dev);
+}
+template<typename T, typename O>
+__global__ void backward_x_cuda_tc_global(T* dev, O* gy_dev) {
+  dev->backward_x_cuda_tc_device(*gy_dev);
+}
+
 template<typename T, typename O>
 __global__ void __L1__backward_cuda_fast_global(T* dev, O* gy_dev) {
   dev->__L1__backward_cuda_fast_device(*gy_dev);
@@ -270,3 +363,13 @@ __global__ void update_cuda_base_global(T* dev) {
   dev->update_cuda_base_device();
 }
 
+/**
+   @brief a global CUDA function that updates all entries of a
+   list of parameters (e.g., ada_delta_list) in a single launch
+   @param (list) the list (passed by value)
+  */
+template<typename T>
+__global__ void update_multi_cuda_global(T list) {
+  list.update_cuda_device();
+}
+
@@ -0,0 +1,436 @@
+/**
+   @file data_parallel.h
+   @brief data-parallel training: replicas of the network in MPI
+   processes (one per node or, with NCCL, one per GPU) that take
+   shards of each mini batch and all-reduce their gradients
+   @details compile with -DUSE_MPI=1 (and mpicxx, or -lmpi) to get
+   replicas; add -DUSE_NCCL=1 (and -lnccl) for CUDA algorithms to
+   reduce gradients on the device with NCCL.  without USE_MPI,
+   everything here degenerates to a single replica and costs nothing
+ */
+#pragma once
+
+#ifndef USE_MPI
+#define USE_MPI 0
+#endif
+#ifndef USE_NCCL
+#define USE_NCCL 0
+#endif
+
+#include "mnist_util.h"
+#if USE_MPI
+/* only the C API is used */
+#define OMPI_SKIP_MPICXX 1
+#define MPICH_SKIP_MPICXX 1
+#include <mpi.h>
+#endif
+#if USE_NCCL
+#include <nccl.h>
+#endif
+
+/**
+   @brief the replicas (processes) of data-parallel training
+ */
+struct dp_env {
+  int rank;                     /**< this replica (0 .. size-1) */
+  int size;                     /**< the number of replicas */
+  int local_rank;               /**< this replica among those on the same node */
+#if USE_MPI
+  MPI_Comm comm;                /**< all replicas */
+#endif
+  /**
+     @brief start replicas (MPI_Init) and pick this replica's GPU
+     @param (argc) argc of main
+     @param (argv) argv of main
+     @details replicas on a node take GPUs local_rank % (GPUs of the node)
+  */
+  void init(int * argc, char *** argv) {
+#if USE_MPI
+    MPI_Init(argc, argv);
+    comm = MPI_COMM_WORLD;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    MPI_Comm node;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+    MPI_Comm_rank(node, &local_rank);
+    MPI_Comm_free(&node);
+#if __CUDACC__
+    int n_devs = 0;
+    if (cudaGetDeviceCount(&n_devs) == cudaSuccess && n_devs > 0) {
+      check_api_error(cudaSetDevice(local_rank % n_devs));
+    }
+#endif
+#else
+    (void)argc;
+    (void)argv;
+    rank = 0;
+    size = 1;
+    local_rank = 0;
+#endif
+  }
+  /**
+     @brief end replicas (MPI_Finalize)
+  */
+  void fini() {
+#if USE_MPI
+    MPI_Finalize();
+#endif
+  }
+  /**
+     @brief replace x[0:n] with their sums over all replicas
+  */
+  void sum(double * x, int n) {
+#if USE_MPI
+    if (size > 1) {
+      MPI_Allreduce(MPI_IN_PLACE, x, n, MPI_DOUBLE, MPI_SUM, comm);
+    }
+#else
+    (void)x;
+    (void)n;
+#endif
+  }
+  /**
+     @brief 1 if all replicas give the same x
+  */
+  int same(unsigned long x) {
+#if USE_MPI
+    if (size > 1) {
+      unsigned long lo = x, hi = x;
+      MPI_Allreduce(MPI_IN_PLACE, &lo, 1, MPI_UNSIGNED_LONG, MPI_MIN, comm);
+      MPI_Allreduce(MPI_IN_PLACE, &hi, 1, MPI_UNSIGNED_LONG, MPI_MAX, comm);
+      return lo == hi;
+    }
+#endif
+    (void)x;
+    return 1;
+  }
+};
+
+/**
+   @brief a hash (FNV-1a) of n reals at p
+   @param (p) the address of reals
+   @param (n) the number of reals
+   @param (cuda) 1 if p is a device address
+   @param (h) the hash of data before p (to hash several arrays)
+   @details used to check that replicas have bitwise-identical weights
+ */
+static unsigned long dp_digest(const real * p, long n, int cuda, unsigned long h) {
+  const real * q = p;
+  real * buf = 0;
+  if (cuda) {
+#if __CUDACC__
+    buf = (real *)malloc(sizeof(real) * n);
+    ::to_host(buf, (void *)p, sizeof(real) * n);
+    q = buf;
+#endif
+  }
+  const unsigned char * c = (const unsigned char *)q;
+  for (size_t k = 0; k < sizeof(real) * n; k++) {
+    h = (h ^ c[k]) * 1099511628211UL;
+  }
+  free(buf);
+  return h;
+}
+
+/**
+   @brief all-reduces (sums) gradients of replicas, in buckets
+   started while backward is still going on
+   @details tensors are added in the order in which backward
+   finishes them (fc2 first, conv1 last), each with the stage
+   (0, 1, ...) after which it is final.  plan groups consecutive
+   tensors into buckets of about cap bytes; a bucket starts as soon
+   as the stage of its last tensor is ready, so reducing gradients
+   of later layers overlaps backward of earlier ones, and finish
+   waits for all of them before update.  a bucket of a single tensor
+   is reduced in place; others are packed into (and unpacked
+   from) a staging buffer so that a single call reduces them.
+   a reduction gives the same sum to all replicas, so replicas that
+   start with the same weights keep bitwise-identical weights.
+
+   gradients on the host are reduced by MPI_Iallreduce.  gradients on
+   the device are reduced by ncclAllReduce on a stream of its own
+   (USE_NCCL), ordered after backward by events and before update;
+   without NCCL, they are copied to pinned host memory and reduced by MPI
+ */
+struct grad_sync {
+  static const int max_tensors = 16; /**< the maximum number of tensors */
+  /**
+     @brief a gradient tensor
+  */
+  struct tensor_t {
+    real * g;                   /**< the address (device address if cuda) */
+    long n;                     /**< the number of elements */
+    int stage;                  /**< final after this stage of backward */
+  };
+  /**
+     @brief tensors reduced together
+  */
+  struct bucket_t {
+    int first;                  /**< the first tensor */
+    int last;                   /**< one past the last tensor */
+    long n;                     /**< the number of elements */
+    int stage;                  /**< started after this stage */
+    real * buf;                 /**< staging buffer (0 : reduced in place) */
+    int started;                /**< 1 if it has been started in this step */
+#if USE_MPI
+    MPI_Request req;            /**< the request of MPI_Iallreduce */
+#endif
+  };
+  dp_env * env;                 /**< replicas */
+  logger * lgr;                 /**< logger */
+  int cuda;                     /**< 1 if gradients are on the device */
+  long cap;                     /**< bytes of a bucket */
+  tensor_t tensors[max_tensors]; /**< tensors */
+  int n_tensors;                 /**< the number of tensors */
+  bucket_t buckets[max_tensors]; /**< buckets */
+  int n_buckets;                 /**< the number of buckets */
+#if __CUDACC__
+  cudaStream_t stream;          /**< the stream reductions are issued to */
+  cudaEvent_t ev;               /**< synchronizes stream with the compute stream */
+#endif
+#if USE_NCCL
+  ncclComm_t nccl;              /**< all replicas (NCCL) */
+#endif
+  /**
+     @brief make an empty set of gradients
+     @param (env) replicas
+     @param (lgr) logger
+     @param (cuda) 1 if gradients are on the device
+     @param (cap) bytes of a bucket
+  */
+  void init(dp_env * env, logger * lgr, int cuda, long cap) {
+    this->env = env;
+    this->lgr = lgr;
+    this->cuda = cuda;
+    this->cap = cap;
+    n_tensors = 0;
+    n_buckets = 0;
+  }
+  /**
+     @brief add a gradient
+     @param (g) the address (device address if cuda)
+     @param (n) the number of elements
+     @param (stage) backward finishes it at this stage
+     @details call it in the order in which backward finishes tensors
+  */
+  void add(real * g, long n, int stage) {
+    assert(n_tensors < max_tensors);
+    assert(n_tensors == 0 || tensors[n_tensors - 1].stage <= stage);
+    tensors[n_tensors++] = { g, n, stage };
+  }
+  /**
+     @brief 1 if reductions go through NCCL
+  */
+  int use_nccl() {
+    return cuda && USE_NCCL;
+  }
+  /**
+     @brief group tensors into buckets and allocate staging buffers
+  */
+  void plan() {
+    n_buckets = 0;
+    for (int i = 0; i < n_tensors; i++) {
+      bucket_t * b = (n_buckets ? &buckets[n_buckets - 1] : 0);
+      if (!b || (long)sizeof(real) * (b->n + tensors[i].n) > cap) {
+        b = &buckets[n_buckets++];
+        b->first = i;
+        b->n = 0;
+      }
+      b->last = i + 1;
+      b->n += tensors[i].n;
+      b->stage = tensors[i].stage;
+    }
+    for (int j = 0; j < n_buckets; j++) {
+      bucket_t& b = buckets[j];
+      b.started = 0;
+      b.buf = 0;
+      /* without NCCL, device gradients always go through host memory */
+      if (b.last - b.first > 1 || (cuda && !use_nccl())) {
+        b.buf = (real *)alloc_buf(sizeof(real) * b.n);
+      }
+      lgr->log(1, "data parallel: bucket %d: %d tensors, %ld bytes, after stage %d%s",
+               j, b.last - b.first, (long)sizeof(real) * b.n, b.stage,
+               (b.buf ? "" : ", in place"));
+    }
+#if __CUDACC__
+    if (cuda) {
+      check_api_error(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+      check_api_error(cudaEventCreateWithFlags(&ev, cudaEventDisableTiming));
+    }
+#endif
+#if USE_NCCL && USE_MPI
+    if (use_nccl()) {
+      ncclUniqueId id;
+      if (env->rank == 0) ncclGetUniqueId(&id);
+      MPI_Bcast(&id, sizeof(id), MPI_BYTE, 0, env->comm);
+      if (ncclCommInitRank(&nccl, env->size, id, env->rank) != ncclSuccess) {
+        fprintf(stderr, "error: ncclCommInitRank failed\n");
+        exit(1);
+      }
+    }
+#endif
+  }
+  /**
+     @brief release staging buffers
+  */
+  void fini() {
+    for (int j = 0; j < n_buckets; j++) {
+      if (buckets[j].buf) free_buf(buckets[j].buf);
+      buckets[j].buf = 0;
+    }
+#if __CUDACC__
+    if (cuda) {
+      check_api_error(cudaEventDestroy(ev));
+      check_api_error(cudaStreamDestroy(stream));
+    }
+#endif
+#if USE_NCCL
+    if (use_nccl()) ncclCommDestroy(nccl);
+#endif
+  }
+  /**
+     @brief allocate a staging buffer of sz bytes
+  */
+  void * alloc_buf(size_t sz) {
+#if __CUDACC__
+    if (cuda) {
+      return (use_nccl() ? dev_malloc(sz) : host_malloc(sz));
+    }
+#endif
+    void * a = malloc(sz);
+    if (!a) { perror("malloc"); exit(1); }
+    return a;
+  }
+  /**
+     @brief free a buffer from alloc_buf
+  */
+  void free_buf(void * a) {
+#if __CUDACC__
+    if (cuda) {
+      if (use_nccl()) dev_free(a); else host_free(a);
+      return;
+    }
+#endif
+    free(a);
+  }
+  /**
+     @brief copy a tensor into (pack = 1) or from (pack = 0) a staging buffer
+  */
+  void copy(tensor_t& t, real * buf, int pack) {
+    const size_t sz = sizeof(real) * t.n;
+    if (!cuda) {
+      if (pack) memcpy(buf, t.g, sz); else memcpy(t.g, buf, sz);
+      return;
+    }
+#if __CUDACC__
+    if (use_nccl()) {
+      check_api_error(cudaMemcpyAsync(pack ? buf : t.g, pack ? t.g : buf, sz,
+                                      cudaMemcpyDeviceToDevice, stream));
+    } else if (pack) {
+      ::to_host(buf, t.g, sz);
+    } else {
+      ::to_dev(t.g, buf, sz);
+    }
+#endif
+  }
+  /**
+     @brief start reducing a bucket
+  */
+  void start(bucket_t& b) {
+    real * p = (b.buf ? b.buf : tensors[b.first].g);
+    if (b.buf) {
+      long off = 0;
+      for (int i = b.first; i < b.last; i++) {
+        copy(tensors[i], b.buf + off, 1);
+        off += tensors[i].n;
+      }
+    }
+#if USE_NCCL
+    if (use_nccl()) {
+      ncclDataType_t ty = (sizeof(real) == 4 ? ncclFloat : ncclDouble);
+      if (ncclAllReduce(p, p, b.n, ty, ncclSum, nccl, stream) != ncclSuccess) {
+        fprintf(stderr, "error: ncclAllReduce failed\n");
+        exit(1);
+      }
+      b.started = 1;
+      return;
+    }
+#endif
+#if USE_MPI
+    MPI_Datatype ty = (sizeof(real) == 4 ? MPI_FLOAT : MPI_DOUBLE);
+    MPI_Iallreduce(MPI_IN_PLACE, p, b.n, ty, MPI_SUM, env->comm, &b.req);
+#else
+    (void)p;
+#endif
+    b.started = 1;
+  }
+  /**
+     @brief called when backward has finished stage; start buckets
+     that became ready
+     @param (stage) the stage (0, 1, ...) just finished
+  */
+  void ready(int stage) {
+    if (env->size == 1) return;
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+#if __CUDACC__
+    if (use_nccl()) {
+      /* reductions on stream wait for backward queued so far */
+      check_api_error(cudaEventRecord(ev, cudaStreamPerThread));
+      check_api_error(cudaStreamWaitEvent(stream, ev, 0));
+    }
+#endif
+    for (int j = 0; j < n_buckets; j++) {
+      if (!buckets[j].started && buckets[j].stage <= stage) {
+        start(buckets[j]);
+      }
+    }
+#if USE_MPI
+    /* give MPI a chance to progress reductions started earlier */
+    for (int j = 0; j < n_buckets; j++) {
+      if (buckets[j].started && !use_nccl()) {
+        int flag;
+        MPI_Test(&buckets[j].req, &flag, MPI_STATUS_IGNORE);
+      }
+    }
+#endif
+    tsc_t t1 = get_tsc();
+    log_end_fun(lgr, t0, t1);
+  }
+  /**
+     @brief wait for all reductions and unpack them, so that
+     gradients are the sums of all replicas'
+     @details for NCCL, the host does not wait; kernels issued to the
+     compute stream afterwards (update) wait for the reductions
+  */
+  void finish() {
+    if (env->size == 1) return;
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    ready(tensors[n_tensors - 1].stage);
+    for (int j = 0; j < n_buckets; j++) {
+      bucket_t& b = buckets[j];
+#if USE_MPI
+      if (!use_nccl()) {
+        MPI_Wait(&b.req, MPI_STATUS_IGNORE);
+      }
+#endif
+      if (b.buf) {
+        long off = 0;
+        for (int i = b.first; i < b.last; i++) {
+          copy(tensors[i], b.buf + off, 0);
+          off += tensors[i].n;
+        }
+      }
+      b.started = 0;
+    }
+#if __CUDACC__
+    if (use_nccl()) {
+      check_api_error(cudaEventRecord(ev, stream));
+      check_api_error(cudaStreamWaitEvent(cudaStreamPerThread, ev, 0));
+    }
+#endif
+    tsc_t t1 = get_tsc();
+    log_end_fun(lgr, t0, t1);
+  }
+};
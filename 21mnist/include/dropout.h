@@ -7,6 +7,7 @@
 #include "mnist_util.h"
 #include "tensor.h"
 #include "grad_check.h"
+#include "bench.h"
 
 /**
    @brief configuration data for Dropout
@@ -14,6 +15,7 @@
 struct DropoutCfg {
   real ratio;                   /**< the probability to drop (zero) an element */
   long seed;                    /**< random number seed */
+  int inplace;                  /**< 1 if y overwrites x (and gx overwrites gy); cpu only */
 };
 
 /**
@@ -41,6 +43,7 @@ struct Dropout {
   tensor<real,N0,N1,N2,N3> gx;      /**< gradient of loss wrt to input x */
   real drop_ratio;              /**< drop probability */
   long state_forward;           /**< random number state at the forward function */
+  int inplace;                  /**< 1 if forward/backward work in place (DropoutCfg::inplace) */
   /**
      @brief initialize the layer
      @param (opt) command line options
@@ -54,6 +57,7 @@ struct Dropout {
     (void)rg;
     this->drop_ratio = cfg.ratio;
     this->rg.seed(cfg.seed);
+    this->inplace = cfg.inplace && !opt.cuda_algo;
   }
   /**
      @brief set the device pointer for this and all subobjects
@@ -113,30 +117,131 @@ struct Dropout {
       }
     }
   }
+  /**
+     @brief 1 if the mask is drawn from the counter-based generator
+     (philox_t) instead of the sequential one (rg)
+     @details forward_cpu_omp (also used by cpu_nchwc) and
+     forward_cuda_fast (also used by cuda_tc) draw the mask
+     in parallel, so they must not share the state of rg among
+     threads.  the mask of element j of sample i0 is instead
+     philox_t::rand01(key, i0, j) < ratio,
+     where key is the state of rg at the forward.  the mask is
+     thus the same on CPU and GPU and for any number of threads,
+     and backward regenerates it per element.
+  */
+  int ctr_mask() const {
+    return (opt.algo == algo_cpu_omp || opt.algo == algo_cpu_nchwc
+            || opt.algo == algo_cuda_fast || opt.algo == algo_cuda_tc);
+  }
+  /**
+     @brief start a forward with the counter-based generator
+     @returns the key of the mask of this forward
+     @details the key is remembered in state_forward for backward
+     and rg advances so that the next forward gets a new mask.
+     under cuda_fast it runs on the device (next_key_global), so the
+     key never has to be passed from the host and a captured CUDA
+     graph draws a new mask at each replay
+  */
+  __device__ __host__
+  uint64_t next_key() {
+    state_forward = rg.get_state();
+    rg.next();
+    return state_forward;
+  }
+  /**
+     @brief 1 if element j of sample i0 is dropped with probability p
+     @param (key) the key returned by next_key
+     @param (i0) the index in the batch
+     @param (j) the index of the element in the sample (i.e., (i1 * N2 + i2) * N3 + i3)
+     @param (p) drop probability
+  */
+  __device__ __host__
+  static int dropped(uint64_t key, idx_t i0, idx_t j, real p) {
+    return philox_t::rand01(key, i0, j) < p;
+  }
+  /**
+     @brief 1 if the activations are in the blocked layout (tensor::blk),
+     whose element at position q of a sample is not element q
+     @details under cpu_nchwc; the mask is nevertheless drawn by
+     the logical index (logical_index), so that it is the same as
+     that of the other counter-based algorithms
+  */
+  int blocked() const {
+    return (opt.algo == algo_cpu_nchwc
+            && !tensor<real,N0,N1,N2,N3>::blk_is_identity());
+  }
+  /**
+     @brief the logical index (i1 * N2 + i2) * N3 + i3 of the element
+     at position q of a sample in the blocked layout
+  */
+  static idx_t logical_index(idx_t q) {
+    const idx_t CB = tensor<real,N0,N1,N2,N3>::CB;
+    const idx_t P = N2 * N3;
+    const idx_t i1 = q / (P * CB) * CB + q % CB;
+    return i1 * P + q / CB % P;
+  }
+  /**
+     @brief a parallel cpu implementation of forward
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @sa ctr_mask
+  */
   void forward_cpu_omp(tensor<real,N0,N1,N2,N3>& x, int training) {
     const idx_t n0 = x.n0;
+    const idx_t n = N1 * N2 * N3;
     y.set_n0(n0);
-    /* zero elements with probability of ratio and
-       scale others by 1/(1-ratio) so that the sum 
-       will stay approximately the same */
-    state_forward = rg.get_state();
+    const uint64_t key = next_key();
+    const int blk = blocked();
     real p = training ? drop_ratio : 0.0;
     real scale = 1.0 / (1 - p);
-    #pragma omp parallel for collapse(4)
+#pragma omp parallel for
     for (idx_t i0 = 0; i0 < n0; i0++) {
-      for (idx_t i1 = 0; i1 < N1; i1++) {
-        for (idx_t i2 = 0; i2 < N2; i2++) {
-          for (idx_t i3 = 0; i3 < N3; i3++) {
-            if (rg.rand01() < p) {
-              y(i0,i1,i2,i3) = 0.0;
-            } else {
-              y(i0,i1,i2,i3) = x(i0,i1,i2,i3) * scale;
-            }
-          }
-        }
+      const real * x_i = &x.w[i0][0][0][0];
+      real * y_i = &y.w[i0][0][0][0];
+#pragma omp simd
+      for (idx_t j = 0; j < n; j++) {
+        const idx_t k = (blk ? logical_index(j) : j);
+        y_i[j] = (dropped(key, i0, k, p) ? 0.0 : x_i[j] * scale);
       }
     }
   }
+  /**
+     @brief a cuda implementation of forward (one thread per element)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @sa ctr_mask
+  */
+  void forward_cuda_fast(tensor<real,N0,N1,N2,N3>& x, int training) {
+#if __CUDACC__
+    const int n_threads = 256;
+    const int n_blocks = (N0 * N1 * N2 * N3 + n_threads - 1) / n_threads;
+    launch_and_sync((next_key_global<<<1,1>>>(dev)));
+    launch_and_sync((forward_cuda_fast_global<<<n_blocks,n_threads>>>(dev, x.dev, training)));
+#else
+    (void)x;
+    (void)training;
+    err_cuda_code_non_cuda_compiler(opt.algo_s);
+#endif
+  }
+#if __CUDACC__
+  __device__
+  void forward_cuda_fast_device(tensor<real,N0,N1,N2,N3>& x, int training) {
+    const uint64_t key = state_forward;
+    const idx_t n0 = x.n0;
+    const idx_t n = N1 * N2 * N3;
+    y.set_n0(n0);
+    real p = training ? drop_ratio : 0.0;
+    real scale = 1.0 / (1 - p);
+    idx_t t = blockDim.x * blockIdx.x + threadIdx.x;
+    if (t < n0 * n) {
+      const idx_t i0 = t / n;
+      const idx_t j = t % n;
+      const real * x_i = &x.w[i0][0][0][0];
+      real * y_i = &y.w[i0][0][0][0];
+      y_i[j] = (dropped(key, i0, j, p) ? 0.0 : x_i[j] * scale);
+    }
+  }
+#endif
   /**
      @brief the device function of forward called from the 
      global (non-member) function
@@ -181,6 +286,52 @@ struct Dropout {
   void forward_cpu_base(tensor<real,N0,N1,N2,N3>& x, int training) {
     forward_base(x, training);
   }
+  /**
+     @brief in-place forward (x is overwritten by the output)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @details draws the same mask as forward would (serially
+     in the order of forward_base, or with the counter-based generator
+     when ctr_mask()).  legal when nobody reads x after this layer
+  */
+  void forward_inplace(tensor<real,N0,N1,N2,N3>& x, int training) {
+    const idx_t n0 = x.n0;
+    const idx_t n = N1 * N2 * N3;
+    const int ctr = ctr_mask();
+    const uint64_t key = (ctr ? next_key() : 0);
+    if (!ctr) state_forward = rg.get_state();
+    const int blk = blocked();
+    real p = training ? drop_ratio : 0.0;
+    real scale = 1.0 / (1 - p);
+#pragma omp parallel for if(ctr)
+    for (idx_t i0 = 0; i0 < n0; i0++) {
+      real * x_i = &x.w[i0][0][0][0];
+      for (idx_t j = 0; j < n; j++) {
+        const idx_t k = (blk ? logical_index(j) : j);
+        const int drop = (ctr ? dropped(key, i0, k, p) : rg.rand01() < p);
+        x_i[j] = (drop ? 0.0 : x_i[j] * scale);
+      }
+    }
+  }
+  /**
+     @brief 1 if this layer has its own implementation of algorithm a
+     @details forward and backward fall back to the baseline for
+     others; when you add a case for your algorithm to them, add it
+     here too (--algo auto measures only these)
+  */
+  static int has_algo(algo_t a) {
+    switch (a) {
+    case algo_cpu_base:
+    case algo_cuda_base:
+    case algo_cpu_omp:
+    case algo_cpu_nchwc:
+    case algo_cuda_fast:
+    case algo_cuda_tc:
+      return 1;
+    default:
+      return 0;
+    }
+  }
   /**
      @brief forward phase of the layer
      @param (x) input images
@@ -196,10 +347,22 @@ struct Dropout {
   tensor<real,N0,N1,N2,N3>& forward(tensor<real,N0,N1,N2,N3>& x, int training) {
     log_start_fun(lgr);
     tsc_t t0 = get_tsc();
+    if (inplace) {
+      forward_inplace(x, training);
+      tsc_t t1 = get_tsc();
+      log_end_kernel(lgr, t0, t1, prof_forward, x.n0,
+                     1.0 * x.n0 * N1 * N2 * N3,
+                     2.0 * sizeof(real) * x.n0 * N1 * N2 * N3);
+      return x;
+    }
     switch (opt.algo) {
       /* add case for your implementations here */
     case algo_cpu_omp:
+    case algo_cpu_nchwc:        // elementwise; the mask by the logical index
       forward_cpu_omp(x, training); break;
+    case algo_cuda_fast:
+    case algo_cuda_tc:
+      forward_cuda_fast(x, training); break;
     case algo_cpu_base:
       forward_cpu_base(x, training); break;
     case algo_cuda_base:
@@ -212,7 +375,9 @@ struct Dropout {
       }        
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_forward, x.n0,
+                   1.0 * x.n0 * N1 * N2 * N3,
+                   2.0 * sizeof(real) * x.n0 * N1 * N2 * N3);
     return y;
   }
   /**
@@ -250,26 +415,63 @@ struct Dropout {
       }
     }
   }
+  /**
+     @brief a parallel cpu implementation of backward
+     @param (gy) gradient of loss with respect to the output
+     @details the mask is regenerated from state_forward
+     @sa ctr_mask
+  */
   void backward_cpu_omp(tensor<real,N0,N1,N2,N3>& gy) {
     const idx_t n0 = gy.n0;
+    const idx_t n = N1 * N2 * N3;
     gx.set_n0(n0);
-    rg.seed(state_forward);
+    const uint64_t key = state_forward;
+    const int blk = blocked();
     real scale = 1.0 / (1 - drop_ratio);
-    #pragma omp parallel for collapse(4)
+#pragma omp parallel for
     for (idx_t i0 = 0; i0 < n0; i0++) {
-      for (idx_t i1 = 0; i1 < N1; i1++) {
-        for (idx_t i2 = 0; i2 < N2; i2++) {
-          for (idx_t i3 = 0; i3 < N3; i3++) {
-            if (rg.rand01() < drop_ratio) {
-              gx(i0,i1,i2,i3) = 0.0;
-            } else {
-              gx(i0,i1,i2,i3) = scale * gy(i0,i1,i2,i3);
-            }
-          }
-        }
+      const real * gy_i = &gy.w[i0][0][0][0];
+      real * gx_i = &gx.w[i0][0][0][0];
+#pragma omp simd
+      for (idx_t j = 0; j < n; j++) {
+        const idx_t k = (blk ? logical_index(j) : j);
+        gx_i[j] = (dropped(key, i0, k, drop_ratio) ? 0.0 : scale * gy_i[j]);
       }
     }
   }
+  /**
+     @brief a cuda implementation of backward (one thread per element)
+     @param (gy) gradient of loss with respect to the output
+     @sa ctr_mask
+  */
+  void backward_cuda_fast(tensor<real,N0,N1,N2,N3>& gy) {
+#if __CUDACC__
+    const int n_threads = 256;
+    const int n_blocks = (N0 * N1 * N2 * N3 + n_threads - 1) / n_threads;
+    launch_and_sync((backward_cuda_fast_global<<<n_blocks,n_threads>>>(dev, gy.dev)));
+#else
+    (void)gy;
+    err_cuda_code_non_cuda_compiler(opt.algo_s);
+#endif
+  }
+#if __CUDACC__
+  __device__
+  void backward_cuda_fast_device(tensor<real,N0,N1,N2,N3>& gy) {
+    const uint64_t key = state_forward;
+    const idx_t n0 = gy.n0;
+    const idx_t n = N1 * N2 * N3;
+    gx.set_n0(n0);
+    real scale = 1.0 / (1 - drop_ratio);
+    idx_t t = blockDim.x * blockIdx.x + threadIdx.x;
+    if (t < n0 * n) {
+      const idx_t i0 = t / n;
+      const idx_t j = t % n;
+      const real * gy_i = &gy.w[i0][0][0][0];
+      real * gx_i = &gx.w[i0][0][0][0];
+      gx_i[j] = (dropped(key, i0, j, drop_ratio) ? 0.0 : scale * gy_i[j]);
+    }
+  }
+#endif
   /**
      @brief the device function of backward called from the 
      global (non-member) function
@@ -310,6 +512,29 @@ struct Dropout {
   void backward_cpu_base(tensor<real,N0,N1,N2,N3>& gy) {
     backward_base(gy);
   }
+  /**
+     @brief in-place backward (gy is overwritten by the gradient wrt the input)
+     @param (gy) gradient of loss with respect to the output
+     @sa forward_inplace
+  */
+  void backward_inplace(tensor<real,N0,N1,N2,N3>& gy) {
+    const idx_t n0 = gy.n0;
+    const idx_t n = N1 * N2 * N3;
+    const int ctr = ctr_mask();
+    const uint64_t key = state_forward;
+    if (!ctr) rg.seed(state_forward);
+    const int blk = blocked();
+    real scale = 1.0 / (1 - drop_ratio);
+#pragma omp parallel for if(ctr)
+    for (idx_t i0 = 0; i0 < n0; i0++) {
+      real * g_i = &gy.w[i0][0][0][0];
+      for (idx_t j = 0; j < n; j++) {
+        const idx_t k = (blk ? logical_index(j) : j);
+        const int drop = (ctr ? dropped(key, i0, k, drop_ratio) : rg.rand01() < drop_ratio);
+        g_i[j] = (drop ? 0.0 : scale * g_i[j]);
+      }
+    }
+  }
   /**
      @brief calc the gradient of loss wrt the input (x)
      @param (gy) gradient of loss with respect to the output
@@ -329,10 +554,22 @@ struct Dropout {
   tensor<real,N0,N1,N2,N3>& backward(tensor<real,N0,N1,N2,N3>& gy) {
     log_start_fun(lgr);
     tsc_t t0 = get_tsc();
+    if (inplace) {
+      backward_inplace(gy);
+      tsc_t t1 = get_tsc();
+      log_end_kernel(lgr, t0, t1, prof_backward, gy.n0,
+                     1.0 * gy.n0 * N1 * N2 * N3,
+                     2.0 * sizeof(real) * gy.n0 * N1 * N2 * N3);
+      return gy;
+    }
     switch (opt.algo) {
       /* add case for your implementations here */
     case algo_cpu_omp:
+    case algo_cpu_nchwc:        // elementwise; the mask by the logical index
       backward_cpu_omp(gy); break;
+    case algo_cuda_fast:
+    case algo_cuda_tc:
+      backward_cuda_fast(gy); break;
     case algo_cpu_base:
       backward_cpu_base(gy); break;
     case algo_cuda_base:
@@ -345,7 +582,9 @@ struct Dropout {
       }        
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_backward, gy.n0,
+                   1.0 * gy.n0 * N1 * N2 * N3,
+                   2.0 * sizeof(real) * gy.n0 * N1 * N2 * N3);
     return gx;
   }
 
@@ -417,7 +656,15 @@ int dropout_main(int argc, char ** argv) {
   /* check errors */
   double max_e = 0.0;
   double sum_e = 0.0;
-  DropoutCfg cfg = { .ratio = 0.5, .seed = opt.dropout_seed_1 };
+  DropoutCfg cfg = { .ratio = 0.5, .seed = opt.dropout_seed_1, .inplace = 0 };
+  if (strlen(opt.bench)) {
+    int r = bench_layer<Dropout<maxB,C,H,W>,
+                        tensor<real,maxB,C,H,W>,
+                        tensor<real,maxB,C,H,W>,
+                        DropoutCfg>(opt, &lgr, rg, cfg, "dropout", maxB);
+    lgr.end_log();
+    return r;
+  }
   for (int iter = 0; iter < n_checks; iter++) {
     printf("==== %d ====\n", iter);
     double e = grad_check<Dropout<maxB,C,H,W>,
@@ -430,6 +677,6 @@ int dropout_main(int argc, char ** argv) {
   printf("max relative error = %.9f\n", max_e);
   printf("avg relative error = %.9f\n", sum_e / n_checks);
   lgr.end_log();
-  return 0;
+  return grad_check_verdict(opt, max_e);
 }
 
@@ -0,0 +1,293 @@
+/**
+   @file fused.h
+   @brief convolution -> relu -> max pooling -> dropout in a single pass
+ */
+#pragma once
+
+#include "mnist_util.h"
+#include "tensor.h"
+#include "gemm.h"
+#include "convolution.h"
+#include "max_pooling.h"
+#include "dropout.h"
+#include "arena.h"
+
+/**
+   @brief fused convolution, relu, max pooling and dropout
+
+   @param (maxB) the maximum number of images (batch size)
+   @param (IC) the number of input channels of the convolution
+   @param (H) height of an input image
+   @param (W) width of an input image
+   @param (K) convolution kernel size
+   @param (OC) the number of output channels of the convolution
+   @param (S) shrink factor of the pooling
+
+   @details computes what conv.forward, relu.forward,
+   pool.forward and dropout.forward compute in sequence, without
+   materializing the (maxB,OC,H-K+1,W-K+1) outputs of the convolution
+   and the relu. the convolution output of one image at a time goes
+   to a small buffer (ys) that stays in cache, and the pooling,
+   relu and dropout are applied to it right away. since relu and max
+   commute, the max is taken before relu.  the layer objects keep
+   their roles for the results: pool.y holds the pooled values
+   *before* relu, pool.argmax_i/j the position of the maximum and
+   dropout.y the final output; the dropout mask is the one
+   dropout.forward would draw (see Dropout::ctr_mask), so the output
+   is identical to the unfused network.
+
+   backward only visits the position that gave the maximum of each
+   window, and only when it passed relu (pool.y >= 0), so both the
+   gradient wrt the relu/pooling inputs and the dense gradient wrt the
+   convolution output are never formed.
+ */
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t K,idx_t OC,idx_t S>
+struct ConvReluPoolDropout {
+  static const idx_t OH = H - K + 1;  /**< convolution output height */
+  static const idx_t OW = W - K + 1;  /**< convolution output width */
+  static const idx_t PH = OH / S;     /**< pooled height */
+  static const idx_t PW = OW / S;     /**< pooled width */
+  cmdline_opt opt;                    /**< command line option */
+  logger * lgr;                       /**< logger */
+  tensor<real,OC,OH,OW> ys;           /**< convolution output of a single image */
+  heap_tensor<real,maxB,OC,PH,PW> gp; /**< ∂L/∂(pooled convolution output); batch_size rows */
+  int gp_id;                          /**< index of gp in the scratch arena (or -1) */
+  /**
+     @brief initialize
+     @param (opt) command line options
+     @param (lgr) logger
+  */
+  void init(cmdline_opt opt, logger * lgr) {
+    this->opt = opt;
+    this->lgr = lgr;
+    if (opt.fuse) {
+      gp.alloc(min_i(maxB, opt.batch_size));
+    }
+  }
+  /**
+     @brief add work buffers (gp) to an arena
+     @param (a) the arena
+     @param (owner) the name of this block
+     @param (live) steps at which backward runs
+  */
+  void plan_scratch(arena_t& a, const char * owner, uint64_t live) {
+    gp_id = (gp.cap0 ? a.add(owner, "gp", gp.bytes(gp.cap0), live) : -1);
+  }
+  /**
+     @brief move work buffers into an arena after it is allocated
+     @param (a) the arena
+  */
+  void attach_scratch(arena_t& a) {
+    if (gp_id >= 0) gp.attach((real *)a.ptr(gp_id), gp.cap0);
+  }
+  /**
+     @brief fused forward
+     @param (conv) the convolution layer
+     @param (pool) the max pooling layer
+     @param (dropout) the dropout layer
+     @param (x) input images to the convolution
+     @param (training) 1 if it is called in training not testing
+     @returns the output of dropout (dropout.y)
+  */
+  tensor<real,maxB,OC,PH,PW>&
+  forward(Convolution2D<maxB,IC,H,W,K,OC>& conv,
+          MaxPooling2D<maxB,OC,OH,OW,S>& pool,
+          Dropout<maxB,OC,PH,PW>& dropout,
+          tensor<real,maxB,IC,H,W>& x, int training) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    const idx_t B = x.n0;
+    const idx_t P = OH * OW;
+    const idx_t R = IC * K * K;
+    conv.x_ptr = &x;            // save pointer to input for backward
+    pool.y.set_n0(B);
+    pool.argmax_i.set_n0(B);
+    pool.argmax_j.set_n0(B);
+    dropout.y.set_n0(B);
+    ys.set_n0(OC);
+    /* same mask as dropout.forward would draw under opt.algo */
+    const int ctr = dropout.ctr_mask();
+    const uint64_t key = (ctr ? dropout.next_key() : 0);
+    if (!ctr) dropout.state_forward = dropout.rg.get_state();
+    const real p = training ? dropout.drop_ratio : 0.0;
+    const real scale = 1.0 / (1 - p);
+    real * c = conv.col.w;
+    real * y_s = &ys.w[0][0][0][0];
+    for (idx_t s = 0; s < B; s++) {
+      /* convolution of image s into ys */
+      conv.im2col(x, s, c);
+#pragma omp parallel for
+      for (idx_t oc = 0; oc < OC; oc++) {
+        const real b_oc = conv.b(oc);
+        for (idx_t q = 0; q < P; q++) {
+          y_s[oc * P + q] = b_oc;
+        }
+      }
+      gemm<OC,OH*OW,IC*K*K>(OC, P, R, &conv.w.w[0][0][0][0], R, 1,
+                            c, conv.col.ld, 1, y_s, P, 1);
+      /* max pooling */
+#pragma omp parallel for collapse(2)
+      for (idx_t oc = 0; oc < OC; oc++) {
+        for (idx_t i = 0; i < PH; i++) {
+          for (idx_t j = 0; j < PW; j++) {
+            idx_t max_i = S * i;
+            idx_t max_j = S * j;
+            real v = ys(oc,max_i,max_j);
+            for (idx_t i_ = S * i; i_ < S * (i + 1); i_++) {
+              for (idx_t j_ = S * j; j_ < S * (j + 1); j_++) {
+                if (v < ys(oc,i_,j_)) {
+                  max_i = i_;
+                  max_j = j_;
+                  v = ys(oc,max_i,max_j);
+                }
+              }
+            }
+            pool.y(s,oc,i,j) = v;
+            pool.argmax_i(s,oc,i,j) = max_i;
+            pool.argmax_j(s,oc,i,j) = max_j;
+          }
+        }
+      }
+      /* relu and dropout; without the counter-based generator,
+         random numbers are drawn serially in the same order as
+         Dropout::forward_base */
+#pragma omp parallel for if(ctr)
+      for (idx_t oc = 0; oc < OC; oc++) {
+        for (idx_t i = 0; i < PH; i++) {
+          for (idx_t j = 0; j < PW; j++) {
+            const real v = pool.y(s,oc,i,j);
+            const int drop = (ctr ?
+                              dropout.dropped(key, s, (oc * PH + i) * PW + j, p) :
+                              dropout.rg.rand01() < p);
+            if (drop) {
+              dropout.y(s,oc,i,j) = 0.0;
+            } else {
+              dropout.y(s,oc,i,j) = (v >= 0 ? v : 0) * scale;
+            }
+          }
+        }
+      }
+    }
+    tsc_t t1 = get_tsc();
+    log_end_kernel(lgr, t0, t1, prof_forward, x.n0,
+                   x.n0 * (2.0 * OC * OH * OW * IC * K * K + 2.0 * OC * OH * OW),
+                   sizeof(real) * (1.0 * x.n0 * (IC * H * W + OC * PH * PW) + OC * (IC * K * K + 1)));
+    return dropout.y;
+  }
+  /**
+     @brief fused backward
+     @param (conv) the convolution layer
+     @param (pool) the max pooling layer
+     @param (dropout) the dropout layer
+     @param (gy) gradient of loss with respect to the output of dropout
+     @returns gradient of loss with respect to the input of the
+     convolution (conv.gx). conv.gw and conv.gb are set too.
+  */
+  tensor<real,maxB,IC,H,W>&
+  backward(Convolution2D<maxB,IC,H,W,K,OC>& conv,
+           MaxPooling2D<maxB,OC,OH,OW,S>& pool,
+           Dropout<maxB,OC,PH,PW>& dropout,
+           tensor<real,maxB,OC,PH,PW>& gy) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    const idx_t B = gy.n0;
+    tensor<real,maxB,IC,H,W>& x = *conv.x_ptr;
+    conv.gw.set_n0(OC);
+    conv.gb.set_n0(OC);
+    conv.gx.set_n0(B);
+    gp.set_n0(B);
+    /* dropout and relu backward; replays the random numbers of forward */
+    const int ctr = dropout.ctr_mask();
+    const uint64_t key = dropout.state_forward;
+    if (!ctr) dropout.rg.seed(dropout.state_forward);
+    const real ratio = dropout.drop_ratio;
+    const real scale = 1.0 / (1 - ratio);
+#pragma omp parallel for if(ctr)
+    for (idx_t s = 0; s < B; s++) {
+      for (idx_t oc = 0; oc < OC; oc++) {
+        for (idx_t i = 0; i < PH; i++) {
+          for (idx_t j = 0; j < PW; j++) {
+            const int drop = (ctr ?
+                              dropout.dropped(key, s, (oc * PH + i) * PW + j, ratio) :
+                              dropout.rg.rand01() < ratio);
+            const int pass = (pool.y(s,oc,i,j) >= 0);
+            gp(s,oc,i,j) = (!drop && pass ? scale * gy(s,oc,i,j) : 0.0);
+          }
+        }
+      }
+    }
+    /* ∂L/∂w and ∂L/∂b; gradient wrt the convolution output is
+       gp at (argmax_i,argmax_j) of each window and zero elsewhere */
+#pragma omp parallel for
+    for (idx_t oc = 0; oc < OC; oc++) {
+      real gb = 0.0;
+      real gw[IC][K][K];
+      for (idx_t ic = 0; ic < IC; ic++) {
+        for (idx_t di = 0; di < K; di++) {
+          for (idx_t dj = 0; dj < K; dj++) {
+            gw[ic][di][dj] = 0.0;
+          }
+        }
+      }
+      for (idx_t s = 0; s < B; s++) {
+        for (idx_t i = 0; i < PH; i++) {
+          for (idx_t j = 0; j < PW; j++) {
+            const real g = gp(s,oc,i,j);
+            if (g == 0.0) continue;
+            const idx_t ai = pool.argmax_i(s,oc,i,j);
+            const idx_t aj = pool.argmax_j(s,oc,i,j);
+            gb += g;
+            for (idx_t ic = 0; ic < IC; ic++) {
+              for (idx_t di = 0; di < K; di++) {
+                for (idx_t dj = 0; dj < K; dj++) {
+                  gw[ic][di][dj] += g * x(s,ic,ai+di,aj+dj);
+                }
+              }
+            }
+          }
+        }
+      }
+      conv.gb(oc) = gb;
+      for (idx_t ic = 0; ic < IC; ic++) {
+        for (idx_t di = 0; di < K; di++) {
+          for (idx_t dj = 0; dj < K; dj++) {
+            conv.gw(oc,ic,di,dj) = gw[ic][di][dj];
+          }
+        }
+      }
+    }
+    /* ∂L/∂x */
+#pragma omp parallel for
+    for (idx_t s = 0; s < B; s++) {
+      for (idx_t ic = 0; ic < IC; ic++) {
+        for (idx_t i = 0; i < H; i++) {
+          for (idx_t j = 0; j < W; j++) {
+            conv.gx(s,ic,i,j) = 0.0;
+          }
+        }
+      }
+      for (idx_t oc = 0; oc < OC; oc++) {
+        for (idx_t i = 0; i < PH; i++) {
+          for (idx_t j = 0; j < PW; j++) {
+            const real g = gp(s,oc,i,j);
+            if (g == 0.0) continue;
+            const idx_t ai = pool.argmax_i(s,oc,i,j);
+            const idx_t aj = pool.argmax_j(s,oc,i,j);
+            for (idx_t ic = 0; ic < IC; ic++) {
+              for (idx_t di = 0; di < K; di++) {
+                for (idx_t dj = 0; dj < K; dj++) {
+                  conv.gx(s,ic,ai+di,aj+dj) += g * conv.w(oc,ic,di,dj);
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+    tsc_t t1 = get_tsc();
+    log_end_kernel(lgr, t0, t1, prof_backward, gy.n0,
+                   4.0 * gy.n0 * OC * OH * OW * IC * K * K,
+                   sizeof(real) * (1.0 * gy.n0 * (2 * IC * H * W + OC * PH * PW) + 2 * OC * (IC * K * K + 1)));
+    return conv.gx;
+  }
+};
@@ -0,0 +1,553 @@
+/**
+   @file gemm.h
+   @brief cache-tiled, register-blocked matrix multiply (C = A B)
+   used by the GEMM-lowered layers (e.g., im2col convolution)
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "mnist_util.h"
+#include "intrin.h"
+
+/**
+   @brief rows of C computed by a single micro-kernel invocation
+   @details MR x NR accumulators are kept in registers; 6 x 16 floats
+   are 12 256-bit registers (AVX2) or 6 512-bit registers (AVX-512)
+ */
+#ifndef GEMM_MR
+#define GEMM_MR 6
+#endif
+/**
+   @brief columns of C computed by a single micro-kernel invocation
+ */
+#ifndef GEMM_NR
+#define GEMM_NR 16
+#endif
+/**
+   @brief rows of A processed per cache tile (A block of MC x KC stays in L2)
+ */
+#ifndef GEMM_MC
+#define GEMM_MC 96
+#endif
+/**
+   @brief inner dimension processed per cache tile (B panel of KC x NR stays in L1)
+ */
+#ifndef GEMM_KC
+#define GEMM_KC 256
+#endif
+/**
+   @brief columns of B processed per cache tile
+ */
+#ifndef GEMM_NC
+#define GEMM_NC 1024
+#endif
+
+/**
+   @brief the register-blocked micro-kernel: C[0:mr,0:nr] (+)= A[0:mr,0:kc] B[0:kc,0:nr]
+   @param (kc) the inner dimension
+   @param (mr) rows to compute (<= GEMM_MR)
+   @param (nr) columns to compute (<= GEMM_NR)
+   @param (A) the top-left element of A; A(i,p) = A[i*rsa + p*csa]
+   @param (rsa) row stride of A
+   @param (csa) column stride of A
+   @param (B) the top-left element of B; B(p,j) = B[p*ldb + j]
+   @param (ldb) row stride of B
+   @param (C) the top-left element of C; C(i,j) = C[i*ldc + j]
+   @param (ldc) row stride of C
+   @param (accumulate) 1 if the result is added to C, 0 if it overwrites C
+   @details the accumulators are a fixed-size MR x NR array so that the
+   compiler can keep them in registers when the tile is full (mr == MR
+   and nr == NR); partial tiles at the edges take the same code with
+   the unused lanes simply not stored
+ */
+static inline void gemm_micro_kernel(idx_t kc, idx_t mr, idx_t nr,
+                                     const real * A, idx_t rsa, idx_t csa,
+                                     const real * B, idx_t ldb,
+                                     real * C, idx_t ldc, int accumulate) {
+  real c[GEMM_MR][GEMM_NR];
+  for (idx_t i = 0; i < GEMM_MR; i++) {
+#pragma omp simd
+    for (idx_t j = 0; j < GEMM_NR; j++) {
+      c[i][j] = 0.0;
+    }
+  }
+  if (mr == GEMM_MR && nr == GEMM_NR) {
+    /* full tile; trip counts are compile-time constants */
+    for (idx_t p = 0; p < kc; p++) {
+      const real * b = B + p * ldb;
+      for (idx_t i = 0; i < GEMM_MR; i++) {
+        const real a = A[i * rsa + p * csa];
+#pragma omp simd
+        for (idx_t j = 0; j < GEMM_NR; j++) {
+          c[i][j] += a * b[j];
+        }
+      }
+    }
+  } else {
+    /* edge tile */
+    for (idx_t p = 0; p < kc; p++) {
+      const real * b = B + p * ldb;
+      for (idx_t i = 0; i < mr; i++) {
+        const real a = A[i * rsa + p * csa];
+#pragma omp simd
+        for (idx_t j = 0; j < nr; j++) {
+          c[i][j] += a * b[j];
+        }
+      }
+    }
+  }
+  if (accumulate) {
+    for (idx_t i = 0; i < mr; i++) {
+#pragma omp simd
+      for (idx_t j = 0; j < nr; j++) {
+        C[i * ldc + j] += c[i][j];
+      }
+    }
+  } else {
+    for (idx_t i = 0; i < mr; i++) {
+#pragma omp simd
+      for (idx_t j = 0; j < nr; j++) {
+        C[i * ldc + j] = c[i][j];
+      }
+    }
+  }
+}
+
+/**
+   @brief C (+)= A B, where A is M x K, B is K x N and C is M x N
+   @param (M) rows of A and C
+   @param (N) columns of B and C
+   @param (K) columns of A and rows of B
+   @param (A) matrix A; A(i,p) = A[i*rsa + p*csa]
+   @param (rsa) row stride of A
+   @param (csa) column stride of A (give rsa = 1, csa = lda
+   to multiply by the transpose of a row-major matrix)
+   @param (B) matrix B (row-major); B(p,j) = B[p*ldb + j]
+   @param (ldb) row stride of B
+   @param (C) matrix C (row-major); C(i,j) = C[i*ldc + j]
+   @param (ldc) row stride of C
+   @param (accumulate) 1 if C += A B, 0 if C = A B
+   @details the loop structure follows the well-known
+   GotoBLAS/BLIS scheme; the outer three loops walk NC x KC x MC
+   blocks so that a KC x NR panel of B stays in L1 and an MC x KC block
+   of A in L2 while the micro-kernel sweeps across them
+ */
+__attribute__((unused))
+static void gemm_blocked(idx_t M, idx_t N, idx_t K,
+                         const real * A, idx_t rsa, idx_t csa,
+                         const real * B, idx_t ldb,
+                         real * C, idx_t ldc, int accumulate) {
+  if (K == 0) {
+    if (!accumulate) {
+      for (idx_t i = 0; i < M; i++) {
+        for (idx_t j = 0; j < N; j++) {
+          C[i * ldc + j] = 0.0;
+        }
+      }
+    }
+    return;
+  }
+  for (idx_t jc = 0; jc < N; jc += GEMM_NC) {
+    const idx_t nc = min_i(GEMM_NC, N - jc);
+    for (idx_t pc = 0; pc < K; pc += GEMM_KC) {
+      const idx_t kc = min_i(GEMM_KC, K - pc);
+      /* only the first KC block may overwrite C */
+      const int acc = (accumulate || pc > 0);
+      for (idx_t ic = 0; ic < M; ic += GEMM_MC) {
+        const idx_t mc = min_i(GEMM_MC, M - ic);
+        for (idx_t jr = 0; jr < nc; jr += GEMM_NR) {
+          const idx_t nr = min_i(GEMM_NR, nc - jr);
+          for (idx_t ir = 0; ir < mc; ir += GEMM_MR) {
+            const idx_t mr = min_i(GEMM_MR, mc - ir);
+            const idx_t i = ic + ir;
+            const idx_t j = jc + jr;
+            gemm_micro_kernel(kc, mr, nr,
+                              A + i * rsa + pc * csa, rsa, csa,
+                              B + pc * ldb + j, ldb,
+                              C + i * ldc + j, ldc, acc);
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+   @brief round x up to a multiple of a
+ */
+static constexpr idx_t gemm_round_up(idx_t x, idx_t a) {
+  return (x + a - 1) / a * a;
+}
+
+/**
+   @brief pack an mc x kc block of A into ceil(mc/MR) row panels
+   @param (mc) rows of the block
+   @param (kc) columns of the block
+   @param (A) the top-left element of the block; A(i,p) = A[i*rsa + p*csa]
+   @param (rsa) row stride of A
+   @param (csa) column stride of A
+   @param (Ap) the packed buffer; panel q holds rows q*MR..q*MR+MR-1
+   column by column (Ap[q*kc*MR + p*MR + i]), rows beyond mc are zero
+ */
+static inline void gemm_pack_a(idx_t mc, idx_t kc,
+                               const real * A, idx_t rsa, idx_t csa,
+                               real * Ap) {
+  for (idx_t ir = 0; ir < mc; ir += GEMM_MR) {
+    const idx_t mr = min_i(GEMM_MR, mc - ir);
+    real * a = Ap + ir * kc;
+    for (idx_t p = 0; p < kc; p++) {
+      for (idx_t i = 0; i < mr; i++) {
+        a[p * GEMM_MR + i] = A[(ir + i) * rsa + p * csa];
+      }
+      for (idx_t i = mr; i < GEMM_MR; i++) {
+        a[p * GEMM_MR + i] = 0.0;
+      }
+    }
+  }
+}
+
+/**
+   @brief pack a kc x nr block of B into a panel of NR columns
+   @param (kc) rows of the block
+   @param (nr) columns of the block (<= GEMM_NR)
+   @param (B) the top-left element of the block; B(p,j) = B[p*rsb + j*csb]
+   @param (rsb) row stride of B
+   @param (csb) column stride of B
+   @param (Bp) the packed panel, row by row (Bp[p*NR + j]);
+   columns beyond nr are zero
+ */
+static inline void gemm_pack_b_panel(idx_t kc, idx_t nr,
+                                     const real * B, idx_t rsb, idx_t csb,
+                                     real * Bp) {
+  if (csb == 1) {
+    for (idx_t p = 0; p < kc; p++) {
+#pragma omp simd
+      for (idx_t j = 0; j < nr; j++) {
+        Bp[p * GEMM_NR + j] = B[p * rsb + j];
+      }
+      for (idx_t j = nr; j < GEMM_NR; j++) {
+        Bp[p * GEMM_NR + j] = 0.0;
+      }
+    }
+  } else {
+    for (idx_t p = 0; p < kc; p++) {
+      for (idx_t j = 0; j < nr; j++) {
+        Bp[p * GEMM_NR + j] = B[p * rsb + j * csb];
+      }
+      for (idx_t j = nr; j < GEMM_NR; j++) {
+        Bp[p * GEMM_NR + j] = 0.0;
+      }
+    }
+  }
+}
+
+/**
+   @brief the micro-kernel on packed panels: C[0:mr,0:nr] (+)= Ap Bp
+   @param (kc) the inner dimension
+   @param (Ap) an MR-row panel packed by gemm_pack_a
+   @param (Bp) an NR-column panel packed by gemm_pack_b_panel
+   @param (mr) rows of C to store (<= GEMM_MR)
+   @param (nr) columns of C to store (<= GEMM_NR)
+   @param (C) the top-left element of C; C(i,j) = C[i*ldc + j]
+   @param (ldc) row stride of C
+   @param (accumulate) 1 if the result is added to C, 0 if it overwrites C
+   @details the panels are zero-padded, so the inner loop always runs
+   on a full MR x NR tile with unit-stride loads
+ */
+static inline void gemm_packed_micro_kernel(idx_t kc,
+                                            const real * __restrict__ Ap,
+                                            const real * __restrict__ Bp,
+                                            idx_t mr, idx_t nr,
+                                            real * C, idx_t ldc, int accumulate) {
+  real c[GEMM_MR][GEMM_NR];
+  for (idx_t i = 0; i < GEMM_MR; i++) {
+#pragma omp simd
+    for (idx_t j = 0; j < GEMM_NR; j++) {
+      c[i][j] = 0.0;
+    }
+  }
+  for (idx_t p = 0; p < kc; p++) {
+    const real * a = Ap + p * GEMM_MR;
+    const real * b = Bp + p * GEMM_NR;
+    for (idx_t i = 0; i < GEMM_MR; i++) {
+#pragma omp simd
+      for (idx_t j = 0; j < GEMM_NR; j++) {
+        c[i][j] += a[i] * b[j];
+      }
+    }
+  }
+  if (accumulate) {
+    for (idx_t i = 0; i < mr; i++) {
+#pragma omp simd
+      for (idx_t j = 0; j < nr; j++) {
+        C[i * ldc + j] += c[i][j];
+      }
+    }
+  } else {
+    for (idx_t i = 0; i < mr; i++) {
+#pragma omp simd
+      for (idx_t j = 0; j < nr; j++) {
+        C[i * ldc + j] = c[i][j];
+      }
+    }
+  }
+}
+
+/**
+   @brief a micro-kernel on packed panels (gemm_packed_micro_kernel
+   or an intrinsic one of intrin.h)
+ */
+typedef void (*gemm_kernel_t)(idx_t kc, const real * Ap, const real * Bp,
+                              idx_t mr, idx_t nr, real * C, idx_t ldc, int accumulate);
+
+/**
+   @brief the micro-kernel gemm should use for an algorithm
+   @details the intrinsic kernel of the flavor --isa selects for
+   cpu_intrin and cpu_int8 (whose layers in real are those of the
+   inference-only network), if there is one and the tile is the one
+   it computes, gemm_packed_micro_kernel otherwise
+ */
+static gemm_kernel_t gemm_kernel_for(cmdline_opt opt) {
+  gemm_kernel_t k = 0;
+  if ((opt.algo == algo_cpu_intrin || opt.algo == algo_cpu_int8)
+      && GEMM_MR == intrin_gemm_mr && GEMM_NR == intrin_gemm_nr) {
+    k = intrin_select(opt).gemm;
+  }
+  return (k ? k : gemm_packed_micro_kernel);
+}
+
+/**
+   @brief a packing buffer of gemm kept across calls
+   @details it grows to the largest size asked so far (rounded up
+   to 64 bytes, as aligned_alloc requires) and is never shrunk,
+   so the convolutions calling gemm every batch allocate nothing
+   after the first one
+ */
+struct gemm_pack_buf {
+  real * p;                     /**< the buffer (64-byte aligned) */
+  size_t bytes;                 /**< its size */
+  /**
+     @brief the buffer, made at least n elements
+  */
+  real * get(size_t n) {
+    size_t sz = (sizeof(real) * n + 63) / 64 * 64;
+    if (sz > bytes) {
+      free(p);
+      p = (real *)aligned_alloc(64, sz);
+      if (!p) {
+        perror("aligned_alloc"); bail();
+      }
+      bytes = sz;
+    }
+    return p;
+  }
+  ~gemm_pack_buf() {
+    free(p);
+  }
+};
+
+/**
+   @brief the packing buffer of the calling thread
+   @param (which) 0 : the panel of B, 1 : the block of A
+   @details one per thread, as gemm may be called from within a
+   parallel region (each thread then packs both into its own) and
+   packs A on every thread of its own parallel region otherwise
+ */
+__attribute__((unused))
+static real * gemm_pack_buf_of(int which, size_t n) {
+  static thread_local gemm_pack_buf b[2];
+  return b[which].get(n);
+}
+
+/**
+   @brief C (+)= A B with packed panels, cache tiling and OpenMP
+   @param (M) the maximum number of rows of A and C
+   @param (N) the maximum number of columns of B and C
+   @param (K) the maximum number of columns of A and rows of B
+   @param (m) the actual number of rows of A and C (<= M)
+   @param (n) the actual number of columns of B and C (<= N)
+   @param (k) the actual number of columns of A and rows of B (<= K)
+   @param (A) matrix A; A(i,p) = A[i*rsa + p*csa]
+   @param (rsa) row stride of A
+   @param (csa) column stride of A
+   @param (B) matrix B; B(p,j) = B[p*rsb + j*csb]
+   @param (rsb) row stride of B
+   @param (csb) column stride of B
+   @param (C) matrix C (row-major); C(i,j) = C[i*ldc + j]
+   @param (ldc) row stride of C
+   @param (accumulate) 1 if C += A B, 0 if C = A B
+   @param (kernel) the micro-kernel (gemm_kernel_for)
+
+   @details the compile-time shape bounds the packing buffers (a KC x
+   NC panel of B shared by all threads and an MC x KC block of A per
+   thread, kept across calls by gemm_pack_buf_of). for each KC x NC
+   panel of B, the threads first pack it together, then split the rows of C among themselves; each thread
+   packs its own block of A and sweeps the micro-kernel across the
+   panel. arbitrary strides of A and B are absorbed by packing, so
+   transposed operands need no copy. when called from within a
+   parallel region it runs on the calling thread only.
+ */
+template<idx_t M,idx_t N,idx_t K>
+static void gemm(idx_t m, idx_t n, idx_t k,
+                 const real * A, idx_t rsa, idx_t csa,
+                 const real * B, idx_t rsb, idx_t csb,
+                 real * C, idx_t ldc, int accumulate,
+                 gemm_kernel_t kernel = gemm_packed_micro_kernel) {
+  constexpr idx_t MC = gemm_round_up(M < GEMM_MC ? M : GEMM_MC, GEMM_MR);
+  constexpr idx_t NC = gemm_round_up(N < GEMM_NC ? N : GEMM_NC, GEMM_NR);
+  constexpr idx_t KC = (K < GEMM_KC ? K : GEMM_KC);
+  assert(m <= M);
+  assert(n <= N);
+  assert(k <= K);
+  if (m == 0 || n == 0) return;
+  if (k == 0) {
+    if (!accumulate) {
+      for (idx_t i = 0; i < m; i++) {
+        for (idx_t j = 0; j < n; j++) {
+          C[i * ldc + j] = 0.0;
+        }
+      }
+    }
+    return;
+  }
+  real * Bp = gemm_pack_buf_of(0, KC * NC);
+#pragma omp parallel
+  {
+    real * Ap = gemm_pack_buf_of(1, MC * KC);
+#ifdef _OPENMP
+    const idx_t nth = omp_get_num_threads();
+#else
+    const idx_t nth = 1;
+#endif
+    /* shrink the row block so that every thread gets some */
+    const idx_t mc = min_i(MC, gemm_round_up((m + nth - 1) / nth, GEMM_MR));
+    for (idx_t jc = 0; jc < n; jc += NC) {
+      const idx_t nc = min_i(NC, n - jc);
+      for (idx_t pc = 0; pc < k; pc += KC) {
+        const idx_t kc = min_i(KC, k - pc);
+        /* only the first KC block may overwrite C */
+        const int acc = (accumulate || pc > 0);
+#pragma omp for schedule(static)
+        for (idx_t jr = 0; jr < nc; jr += GEMM_NR) {
+          gemm_pack_b_panel(kc, min_i(GEMM_NR, nc - jr),
+                            B + pc * rsb + (jc + jr) * csb, rsb, csb,
+                            Bp + jr * kc);
+        }
+#pragma omp for schedule(dynamic)
+        for (idx_t ic = 0; ic < m; ic += mc) {
+          const idx_t mc_ = min_i(mc, m - ic);
+          gemm_pack_a(mc_, kc, A + ic * rsa + pc * csa, rsa, csa, Ap);
+          for (idx_t jr = 0; jr < nc; jr += GEMM_NR) {
+            const idx_t nr = min_i(GEMM_NR, nc - jr);
+            for (idx_t ir = 0; ir < mc_; ir += GEMM_MR) {
+              const idx_t mr = min_i(GEMM_MR, mc_ - ir);
+              kernel(kc, Ap + ir * kc, Bp + jr * kc, mr, nr,
+                     C + (ic + ir) * ldc + jc + jr, ldc, acc);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+   @brief the reference (naive) C = A B, used for checking gemm
+ */
+__attribute__((unused))
+static void gemm_ref(idx_t m, idx_t n, idx_t k,
+                     const real * A, idx_t rsa, idx_t csa,
+                     const real * B, idx_t rsb, idx_t csb,
+                     real * C, idx_t ldc) {
+  for (idx_t i = 0; i < m; i++) {
+    for (idx_t j = 0; j < n; j++) {
+      double v = 0.0;
+      for (idx_t p = 0; p < k; p++) {
+        v += A[i * rsa + p * csa] * B[p * rsb + j * csb];
+      }
+      C[i * ldc + j] = v;
+    }
+  }
+}
+
+/**
+   @brief check gemm against gemm_ref and measure its speed
+   for one shape, transposing A and/or B as given
+   @param (M) rows of C
+   @param (N) columns of C
+   @param (K) inner dimension
+   @param (name) the name shown in the report
+   @param (ta) 1 if A is stored transposed (K x M row-major)
+   @param (tb) 1 if B is stored transposed (N x K row-major)
+   @param (reps) the number of timed repetitions
+   @param (rg) random number generator
+   @param (kernel) the micro-kernel gemm uses
+   @returns the relative error |C - R| / |R| (Frobenius norm)
+ */
+template<idx_t M,idx_t N,idx_t K>
+static double gemm_check(const char * name, int ta, int tb,
+                         int reps, rnd_gen_t& rg, gemm_kernel_t kernel) {
+  real * A = (real *)malloc(sizeof(real) * M * K);
+  real * B = (real *)malloc(sizeof(real) * K * N);
+  real * C = (real *)malloc(sizeof(real) * M * N);
+  real * R = (real *)malloc(sizeof(real) * M * N);
+  for (idx_t i = 0; i < M * K; i++) A[i] = rg.rand(-1.0, 1.0);
+  for (idx_t i = 0; i < K * N; i++) B[i] = rg.rand(-1.0, 1.0);
+  const idx_t rsa = (ta ? 1 : K), csa = (ta ? M : 1);
+  const idx_t rsb = (tb ? 1 : N), csb = (tb ? K : 1);
+  gemm_ref(M, N, K, A, rsa, csa, B, rsb, csb, R, N);
+  gemm<M,N,K>(M, N, K, A, rsa, csa, B, rsb, csb, C, N, 0, kernel);
+  double d2 = 0.0, r2 = 0.0;
+  for (idx_t i = 0; i < M * N; i++) {
+    d2 += (C[i] - R[i]) * (C[i] - R[i]);
+    r2 += R[i] * R[i];
+  }
+  double e = sqrt(d2 / r2);
+  tsc_t t0 = get_tsc();
+  for (int r = 0; r < reps; r++) {
+    gemm<M,N,K>(M, N, K, A, rsa, csa, B, rsb, csb, C, N, 0, kernel);
+  }
+  tsc_t t1 = get_tsc();
+  double flops = 2.0 * M * N * K * reps;
+  printf("%s %d x %d x %d (A%s B%s): %.3f GFLOP/s, relative error = %.9f\n",
+         name, M, N, K, (ta ? "^T" : ""), (tb ? "^T" : ""),
+         flops / (t1.ns - t0.ns), e);
+  free(A); free(B); free(C); free(R);
+  return e;
+}
+
+/**
+   @brief entry point of this header file
+   @param (argc) the number of command line args
+   @param (argv) command line args
+   @details if this header file is included from
+   a main C++ file and define gemm_main to be main
+   (e.g., with -Dgemm_main=main), then this
+   function becomes th main function of the executable.
+   it checks gemm on the shapes of the three products of
+   fc1 (y = x w, gw = x^T gy, gx = gy w^T) and conv2, and
+   reports the GFLOP/s of each (-m gives the number of repetitions;
+   -a cpu_intrin checks the intrinsic micro-kernel of --isa)
+*/
+int gemm_main(int argc, char ** argv) {
+  cmdline_opt opt = parse_args(argc, argv);
+  if (opt.error || opt.help) usage(argv[0]);
+  const idx_t B = MAX_BATCH_SIZE;
+  const int reps = opt.epochs;
+  rnd_gen_t rg;
+  rg.seed(opt.weight_seed);
+  const gemm_kernel_t k = gemm_kernel_for(opt);
+  double max_e = 0.0;
+  max_e = max_r(max_e, gemm_check<B,128,9216>("fc1 y=x w", 0, 0, reps, rg, k));
+  max_e = max_r(max_e, gemm_check<9216,128,B>("fc1 gw=x^T gy", 1, 0, reps, rg, k));
+  max_e = max_r(max_e, gemm_check<B,9216,128>("fc1 gx=gy w^T", 0, 1, reps, rg, k));
+  max_e = max_r(max_e, gemm_check<64,576,288>("conv2 y=w col", 0, 0, reps, rg, k));
+  max_e = max_r(max_e, gemm_check<64,288,576>("conv2 gw=gy col^T", 0, 1, reps, rg, k));
+  max_e = max_r(max_e, gemm_check<288,576,64>("conv2 gcol=w^T gy", 1, 0, reps, rg, k));
+  printf("max relative error = %.9f\n", max_e);
+  return 0;
+}
@@ -0,0 +1,183 @@
+/**
+   @file grad_accum.h
+   @brief gradient accumulation: several micro batches per update
+   (--accum-steps)
+ */
+#pragma once
+
+#include "mnist_util.h"
+
+#if __CUDACC__
+/**
+   @brief dst = src (copy = 1) or dst += src (copy = 0) on the device
+ */
+__global__ void grad_accum_global(real * dst, const real * src, long n, int copy) {
+  const long nt = (long)gridDim.x * blockDim.x;
+  for (long k = (long)blockIdx.x * blockDim.x + threadIdx.x; k < n; k += nt) {
+    dst[k] = (copy ? src[k] : dst[k] + src[k]);
+  }
+}
+#endif
+
+/**
+   @brief gradients of a network accumulated over several micro
+   batches before a single update
+   @details the batch size is capped by MAX_BATCH_SIZE (the size of
+   every activation tensor), so a larger (virtual) batch of
+   steps x B samples is trained as steps micro batches of B.
+   layers' backward overwrites their gradients (gw), so the sum of
+   earlier micro batches is kept in a buffer of its own: after a
+   stage of backward finishes a tensor, ready saves (first micro
+   batch) or adds (the others) it to the buffer, except for the last
+   micro batch, whose gradients get the buffer added instead and go
+   on to the all-reduce (if any) and the update.  gradients are sums
+   over samples, so an update sees exactly the gradient of a batch of
+   steps x B (up to rounding).
+   tensors are added with the stages backward finishes them in, as
+   in grad_sync.
+   @sa grad_sync
+ */
+struct grad_accum {
+  static const int max_tensors = 16; /**< the maximum number of tensors */
+  /**
+     @brief a gradient tensor
+  */
+  struct tensor_t {
+    real * g;                   /**< the address (device address if cuda) */
+    real * acc;                 /**< the sum of earlier micro batches (same place as g) */
+    long n;                     /**< the number of elements */
+    int stage;                  /**< final after this stage of backward */
+  };
+  logger * lgr;                 /**< logger */
+  int cuda;                     /**< 1 if gradients are on the device */
+  int steps;                    /**< micro batches per update */
+  int step;                     /**< the micro batch in progress (0 .. steps-1) */
+  tensor_t tensors[max_tensors]; /**< tensors */
+  int n_tensors;                 /**< the number of tensors */
+  /**
+     @brief make an empty set of gradients
+     @param (lgr) logger
+     @param (cuda) 1 if gradients are on the device
+     @param (steps) micro batches per update (--accum-steps)
+  */
+  void init(logger * lgr, int cuda, int steps) {
+    this->lgr = lgr;
+    this->cuda = cuda;
+    this->steps = steps;
+    step = 0;
+    n_tensors = 0;
+  }
+  /**
+     @brief add a gradient
+     @param (g) the address (device address if cuda)
+     @param (n) the number of elements
+     @param (stage) backward finishes it at this stage
+  */
+  void add(real * g, long n, int stage) {
+    assert(n_tensors < max_tensors);
+    tensors[n_tensors++] = { g, 0, n, stage };
+  }
+  /**
+     @brief allocate accumulation buffers
+  */
+  void plan() {
+    long sz = 0;
+    for (int i = 0; i < n_tensors; i++) {
+      tensor_t& t = tensors[i];
+      const size_t b = (sizeof(real) * t.n + 63) / 64 * 64;
+#if __CUDACC__
+      if (cuda) {
+        t.acc = (real *)dev_malloc(b);
+      } else
+#endif
+      {
+        t.acc = (real *)aligned_alloc(64, b);
+        if (!t.acc) err(1, "aligned_alloc");
+      }
+      sz += b;
+    }
+    lgr->log(1, "gradient accumulation: %d micro batches per update, %d tensors, %ld bytes",
+             steps, n_tensors, sz);
+  }
+  /**
+     @brief free accumulation buffers
+  */
+  void fini() {
+    for (int i = 0; i < n_tensors; i++) {
+#if __CUDACC__
+      if (cuda) {
+        dev_free(tensors[i].acc);
+        continue;
+      }
+#endif
+      free(tensors[i].acc);
+    }
+    n_tensors = 0;
+  }
+  /**
+     @brief 1 if the micro batch in progress is the last one before an update
+  */
+  int last() {
+    return step == steps - 1;
+  }
+  /**
+     @brief dst = src (copy = 1) or dst += src (copy = 0)
+  */
+  void add_to(real * dst, const real * src, long n, int copy) {
+    if (!cuda) {
+#pragma omp parallel for simd
+      for (long k = 0; k < n; k++) {
+        dst[k] = (copy ? src[k] : dst[k] + src[k]);
+      }
+      return;
+    }
+#if __CUDACC__
+    const int n_threads = 256;
+    const long n_blocks = (n + n_threads - 1) / n_threads;
+    launch_and_sync((grad_accum_global<<<(n_blocks < 1024 ? n_blocks : 1024),n_threads>>>(dst, src, n, copy)));
+#else
+    err_cuda_code_non_cuda_compiler("grad_accum");
+#endif
+  }
+  /**
+     @brief backward has finished stage of the micro batch in progress
+     @details save or add gradients of the stage to the buffer, or
+     (the last micro batch) add the buffer to them
+  */
+  void ready(int stage) {
+    if (steps == 1) return;
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    for (int i = 0; i < n_tensors; i++) {
+      tensor_t& t = tensors[i];
+      if (t.stage != stage) continue;
+      if (last()) {
+        add_to(t.g, t.acc, t.n, 0);
+      } else {
+        add_to(t.acc, t.g, t.n, step == 0);
+      }
+    }
+    tsc_t t1 = get_tsc();
+    log_end_fun(lgr, t0, t1);
+  }
+  /**
+     @brief move on to the next micro batch (after the one in progress is done)
+  */
+  void next() {
+    step = (last() ? 0 : step + 1);
+  }
+  /**
+     @brief put the sum of the micro batches done so far in the
+     gradients of all stages (to update with fewer than steps
+     micro batches)
+     @returns 0 if no micro batch has been accumulated (nothing to update)
+  */
+  int flush() {
+    if (step == 0) return 0;
+    for (int i = 0; i < n_tensors; i++) {
+      add_to(tensors[i].g, tensors[i].acc, tensors[i].n, 1);
+    }
+    step = 0;
+    return 1;
+  }
+};
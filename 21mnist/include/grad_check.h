@@ -27,6 +27,37 @@
    the diff of the output.
 */
 
+/**
+   @brief the size of perturbations (dx and dw) given to layers in grad_check
+   @param (opt) command line option
+   @details 1.0e-3 unless the algorithm is of reduced precision
+   (algo_is_reduced_precision), whose operands are rounded to
+   FP16/BF16.  a perturbation of 1.0e-3 would be lost in the
+   rounding, so they get larger ones; even so, rounding makes
+   their relative errors much larger than those of real, which is
+   what --grad-tol is for
+   @sa grad_check_verdict
+*/
+static real grad_check_eps(cmdline_opt opt) {
+  return (algo_is_reduced_precision(opt.algo) ? 3.0e-2 : 1.0e-3);
+}
+
+/**
+   @brief compare the max relative error of gradient checks with --grad-tol
+   @param (opt) command line option
+   @param (max_e) the max relative error of the checks
+   @returns 0 if max_e is within the tolerance or no tolerance is
+   given (--grad-tol 0), 1 otherwise; *_main functions return it, so
+   a check can fail a script (e.g., --grad-tol 5e-2 -a cuda_tc)
+*/
+static int grad_check_verdict(cmdline_opt opt, double max_e) {
+  if (opt.grad_tol <= 0.0) return 0;
+  int ok = (max_e <= opt.grad_tol);
+  printf("%s: max relative error %.9f %s tolerance %.9f\n",
+         (ok ? "OK" : "NG"), max_e, (ok ? "<=" : ">"), opt.grad_tol);
+  return !ok;
+}
+
 template<typename T, typename I, typename O, typename C>
 static double grad_check(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, C cfg, idx_t B) {
   /* make weight (layer struct or entire mnist) */
@@ -40,7 +71,7 @@ static double grad_check(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, C cfg, id
   O * alpha = new O();
   alpha->init_uniform(B, rg, -1.0, 1.0);
   
-  real e = 1.0e-3;
+  real e = grad_check_eps(opt);
 
   /* make x - dx/2 and x + dx/2 */
   /* dx = random vector */
@@ -123,7 +154,7 @@ static double grad_check_loss(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, C cf
   O * alpha = new O();
   alpha->init_uniform(B, rg, -1.0, 1.0);
   
-  real e = 1.0e-3;
+  real e = grad_check_eps(opt);
   /* make x - dx/2 and x + dx/2 */
   /* dx = random vector */
   I0 * dx = new I0();
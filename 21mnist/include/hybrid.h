@@ -0,0 +1,265 @@
+/**
+   @file hybrid.h
+   @brief hybrid execution: the layers of a network split between
+   the GPU and the CPU (--hybrid)
+ */
+#pragma once
+
+#include "mnist_util.h"
+#include "tensor.h"
+
+/**
+   @brief the names of the two stages of --hybrid
+ */
+__attribute__((unused))
+static const char * hybrid_stage_names[2] = { "conv1..dropout1", "fc1..nll_softmax" };
+
+/**
+   @brief 1 if --hybrid puts stage (0 : conv1 .. dropout1, 1 : fc1
+   .. nll_softmax) on the CPU
+ */
+__attribute__((unused))
+static int hybrid_on_cpu(int hybrid, int stage) {
+  return (hybrid == 1 && stage == 1) || (hybrid == 2 && stage == 0);
+}
+
+/**
+   @brief the options of a layer of stage under --hybrid
+   @param (o) the options the layer would get (e.g., from the autotuner)
+   @param (stage) 0 : conv1 .. dropout1, 1 : fc1 .. nll_softmax
+   @details the layers of the stage on the CPU run --hybrid-algo;
+   the others keep o
+ */
+__attribute__((unused))
+static cmdline_opt hybrid_place(cmdline_opt o, int stage) {
+  if (hybrid_on_cpu(o.hybrid, stage)) {
+    o.algo = o.hybrid_algo;
+    o.algo_s = o.hybrid_algo_s;
+    o.cuda_algo = 0;
+  }
+  return o;
+}
+
+/**
+   @brief the time each stage of --hybrid computes
+   @details a step of a stage is a segment (e.g., forward of
+   stage 0): begin/end around the calls of the segment.  segments
+   on the CPU are timed on the host; those on the GPU by a pair of
+   events around their kernels on the (per-thread) default stream,
+   read when the same segment comes again (by then the stream has
+   passed them, so it does not wait) or when the times are logged.
+   the occupancy of a stage is its busy time over the wall time of
+   the steps (add_wall); the stage with the lower one has room
+   for more layers
+ */
+struct hybrid_meter {
+  static const int max_segs = 8; /**< the maximum number of segments */
+  logger * lgr;                 /**< logger */
+  int hybrid;                   /**< --hybrid (0 : everything is a no-op) */
+  long busy_ns[2];              /**< the time each stage computed since the last log */
+  long wall_ns;                 /**< the wall time of steps since the last log */
+  long n_steps;                 /**< the number of steps since the last log */
+  tsc_t t0;                     /**< the start of the CPU segment in progress */
+#if __CUDACC__
+  cudaEvent_t ev0[max_segs];    /**< the starts of segments on the GPU */
+  cudaEvent_t ev1[max_segs];    /**< the ends of segments on the GPU */
+  int pending[max_segs];        /**< 1 + the stage of a segment whose events have not been read (0 : none) */
+#endif
+  /**
+     @brief initialize
+     @param (lgr) logger
+     @param (hybrid) --hybrid
+  */
+  void init(logger * lgr, int hybrid) {
+    this->lgr = lgr;
+    this->hybrid = hybrid;
+    busy_ns[0] = busy_ns[1] = 0;
+    wall_ns = 0;
+    n_steps = 0;
+#if __CUDACC__
+    for (int i = 0; i < max_segs; i++) {
+      pending[i] = 0;
+      if (hybrid) {
+        check_api_error(cudaEventCreate(&ev0[i]));
+        check_api_error(cudaEventCreate(&ev1[i]));
+      }
+    }
+#endif
+  }
+  /**
+     @brief release events
+  */
+  void fini() {
+#if __CUDACC__
+    if (hybrid) {
+      for (int i = 0; i < max_segs; i++) {
+        check_api_error(cudaEventDestroy(ev0[i]));
+        check_api_error(cudaEventDestroy(ev1[i]));
+      }
+    }
+#endif
+    hybrid = 0;
+  }
+  /**
+     @brief add the time of GPU segment seg, if it has not been added
+  */
+  void collect(int seg) {
+#if __CUDACC__
+    if (pending[seg]) {
+      float ms = 0.0f;
+      check_api_error(cudaEventSynchronize(ev1[seg]));
+      check_api_error(cudaEventElapsedTime(&ms, ev0[seg], ev1[seg]));
+      busy_ns[pending[seg] - 1] += (long)(ms * 1.0e6);
+      pending[seg] = 0;
+    }
+#else
+    (void)seg;
+#endif
+  }
+  /**
+     @brief segment seg of stage starts
+  */
+  void begin(int seg, int stage) {
+    if (!hybrid) return;
+    assert(seg < max_segs);
+    if (hybrid_on_cpu(hybrid, stage)) {
+      t0 = get_tsc();
+      return;
+    }
+#if __CUDACC__
+    collect(seg);
+    check_api_error(cudaEventRecord(ev0[seg], cudaStreamPerThread));
+#endif
+  }
+  /**
+     @brief segment seg of stage ends (its kernels have been queued, if on the GPU)
+  */
+  void end(int seg, int stage) {
+    if (!hybrid) return;
+    if (hybrid_on_cpu(hybrid, stage)) {
+      busy_ns[stage] += get_tsc().ns - t0.ns;
+      return;
+    }
+#if __CUDACC__
+    check_api_error(cudaEventRecord(ev1[seg], cudaStreamPerThread));
+    pending[seg] = 1 + stage;
+#else
+    (void)seg;
+#endif
+  }
+  /**
+     @brief a step (a batch) took from a to b
+  */
+  void add_wall(tsc_t a, tsc_t b) {
+    wall_ns += b.ns - a.ns;
+    n_steps++;
+  }
+  /**
+     @brief log the busy time and the occupancy of each stage since the last log
+     @param (phase) e.g., "Train Epoch"
+     @param (epoch) the epoch
+  */
+  void log(const char * phase, long epoch) {
+    if (!hybrid || !n_steps) return;
+    for (int i = 0; i < max_segs; i++) collect(i);
+    const double wall = (wall_ns > 0 ? wall_ns : 1);
+    lgr->log(1, "hybrid: %s %ld: %s stage %s busy %.3f ms (%.0f%%), %s stage %s busy %.3f ms (%.0f%%)"
+             " of %.3f ms in %ld batches",
+             phase, epoch,
+             (hybrid_on_cpu(hybrid, 0) ? "cpu" : "gpu"), hybrid_stage_names[0],
+             busy_ns[0] * 1.0e-6, 100.0 * busy_ns[0] / wall,
+             (hybrid_on_cpu(hybrid, 1) ? "cpu" : "gpu"), hybrid_stage_names[1],
+             busy_ns[1] * 1.0e-6, 100.0 * busy_ns[1] / wall,
+             wall_ns * 1.0e-6, n_steps);
+    busy_ns[0] = busy_ns[1] = 0;
+    wall_ns = 0;
+    n_steps = 0;
+  }
+};
+
+/**
+   @brief pinned buffers of micro batches streamed through the two
+   stages of --hybrid (MNIST::test_batch_hybrid)
+   @details two slots, so that a stage works on a micro batch while
+   the other works on the previous one: input images (xs), the
+   output of stage 0 (ms), labels (ts), and the scores and losses
+   of stage 1 (ys, ls) to bring them back from the GPU.  they are
+   in page-locked memory with device shadows, so copies between
+   them and the GPU are queued on the stream (async) and overlap
+   with the CPU.  done[k] is recorded after the last copy of slot k
+   @param (mid_t) the tensor passed from stage 0 to stage 1
+ */
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC,typename mid_t>
+struct hybrid_buffers {
+  tensor<real,maxB,C,H,W> * xs[2]; /**< input images of a micro batch */
+  mid_t * ms[2];                   /**< the output of stage 0 */
+  tensor<idx_t,maxB> * ts[2];      /**< true labels */
+  tensor<real,maxB,nC> * ys[2];    /**< log softmax (from the GPU) */
+  tensor<real,maxB> * ls[2];       /**< losses (from the GPU) */
+  idx_t off[2];                    /**< the first sample of the batch in the slot */
+#if __CUDACC__
+  cudaEvent_t done[2];             /**< the last copy of the slot */
+#endif
+  /**
+     @brief a tensor in page-locked memory with its device shadow
+  */
+  template<typename T>
+  static T * alloc_() {
+#if __CUDACC__
+    T * a = (T *)host_malloc(sizeof(T));
+    a->set_dev(0);
+    a->set_n0(0);
+    make_dev(a, 1);
+    return a;
+#else
+    err_cuda_code_non_cuda_compiler("hybrid_buffers");
+    return 0;
+#endif
+  }
+  /**
+     @brief release a tensor of alloc_
+  */
+  template<typename T>
+  static void free_(T * a) {
+#if __CUDACC__
+    del_dev(a, 1);
+    host_free(a);
+#else
+    (void)a;
+#endif
+  }
+  /**
+     @brief allocate buffers
+     @param (lgr) logger
+  */
+  void init(logger * lgr) {
+    for (int k = 0; k < 2; k++) {
+      xs[k] = alloc_<tensor<real,maxB,C,H,W>>();
+      ms[k] = alloc_<mid_t>();
+      ts[k] = alloc_<tensor<idx_t,maxB>>();
+      ys[k] = alloc_<tensor<real,maxB,nC>>();
+      ls[k] = alloc_<tensor<real,maxB>>();
+      off[k] = 0;
+#if __CUDACC__
+      check_api_error(cudaEventCreateWithFlags(&done[k], cudaEventDisableTiming));
+#endif
+    }
+    lgr->log(1, "hybrid: 2 slots of micro batches, %ld bytes of pinned memory",
+             (long)(2 * (sizeof(*xs[0]) + sizeof(*ms[0]) + sizeof(*ts[0]) + sizeof(*ys[0]) + sizeof(*ls[0]))));
+  }
+  /**
+     @brief release buffers
+  */
+  void fini() {
+    for (int k = 0; k < 2; k++) {
+      free_(xs[k]);
+      free_(ms[k]);
+      free_(ts[k]);
+      free_(ys[k]);
+      free_(ls[k]);
+#if __CUDACC__
+      check_api_error(cudaEventDestroy(done[k]));
+#endif
+    }
+  }
+};
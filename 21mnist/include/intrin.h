@@ -0,0 +1,493 @@
+/**
+   @file intrin.h
+   @brief hand-written intrinsic kernels of the hot loops (-a cpu_intrin)
+   in several instruction set flavors, one of which is chosen at startup
+ */
+#pragma once
+
+#include <string.h>
+#include <err.h>
+#include "mnist_util.h"
+
+/* x86 flavors are compiled with target attributes, so the rest of the
+   binary needs no -mavx2/-mavx512f and runs on any x86-64 */
+#if (defined(__x86_64__) || defined(__i386__)) && !__CUDACC__
+#define INTRIN_X86 1
+#include <immintrin.h>
+#else
+#define INTRIN_X86 0
+#endif
+#if defined(__aarch64__) && !__CUDACC__
+#define INTRIN_NEON 1
+#include <arm_neon.h>
+#else
+#define INTRIN_NEON 0
+#endif
+
+/**
+   @brief instruction set flavors of the kernels
+ */
+typedef enum {
+  isa_generic,                  /**< no intrinsics (the kernels of cpu_omp/cpu_blas_like) */
+  isa_avx2,                     /**< AVX2 + FMA (256 bit) */
+  isa_avx512,                   /**< AVX-512F (512 bit) */
+  isa_neon,                     /**< ARMv8 Advanced SIMD (128 bit) */
+  isa_invalid,
+} isa_t;
+
+/**
+   @brief names of isa_t (for --isa)
+ */
+static const char * const isa_names[isa_invalid] = {
+  "generic", "avx2", "avx512", "neon"
+};
+
+/**
+   @brief the flavor named s (isa_invalid if there is none)
+ */
+static isa_t parse_isa(const char * s) {
+  for (int i = 0; i < (int)isa_invalid; i++) {
+    if (strcmp(s, isa_names[i]) == 0) return (isa_t)i;
+  }
+  return isa_invalid;
+}
+
+/**
+   @brief 1 if this build has flavor isa and the processor (and OS) supports it
+ */
+static int isa_supported(isa_t isa) {
+  switch (isa) {
+  case isa_generic:
+    return 1;
+#if INTRIN_X86
+  case isa_avx2:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  case isa_avx512:
+    return __builtin_cpu_supports("avx512f");
+#endif
+#if INTRIN_NEON
+  case isa_neon:
+    return 1;                   // mandatory on aarch64
+#endif
+  default:
+    return 0;
+  }
+}
+
+/**
+   @brief the flavor to run
+   @param (s) --isa; "auto" for the widest the processor supports
+ */
+static isa_t isa_select(const char * s) {
+  if (strcmp(s, "auto") != 0) {
+    isa_t isa = parse_isa(s);
+    if (isa == isa_invalid) errx(1, "--isa: invalid flavor (%s)", s);
+    if (!isa_supported(isa)) errx(1, "--isa: %s is not supported on this processor or build", s);
+    return isa;
+  }
+  static const isa_t pref[] = { isa_avx512, isa_avx2, isa_neon };
+  for (isa_t isa : pref) {
+    if (isa_supported(isa)) return isa;
+  }
+  return isa_generic;
+}
+
+/**
+   @brief rows and columns of C the gemm kernels compute (GEMM_MR x GEMM_NR
+   must be these for them to be used)
+ */
+enum { intrin_gemm_mr = 6, intrin_gemm_nr = 16 };
+
+/**
+   @brief the kernels of a flavor
+   @details a null kernel means the flavor has none (the caller runs
+   its generic loop).  only float has intrinsic kernels; for other
+   reals all are null
+ */
+template<typename T>
+struct intrin_kernels {
+  /** @brief C[0:mr,0:nr] (+)= Ap Bp on packed panels (as gemm_packed_micro_kernel) */
+  void (*gemm)(idx_t kc, const T * Ap, const T * Bp, idx_t mr, idx_t nr,
+               T * C, idx_t ldc, int accumulate);
+  /** @brief y[0:n] = max(0, x[0:n]) (y may be x) */
+  void (*relu)(idx_t n, const T * x, T * y);
+  /** @brief gx[0:n] = (x >= 0 ? gy : 0) (gx may be gy) */
+  void (*relu_grad)(idx_t n, const T * x, const T * gy, T * gx);
+  /** @brief a row of 2x2 max pooling: y[j], ai[j], aj[j] for j < ow from
+      input rows r0 = 2i and r1 = 2i+1 (as MaxPooling2D::forward_cpu_omp) */
+  void (*pool2)(idx_t ow, const T * r0, const T * r1, idx_t i,
+                T * y, idx_t * ai, idx_t * aj);
+  /** @brief the kernels of flavor isa */
+  static intrin_kernels get(isa_t isa) {
+    (void)isa;
+    return { 0, 0, 0, 0 };
+  }
+};
+
+/**
+   @brief 2x2 max pooling of outputs j0 <= j < ow, one by one (the tail
+   of the vector kernels); ties keep the first in the order
+   (2i,2j), (2i,2j+1), (2i+1,2j), (2i+1,2j+1)
+ */
+static inline void intrin_pool2_tail(idx_t j0, idx_t ow, const float * r0, const float * r1,
+                                     idx_t i, float * y, idx_t * ai, idx_t * aj) {
+  for (idx_t j = j0; j < ow; j++) {
+    float v = r0[2 * j];
+    idx_t mi = 2 * i, mj = 2 * j;
+    if (v < r0[2 * j + 1]) { v = r0[2 * j + 1]; mj = 2 * j + 1; }
+    if (v < r1[2 * j])     { v = r1[2 * j];     mi = 2 * i + 1; mj = 2 * j; }
+    if (v < r1[2 * j + 1]) { v = r1[2 * j + 1]; mi = 2 * i + 1; mj = 2 * j + 1; }
+    y[j] = v;
+    ai[j] = mi;
+    aj[j] = mj;
+  }
+}
+
+/**
+   @brief store an MR x NR tile c (row-major) to C[0:mr,0:nr] (the edge
+   tiles of the vector gemm kernels)
+ */
+static inline void intrin_gemm_store_tile(const float * c, idx_t mr, idx_t nr,
+                                          float * C, idx_t ldc, int accumulate) {
+  for (idx_t i = 0; i < mr; i++) {
+    for (idx_t j = 0; j < nr; j++) {
+      if (accumulate) {
+        C[i * ldc + j] += c[i * intrin_gemm_nr + j];
+      } else {
+        C[i * ldc + j] = c[i * intrin_gemm_nr + j];
+      }
+    }
+  }
+}
+
+#if INTRIN_X86
+/**
+   @brief gemm kernel, AVX-512: a row of 16 in a zmm, 6 accumulators
+   @details edge tiles are stored with masks
+ */
+__attribute__((target("avx512f")))
+static void intrin_gemm_avx512(idx_t kc, const float * Ap, const float * Bp,
+                               idx_t mr, idx_t nr, float * C, idx_t ldc, int accumulate) {
+  __m512 c0 = _mm512_setzero_ps(), c1 = _mm512_setzero_ps(), c2 = _mm512_setzero_ps();
+  __m512 c3 = _mm512_setzero_ps(), c4 = _mm512_setzero_ps(), c5 = _mm512_setzero_ps();
+  for (idx_t p = 0; p < kc; p++) {
+    const __m512 b = _mm512_loadu_ps(Bp + p * 16);
+    const float * a = Ap + p * 6;
+    c0 = _mm512_fmadd_ps(_mm512_set1_ps(a[0]), b, c0);
+    c1 = _mm512_fmadd_ps(_mm512_set1_ps(a[1]), b, c1);
+    c2 = _mm512_fmadd_ps(_mm512_set1_ps(a[2]), b, c2);
+    c3 = _mm512_fmadd_ps(_mm512_set1_ps(a[3]), b, c3);
+    c4 = _mm512_fmadd_ps(_mm512_set1_ps(a[4]), b, c4);
+    c5 = _mm512_fmadd_ps(_mm512_set1_ps(a[5]), b, c5);
+  }
+  const __m512 c[6] = { c0, c1, c2, c3, c4, c5 };
+  const __mmask16 m = (__mmask16)((1u << nr) - 1);
+  for (idx_t i = 0; i < mr; i++) {
+    float * Ci = C + i * ldc;
+    __m512 v = c[i];
+    if (accumulate) v = _mm512_add_ps(v, _mm512_maskz_loadu_ps(m, Ci));
+    _mm512_mask_storeu_ps(Ci, m, v);
+  }
+}
+
+/**
+   @brief gemm kernel, AVX2: a row of 16 in two ymm, 12 accumulators
+ */
+__attribute__((target("avx2,fma")))
+static void intrin_gemm_avx2(idx_t kc, const float * Ap, const float * Bp,
+                             idx_t mr, idx_t nr, float * C, idx_t ldc, int accumulate) {
+  __m256 c[6][2];
+  for (int i = 0; i < 6; i++) {
+    c[i][0] = _mm256_setzero_ps();
+    c[i][1] = _mm256_setzero_ps();
+  }
+  for (idx_t p = 0; p < kc; p++) {
+    const __m256 b0 = _mm256_loadu_ps(Bp + p * 16);
+    const __m256 b1 = _mm256_loadu_ps(Bp + p * 16 + 8);
+    const float * a = Ap + p * 6;
+    for (int i = 0; i < 6; i++) {
+      const __m256 ai = _mm256_broadcast_ss(a + i);
+      c[i][0] = _mm256_fmadd_ps(ai, b0, c[i][0]);
+      c[i][1] = _mm256_fmadd_ps(ai, b1, c[i][1]);
+    }
+  }
+  if (mr == 6 && nr == 16) {
+    for (int i = 0; i < 6; i++) {
+      float * Ci = C + i * ldc;
+      __m256 v0 = c[i][0], v1 = c[i][1];
+      if (accumulate) {
+        v0 = _mm256_add_ps(v0, _mm256_loadu_ps(Ci));
+        v1 = _mm256_add_ps(v1, _mm256_loadu_ps(Ci + 8));
+      }
+      _mm256_storeu_ps(Ci, v0);
+      _mm256_storeu_ps(Ci + 8, v1);
+    }
+  } else {
+    float t[6 * 16];
+    for (int i = 0; i < 6; i++) {
+      _mm256_storeu_ps(t + i * 16, c[i][0]);
+      _mm256_storeu_ps(t + i * 16 + 8, c[i][1]);
+    }
+    intrin_gemm_store_tile(t, mr, nr, C, ldc, accumulate);
+  }
+}
+
+/**
+   @brief relu, AVX-512
+   @details x where 0 < x, as max_r(0, x) (0 for NaN)
+ */
+__attribute__((target("avx512f")))
+static void intrin_relu_avx512(idx_t n, const float * x, float * y) {
+  const __m512 z = _mm512_setzero_ps();
+  idx_t j = 0;
+  for (; j + 16 <= n; j += 16) {
+    const __m512 v = _mm512_loadu_ps(x + j);
+    _mm512_storeu_ps(y + j, _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(z, v, _CMP_LT_OQ), v));
+  }
+  if (j < n) {
+    const __mmask16 m = (__mmask16)((1u << (n - j)) - 1);
+    const __m512 v = _mm512_maskz_loadu_ps(m, x + j);
+    _mm512_mask_storeu_ps(y + j, m, _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(z, v, _CMP_LT_OQ), v));
+  }
+}
+
+/**
+   @brief relu gradient, AVX-512
+ */
+__attribute__((target("avx512f")))
+static void intrin_relu_grad_avx512(idx_t n, const float * x, const float * gy, float * gx) {
+  const __m512 z = _mm512_setzero_ps();
+  idx_t j = 0;
+  for (; j + 16 <= n; j += 16) {
+    const __mmask16 p = _mm512_cmp_ps_mask(_mm512_loadu_ps(x + j), z, _CMP_GE_OQ);
+    _mm512_storeu_ps(gx + j, _mm512_maskz_mov_ps(p, _mm512_loadu_ps(gy + j)));
+  }
+  if (j < n) {
+    const __mmask16 m = (__mmask16)((1u << (n - j)) - 1);
+    const __mmask16 p = _mm512_mask_cmp_ps_mask(m, _mm512_maskz_loadu_ps(m, x + j), z, _CMP_GE_OQ);
+    _mm512_mask_storeu_ps(gx + j, m, _mm512_maskz_loadu_ps(p, gy + j));
+  }
+}
+
+/**
+   @brief relu, AVX2
+   @details max_ps returns its second operand (0) if x is NaN, as max_r(0, x)
+ */
+__attribute__((target("avx2")))
+static void intrin_relu_avx2(idx_t n, const float * x, float * y) {
+  const __m256 z = _mm256_setzero_ps();
+  idx_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    _mm256_storeu_ps(y + j, _mm256_max_ps(_mm256_loadu_ps(x + j), z));
+  }
+  for (; j < n; j++) {
+    y[j] = max_r(0, x[j]);
+  }
+}
+
+/**
+   @brief relu gradient, AVX2
+ */
+__attribute__((target("avx2")))
+static void intrin_relu_grad_avx2(idx_t n, const float * x, const float * gy, float * gx) {
+  const __m256 z = _mm256_setzero_ps();
+  idx_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    const __m256 p = _mm256_cmp_ps(_mm256_loadu_ps(x + j), z, _CMP_GE_OQ);
+    _mm256_storeu_ps(gx + j, _mm256_and_ps(p, _mm256_loadu_ps(gy + j)));
+  }
+  for (; j < n; j++) {
+    gx[j] = (x[j] >= 0 ? gy[j] : 0);
+  }
+}
+
+/**
+   @brief 2x2 max pooling of a row, AVX2: 8 outputs from 16 inputs of
+   each of the two rows, whose even and odd elements are separated
+   with shuffles; AVX-512 uses it too (pooled rows are short)
+ */
+__attribute__((target("avx2")))
+static void intrin_pool2_avx2(idx_t ow, const float * r0, const float * r1, idx_t i,
+                              float * y, idx_t * ai, idx_t * aj) {
+  const __m256i lane2 = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+  const __m256i i0 = _mm256_set1_epi32(2 * i);
+  idx_t j = 0;
+  for (; j + 8 <= ow; j += 8) {
+    __m256 ev[2], od[2];
+    const float * r[2] = { r0 + 2 * j, r1 + 2 * j };
+    for (int k = 0; k < 2; k++) {
+      const __m256 a = _mm256_loadu_ps(r[k]);
+      const __m256 b = _mm256_loadu_ps(r[k] + 8);
+      /* [a0 a2 b0 b2 | a4 a6 b4 b6] -> [a0 a2 a4 a6 b0 b2 b4 b6] */
+      ev[k] = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, 0x88)), 0xD8));
+      od[k] = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, 0xDD)), 0xD8));
+    }
+    const __m256i j0 = _mm256_add_epi32(_mm256_set1_epi32(2 * j), lane2);
+    /* within a row, the odd one only if it is larger (all-ones masks are -1) */
+    const __m256 g0 = _mm256_cmp_ps(ev[0], od[0], _CMP_LT_OQ);
+    const __m256 g1 = _mm256_cmp_ps(ev[1], od[1], _CMP_LT_OQ);
+    const __m256 m0 = _mm256_blendv_ps(ev[0], od[0], g0);
+    const __m256 m1 = _mm256_blendv_ps(ev[1], od[1], g1);
+    const __m256i mj0 = _mm256_sub_epi32(j0, _mm256_castps_si256(g0));
+    const __m256i mj1 = _mm256_sub_epi32(j0, _mm256_castps_si256(g1));
+    /* the second row only if it is larger */
+    const __m256 g = _mm256_cmp_ps(m0, m1, _CMP_LT_OQ);
+    _mm256_storeu_ps(y + j, _mm256_blendv_ps(m0, m1, g));
+    _mm256_storeu_si256((__m256i *)(ai + j), _mm256_sub_epi32(i0, _mm256_castps_si256(g)));
+    _mm256_storeu_si256((__m256i *)(aj + j),
+                        _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(mj0),
+                                                             _mm256_castsi256_ps(mj1), g)));
+  }
+  intrin_pool2_tail(j, ow, r0, r1, i, y, ai, aj);
+}
+#endif
+
+#if INTRIN_NEON
+/**
+   @brief gemm kernel, NEON: a row of 16 in four q registers, 24 accumulators
+ */
+static void intrin_gemm_neon(idx_t kc, const float * Ap, const float * Bp,
+                             idx_t mr, idx_t nr, float * C, idx_t ldc, int accumulate) {
+  float32x4_t c[6][4];
+  for (int i = 0; i < 6; i++) {
+    for (int q = 0; q < 4; q++) c[i][q] = vdupq_n_f32(0.0f);
+  }
+  for (idx_t p = 0; p < kc; p++) {
+    const float32x4_t b0 = vld1q_f32(Bp + p * 16);
+    const float32x4_t b1 = vld1q_f32(Bp + p * 16 + 4);
+    const float32x4_t b2 = vld1q_f32(Bp + p * 16 + 8);
+    const float32x4_t b3 = vld1q_f32(Bp + p * 16 + 12);
+    const float * a = Ap + p * 6;
+    for (int i = 0; i < 6; i++) {
+      c[i][0] = vfmaq_n_f32(c[i][0], b0, a[i]);
+      c[i][1] = vfmaq_n_f32(c[i][1], b1, a[i]);
+      c[i][2] = vfmaq_n_f32(c[i][2], b2, a[i]);
+      c[i][3] = vfmaq_n_f32(c[i][3], b3, a[i]);
+    }
+  }
+  if (mr == 6 && nr == 16) {
+    for (int i = 0; i < 6; i++) {
+      float * Ci = C + i * ldc;
+      for (int q = 0; q < 4; q++) {
+        float32x4_t v = c[i][q];
+        if (accumulate) v = vaddq_f32(v, vld1q_f32(Ci + 4 * q));
+        vst1q_f32(Ci + 4 * q, v);
+      }
+    }
+  } else {
+    float t[6 * 16];
+    for (int i = 0; i < 6; i++) {
+      for (int q = 0; q < 4; q++) vst1q_f32(t + i * 16 + 4 * q, c[i][q]);
+    }
+    intrin_gemm_store_tile(t, mr, nr, C, ldc, accumulate);
+  }
+}
+
+/**
+   @brief relu, NEON
+ */
+static void intrin_relu_neon(idx_t n, const float * x, float * y) {
+  const float32x4_t z = vdupq_n_f32(0.0f);
+  idx_t j = 0;
+  for (; j + 4 <= n; j += 4) {
+    const float32x4_t v = vld1q_f32(x + j);
+    /* not vmaxq, which propagates NaN (max_r gives 0) */
+    vst1q_f32(y + j, vbslq_f32(vcltq_f32(z, v), v, z));
+  }
+  for (; j < n; j++) {
+    y[j] = max_r(0, x[j]);
+  }
+}
+
+/**
+   @brief relu gradient, NEON
+ */
+static void intrin_relu_grad_neon(idx_t n, const float * x, const float * gy, float * gx) {
+  const float32x4_t z = vdupq_n_f32(0.0f);
+  idx_t j = 0;
+  for (; j + 4 <= n; j += 4) {
+    const uint32x4_t p = vcgeq_f32(vld1q_f32(x + j), z);
+    vst1q_f32(gx + j, vreinterpretq_f32_u32(vandq_u32(p, vreinterpretq_u32_f32(vld1q_f32(gy + j)))));
+  }
+  for (; j < n; j++) {
+    gx[j] = (x[j] >= 0 ? gy[j] : 0);
+  }
+}
+
+/**
+   @brief 2x2 max pooling of a row, NEON: 4 outputs from 8 inputs of
+   each row, deinterleaved by vld2q
+ */
+static void intrin_pool2_neon(idx_t ow, const float * r0, const float * r1, idx_t i,
+                              float * y, idx_t * ai, idx_t * aj) {
+  const int32_t l[4] = { 0, 2, 4, 6 };
+  const int32x4_t lane2 = vld1q_s32(l);
+  const int32x4_t i0 = vdupq_n_s32(2 * i);
+  idx_t j = 0;
+  for (; j + 4 <= ow; j += 4) {
+    const float32x4x2_t v0 = vld2q_f32(r0 + 2 * j);
+    const float32x4x2_t v1 = vld2q_f32(r1 + 2 * j);
+    const int32x4_t j0 = vaddq_s32(vdupq_n_s32(2 * j), lane2);
+    const uint32x4_t g0 = vcltq_f32(v0.val[0], v0.val[1]);
+    const uint32x4_t g1 = vcltq_f32(v1.val[0], v1.val[1]);
+    const float32x4_t m0 = vbslq_f32(g0, v0.val[1], v0.val[0]);
+    const float32x4_t m1 = vbslq_f32(g1, v1.val[1], v1.val[0]);
+    const int32x4_t mj0 = vsubq_s32(j0, vreinterpretq_s32_u32(g0));
+    const int32x4_t mj1 = vsubq_s32(j0, vreinterpretq_s32_u32(g1));
+    const uint32x4_t g = vcltq_f32(m0, m1);
+    vst1q_f32(y + j, vbslq_f32(g, m1, m0));
+    vst1q_s32((int32_t *)(ai + j), vsubq_s32(i0, vreinterpretq_s32_u32(g)));
+    vst1q_s32((int32_t *)(aj + j), vbslq_s32(g, mj1, mj0));
+  }
+  intrin_pool2_tail(j, ow, r0, r1, i, y, ai, aj);
+}
+#endif
+
+/**
+   @brief the kernels for float
+   @details AVX-512 pools with the AVX2 kernel (a pooled row of
+   MNIST is 12 wide, less than a zmm of outputs); the pooling
+   kernels store argmax as 32 bit integers, so they need idx_t to be int
+ */
+template<>
+struct intrin_kernels<float> {
+  void (*gemm)(idx_t kc, const float * Ap, const float * Bp, idx_t mr, idx_t nr,
+               float * C, idx_t ldc, int accumulate);
+  void (*relu)(idx_t n, const float * x, float * y);
+  void (*relu_grad)(idx_t n, const float * x, const float * gy, float * gx);
+  void (*pool2)(idx_t ow, const float * r0, const float * r1, idx_t i,
+                float * y, idx_t * ai, idx_t * aj);
+  static intrin_kernels get(isa_t isa) {
+    intrin_kernels k = { 0, 0, 0, 0 };
+    const int int_idx = (sizeof(idx_t) == 4);
+    switch (isa) {
+#if INTRIN_X86
+    case isa_avx512:
+      k = { intrin_gemm_avx512, intrin_relu_avx512, intrin_relu_grad_avx512,
+            (int_idx ? intrin_pool2_avx2 : 0) };
+      break;
+    case isa_avx2:
+      k = { intrin_gemm_avx2, intrin_relu_avx2, intrin_relu_grad_avx2,
+            (int_idx ? intrin_pool2_avx2 : 0) };
+      break;
+#endif
+#if INTRIN_NEON
+    case isa_neon:
+      k = { intrin_gemm_neon, intrin_relu_neon, intrin_relu_grad_neon,
+            (int_idx ? intrin_pool2_neon : 0) };
+      break;
+#endif
+    default:
+      (void)int_idx;
+      break;
+    }
+    return k;
+  }
+};
+
+/**
+   @brief the kernels of the flavor --isa selects
+ */
+static intrin_kernels<real> intrin_select(cmdline_opt opt) {
+  return intrin_kernels<real>::get(isa_select(opt.isa));
+}
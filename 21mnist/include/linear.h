@@ -9,7 +9,12 @@
 #include "tensor.h"
 #include "ada_delta.h"
 #include "grad_check.h"
+#include "bench.h"
+#include "gemm.h"
+#include "tc_gemm.h"
+#ifdef _OPENMP
 #include <omp.h>
+#endif
 #include <stdio.h>
 
 /**
@@ -46,6 +51,7 @@ struct Linear {
   tensor<real,M,K0,K1,K2> gx;  /**< gradient of loss wrt to input x */
   AdaDelta<K0,K1,K2,N> opt_w;  /**< AdaDelta optimizer for w */
   AdaDelta<N> opt_b;           /**< AdaDelta optimizer for b */
+  gemm_kernel_t gemm_kern;     /**< micro-kernel of the packed gemm (cpu_blas_like, cpu_intrin) */
   /**
      @brief initialize the layer
      @param (opt) command line options
@@ -62,6 +68,9 @@ struct Linear {
     b.init_uniform(N, rg, -bound, bound);
     opt_w.init(opt.lr);
     opt_b.init(opt.lr);
+    opt_w.set_grad_scale(1.0 / opt.loss_scale);
+    opt_b.set_grad_scale(1.0 / opt.loss_scale);
+    gemm_kern = gemm_kernel_for(opt);
   }
   /**
      @brief set the device pointer for this and all subobjects
@@ -145,10 +154,34 @@ struct Linear {
   void update_cpu_base() {
     update_base();
   }
-  __device__ __host__
+  /**
+     @brief update with the fused AdaDelta update on OpenMP threads and SIMD
+     @sa AdaDelta::update_cpu_omp
+  */
   void update_cpu_omp() {
-    opt_w.update(w, gw);
-    opt_b.update(b, gb);
+    opt_w.update_cpu_omp(w, gw);
+    opt_b.update_cpu_omp(b, gb);
+  }
+  /**
+     @brief add the updates of w and b to a list updated together
+     @param (l) the list
+     @param (cuda) 1 if the list gets device addresses
+     @sa ada_delta_list
+  */
+  void add_params(ada_delta_list& l, int cuda) {
+    opt_w.add_to(l, w, gw, cuda);
+    opt_b.add_to(l, b, gb, cuda);
+  }
+  /**
+     @brief add w, b and their optimizer states to a checkpoint
+     @param (l) the checkpoint
+     @param (name) the name of this layer (e.g., "conv1")
+  */
+  void add_state(checkpoint_list& l, const char * name) {
+    l.add(name, "w", w);
+    l.add(name, "b", b);
+    opt_w.add_state(l, name, "w");
+    opt_b.add_state(l, name, "b");
   }
   /**
      @brief update weights of all sublayers with gradients
@@ -180,7 +213,9 @@ struct Linear {
       }        
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_update, 0,
+                   10.0 * N * (K0 * K1 * K2 + 1),
+                   7.0 * sizeof(real) * N * (K0 * K1 * K2 + 1));
   }
   /**
      @brief the baseline (serial) implementation of forward
@@ -281,6 +316,105 @@ struct Linear {
       }
     }
   }
+  /**
+     @brief forward as a single packed gemm, y = x w + b
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @sa gemm
+  */
+  void forward_cpu_blas_like(tensor<real,M,K0,K1,K2>& x, int training) {
+    (void)training;
+    const idx_t m = x.n0;
+    const idx_t KK = K0 * K1 * K2;
+    y.set_n0(m);
+    x_ptr = &x;
+    for (idx_t i = 0; i < m; i++) {
+#pragma omp simd
+      for (idx_t j = 0; j < N; j++) {
+        y(i,j) = b(j);
+      }
+    }
+    gemm<M,N,K0*K1*K2>(m, N, KK, &x.w[0][0][0][0], KK, 1,
+                       &w.w[0][0][0][0], N, 1, &y.w[0][0][0][0], N, 1, gemm_kern);
+  }
+  /**
+     @brief forward on input in the blocked layout (cpu_nchwc), y = x w + b
+     @param (x) input images (blocked; tensor::blk)
+     @param (training) 1 if it is called in training not testing
+     @details w keeps its (K0,K1,K2) rows, so this flattens x without
+     reordering it: the K1*K2 rows of channel c meet the elements of x
+     CB apart starting from c%CB of block c/CB, a strided operand
+     gemm packs as it goes.  same as forward_cpu_blas_like if the
+     blocked layout is the standard one (e.g., fc2)
+     @sa forward_cpu_blas_like
+  */
+  void forward_cpu_nchwc(tensor<real,M,K0,K1,K2>& x, int training) {
+    if (tensor<real,M,K0,K1,K2>::blk_is_identity()) {
+      forward_cpu_blas_like(x, training);
+      return;
+    }
+    (void)training;
+    const idx_t m = x.n0;
+    const idx_t KK = K0 * K1 * K2;
+    const idx_t P = K1 * K2;
+    const idx_t CB = tensor<real,M,K0,K1,K2>::CB;
+    y.set_n0(m);
+    x_ptr = &x;
+    for (idx_t i = 0; i < m; i++) {
+#pragma omp simd
+      for (idx_t j = 0; j < N; j++) {
+        y(i,j) = b(j);
+      }
+    }
+    for (idx_t c = 0; c < K0; c++) {
+      const real * x_c = &x.w[0][0][0][0] + c / CB * P * CB + c % CB;
+      gemm<M,N,K1*K2>(m, N, P, x_c, KK, CB,
+                      &w.w[c][0][0][0], N, 1, &y.w[0][0][0][0], N, 1);
+    }
+  }
+  /**
+     @brief a cuda implementation of forward on tensor cores (cuda_tc), y = x w + b
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @details x and w are rounded to FP16 (BF16 with -DTC_BF16=1)
+     as tc_gemm_block stages them and products are accumulated in
+     FP32.  the grid covers M (the maximum batch size) rows; blocks
+     of rows >= x.n0 quit right away
+     @sa tc_gemm_block
+  */
+  void forward_cuda_tc(tensor<real,M,K0,K1,K2>& x, int training) {
+#if __CUDACC__
+    launch_and_sync((forward_cuda_tc_global<<<tc_grid(M, N),tc_threads>>>(dev, x.dev, training)));
+#else
+    (void)x;
+    (void)training;
+    err_cuda_code_non_cuda_compiler(opt.algo_s);
+#endif
+  }
+#if __CUDACC__
+  /**
+     @brief the device function of forward_cuda_tc (a block)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @sa forward_cuda_tc
+  */
+  __device__
+  void forward_cuda_tc_device(tensor<real,M,K0,K1,K2>& x, int training) {
+    (void)training;
+    const idx_t m = x.n0;
+    const idx_t KK = K0 * K1 * K2;
+    if (blockIdx.x == 0 && blockIdx.y == 0 && threadIdx.x == 0) {
+      y.set_n0(m);
+      x_ptr = &x;
+    }
+    const real * xp = &x.w[0][0][0][0];
+    const real * wp = &w.w[0][0][0][0];
+    tc_gemm_block(m, N, KK,
+                  [&](idx_t i, idx_t k) { return xp[i * KK + k]; },
+                  [&](idx_t k, idx_t j) { return wp[k * N + j]; },
+                  [&](idx_t i, idx_t j, real v) { y.w[i][j][0][0] = v + b.w[j][0][0][0]; });
+  }
+#endif
   /**
      @brief the device function of forward called from the 
      global (non-member) function
@@ -327,6 +461,28 @@ struct Linear {
   }
   
   
+  /**
+     @brief 1 if this layer has its own implementation of algorithm a
+     @details forward and backward fall back to the baseline for
+     others; when you add a case for your algorithm to them, add it
+     here too (--algo auto measures only these)
+  */
+  static int has_algo(algo_t a) {
+    switch (a) {
+    case algo_cpu_base:
+    case algo_cuda_base:
+    case algo_cpu_omp:
+    case algo_cpu_simd:
+    case algo_cpu_omp_simd:
+    case algo_cpu_blas_like:
+    case algo_cpu_nchwc:
+    case algo_cpu_intrin:
+    case algo_cuda_tc:
+      return 1;
+    default:
+      return 0;
+    }
+  }
   /**
      @brief forward phase of the layer
      @param (x) input images
@@ -344,6 +500,11 @@ struct Linear {
     tsc_t t0 = get_tsc();
     switch (opt.algo) {
       /* add case for your implementations here */
+    case algo_cpu_blas_like:
+    case algo_cpu_intrin:       // with the intrinsic gemm kernel (gemm_kern)
+      forward_cpu_blas_like(x, training); break;
+    case algo_cpu_nchwc:
+      forward_cpu_nchwc(x, training); break;
     case algo_cpu_omp_simd:
       forward_cpu_omp_simd(x, training); break;
     case algo_cpu_simd:
@@ -354,6 +515,8 @@ struct Linear {
       forward_cpu_base(x, training); break;
     case algo_cuda_base:
       forward_cuda_base(x, training); break;
+    case algo_cuda_tc:
+      forward_cuda_tc(x, training); break;
     default:
       if (opt.cuda_algo) {
         forward_cuda_base(x, training);
@@ -362,7 +525,9 @@ struct Linear {
       }        
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_forward, x.n0,
+                   2.0 * x.n0 * N * K0 * K1 * K2,
+                   sizeof(real) * (1.0 * x.n0 * (K0 * K1 * K2 + N) + N * (K0 * K1 * K2 + 1)));
     return y;
   }
   /**
@@ -561,6 +726,153 @@ struct Linear {
       }
     }
   }
+  /**
+     @brief backward as two packed gemms, gw = x^T gy and gx = gy w^T
+     @param (gy) gradient of loss with respect to the output
+     @details transposed operands are given to gemm as strides
+     @sa gemm
+  */
+  void backward_cpu_blas_like(tensor<real,M,N>& gy) {
+    const idx_t m = gy.n0;
+    const idx_t KK = K0 * K1 * K2;
+    gw.set_n0(K0);
+    gb.set_n0(N);
+    gx.set_n0(m);
+    tensor<real,M,K0,K1,K2>& x = *x_ptr;
+    gemm<K0*K1*K2,N,M>(KK, N, m, &x.w[0][0][0][0], 1, KK,
+                       &gy.w[0][0][0][0], N, 1, &gw.w[0][0][0][0], N, 0, gemm_kern);
+    for (idx_t j = 0; j < N; j++) {
+      gb(j) = 0.0;
+    }
+    for (idx_t i = 0; i < m; i++) {
+#pragma omp simd
+      for (idx_t j = 0; j < N; j++) {
+        gb(j) += gy(i,j);
+      }
+    }
+    gemm<M,K0*K1*K2,N>(m, KK, N, &gy.w[0][0][0][0], N, 1,
+                       &w.w[0][0][0][0], 1, N, &gx.w[0][0][0][0], KK, 0, gemm_kern);
+  }
+  /**
+     @brief backward on input in the blocked layout (cpu_nchwc)
+     @param (gy) gradient of loss with respect to the output
+     @details gw of the rows of a channel is x_c^T gy as in
+     forward_cpu_nchwc.  gx of a block of channels of a pixel is
+     gy (m x N) times the CB rows of w of those channels (N x CB,
+     K1*K2*N apart), whose output columns are contiguous in the
+     blocked layout
+     @sa forward_cpu_nchwc
+     @sa backward_cpu_blas_like
+  */
+  void backward_cpu_nchwc(tensor<real,M,N>& gy) {
+    if (tensor<real,M,K0,K1,K2>::blk_is_identity()) {
+      backward_cpu_blas_like(gy);
+      return;
+    }
+    const idx_t m = gy.n0;
+    const idx_t KK = K0 * K1 * K2;
+    const idx_t P = K1 * K2;
+    const idx_t CB = tensor<real,M,K0,K1,K2>::CB;
+    gw.set_n0(K0);
+    gb.set_n0(N);
+    gx.set_n0(m);
+    tensor<real,M,K0,K1,K2>& x = *x_ptr;
+#pragma omp parallel for
+    for (idx_t c = 0; c < K0; c++) {
+      const real * x_c = &x.w[0][0][0][0] + c / CB * P * CB + c % CB;
+      gemm<K1*K2,N,M>(P, N, m, x_c, CB, KK,
+                      &gy.w[0][0][0][0], N, 1, &gw.w[c][0][0][0], N, 0);
+    }
+    for (idx_t j = 0; j < N; j++) {
+      gb(j) = 0.0;
+    }
+    for (idx_t i = 0; i < m; i++) {
+#pragma omp simd
+      for (idx_t j = 0; j < N; j++) {
+        gb(j) += gy(i,j);
+      }
+    }
+#pragma omp parallel for collapse(2)
+    for (idx_t cb = 0; cb < K0 / CB; cb++) {
+      for (idx_t p = 0; p < P; p++) {
+        const real * w_c = &w.w[0][0][0][0] + (cb * CB * P + p) * N;
+        real * gx_c = &gx.w[0][0][0][0] + (cb * P + p) * CB;
+        gemm<M,CB,N>(m, CB, N, &gy.w[0][0][0][0], N, 1,
+                     w_c, 1, P * N, gx_c, KK, 0);
+      }
+    }
+  }
+  /**
+     @brief a cuda implementation of backward on tensor cores (cuda_tc)
+     @param (gy) gradient of loss with respect to the output
+     @details gw = x^T gy and gx = gy w^T as in backward_cpu_blas_like,
+     with operands rounded as in forward_cuda_tc.  gb is summed in
+     FP32 by the blocks of the first row of the gw kernel
+     @sa backward_w_cuda_tc_device
+     @sa backward_x_cuda_tc_device
+  */
+  void backward_cuda_tc(tensor<real,M,N>& gy) {
+#if __CUDACC__
+    launch_and_sync((backward_w_cuda_tc_global<<<tc_grid(K0 * K1 * K2, N),tc_threads>>>(dev, gy.dev)));
+    launch_and_sync((backward_x_cuda_tc_global<<<tc_grid(M, K0 * K1 * K2),tc_threads>>>(dev, gy.dev)));
+#else
+    (void)gy;
+    err_cuda_code_non_cuda_compiler(opt.algo_s);
+#endif
+  }
+#if __CUDACC__
+  /**
+     @brief the device function computing gw and gb in backward_cuda_tc (a block)
+     @param (gy) gradient of loss with respect to the output
+     @sa backward_cuda_tc
+  */
+  __device__
+  void backward_w_cuda_tc_device(tensor<real,M,N>& gy) {
+    const idx_t m = gy.n0;
+    const idx_t KK = K0 * K1 * K2;
+    if (blockIdx.x == 0 && blockIdx.y == 0 && threadIdx.x == 0) {
+      gw.set_n0(K0);
+      gb.set_n0(N);
+    }
+    const real * xp = &x_ptr->w[0][0][0][0];
+    const real * gyp = &gy.w[0][0][0][0];
+    real * gwp = &gw.w[0][0][0][0];
+    tc_gemm_block(KK, N, m,
+                  [&](idx_t k, idx_t i) { return xp[i * KK + k]; },
+                  [&](idx_t i, idx_t j) { return gyp[i * N + j]; },
+                  [&](idx_t k, idx_t j, real v) { gwp[k * N + j] = v; });
+    if (blockIdx.y == 0) {
+      const idx_t j_end = min_i(N, (blockIdx.x + 1) * tc_bn);
+      for (idx_t j = blockIdx.x * tc_bn + threadIdx.x; j < j_end; j += tc_threads) {
+        real v = 0.0;
+        for (idx_t i = 0; i < m; i++) {
+          v += gyp[i * N + j];
+        }
+        gb.w[j][0][0][0] = v;
+      }
+    }
+  }
+  /**
+     @brief the device function computing gx in backward_cuda_tc (a block)
+     @param (gy) gradient of loss with respect to the output
+     @sa backward_cuda_tc
+  */
+  __device__
+  void backward_x_cuda_tc_device(tensor<real,M,N>& gy) {
+    const idx_t m = gy.n0;
+    const idx_t KK = K0 * K1 * K2;
+    if (blockIdx.x == 0 && blockIdx.y == 0 && threadIdx.x == 0) {
+      gx.set_n0(m);
+    }
+    const real * gyp = &gy.w[0][0][0][0];
+    const real * wp = &w.w[0][0][0][0];
+    real * gxp = &gx.w[0][0][0][0];
+    tc_gemm_block(m, KK, N,
+                  [&](idx_t i, idx_t j) { return gyp[i * N + j]; },
+                  [&](idx_t j, idx_t k) { return wp[k * N + j]; },
+                  [&](idx_t i, idx_t k, real v) { gxp[i * KK + k] = v; });
+  }
+#endif
   /**
      @brief the device function of backward called from the 
      global (non-member) function
@@ -623,6 +935,11 @@ struct Linear {
     tsc_t t0 = get_tsc();
     switch (opt.algo) {
       /* add case for your implementations here */
+    case algo_cpu_blas_like:
+    case algo_cpu_intrin:       // with the intrinsic gemm kernel (gemm_kern)
+      backward_cpu_blas_like(gy); break;
+    case algo_cpu_nchwc:
+      backward_cpu_nchwc(gy); break;
     case algo_cpu_omp_simd:
       backward_cpu_omp_simd(gy); break;  
     case algo_cpu_simd:
@@ -633,6 +950,8 @@ struct Linear {
       backward_cpu_base(gy); break;
     case algo_cuda_base:
       backward_cuda_base(gy); break;
+    case algo_cuda_tc:
+      backward_cuda_tc(gy); break;
     default:
       if (opt.cuda_algo) {
         backward_cuda_base(gy);
@@ -641,7 +960,9 @@ struct Linear {
       }        
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_backward, gy.n0,
+                   4.0 * gy.n0 * N * K0 * K1 * K2,
+                   sizeof(real) * (1.0 * gy.n0 * (2 * K0 * K1 * K2 + N) + 2 * N * (K0 * K1 * K2 + 1)));
     return gx;
   }
   /**
@@ -712,6 +1033,14 @@ int linear_main(int argc, char ** argv) {
   double max_e = 0.0;
   double sum_e = 0.0;
   LinearCfg cfg;
+  if (strlen(opt.bench)) {
+    int r = bench_layer<Linear<maxB,N,K>,
+                        tensor<real,maxB,K>,
+                        tensor<real,maxB,N>,
+                        LinearCfg>(opt, &lgr, rg, cfg, "linear", maxB);
+    lgr.end_log();
+    return r;
+  }
   for (int iter = 0; iter < n_checks; iter++) {
     printf("==== %d ====\n", iter);
     real e = grad_check<Linear<maxB,N,K>,
@@ -724,5 +1053,5 @@ int linear_main(int argc, char ** argv) {
   printf("max relative error = %.9f\n", max_e);
   printf("avg relative error = %.9f\n", sum_e / n_checks);
   lgr.end_log();
-  return 0;
+  return grad_check_verdict(opt, max_e);
 }
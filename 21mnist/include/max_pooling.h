@@ -6,7 +6,9 @@
 
 #include "mnist_util.h"
 #include "tensor.h"
+#include "intrin.h"
 #include "grad_check.h"
+#include "bench.h"
 
 /**
    @brief configuration data for Maxpooling2D
@@ -39,6 +41,7 @@ struct MaxPooling2D {
   tensor<idx_t,maxB,C,H/S,W/S> argmax_i; /**< the index that gave the maximum of each output pixel */
   tensor<idx_t,maxB,C,H/S,W/S> argmax_j; /**< the index that gave the maximum of each output pixel */
   tensor<real,maxB,C,H,W> gx;          /**< gradient of loss wrt to input x */
+  intrin_kernels<real> kern;           /**< intrinsic kernels (cpu_intrin) */
   /**
      @brief initialize the layer
      @param (opt) command line options
@@ -51,6 +54,8 @@ struct MaxPooling2D {
     this->lgr = lgr;
     (void)rg;
     (void)cfg;
+    kern = intrin_kernels<real>::get(isa_generic);
+    if (opt.algo == algo_cpu_intrin) kern = intrin_select(opt);
   }
   /**
      @brief set the device pointer for this and all subobjects
@@ -151,6 +156,87 @@ struct MaxPooling2D {
       }
     }
   }
+  /**
+     @brief forward with the intrinsic 2x2 kernel, a pooled row per
+     call (cpu_intrin; cpu_omp if S != 2 or the flavor has none)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @details ties are broken as in forward_cpu_omp
+     @sa intrin_kernels
+  */
+  void forward_cpu_intrin(tensor<real,maxB,C,H,W>& x, int training) {
+    if (S != 2 || !kern.pool2) {
+      forward_cpu_omp(x, training);
+      return;
+    }
+    const idx_t B = x.n0;
+    y.set_n0(B);
+    argmax_i.set_n0(B);
+    argmax_j.set_n0(B);
+    #pragma omp parallel for collapse(3)
+    for (idx_t s = 0; s < B; s++) {
+      for (idx_t c = 0; c < C; c++) {
+        for (idx_t i = 0; i < H/S; i++) {
+          kern.pool2(W/S, &x.w[s][c][2 * i][0], &x.w[s][c][2 * i + 1][0], i,
+                     &y.w[s][c][i][0], &argmax_i.w[s][c][i][0], &argmax_j.w[s][c][i][0]);
+        }
+      }
+    }
+  }
+  /**
+     @brief forward on activations in the blocked layout (cpu_nchwc)
+     @param (x) input images (blocked; tensor::blk)
+     @param (training) 1 if it is called in training not testing
+     @details the CB channels of a pixel are compared in a vector;
+     argmax_i and argmax_j are in the blocked layout too
+  */
+  void forward_cpu_nchwc(tensor<real,maxB,C,H,W>& x, int training) {
+    (void)training;
+    const idx_t B = x.n0;
+    const idx_t CB = tensor<real,maxB,C,H,W>::CB;
+    y.set_n0(B);
+    argmax_i.set_n0(B);
+    argmax_j.set_n0(B);
+    #pragma omp parallel for collapse(4)
+    for (idx_t s = 0; s < B; s++) {
+      for (idx_t cb = 0; cb < C / CB; cb++) {
+        for (idx_t i = 0; i < H/S; i++) {
+          for (idx_t j = 0; j < W/S; j++) {
+            real v[CB];
+            idx_t mi[CB], mj[CB];
+            const real * x0 = x.blk_ptr(s, cb, S * i, S * j);
+#pragma omp simd
+            for (idx_t c = 0; c < CB; c++) {
+              v[c] = x0[c];
+              mi[c] = S * i;
+              mj[c] = S * j;
+            }
+            for (idx_t i_ = S * i; i_ < S * (i + 1); i_++) {
+              for (idx_t j_ = S * j; j_ < S * (j + 1); j_++) {
+                const real * xp = x.blk_ptr(s, cb, i_, j_);
+#pragma omp simd
+                for (idx_t c = 0; c < CB; c++) {
+                  const int gt = (v[c] < xp[c]);
+                  v[c] = (gt ? xp[c] : v[c]);
+                  mi[c] = (gt ? i_ : mi[c]);
+                  mj[c] = (gt ? j_ : mj[c]);
+                }
+              }
+            }
+            real * yp = y.blk_ptr(s, cb, i, j);
+            idx_t * ip = argmax_i.blk_ptr(s, cb, i, j);
+            idx_t * jp = argmax_j.blk_ptr(s, cb, i, j);
+#pragma omp simd
+            for (idx_t c = 0; c < CB; c++) {
+              yp[c] = v[c];
+              ip[c] = mi[c];
+              jp[c] = mj[c];
+            }
+          }
+        }
+      }
+    }
+  }
   /**
      @brief the device function of forward called from the 
      global (non-member) function
@@ -195,6 +281,24 @@ struct MaxPooling2D {
   void forward_cpu_base(tensor<real,maxB,C,H,W>& x, int training) {
     forward_base(x, training);
   }
+  /**
+     @brief 1 if this layer has its own implementation of algorithm a
+     @details forward and backward fall back to the baseline for
+     others; when you add a case for your algorithm to them, add it
+     here too (--algo auto measures only these)
+  */
+  static int has_algo(algo_t a) {
+    switch (a) {
+    case algo_cpu_base:
+    case algo_cuda_base:
+    case algo_cpu_omp:
+    case algo_cpu_nchwc:
+    case algo_cpu_intrin:
+      return 1;
+    default:
+      return 0;
+    }
+  }
   /**
      @brief forward phase of the layer
      @param (x) input images
@@ -212,8 +316,12 @@ struct MaxPooling2D {
     tsc_t t0 = get_tsc();
     switch (opt.algo) {
       /* add case for your implementations here */
+    case algo_cpu_intrin:
+      forward_cpu_intrin(x, training); break;
     case algo_cpu_omp:
       forward_cpu_omp(x, training); break;
+    case algo_cpu_nchwc:
+      forward_cpu_nchwc(x, training); break;
     case algo_cpu_base:
       forward_cpu_base(x, training); break;
     case algo_cuda_base:
@@ -226,7 +334,9 @@ struct MaxPooling2D {
       }        
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_forward, x.n0,
+                   1.0 * x.n0 * C * H * W,
+                   sizeof(real) * x.n0 * C * (H * W + (H/S) * (W/S)));
     return y;
   }
   /**
@@ -295,6 +405,40 @@ struct MaxPooling2D {
       }
     }
   }
+  /**
+     @brief backward on activations in the blocked layout (cpu_nchwc)
+     @param (gy) gradient of loss with respect to the output (blocked)
+     @sa forward_cpu_nchwc
+  */
+  void backward_cpu_nchwc(tensor<real,maxB,C,H/S,W/S>& gy) {
+    const idx_t B = gy.n0;
+    const idx_t CB = tensor<real,maxB,C,H,W>::CB;
+    gx.set_n0(B);
+    #pragma omp parallel for collapse(2)
+    for (idx_t s = 0; s < B; s++) {
+      for (idx_t cb = 0; cb < C / CB; cb++) {
+        for (idx_t i = 0; i < H; i++) {
+          for (idx_t j = 0; j < W; j++) {
+            real * gp = gx.blk_ptr(s, cb, i, j);
+#pragma omp simd
+            for (idx_t c = 0; c < CB; c++) {
+              gp[c] = 0;
+            }
+          }
+        }
+        for (idx_t i = 0; i < H/S; i++) {
+          for (idx_t j = 0; j < W/S; j++) {
+            const real * gyp = gy.blk_ptr(s, cb, i, j);
+            const idx_t * ip = argmax_i.blk_ptr(s, cb, i, j);
+            const idx_t * jp = argmax_j.blk_ptr(s, cb, i, j);
+            for (idx_t c = 0; c < CB; c++) {
+              gx.blk_ptr(s, cb, ip[c], jp[c])[c] = gyp[c];
+            }
+          }
+        }
+      }
+    }
+  }
   /**
      @brief the device function of backward called from the 
      global (non-member) function
@@ -357,7 +501,10 @@ struct MaxPooling2D {
     switch (opt.algo) {
       /* add case for your implementations here */
     case algo_cpu_omp:
+    case algo_cpu_intrin:       // a scatter; nothing to vectorize
       backward_cpu_omp(gy); break;
+    case algo_cpu_nchwc:
+      backward_cpu_nchwc(gy); break;
     case algo_cpu_base:
       backward_cpu_base(gy); break;
     case algo_cuda_base:
@@ -370,7 +517,9 @@ struct MaxPooling2D {
       }        
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_backward, gy.n0,
+                   1.0 * gy.n0 * C * H * W,
+                   sizeof(real) * gy.n0 * C * (2 * H * W + (H/S) * (W/S)));
     return gx;
   }
 
@@ -444,6 +593,14 @@ int max_pooling_main(int argc, char ** argv) {
   double max_e = 0.0;
   double sum_e = 0.0;
   MaxPooling2DCfg cfg;
+  if (strlen(opt.bench)) {
+    int r = bench_layer<MaxPooling2D<maxB,C,H,W,S>,
+                        tensor<real,maxB,C,H,W>,
+                        tensor<real,maxB,C,H/S,W/S>,
+                        MaxPooling2DCfg>(opt, &lgr, rg, cfg, "max_pooling", maxB);
+    lgr.end_log();
+    return r;
+  }
   for (int iter = 0; iter < n_checks; iter++) {
     printf("==== %d ====\n", iter);
     double e = grad_check<MaxPooling2D<maxB,C,H,W,S>,
@@ -456,6 +613,6 @@ int max_pooling_main(int argc, char ** argv) {
   printf("max relative error = %.9f\n", max_e);
   printf("avg relative error = %.9f\n", sum_e / n_checks);
   lgr.end_log();
-  return 0;
+  return grad_check_verdict(opt, max_e);
 }
 
@@ -4,6 +4,7 @@
  */
 #pragma once
 
+#include <err.h>
 #include "mnist_util.h"
 #include "tensor.h"
 #include "convolution.h"
@@ -12,7 +13,14 @@
 #include "dropout.h"
 #include "linear.h"
 #include "nll_softmax.h"
+#include "fused.h"
+#include "arena.h"
 #include "grad_check.h"
+#include "bench.h"
+#include "autotune.h"
+#include "data_parallel.h"
+#include "grad_accum.h"
+#include "hybrid.h"
 
 /**
    @file mnist.h
@@ -37,6 +45,113 @@ struct MNISTCfg {
   NLLSoftmaxCfg nll_softmax;   /**< nll_softmax's cfg parameter */
 };
 
+/**
+   @brief the loss and correct predictions of a mini batch
+ */
+struct batch_stats_t {
+  double loss;                  /**< the sum of losses of samples */
+  long correct;                 /**< the number of samples predicted right */
+};
+
+/**
+   @brief write the class of the largest score of samples i, i+nt, ... of y into pred
+   @param (y) scores (or log softmax) of classes
+   @param (pred) predicted classes (n0 must have been set)
+   @param (i) this thread
+   @param (nt) the number of threads
+ */
+template<idx_t maxB,idx_t nC>
+__device__ __host__
+static void batch_classify(tensor<real,maxB,nC>& y, tensor<idx_t,maxB>& pred, idx_t i, idx_t nt) {
+  const idx_t B = y.n0;
+  for (idx_t s = i; s < B; s += nt) {
+    idx_t pred_class = 0;
+    for (idx_t c = 0; c < nC; c++) {
+      if (y(s,pred_class) < y(s,c)) {
+        pred_class = c;
+      }
+    }
+    pred(s) = pred_class;
+  }
+}
+
+/**
+   @brief the sum of losses and the number of correct predictions
+   @param (l) the loss of each sample (0 : none)
+   @param (t) true labels (0 : none)
+   @param (pred) predicted classes
+   @param (st) get the sums
+   @details summed in the order of samples, so it is the same on the host and the device
+ */
+template<idx_t maxB>
+__device__ __host__
+static void batch_sums(tensor<real,maxB> * l, tensor<idx_t,maxB> * t,
+                       tensor<idx_t,maxB>& pred, batch_stats_t * st) {
+  double L = 0.0;
+  long correct = 0;
+  for (idx_t s = 0; s < pred.n0; s++) {
+    if (l) L += (*l)(s);
+    if (t && pred(s) == (*t)(s)) correct++;
+  }
+  st->loss = L;
+  st->correct = correct;
+}
+
+#if __CUDACC__
+/**
+   @brief batch_classify and batch_sums on the device, in a single block
+   @param (st) get the sums (0 : only classify)
+ */
+template<idx_t maxB,idx_t nC>
+__global__ void batch_stats_global(tensor<real,maxB,nC> * y, tensor<real,maxB> * l,
+                                   tensor<idx_t,maxB> * t, tensor<idx_t,maxB> * pred,
+                                   batch_stats_t * st) {
+  if (threadIdx.x == 0) pred->set_n0(y->n0);
+  __syncthreads();
+  batch_classify(*y, *pred, threadIdx.x, blockDim.x);
+  __syncthreads();
+  if (st && threadIdx.x == 0) batch_sums(l, t, *pred, st);
+}
+#endif
+
+/**
+   @brief predictions, the sum of losses and correct predictions of a batch
+   @param (y) scores (or log softmax) of classes
+   @param (l) the loss of each sample (0 : none)
+   @param (t) true labels (0 : none)
+   @param (pred) get the predicted classes
+   @param (st) the device address the kernel writes the sums to (CUDA only; 0 if l and t are 0)
+   @param (cuda_algo) 1 if y, l, t and pred are on the device
+   @param (with_pred) 1 if pred is needed on the host
+   @returns the sums
+   @details under CUDA algorithms, a kernel computes them from the
+   device shadows, so what comes back is the sums (16 bytes) and, if
+   with_pred, B predictions, instead of scores and losses of maxB samples
+ */
+template<idx_t maxB,idx_t nC>
+static batch_stats_t batch_stats_of(tensor<real,maxB,nC>& y, tensor<real,maxB> * l,
+                                    tensor<idx_t,maxB> * t, tensor<idx_t,maxB>& pred,
+                                    batch_stats_t * st, int cuda_algo, int with_pred) {
+  batch_stats_t r = { 0.0, 0 };
+  if (cuda_algo) {
+#if __CUDACC__
+    launch_and_sync((batch_stats_global<maxB,nC><<<1,64>>>(y.dev, (l ? l->dev : 0), (t ? t->dev : 0),
+                                                           pred.dev, st)));
+    if (st) ::to_host(&r, st, sizeof(r));
+    if (with_pred) to_host(&pred, cuda_algo);
+#else
+    (void)with_pred;
+    err_cuda_code_non_cuda_compiler("batch_stats");
+#endif
+  } else {
+    (void)st;
+    pred.set_n0(y.n0);
+    batch_classify(y, pred, 0, 1);
+    if (l || t) batch_sums(l, t, pred, &r);
+  }
+  return r;
+}
+
 /**
    @brief MNIST network
    @param (maxB) maximum batch size it can accommodate (64)
@@ -44,8 +159,10 @@ struct MNISTCfg {
    @param (H) image height
    @param (W) image width
    @param (nC) number of classes
+   @param (train) 1 for the network that trains; 0 for the
+   inference-only specialization (mnist_infer.h)
  */
-template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC>
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC,int train=1>
 struct MNIST {
 #if __CUDACC__
   MNIST<maxB,C,H,W,nC>* dev;    /**< device shadow */
@@ -53,6 +170,7 @@ struct MNIST {
   cmdline_opt opt;              /**< command line option */
   logger * lgr;                 /**< logger */
   tensor<real,maxB,C,H,W> x;    /**< input images */
+  tensor<real,maxB,C,H,W> x_blk; /**< input images in the blocked layout and, after backward, the gradient wrt them (cpu_nchwc) */
   tensor<idx_t,maxB> t;         /**< true labels of images */
   tensor<idx_t,maxB> idxs;      /**< indexes of images */
   tensor<idx_t,maxB> pred;      /**< predicted labels of images */
@@ -75,7 +193,39 @@ struct MNIST {
   Dropout<maxB,nF> dropout2;
   Linear<maxB,nC,nF> fc2;
   NLLSoftmax<maxB,nC> nll_softmax;
+  ConvReluPoolDropout<maxB,C1,H1,W1,K,C2,2> fused; /**< conv2-relu2-max_pooling_2d-dropout1 in one pass (--fuse 1) */
+  arena_t scratch;              /**< cpu-only work buffers of layers, sharing memory */
+  arena_t act;                  /**< activations, gradients and states of layers, sharing memory (allocated with TENSOR_HEAP; only planned in CUDA builds) */
+  idx_t gy_dev_n0;              /**< the number of ones in the device shadow of gy (-1 : not sent yet); see forward_backward_update_async */
+  grad_sync * gsync;            /**< all-reduces gradients with other replicas (0 : a single replica); see set_grad_sync */
+  grad_accum * gacc;            /**< accumulates gradients over micro batches (0 : update every batch); see set_grad_accum */
+  batch_stats_t stats;          /**< sums of the last batch (batch_stats); under CUDA, the kernel writes them to the device shadow of this */
+  hybrid_meter hmeter;          /**< busy time of the stages of --hybrid */
+  hybrid_buffers<maxB,C,H,W,nC,tensor<real,maxB,C2,H3,W3>> hbuf; /**< micro batches streamed through the stages of --hybrid (test_batch_hybrid) */
+#if __CUDACC__
+  /**
+     @brief an instantiated CUDA graph of a training step
+  */
+  struct step_graph_t {
+    void * x;                   /**< the device shadow of input images it was captured with */
+    void * t;                   /**< the device shadow of true labels it was captured with */
+    idx_t B;                    /**< batch size it was captured with */
+    cudaGraphExec_t exec;       /**< the graph */
+  };
+  static const int max_step_graphs = 8; /**< the maximum number of graphs kept */
+  step_graph_t step_graphs[max_step_graphs]; /**< graphs captured so far (--cuda-exec 2) */
+  int n_step_graphs;                         /**< the number of graphs in step_graphs */
+#endif
   
+  /**
+     @brief 1 if some layer implements algorithm a (the others
+     run their baselines under it)
+  */
+  static int has_algo(algo_t a) {
+    return (decltype(conv1)::has_algo(a) || decltype(relu1)::has_algo(a)
+            || decltype(max_pooling_2d)::has_algo(a) || decltype(dropout1)::has_algo(a)
+            || decltype(fc1)::has_algo(a) || decltype(nll_softmax)::has_algo(a));
+  }
   /**
      @brief initialize everything
      @param (opt) command line options
@@ -84,19 +234,302 @@ struct MNIST {
      @param (cfg) configuration parameters
   */
   void init(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, MNISTCfg cfg) {
+    if (algo_is_blocked(opt.algo) && opt.fuse) {
+      lgr->log(1, "--fuse is ignored under %s (fused works on the standard layout)", opt.algo_s);
+      opt.fuse = 0;
+    }
     this->opt = opt;
     this->lgr = lgr;
-    conv1.init(opt, lgr, rg, cfg.conv1);
-    relu1.init(opt, lgr, rg, cfg.relu1);
-    conv2.init(opt, lgr, rg, cfg.conv2);
-    relu2.init(opt, lgr, rg, cfg.relu2);
-    max_pooling_2d.init(opt, lgr, rg, cfg.max_pooling_2d);
-    dropout1.init(opt, lgr, rg, cfg.dropout1);
-    fc1.init(opt, lgr, rg, cfg.fc1);
-    relu3.init(opt, lgr, rg, cfg.relu3);
-    dropout2.init(opt, lgr, rg, cfg.dropout2);
-    fc2.init(opt, lgr, rg, cfg.fc2);
-    nll_softmax.init(opt, lgr, rg, cfg.nll_softmax);
+    if (opt.numa && !opt.cuda_algo) {
+      numa_pin_threads(lgr);
+    }
+    /* each layer gets its own algorithm under --algo auto, and
+       those of the stage --hybrid puts on the CPU get --hybrid-algo */
+    autotuner tn;
+    tn.init(opt, lgr, min_i(maxB, opt.batch_size));
+    typedef tensor<real,maxB,C1,H1,W1> t1;
+    typedef tensor<real,maxB,C2,H2,W2> t2;
+    typedef tensor<real,maxB,C2,H3,W3> t3;
+    conv1.init(hybrid_place(tn.choose<decltype(conv1),tensor<real,maxB,C,H,W>,t1>("conv1", cfg.conv1), 0),
+               lgr, rg, cfg.conv1);
+    relu1.init(hybrid_place(tn.choose<decltype(relu1),t1,t1>("relu1", cfg.relu1), 0), lgr, rg, cfg.relu1);
+    conv2.init(hybrid_place(tn.choose<decltype(conv2),t1,t2>("conv2", cfg.conv2), 0), lgr, rg, cfg.conv2);
+    relu2.init(hybrid_place(tn.choose<decltype(relu2),t2,t2>("relu2", cfg.relu2), 0), lgr, rg, cfg.relu2);
+    max_pooling_2d.init(hybrid_place(tn.choose<decltype(max_pooling_2d),t2,t3>("max_pooling_2d", cfg.max_pooling_2d), 0),
+                        lgr, rg, cfg.max_pooling_2d);
+    dropout1.init(hybrid_place(tn.choose<decltype(dropout1),t3,t3>("dropout1", cfg.dropout1), 0),
+                  lgr, rg, cfg.dropout1);
+    fc1.init(hybrid_place(tn.choose<decltype(fc1),t3,tensor<real,maxB,nF>>("fc1", cfg.fc1), 1), lgr, rg, cfg.fc1);
+    relu3.init(hybrid_place(tn.choose<decltype(relu3),tensor<real,maxB,nF>,tensor<real,maxB,nF>>("relu3", cfg.relu3), 1),
+               lgr, rg, cfg.relu3);
+    dropout2.init(hybrid_place(tn.choose<decltype(dropout2),tensor<real,maxB,nF>,tensor<real,maxB,nF>>("dropout2", cfg.dropout2), 1),
+                  lgr, rg, cfg.dropout2);
+    fc2.init(hybrid_place(tn.choose<decltype(fc2),tensor<real,maxB,nF>,tensor<real,maxB,nC>>("fc2", cfg.fc2), 1),
+             lgr, rg, cfg.fc2);
+    nll_softmax.init(hybrid_place(tn.choose_loss<decltype(nll_softmax),tensor<real,maxB,nC>,tensor<idx_t,maxB>,
+                                  tensor<real,maxB>>("nll_softmax", cfg.nll_softmax, nC), 1),
+                     lgr, rg, cfg.nll_softmax);
+    tn.fini();
+    fused.init(opt, lgr);
+    name_layers();
+    plan_memory(cfg);
+    if (opt.numa && !opt.cuda_algo) {
+      first_touch();
+    }
+    gy_dev_n0 = -1;
+    gsync = 0;
+    gacc = 0;
+    hmeter.init(lgr, opt.hybrid);
+    if (opt.hybrid) {
+      lgr->log(1, "hybrid: %s on the %s (-a %s), %s on the %s (-a %s)",
+               hybrid_stage_names[0], (hybrid_on_cpu(opt.hybrid, 0) ? "cpu" : "gpu"), conv1.opt.algo_s,
+               hybrid_stage_names[1], (hybrid_on_cpu(opt.hybrid, 1) ? "cpu" : "gpu"), fc1.opt.algo_s);
+      hbuf.init(lgr);
+    }
+#if __CUDACC__
+    n_step_graphs = 0;
+    if (opt.cuda_algo && opt.cuda_exec) {
+      launch_sync = 0;
+    }
+#if !defined(CUDA_API_PER_THREAD_DEFAULT_STREAM)
+    if (opt.cuda_algo && opt.cuda_exec == 2) {
+      fprintf(stderr, "error: --cuda-exec 2 needs a build with --default-stream per-thread\n");
+      exit(1);
+    }
+#endif
+#endif
+  }
+  /**
+     @brief give the profiler names of layers, so the kernel profile
+     shows them (e.g., "conv1 Convolution2D::forward")
+  */
+  void name_layers() {
+    lgr->prof.name(&conv1, "conv1");
+    lgr->prof.name(&relu1, "relu1");
+    lgr->prof.name(&conv2, "conv2");
+    lgr->prof.name(&relu2, "relu2");
+    lgr->prof.name(&max_pooling_2d, "max_pooling_2d");
+    lgr->prof.name(&dropout1, "dropout1");
+    lgr->prof.name(&fc1, "fc1");
+    lgr->prof.name(&relu3, "relu3");
+    lgr->prof.name(&dropout2, "dropout2");
+    lgr->prof.name(&fc2, "fc2");
+    lgr->prof.name(&nll_softmax, "nll_softmax");
+    lgr->prof.name(&fused, "fused");
+  }
+  /**
+     @brief plan memory of work buffers and activations/gradients
+     @param (cfg) configuration parameters
+     @details steps are numbered as forward of the k-th layer (from 0)
+     = k and backward of it = 21 - k.  work buffers of each
+     layer (e.g., im2col matrices) are live only while the layer
+     runs, so they are put in a single arena (scratch) and share
+     memory.  activations (y), gradients (gx) and the states
+     kept from forward to backward (e.g., argmax of pooling) are
+     planned for the actual batch size in another arena (act), where
+     they share memory according to their lifetimes and in-place
+     relu/dropout (--inplace) share the buffers of their neighbors.
+     with TENSOR_HEAP (builds without CUDA), act is allocated and
+     the layers' tensors use it (attach_activations); CUDA builds
+     keep them embedded in the layers (device shadows copy the
+     entire layers) and only log the plan.  the size of separate
+     buffers without in-place layers is logged for comparison.
+  */
+  void plan_memory(MNISTCfg cfg) {
+    const int last = 21;
+    scratch.init();
+    conv1.plan_scratch(scratch, "conv1", arena_t::steps(0, 0) | arena_t::steps(last, last));
+    conv2.plan_scratch(scratch, "conv2", arena_t::steps(2, 2) | arena_t::steps(last - 2, last - 2));
+    fused.plan_scratch(scratch, "fused", arena_t::steps(last - 2, last - 2));
+    scratch.plan();
+    scratch.alloc(opt.numa && !opt.cuda_algo);
+    conv1.attach_scratch(scratch);
+    conv2.attach_scratch(scratch);
+    fused.attach_scratch(scratch);
+    scratch.log(lgr, "scratch");
+
+    (void)cfg;
+    const idx_t B = min_i(maxB, opt.batch_size);
+    arena_layer_t L[11];
+    int yb[11], gb[11], ab[11];
+    act.init();
+    arena_add_chain(act, L, layer_chain(L, B, 1), yb, gb, ab);
+    act.plan();
+#if TENSOR_HEAP
+    act.alloc(opt.numa);
+    attach_activations(yb, gb, ab, B);
+#endif
+    act.log(lgr, "activations");
+    arena_t sep;
+    sep.init();
+    arena_add_chain(sep, L, layer_chain(L, B, 0));
+    lgr->log(1, "activations: batch size %ld, %ld bytes %s,"
+             " %ld bytes as separate buffers without in-place layers",
+             (long)B, (long)act.peak, (act.slab ? "allocated" : "planned"), (long)sep.naive());
+  }
+#if TENSOR_HEAP
+  /**
+     @brief let outputs, gradients and states of layers use the
+     buffers of act for B rows
+     @param (yb) the buffers of the outputs of the layers of layer_chain
+     @param (gb) the buffers of the gradients wrt their inputs
+     @param (ab) the buffers of their states
+     @param (B) the batch size
+     @details an in-place layer gets the buffers of its neighbors,
+     which is what its forward and backward return.  under --fuse 1,
+     fused computes into dropout1.y, conv2.gx and the state of
+     max_pooling_2d (y and argmax), and the tensors of the layers it
+     replaces get no memory
+  */
+  void attach_activations(int * yb, int * gb, int * ab, idx_t B) {
+    int k = 0;
+    arena_attach(conv1.y, act, yb[k], 0, B);
+    arena_attach(conv1.gx, act, gb[k], 0, B);
+    k++;
+    arena_attach(relu1.y, act, yb[k], 0, B);
+    arena_attach(relu1.gx, act, gb[k], 0, B);
+    k++;
+    if (opt.fuse && !opt.cuda_algo) {
+      arena_attach(dropout1.y, act, yb[k], 0, B);
+      arena_attach(conv2.gx, act, gb[k], 0, B);
+      attach_pooling_state(ab[k], 1, B);
+      k++;
+      conv2.y.attach(0, 0);
+      relu2.y.attach(0, 0);
+      relu2.gx.attach(0, 0);
+      max_pooling_2d.gx.attach(0, 0);
+      dropout1.gx.attach(0, 0);
+    } else {
+      arena_attach(conv2.y, act, yb[k], 0, B);
+      arena_attach(conv2.gx, act, gb[k], 0, B);
+      k++;
+      arena_attach(relu2.y, act, yb[k], 0, B);
+      arena_attach(relu2.gx, act, gb[k], 0, B);
+      k++;
+      arena_attach(max_pooling_2d.y, act, yb[k], 0, B);
+      arena_attach(max_pooling_2d.gx, act, gb[k], 0, B);
+      attach_pooling_state(ab[k], 0, B);
+      k++;
+      arena_attach(dropout1.y, act, yb[k], 0, B);
+      arena_attach(dropout1.gx, act, gb[k], 0, B);
+      k++;
+    }
+    arena_attach(fc1.y, act, yb[k], 0, B);
+    arena_attach(fc1.gx, act, gb[k], 0, B);
+    k++;
+    arena_attach(relu3.y, act, yb[k], 0, B);
+    arena_attach(relu3.gx, act, gb[k], 0, B);
+    k++;
+    arena_attach(dropout2.y, act, yb[k], 0, B);
+    arena_attach(dropout2.gx, act, gb[k], 0, B);
+    k++;
+    arena_attach(fc2.y, act, yb[k], 0, B);
+    arena_attach(fc2.gx, act, gb[k], 0, B);
+    k++;
+    arena_attach(nll_softmax.y, act, yb[k], 0, B);
+    arena_attach(nll_softmax.gx, act, gb[k], 0, B);
+    arena_attach(nll_softmax.l, act, ab[k], 0, B);
+    k++;
+  }
+  /**
+     @brief let the state of max_pooling_2d (argmax_i and argmax_j,
+     preceded by y under --fuse 1) use buffer i of act
+     @param (i) the buffer
+     @param (with_y) 1 if y is a part of the state (fused)
+     @param (B) the batch size
+  */
+  void attach_pooling_state(int i, int with_y, idx_t B) {
+    size_t off = 0;
+    if (with_y) {
+      arena_attach(max_pooling_2d.y, act, i, off, B);
+      off += max_pooling_2d.y.bytes(B);
+    }
+    arena_attach(max_pooling_2d.argmax_i, act, i, off, B);
+    off += max_pooling_2d.argmax_i.bytes(B);
+    arena_attach(max_pooling_2d.argmax_j, act, i, off, B);
+  }
+#endif
+  /**
+     @brief first touch activations and gradients (--numa 1)
+     @details the rows of the batch size of outputs (y), gradients
+     wrt inputs (gx) and other per-sample state are zeroed by the
+     threads in the partitioning the compute loops use
+     (numa_first_touch_rows), so each thread's chunk is on its node
+     (act.alloc first touches those in act by equal chunks).
+     weights and their gradients are left where init put them;
+     they are not partitioned by samples
+  */
+  void first_touch() {
+    const idx_t B = min_i(maxB, opt.batch_size);
+    numa_first_touch_rows(x, B);
+    numa_first_touch_rows(x_blk, B);
+    /* those in act were first touched by act.alloc */
+    if (!act.slab) {
+      numa_first_touch_rows(conv1.y, B);
+      numa_first_touch_rows(conv1.gx, B);
+      numa_first_touch_rows(relu1.y, B);
+      numa_first_touch_rows(relu1.gx, B);
+      numa_first_touch_rows(conv2.y, B);
+      numa_first_touch_rows(conv2.gx, B);
+      numa_first_touch_rows(relu2.y, B);
+      numa_first_touch_rows(relu2.gx, B);
+      numa_first_touch_rows(max_pooling_2d.y, B);
+      numa_first_touch_rows(max_pooling_2d.argmax_i, B);
+      numa_first_touch_rows(max_pooling_2d.argmax_j, B);
+      numa_first_touch_rows(max_pooling_2d.gx, B);
+      numa_first_touch_rows(dropout1.y, B);
+      numa_first_touch_rows(dropout1.gx, B);
+      numa_first_touch_rows(fc1.y, B);
+      numa_first_touch_rows(fc1.gx, B);
+      numa_first_touch_rows(relu3.y, B);
+      numa_first_touch_rows(relu3.gx, B);
+      numa_first_touch_rows(dropout2.y, B);
+      numa_first_touch_rows(dropout2.gx, B);
+      numa_first_touch_rows(fc2.y, B);
+      numa_first_touch_rows(fc2.gx, B);
+      numa_first_touch_rows(nll_softmax.y, B);
+      numa_first_touch_rows(nll_softmax.l, B);
+      numa_first_touch_rows(nll_softmax.gx, B);
+    }
+    lgr->log(1, "numa: activations and gradients of batch size %ld first touched by %d threads",
+             (long)B, numa_n_threads());
+  }
+  /**
+     @brief describe the layers as a chain for arena_add_chain
+     @param (L) the array to which the layers are written
+     @param (B) the batch size
+     @param (use_inplace) 0 to ignore in-place flags of layers
+     @returns the number of layers
+  */
+  int layer_chain(arena_layer_t * L, idx_t B, int use_inplace) {
+    const int fuse = opt.fuse && !opt.cuda_algo;
+    const int ip_r1 = use_inplace && relu1.inplace;
+    const int ip_r2 = use_inplace && relu2.inplace;
+    const int ip_r3 = use_inplace && relu3.inplace;
+    const int ip_d1 = use_inplace && dropout1.inplace;
+    const int ip_d2 = use_inplace && dropout2.inplace;
+    int n = 0;
+    /* name, y, gx, aux, backward reads x, backward reads y, in-place */
+    L[n++] = { "conv1", B * sizeof(conv1.y.w[0]), B * sizeof(conv1.gx.w[0]), 0, 1, 0, 0 };
+    L[n++] = { "relu1", B * sizeof(relu1.y.w[0]), B * sizeof(relu1.gx.w[0]), 0, !ip_r1, ip_r1, ip_r1 };
+    if (fuse) {
+      L[n++] = { "fused", B * sizeof(dropout1.y.w[0]), B * sizeof(conv2.gx.w[0]),
+                 B * (sizeof(max_pooling_2d.y.w[0]) + sizeof(max_pooling_2d.argmax_i.w[0])
+                      + sizeof(max_pooling_2d.argmax_j.w[0])), 1, 0, 0 };
+    } else {
+      L[n++] = { "conv2", B * sizeof(conv2.y.w[0]), B * sizeof(conv2.gx.w[0]), 0, 1, 0, 0 };
+      L[n++] = { "relu2", B * sizeof(relu2.y.w[0]), B * sizeof(relu2.gx.w[0]), 0, !ip_r2, ip_r2, ip_r2 };
+      L[n++] = { "max_pooling_2d", B * sizeof(max_pooling_2d.y.w[0]), B * sizeof(max_pooling_2d.gx.w[0]),
+                 B * (sizeof(max_pooling_2d.argmax_i.w[0]) + sizeof(max_pooling_2d.argmax_j.w[0])), 0, 0, 0 };
+      L[n++] = { "dropout1", B * sizeof(dropout1.y.w[0]), B * sizeof(dropout1.gx.w[0]), 0, 0, 0, ip_d1 };
+    }
+    L[n++] = { "fc1", B * sizeof(fc1.y.w[0]), B * sizeof(fc1.gx.w[0]), 0, 1, 0, 0 };
+    L[n++] = { "relu3", B * sizeof(relu3.y.w[0]), B * sizeof(relu3.gx.w[0]), 0, !ip_r3, ip_r3, ip_r3 };
+    L[n++] = { "dropout2", B * sizeof(dropout2.y.w[0]), B * sizeof(dropout2.gx.w[0]), 0, 0, 0, ip_d2 };
+    L[n++] = { "fc2", B * sizeof(fc2.y.w[0]), B * sizeof(fc2.gx.w[0]), 0, 1, 0, 0 };
+    L[n++] = { "nll_softmax", B * sizeof(nll_softmax.y.w[0]), B * sizeof(nll_softmax.gx.w[0]),
+               B * sizeof(nll_softmax.l.w[0]), 0, 1, 0 };
+    return n;
   }
   /**
      @brief set the device pointer for this and all subobjects
@@ -110,6 +543,7 @@ struct MNIST {
 #if __CUDACC__
     this->dev = dev;
     x.set_dev(dev ? &dev->x : 0);
+    x_blk.set_dev(dev ? &dev->x_blk : 0);
     t.set_dev(dev ? &dev->t : 0);
     idxs.set_dev(dev ? &dev->idxs : 0);
     pred.set_dev(dev ? &dev->pred : 0);
@@ -142,10 +576,120 @@ struct MNIST {
      @sa backward
   */
   void update() {
-    conv1.update();
-    conv2.update();
-    fc1.update();
-    fc2.update();
+    if (opt.hybrid) {
+      update_hybrid();
+    } else if (update_each()) {
+      conv1.update();
+      conv2.update();
+      fc1.update();
+      fc2.update();
+    } else {
+      update_multi();
+    }
+  }
+  /**
+     @brief 1 if layers update their weights one by one, 0 if all in
+     one go (update_multi)
+     @details the baselines keep their own updates and cpu_winograd
+     conv layers transform weights after their updates; under --algo
+     auto (or --hybrid, which may put them on the CPU), it is the
+     algorithms of conv layers that matter
+  */
+  int update_each() {
+    switch (opt.algo) {
+    case algo_cpu_base:
+    case algo_cuda_base:
+    case algo_cpu_winograd:     // conv layers transform weights after update
+      return 1;
+    default:
+      return (conv1.opt.algo == algo_cpu_winograd || conv2.opt.algo == algo_cpu_winograd);
+    }
+  }
+  /**
+     @brief add weights and biases of the layers of a stage of
+     --hybrid to l, with addresses of the device the stage runs on
+     @param (l) the list to add them to
+     @param (stage) 0 : conv1 and conv2, 1 : fc1 and fc2
+  */
+  void add_stage_params(ada_delta_list& l, int stage) {
+    const int cuda = !hybrid_on_cpu(opt.hybrid, stage);
+    if (stage == 0) {
+      conv1.add_params(l, cuda);
+      conv2.add_params(l, cuda);
+    } else {
+      fc1.add_params(l, cuda);
+      fc2.add_params(l, cuda);
+    }
+  }
+  /**
+     @brief update under --hybrid: the stage on the GPU first, so
+     that its update runs (queued, with --cuda-exec 1) while the CPU
+     updates the weights of the other stage
+  */
+  void update_hybrid() {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    const int first = (hybrid_on_cpu(opt.hybrid, 0) ? 1 : 0);
+    for (int k = 0; k < 2; k++) {
+      const int stage = (k == 0 ? first : 1 - first);
+      hmeter.begin(4 + stage, stage);
+      if (update_each()) {
+        if (stage == 0) {
+          conv1.update();
+          conv2.update();
+        } else {
+          fc1.update();
+          fc2.update();
+        }
+      } else {
+        ada_delta_list l;
+        l.init();
+        add_stage_params(l, stage);
+        if (hybrid_on_cpu(opt.hybrid, stage)) {
+          l.update_cpu();
+        } else {
+          l.update_cuda();
+        }
+      }
+      hmeter.end(4 + stage, stage);
+    }
+    tsc_t t1 = get_tsc();
+    log_end_fun(lgr, t0, t1);
+  }
+  /**
+     @brief add weights and biases of all layers (conv1, conv2, fc1, fc2) to l
+     @param (l) the list to add them to
+     @param (cuda) 1 if device addresses are added
+  */
+  void add_params(ada_delta_list& l, int cuda) {
+    conv1.add_params(l, cuda);
+    conv2.add_params(l, cuda);
+    fc1.add_params(l, cuda);
+    fc2.add_params(l, cuda);
+  }
+  /**
+     @brief update all weights in one go (multi-tensor apply)
+     @details the weights and biases of conv1, conv2, fc1 and fc2
+     are put in a single list and updated in one OpenMP parallel
+     region (CPU) or one kernel launch (CUDA), instead of a
+     parallel region or launch per tensor
+     @sa ada_delta_list
+  */
+  void update_multi() {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    ada_delta_list l;
+    l.init();
+    add_params(l, opt.cuda_algo);
+    if (opt.cuda_algo) {
+      l.update_cuda();
+    } else {
+      l.update_cpu();
+    }
+    tsc_t t1 = get_tsc();
+    log_end_kernel(lgr, t0, t1, prof_update, 0,
+                   10.0 * l.begin[l.n],
+                   7.0 * sizeof(real) * l.begin[l.n]);
   }
   /**
      @brief forward phase of the network
@@ -160,18 +704,59 @@ struct MNIST {
      @sa update
   */
   tensor<real,maxB>& forward(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t, int training) {
-    tensor<real,maxB,C1,H1,W1>& x1  = conv1.forward(x, training);
+    hmeter.begin(0, 0);
+    tensor<real,maxB,C2,H3,W3>& x6  = conv_stage(x, training);
+    hmeter.end(0, 0);
+    hybrid_cross(x6, 1);
+    hmeter.begin(1, 1);
+    tensor<real,maxB,nC>&       x10 = fc_stage(x6, training);
+    tensor<real,maxB>&          l   = nll_softmax.forward(x10, t, training);
+    hmeter.end(1, 1);
+    return l;
+  }
+  /**
+     @brief forward phase of the network up to the last linear layer (fc2)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @returns the scores of classes for each image (before log softmax)
+     @details it needs no labels; infer uses it alone
+     @sa forward
+  */
+  tensor<real,maxB,nC>& logits(tensor<real,maxB,C,H,W>& x, int training) {
+    return fc_stage(hybrid_cross(conv_stage(x, training), 1), training);
+  }
+  /**
+     @brief forward of conv1 .. dropout1 (stage 0 of --hybrid)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @returns the output of dropout1
+  */
+  tensor<real,maxB,C2,H3,W3>& conv_stage(tensor<real,maxB,C,H,W>& x, int training) {
+    tensor<real,maxB,C1,H1,W1>& x1  = conv1.forward(to_layout(x), training);
     tensor<real,maxB,C1,H1,W1>& x2  = relu1.forward(x1, training);
-    tensor<real,maxB,C2,H2,W2>& x3  = conv2.forward(x2, training);
-    tensor<real,maxB,C2,H2,W2>& x4  = relu2.forward(x3, training);
-    tensor<real,maxB,C2,H3,W3>& x5  = max_pooling_2d.forward(x4, training);
-    tensor<real,maxB,C2,H3,W3>& x6  = dropout1.forward(x5, training);
+    tensor<real,maxB,C2,H3,W3>* x6_ptr;
+    if (opt.fuse && !opt.cuda_algo) {
+      x6_ptr = &fused.forward(conv2, max_pooling_2d, dropout1, x2, training);
+    } else {
+      tensor<real,maxB,C2,H2,W2>& x3  = conv2.forward(x2, training);
+      tensor<real,maxB,C2,H2,W2>& x4  = relu2.forward(x3, training);
+      tensor<real,maxB,C2,H3,W3>& x5  = max_pooling_2d.forward(x4, training);
+      x6_ptr = &dropout1.forward(x5, training);
+    }
+    return *x6_ptr;
+  }
+  /**
+     @brief forward of fc1 .. fc2 (stage 1 of --hybrid, but the loss)
+     @param (x6) the output of dropout1 (conv_stage)
+     @param (training) 1 if it is called in training not testing
+     @returns the scores of classes for each image (before log softmax)
+  */
+  tensor<real,maxB,nC>& fc_stage(tensor<real,maxB,C2,H3,W3>& x6, int training) {
     tensor<real,maxB,nF>&       x7  = fc1.forward(x6, training);
     tensor<real,maxB,nF>&       x8  = relu3.forward(x7, training);
     tensor<real,maxB,nF>&       x9  = dropout2.forward(x8, training);
     tensor<real,maxB,nC>&       x10 = fc2.forward(x9, training);
-    tensor<real,maxB>&          l   = nll_softmax.forward(x10, t, training);
-    return l;
+    return x10;
   }
   /**
      @brief calc the gradient of loss wrt the input (x)
@@ -190,38 +775,331 @@ struct MNIST {
      @sa update
   */
   tensor<real,maxB,C,H,W>& backward(tensor<real,maxB>& gl, tensor<idx_t,maxB>& t) {
+    hmeter.begin(2, 1);
     tensor<real,maxB,nC>&       gx10 = nll_softmax.backward(gl, t);
     tensor<real,maxB,nF>&       gx9  = fc2.backward(gx10);
+    grads_ready(0);
     tensor<real,maxB,nF>&       gx8  = dropout2.backward(gx9);
     tensor<real,maxB,nF>&       gx7  = relu3.backward(gx8);
     tensor<real,maxB,C2,H3,W3>& gx6  = fc1.backward(gx7);
-    tensor<real,maxB,C2,H3,W3>& gx5  = dropout1.backward(gx6);
-    tensor<real,maxB,C2,H2,W2>& gx4  = max_pooling_2d.backward(gx5);
-    tensor<real,maxB,C2,H2,W2>& gx3  = relu2.backward(gx4);
-    tensor<real,maxB,C1,H1,W1>& gx2  = conv2.backward(gx3);
+    grads_ready(1);
+    hmeter.end(2, 1);
+    hybrid_cross(gx6, 0);
+    hmeter.begin(3, 0);
+    tensor<real,maxB,C1,H1,W1>* gx2_ptr;
+    if (opt.fuse && !opt.cuda_algo) {
+      gx2_ptr = &fused.backward(conv2, max_pooling_2d, dropout1, gx6);
+    } else {
+      tensor<real,maxB,C2,H3,W3>& gx5  = dropout1.backward(gx6);
+      tensor<real,maxB,C2,H2,W2>& gx4  = max_pooling_2d.backward(gx5);
+      tensor<real,maxB,C2,H2,W2>& gx3  = relu2.backward(gx4);
+      gx2_ptr = &conv2.backward(gx3);
+    }
+    grads_ready(2);
+    tensor<real,maxB,C1,H1,W1>& gx2  = *gx2_ptr;
     tensor<real,maxB,C1,H1,W1>& gx1  = relu1.backward(gx2);
-    tensor<real,maxB,C,H,W>&    gx   = conv1.backward(gx1);
+    tensor<real,maxB,C,H,W>&    gx   = from_layout(conv1.backward(gx1));
+    grads_ready(3);
+    hmeter.end(3, 0);
     return gx;
   }
+  /**
+     @brief under --hybrid, move a tensor passed between the two
+     stages (the output of dropout1 or the gradient wrt it) to the
+     device of stage
+     @param (a) the tensor
+     @param (stage) the stage that reads it next
+     @returns a
+     @details only the live rows move (to_dev and to_host of
+     tensor.h); the copy waits for the kernels that wrote a, if on
+     the GPU.  without --hybrid, it does nothing
+  */
+  template<typename T>
+  T& hybrid_cross(T& a, int stage) {
+    if (opt.hybrid) {
+      if (hybrid_on_cpu(opt.hybrid, stage)) {
+        to_host(&a, 1);
+      } else {
+        to_dev(&a, 1);
+      }
+    }
+    return a;
+  }
+  /**
+     @brief input images in the layout the layers work on
+     @param (x) input images in the standard layout
+     @details under algorithms in the blocked layout (algo_is_blocked),
+     layers pass their outputs to the next one as they are; this is
+     the only reorder in the network, and with a single input channel
+     (as in MNIST) there is nothing to reorder
+     @sa from_layout
+  */
+  tensor<real,maxB,C,H,W>& to_layout(tensor<real,maxB,C,H,W>& x) {
+    if (!algo_is_blocked(opt.algo) || tensor<real,maxB,C,H,W>::blk_is_identity()) return x;
+    x.to_blk(x_blk);
+    return x_blk;
+  }
+  /**
+     @brief the gradient wrt the input images in the standard layout
+     @param (gx) the gradient conv1 computed, in the layout of to_layout
+     @details it reuses x_blk, which nobody reads after conv1.backward
+     @sa to_layout
+  */
+  tensor<real,maxB,C,H,W>& from_layout(tensor<real,maxB,C,H,W>& gx) {
+    if (!algo_is_blocked(opt.algo) || tensor<real,maxB,C,H,W>::blk_is_identity()) return gx;
+    x_blk.from_blk(gx);
+    return x_blk;
+  }
+  /**
+     @brief gradients of layers with parameters, in the order backward finishes them
+     @param (l) get the gradients of fc2, fc1, conv2 and conv1 (stages 0, 1, 2 and 3)
+  */
+  void grad_stages(ada_delta_list l[4]) {
+    for (int k = 0; k < 4; k++) l[k].init();
+    fc2.add_params(l[0], opt.cuda_algo);
+    fc1.add_params(l[1], opt.cuda_algo);
+    conv2.add_params(l[2], opt.cuda_algo);
+    conv1.add_params(l[3], opt.cuda_algo);
+  }
+  /**
+     @brief all-reduce gradients with other replicas from now on
+     @param (gs) replicas' gradients (init'ed but empty)
+     @details gradients of fc2, fc1, conv2 and conv1 are added to gs
+     with stages 0, 1, 2 and 3, in the order backward finishes them;
+     backward starts reducing them as it goes (grads_ready) and
+     forward_backward_update waits for them before update
+     @sa grad_sync
+  */
+  void set_grad_sync(grad_sync * gs) {
+    ada_delta_list l[4];
+    grad_stages(l);
+    for (int k = 0; k < 4; k++) {
+      for (int i = 0; i < l[k].n; i++) {
+        gs->add(l[k].items[i].gw, l[k].begin[i + 1] - l[k].begin[i], k);
+      }
+    }
+    gs->plan();
+    gsync = gs;
+  }
+  /**
+     @brief accumulate gradients over micro batches from now on
+     @param (ga) accumulated gradients (init'ed but empty)
+     @details forward_backward_update updates weights once every
+     ga->steps calls, with the sum of their gradients; replicas
+     all-reduce only the sum (in the last micro batch)
+     @sa grad_accum
+  */
+  void set_grad_accum(grad_accum * ga) {
+    ada_delta_list l[4];
+    grad_stages(l);
+    for (int k = 0; k < 4; k++) {
+      for (int i = 0; i < l[k].n; i++) {
+        ga->add(l[k].items[i].gw, l[k].begin[i + 1] - l[k].begin[i], k);
+      }
+    }
+    ga->plan();
+    gacc = ga;
+  }
+  /**
+     @brief tell gacc and gsync (if any) that backward has finished stage
+     @sa set_grad_sync
+     @sa set_grad_accum
+  */
+  void grads_ready(int stage) {
+    if (gacc) gacc->ready(stage);
+    if (gsync && (!gacc || gacc->last())) gsync->ready(stage);
+  }
+  /**
+     @brief sum gradients of replicas (if any) and update, unless
+     gradients are accumulated and more micro batches are to come
+  */
+  void finish_step() {
+    if (!gacc || gacc->last()) {
+      if (gsync) gsync->finish();
+      update();
+    }
+    if (gacc) gacc->next();
+  }
+  /**
+     @brief update with micro batches accumulated so far, if any
+     (an epoch whose batches are not a multiple of --accum-steps)
+     @sa set_grad_accum
+  */
+  void flush_grad_accum() {
+    if (!gacc || !gacc->flush()) return;
+    if (gsync) gsync->finish();
+    update();
+  }
+  /**
+     @brief log the busy time and the occupancy of each stage of
+     --hybrid since the last report (nothing without --hybrid)
+     @param (phase) e.g., "Train Epoch"
+     @param (epoch) the epoch
+  */
+  void hybrid_report(const char * phase, long epoch) {
+    hmeter.log(phase, epoch);
+  }
+  /**
+     @brief add weights, biases and optimizer states of all layers to a checkpoint
+  */
+  void add_state(checkpoint_list& l) {
+    conv1.add_state(l, "conv1");
+    conv2.add_state(l, "conv2");
+    fc1.add_state(l, "fc1");
+    fc2.add_state(l, "fc2");
+  }
+  /**
+     @brief save a checkpoint (weights and optimizer states of all layers)
+     @param (path) the file name
+     @param (epoch) the number of epochs trained
+     @details they are taken from the device under CUDA algorithms
+     (after hybrid_sync under --hybrid)
+     @sa checkpoint_list::save
+  */
+  void save(const char * path, long epoch) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    hybrid_sync(1);
+    checkpoint_list l;
+    l.init(opt.cuda_algo);
+    add_state(l);
+    l.save(path, epoch);
+    tsc_t t1 = get_tsc();
+    log_end_fun(lgr, t0, t1);
+    lgr->log(1, "saved a checkpoint of epoch %ld to %s", epoch, path);
+  }
+  /**
+     @brief load a checkpoint saved by save
+     @param (path) the file name
+     @returns the number of epochs trained recorded in it
+     @details call it after to_dev; under CUDA algorithms, tensors
+     are copied from the mapped file straight to the device shadows.
+     it exits if the checkpoint is not of this network
+     @sa checkpoint_list::load
+  */
+  long load(const char * path) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    checkpoint_list l;
+    l.init(opt.cuda_algo);
+    add_state(l);
+    long epoch = l.load(path);
+    hybrid_sync(0);
+    if (!conv1.opt.cuda_algo) {
+      conv1.weights_changed();
+      conv2.weights_changed();
+    }
+    tsc_t t1 = get_tsc();
+    log_end_fun(lgr, t0, t1);
+    lgr->log(1, "loaded a checkpoint of epoch %ld from %s in %ld ns", epoch, path, t1.ns - t0.ns);
+    return epoch;
+  }
+  /**
+     @brief under --hybrid, copy the layers with weights of the stage
+     on the CPU to their device shadows (to_dev = 1) or back (to_dev = 0)
+     @details the stage on the CPU updates its weights (and optimizer
+     states) on the host, while checkpoints and snapshots
+     (copy_weights_from) of CUDA algorithms take them from the device
+     shadows of all layers; save (and copy_weights_from) send them
+     to the device first and load brings them back.  the layers go
+     whole, as to_dev of the network does.  without --hybrid, it
+     does nothing
+  */
+  void hybrid_sync(int to_dev_) {
+    if (!opt.hybrid) return;
+    if (hybrid_on_cpu(opt.hybrid, 0)) {
+      if (to_dev_) {
+        to_dev(&conv1, 1);
+        to_dev(&conv2, 1);
+      } else {
+        to_host(&conv1, 1);
+        to_host(&conv2, 1);
+      }
+    } else {
+      if (to_dev_) {
+        to_dev(&fc1, 1);
+        to_dev(&fc2, 1);
+      } else {
+        to_host(&fc1, 1);
+        to_host(&fc2, 1);
+      }
+    }
+  }
+  /**
+     @brief a hash of all weights (to check replicas agree)
+  */
+  unsigned long weight_digest() {
+    ada_delta_list l;
+    l.init();
+    add_params(l, opt.cuda_algo);
+    unsigned long h = 14695981039346656037UL;
+    for (int i = 0; i < l.n; i++) {
+      h = dp_digest(l.items[i].w, l.begin[i + 1] - l.begin[i], opt.cuda_algo, h);
+    }
+    return h;
+  }
   /**
      @brief write the predicted class of all samples of the batch into pred
      @param (pred) the vector to which the predicted classes are written to
   */
   void predict(tensor<idx_t,maxB>& pred) {
     tensor<real,maxB,nC>& y = nll_softmax.y;
-    to_host(&y, opt.cuda_algo);
-    const idx_t B = idxs.n0;
-    pred.set_n0(B);
-    for (idx_t s = 0; s < B; s++) {
-      /* get the prediction from logsoftmax */
-      idx_t pred_class = 0;
-      for (idx_t c = 0; c < nC; c++) {
-        if (y(s,pred_class) < y(s,c)) {
-          pred_class = c;
-        }
-      }
-      pred(s) = pred_class;
+    to_host(&y, nll_softmax.opt.cuda_algo);
+    classify(y, pred);
+  }
+  /**
+     @brief predictions (pred), the sum of losses and the number of
+     correct predictions of the batch forward has just seen
+     @param (t) true labels (with their device shadow under CUDA)
+     @param (with_pred) 1 if pred is needed on the host (log_prediction)
+     @details they are taken where nll_softmax runs (the CPU, if
+     --hybrid 1 puts it there)
+     @sa batch_stats_of
+  */
+  batch_stats_t batch_stats(tensor<idx_t,maxB>& t, int with_pred) {
+    const int cuda = nll_softmax.opt.cuda_algo;
+#if __CUDACC__
+    batch_stats_t * st = (cuda ? &dev->stats : 0);
+#else
+    batch_stats_t * st = 0;
+#endif
+    stats = batch_stats_of(nll_softmax.y, &nll_softmax.l, &t, pred, st, cuda, with_pred);
+    return stats;
+  }
+  /**
+     @brief forward a test batch (training = 0) and take its batch_stats
+     @param (x) input images
+     @param (t) true labels
+     @param (with_pred) 1 if pred is needed on the host (log_prediction)
+     @details under --hybrid, the batch is streamed through the two
+     stages in micro batches (test_batch_hybrid)
+  */
+  batch_stats_t test_batch(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t, int with_pred) {
+    if (opt.hybrid) {
+      return test_batch_hybrid(x, t);
     }
+    forward(x, t, 0);
+    return batch_stats(t, with_pred);
+  }
+  /**
+     @brief predict the classes of images, without labels or the loss
+     @param (x) input images (their device shadow under CUDA algorithms)
+     @param (pred) the vector to which the predicted classes are written to
+     (with a device shadow under CUDA algorithms, e.g., this->pred)
+     @details forward with training = 0 up to fc2 and take the class
+     of the largest score (what log softmax would choose); under CUDA
+     algorithms the classes are taken on the device and only they come back
+     @sa logits
+  */
+  void infer(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& pred) {
+    batch_stats_of<maxB,nC>(logits(x, 0), 0, 0, pred, 0, fc2.opt.cuda_algo, 1);
+  }
+  /**
+     @brief write the class of the largest score of each sample in y into pred
+  */
+  void classify(tensor<real,maxB,nC>& y, tensor<idx_t,maxB>& pred) {
+    pred.set_n0(y.n0);
+    batch_classify(y, pred, 0, 1);
   }
   /**
      @brief write the predicted classes into the log and returns the number
@@ -231,10 +1109,12 @@ struct MNIST {
      @param (pred) the vector of predicted classes for each sample
      the batch
      @param (t) the vector of true labels for each sample
+     @param (idxs) the vector of indexes of samples
   */
   idx_t log_prediction(idx_t start_offset,
-                       tensor<idx_t,maxB>& pred, tensor<idx_t,maxB>& t) {
-    const idx_t B = idxs.n0;
+                       tensor<idx_t,maxB>& pred, tensor<idx_t,maxB>& t,
+                       tensor<idx_t,maxB>& idxs) {
+    const idx_t B = t.n0;
     idx_t correct = 0;
     for (idx_t s = 0; s < B; s++) {
       lgr->log(3, "sample %d image %d pred %d truth %d",
@@ -255,24 +1135,269 @@ struct MNIST {
      @details do everything on a mini-batch. forward calculates the 
      loss wrt x and t; backward calculates the gradient 
      of loss wrt x and weights; update updates weights with the
-     gradients
+     gradients. it returns the sum of losses (batch_stats), which
+     also leaves predictions in pred (on the host if --log-pred 1)
   */
   real forward_backward_update(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t) {
+    if (opt.hybrid) {
+      return forward_backward_update_hybrid(x, t);
+    }
+    if (opt.cuda_algo && opt.cuda_exec) {
+      return forward_backward_update_async(x, t);
+    }
     const idx_t B = x.n0;
     /* forward */
-    tensor<real,maxB>& L = forward(x, t, 1);
-    /* a vector (1,1,1,...) to make the single loss value from loss of each sample */
-    gy.init_const(B, 1.0);
+    forward(x, t, 1);
+    /* a vector (1,1,1,...) to make the single loss value from loss
+       of each sample, times the loss scale (--loss-scale) that
+       optimizers divide gradients by */
+    gy.init_const(B, opt.loss_scale);
     to_dev(&gy, opt.cuda_algo);
     /* backward (set weights of all sublayers) */
     backward(gy, t);
-    /* update */
+    /* sum gradients of all replicas and update (unless more micro batches are to come) */
+    finish_step();
+    /* the sum of losses (and predictions); the loss of each sample stays on the GPU */
+    return batch_stats(t, opt.log_pred).loss;
+  }
+  /**
+     @brief forward_backward_update for --cuda-exec 1 and 2
+     @param (x) input images (a mini batch)
+     @param (t) true labels
+     @details kernels are queued to the (per-thread) default
+     stream without waiting for each (launch_sync = 0), and the
+     host waits only once, when the sum of losses comes back (batch_stats).
+     gy (all loss_scale) is sent only when the batch size changes.
+     with --cuda-exec 2, the kernels of forward, backward and update
+     are captured into a CUDA graph the first time a (x, t, batch size)
+     is seen, and the graph is replayed afterwards (step_graph)
+  */
+  real forward_backward_update_async(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t) {
+#if __CUDACC__
+    const idx_t B = x.n0;
+    if (gy_dev_n0 != B) {
+      gy.init_const(B, opt.loss_scale);
+      to_dev(&gy, opt.cuda_algo);
+      gy_dev_n0 = B;
+    }
+    if (opt.cuda_exec == 2) {
+      check_api_error(cudaGraphLaunch(step_graph(x, t), cudaStreamPerThread));
+    } else {
+      forward(x, t, 1);
+      backward(gy, t);
+      finish_step();
+    }
+    return batch_stats(t, opt.log_pred).loss;
+#else
+    (void)x;
+    (void)t;
+    err_cuda_code_non_cuda_compiler(opt.algo_s);
+    return 0.0;
+#endif
+  }
+  /**
+     @brief forward_backward_update under --hybrid
+     @param (x) input images (a mini batch)
+     @param (t) true labels
+     @details forward, backward and update run each stage on its
+     device (hybrid_place), and the output of dropout1 and the
+     gradient wrt it cross between the stages (hybrid_cross).  with
+     --cuda-exec 1, kernels of the GPU stage are queued without
+     waiting, so the GPU stage's backward and update (--hybrid 1) or
+     update (--hybrid 2) run while the CPU computes.  the time of
+     each stage goes to hmeter (hybrid_report)
+  */
+  real forward_backward_update_hybrid(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t) {
+    tsc_t t0 = get_tsc();
+    const idx_t B = x.n0;
+    if (gy_dev_n0 != B) {
+      gy.init_const(B, opt.loss_scale);
+      to_dev(&gy, nll_softmax.opt.cuda_algo);
+      gy_dev_n0 = B;
+    }
+    forward(x, t, 1);
+    backward(gy, t);
+    finish_step();
+    real L = batch_stats(t, opt.log_pred).loss;
+    hmeter.add_wall(t0, get_tsc());
+    return L;
+  }
+  /**
+     @brief test_batch under --hybrid: stream the batch through the
+     two stages in --hybrid-micro micro batches
+     @param (x) input images (on the host)
+     @param (t) true labels (on the host)
+     @details while one stage works on a micro batch, the other
+     works on another.  the kernels of the GPU stage and the copies
+     between it and the pinned slots of hbuf are queued; the host
+     then computes the CPU stage of the previous (--hybrid 1) or
+     the next (--hybrid 2) micro batch before it waits for them
+     (done).  micro batch j uses slot j % 2, so a slot is reused
+     only after what was queued on it two micro batches ago is done.
+     samples are independent in testing (dropout is the identity),
+     so the sums are those of forward on the whole batch, up to
+     rounding of the loss.  predictions are always on the host
+  */
+  batch_stats_t test_batch_hybrid(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t) {
+#if __CUDACC__
+    tsc_t t0 = get_tsc();
+    const idx_t B = x.n0;
+    const idx_t n = (B + opt.hybrid_micro - 1) / opt.hybrid_micro; /* samples per micro batch */
+    const int M = (B + n - 1) / n;                                  /* the number of micro batches */
+    stats.loss = 0.0;
+    stats.correct = 0;
+    pred.set_n0(B);
+    for (int j = 0; j < M + 2; j++) {
+      const int k = j % 2;
+      if (opt.hybrid == 1) {
+        /* queue conv1 .. dropout1 of j on the GPU, then fc1 .. nll_softmax of j - 1 on the CPU */
+        if (j < M) micro_stage0_gpu(x, t, j * n, min_i(n, B - j * n), k);
+        if (j >= 1 && j - 1 < M) micro_stage1_cpu(1 - k);
+      } else {
+        /* take the results of j - 2 of the GPU, then conv1 .. dropout1
+           of j on the CPU and queue fc1 .. nll_softmax of j on the GPU */
+        if (j >= 2 && j - 2 < M) micro_done(k);
+        if (j < M) micro_stage1_gpu(x, t, j * n, min_i(n, B - j * n), k);
+      }
+    }
+    hmeter.add_wall(t0, get_tsc());
+    return stats;
+#else
+    (void)x;
+    (void)t;
+    err_cuda_code_non_cuda_compiler("test_batch_hybrid");
+    return stats;
+#endif
+  }
+#if __CUDACC__
+  /**
+     @brief put samples [off, off + m) of x and t into slot k of hbuf (on the host)
+  */
+  void micro_fill(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t, idx_t off, idx_t m, int k) {
+    hbuf.off[k] = off;
+    hbuf.xs[k]->set_n0(m);
+    hbuf.ts[k]->set_n0(m);
+    memcpy(&hbuf.xs[k]->w[0], &x.w[off], sizeof(x.w[0]) * m);
+    memcpy(&hbuf.ts[k]->w[0], &t.w[off], sizeof(t.w[0]) * m);
+  }
+  /**
+     @brief add the sums and predictions of the micro batch of slot
+     k to stats and pred
+     @param (y) its log softmax (on the host)
+     @param (l) its losses (on the host)
+  */
+  void micro_stats(tensor<real,maxB,nC>& y, tensor<real,maxB>& l, int k) {
+    tensor<idx_t,maxB>& t = *hbuf.ts[k];
+    tensor<idx_t,maxB> p;
+    batch_stats_t r = batch_stats_of(y, &l, &t, p, 0, 0, 1);
+    stats.loss += r.loss;
+    stats.correct += r.correct;
+    memcpy(&pred.w[hbuf.off[k]], &p.w[0], sizeof(p.w[0]) * t.n0);
+  }
+  /**
+     @brief --hybrid 1: queue conv1 .. dropout1 of samples [off, off
+     + m) on the GPU in slot k, and the copy of its output back to
+     the slot
+  */
+  void micro_stage0_gpu(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t, idx_t off, idx_t m, int k) {
+    micro_fill(x, t, off, m, k);
+    tensor<real,maxB,C,H,W> * xs = hbuf.xs[k];
+    tensor<real,maxB,C2,H3,W3> * ms = hbuf.ms[k];
+    to_dev_async(xs->dev, xs, xs->live_bytes(), cudaStreamPerThread);
+    hmeter.begin(6 + k, 0);
+    tensor<real,maxB,C2,H3,W3>& x6 = conv_stage(*xs, 0);
+    hmeter.end(6 + k, 0);
+    ms->set_n0(m);
+    check_api_error(cudaMemcpyAsync(&ms->w[0], &x6.dev->w[0], sizeof(x6.w[0]) * m,
+                                    cudaMemcpyDeviceToHost, cudaStreamPerThread));
+    check_api_error(cudaEventRecord(hbuf.done[k], cudaStreamPerThread));
+  }
+  /**
+     @brief --hybrid 1: wait for slot k and compute fc1 .. nll_softmax of it on the CPU
+  */
+  void micro_stage1_cpu(int k) {
+    check_api_error(cudaEventSynchronize(hbuf.done[k]));
+    hmeter.begin(1, 1);
+    tensor<real,maxB,nC>& x10 = fc_stage(*hbuf.ms[k], 0);
+    tensor<real,maxB>& l = nll_softmax.forward(x10, *hbuf.ts[k], 0);
+    hmeter.end(1, 1);
+    micro_stats(nll_softmax.y, l, k);
+  }
+  /**
+     @brief --hybrid 2: compute conv1 .. dropout1 of samples [off,
+     off + m) on the CPU in slot k, and queue fc1 .. nll_softmax of
+     it on the GPU and the copy of its results back to the slot
+  */
+  void micro_stage1_gpu(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t, idx_t off, idx_t m, int k) {
+    micro_fill(x, t, off, m, k);
+    tensor<real,maxB,C2,H3,W3> * ms = hbuf.ms[k];
+    tensor<idx_t,maxB> * ts = hbuf.ts[k];
+    hmeter.begin(0, 0);
+    tensor<real,maxB,C2,H3,W3>& x6 = conv_stage(*hbuf.xs[k], 0);
+    hmeter.end(0, 0);
+    ms->set_n0(m);
+    memcpy(&ms->w[0], &x6.w[0], sizeof(x6.w[0]) * m);
+    to_dev_async(ms->dev, ms, ms->live_bytes(), cudaStreamPerThread);
+    to_dev_async(ts->dev, ts, ts->live_bytes(), cudaStreamPerThread);
+    hmeter.begin(6 + k, 1);
+    tensor<real,maxB>& l = nll_softmax.forward(fc_stage(*ms, 0), *ts, 0);
+    hmeter.end(6 + k, 1);
+    hbuf.ys[k]->set_n0(m);
+    hbuf.ls[k]->set_n0(m);
+    check_api_error(cudaMemcpyAsync(&hbuf.ys[k]->w[0], &nll_softmax.y.dev->w[0], sizeof(nll_softmax.y.w[0]) * m,
+                                    cudaMemcpyDeviceToHost, cudaStreamPerThread));
+    check_api_error(cudaMemcpyAsync(&hbuf.ls[k]->w[0], &l.dev->w[0], sizeof(l.w[0]) * m,
+                                    cudaMemcpyDeviceToHost, cudaStreamPerThread));
+    check_api_error(cudaEventRecord(hbuf.done[k], cudaStreamPerThread));
+  }
+  /**
+     @brief --hybrid 2: wait for slot k and take its results
+  */
+  void micro_done(int k) {
+    check_api_error(cudaEventSynchronize(hbuf.done[k]));
+    micro_stats(*hbuf.ys[k], *hbuf.ls[k], k);
+  }
+  /**
+     @brief the CUDA graph of a training step on x and t
+     @param (x) input images (a mini batch)
+     @param (t) true labels
+     @returns an instantiated graph of forward, backward and update
+     @details kernel arguments (addresses of device shadows) are
+     baked into a graph, so a graph is captured for each device shadow
+     of x and t a loader hands out (mnist_loader has a few) and
+     each batch size (the last batch may be smaller).  while
+     capturing, kernels are recorded but not run
+  */
+  cudaGraphExec_t step_graph(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t) {
+    const idx_t B = x.n0;
+    for (int i = 0; i < n_step_graphs; i++) {
+      step_graph_t& g = step_graphs[i];
+      if (g.x == x.dev && g.t == t.dev && g.B == B) {
+        return g.exec;
+      }
+    }
+    if (n_step_graphs == max_step_graphs) {
+      for (int i = 0; i < n_step_graphs; i++) {
+        check_api_error(cudaGraphExecDestroy(step_graphs[i].exec));
+      }
+      n_step_graphs = 0;
+    }
+    cudaGraph_t graph;
+    check_api_error(cudaStreamBeginCapture(cudaStreamPerThread, cudaStreamCaptureModeThreadLocal));
+    forward(x, t, 1);
+    backward(gy, t);
     update();
-    /* get the loss of each sample back to host if we are working on GPU */
-    to_host(&L, opt.cuda_algo);
-    double Lsum = gy.dot(L);
-    return Lsum;
+    check_api_error(cudaStreamEndCapture(cudaStreamPerThread, &graph));
+    step_graph_t& g = step_graphs[n_step_graphs++];
+    g.x = x.dev;
+    g.t = t.dev;
+    g.B = B;
+    check_api_error(cudaGraphInstantiateWithFlags(&g.exec, graph, 0));
+    check_api_error(cudaGraphDestroy(graph));
+    lgr->log(2, "captured a training step for batch size %ld into a CUDA graph", (long)B);
+    return g.exec;
   }
+#endif
   /* member functions below assume data are on the host.
      they are only for checking (debugging) implementations */
   /**
@@ -360,17 +1485,26 @@ int mnist_main(int argc, char ** argv) {
   long seed2 = opt.dropout_seed_2;
   MNISTCfg cfg = {
     .conv1 = {},
-    .relu1 = {},
+    .relu1 = { .inplace = opt.inplace },
     .conv2 = {},
-    .relu2 = {},
+    .relu2 = { .inplace = opt.inplace },
     .max_pooling_2d = {},
-    .dropout1 = { .ratio = 0.25f * (seed1 != 0), .seed = seed1 },
+    .dropout1 = { .ratio = 0.25f * (seed1 != 0), .seed = seed1, .inplace = opt.inplace },
     .fc1 = {},
-    .relu3 = {},
-    .dropout2 = { .ratio =  0.5f * (seed2 != 0), .seed = seed2 },
+    .relu3 = { .inplace = opt.inplace },
+    .dropout2 = { .ratio =  0.5f * (seed2 != 0), .seed = seed2, .inplace = opt.inplace },
     .fc2 = {},
     .nll_softmax = {}
   };
+  if (strlen(opt.bench)) {
+    int r = bench_layer_loss<MNIST<maxB,C,H,W,nC>,
+                             tensor<real,maxB,C,H,W>,
+                             tensor<idx_t,maxB>,
+                             tensor<real,maxB>,
+                             MNISTCfg>(opt, &lgr, rg, cfg, "mnist", maxB, nC);
+    lgr.end_log();
+    return r;
+  }
   for (int iter = 0; iter < n_checks; iter++) {
     printf("==== %d ====\n", iter);
     double e = grad_check_loss<MNIST<maxB,C,H,W,nC>,
@@ -384,6 +1518,6 @@ int mnist_main(int argc, char ** argv) {
   printf("max relative error = %.9f\n", max_e);
   printf("avg relative error = %.9f\n", sum_e / n_checks);
   lgr.end_log();
-  return 0;
+  return grad_check_verdict(opt, max_e);
 }
 
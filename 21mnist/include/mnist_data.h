@@ -6,8 +6,11 @@
 #pragma once
 
 #include <err.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include "mnist_util.h"
 #include "tensor.h"
@@ -90,102 +93,273 @@ static pascal_vincent read_pascal_vincent_format(const char * path) {
 }
 
 /**
-   @brief a single training datum + label
-   @param (IC) channels
-   @param (H) height
-   @param (W) width
- */
+   @brief header of a dataset cache file
+   @details a cache file is this header, followed by n labels
+   (unsigned char) at labels_off and n normalized images
+   (n x IC x H x W reals) at imgs_off.  both offsets are multiples of
+   64.  the fields after magic identify the data it was made from;
+   a cache whose fields do not match is rebuilt
+*/
+struct mnist_cache_header {
+  char magic[8];                /**< "MNISTDS2" */
+  int32_t real_sz;              /**< sizeof(real) */
+  int32_t IC;                   /**< channels */
+  int32_t H;                    /**< height */
+  int32_t W;                    /**< width */
+  int64_t n;                    /**< the number of images */
+  double mean;                  /**< mean subtracted from pixels */
+  double std;                   /**< std pixels are divided by */
+  int64_t src_sz;               /**< size of the images file */
+  int64_t src_mtime;            /**< modification time of the images file */
+  int64_t labels_sz;            /**< size of the labels file */
+  int64_t labels_mtime;         /**< modification time of the labels file */
+  int64_t labels_off;           /**< offset of the labels */
+  int64_t imgs_off;             /**< offset of the images */
+};
 
-template<idx_t IC,idx_t H,idx_t W>
-struct data_item {
-  int index;                    /**< index in the original file */
-  unsigned char rgb[IC][H][W];  /**< original pixel values (may be grey scale) */
-  real w[IC][H][W];             /**< pixels of an image */
-  char label;                   /**< true label (0..9) */
-  /**
-     @brief get the (ic,i,j) pixel of the image
-   */
-  real& operator()(idx_t ic, idx_t i, idx_t j) {
-    range_chk(0, ic, IC);
-    range_chk(0, i, H);
-    range_chk(0, j, W);
-    return w[ic][i][j];
+#if __CUDACC__
+/**
+   @brief a global CUDA function gathering images of a mini batch
+   from the dataset on the device
+   @param (x) the device shadow of the mini batch
+   @param (imgs) the images on the device
+   @param (idxs) the device shadow of the indexes of images
+   @param (n) the number of images
+   @details a block copies an image
+*/
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W>
+__global__ void gather_images_global(tensor<real,maxB,IC,H,W> * x, const real * imgs,
+                                     tensor<idx_t,maxB> * idxs, idx_t n) {
+  const idx_t b = blockIdx.x;
+  const long img_sz = IC * H * W;
+  if (b == 0 && threadIdx.x == 0) x->n0 = n;
+  const real * src = imgs + idxs->w[b][0][0][0] * img_sz;
+  real * dst = &x->w[b][0][0][0];
+  for (long k = threadIdx.x; k < img_sz; k += blockDim.x) {
+    dst[k] = src[k];
   }
-};
+}
+#endif
 
 /**
    @brief an entire data
+   @details images are kept already normalized in a single
+   contiguous array, image k at imgs[k * IC * H * W], and labels in
+   another.  load() converts the pascal vincent files once and
+   writes the result to a cache file next to them
+   (e.g., data/train-images-idx3-ubyte.cache); later runs map the
+   cache read-only (mmap) instead of reading and converting the
+   files again, so processes running at the same time share a
+   single copy of the pages.
 */
 template<idx_t maxB,idx_t IC,idx_t H,idx_t W>
 struct mnist_dataset {
-  long cur;
+  long cur;                     /**< the index of the next image to return */
   long n_data;                  /**< the total number of images  */
-  data_item<IC,H,W> * data;     /**< data (n_data items) */
+  const real * imgs;            /**< normalized images (n_data x IC x H x W) */
+  const unsigned char * labels; /**< true labels (0..9) */
+  void * base;                  /**< the mapped cache file or the heap buffer imgs and labels are in */
+  size_t base_sz;               /**< the size of base if it is mapped (0 if on the heap) */
   rnd_gen_t rg; /**< random number generator to pick images for a mini batch  */
+  long * perm;                  /**< the order in which images are returned (n_data indexes) */
+  int shuffle;                  /**< 1 if perm is shuffled at each rewind */
+  int shard;                    /**< this replica takes shard-th of n_shards parts of each batch */
+  int n_shards;                 /**< the number of replicas that share each batch */
+#if __CUDACC__
+  real * imgs_dev;              /**< a copy of imgs on the device (made by to_dev_data) */
+#endif
   
   /**
-     @brief set seed for random number generator
-     @sa (sd) seed
+     @brief set seed for random number generator and turn on shuffling
+     @param (sd) seed (0 : no shuffling)
+     @details call it after load.  from then on, each rewind draws a new
+     permutation of the data with rg, so the order of each epoch
+     depends only on sd and the number of rewinds before it
    */
   void set_seed(long sd) {
     rg.seed(sd);
+    shuffle = (sd != 0);
+  }
+  /**
+     @brief take only a part of each batch (data-parallel training)
+     @param (r) the part this replica takes (0 .. n-1)
+     @param (n) the number of replicas
+     @details from then on, next_indexes still advances by a whole
+     (global) batch of B, but returns only its r-th part of
+     about B/n data.  all replicas must use the same seed (set_seed),
+     so that they agree on batches
+   */
+  void set_shard(int r, int n) {
+    assert(0 <= r && r < n);
+    shard = r;
+    n_shards = n;
+  }
+  /**
+     @brief the header a cache for the images and labels files would have
+     @param (st) stat of the images file
+     @param (lst) stat of the labels file
+     @param (n) the number of images
+  */
+  static mnist_cache_header cache_header(struct stat& st, struct stat& lst,
+                                         long n, real mean, real std) {
+    mnist_cache_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "MNISTDS2", 8);
+    h.real_sz = sizeof(real);
+    h.IC = IC;
+    h.H = H;
+    h.W = W;
+    h.n = n;
+    h.mean = mean;
+    h.std = std;
+    h.src_sz = st.st_size;
+    h.src_mtime = st.st_mtime;
+    h.labels_sz = lst.st_size;
+    h.labels_mtime = lst.st_mtime;
+    h.labels_off = (sizeof(h) + 63) / 64 * 64;
+    h.imgs_off = (h.labels_off + n + 63) / 64 * 64;
+    return h;
+  }
+  /**
+     @brief map a cache file if it exists and matches h
+     @returns 1 if it succeeded
+  */
+  int map_cache(const char * cache_file, mnist_cache_header& h) {
+    int fd = open(cache_file, O_RDONLY);
+    if (fd == -1) return 0;
+    size_t sz = h.imgs_off + sizeof(real) * h.n * IC * H * W;
+    struct stat st;
+    mnist_cache_header g;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size != sz
+        || pread(fd, &g, sizeof(g), 0) != (ssize_t)sizeof(g)
+        || memcmp(&g, &h, sizeof(h)) != 0) {
+      ::close(fd);
+      return 0;
+    }
+    void * p = mmap(0, sz, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return 0;
+    base = p;
+    base_sz = sz;
+    labels = (const unsigned char *)p + h.labels_off;
+    imgs = (const real *)((char *)p + h.imgs_off);
+    return 1;
+  }
+  /**
+     @brief write a buffer to a cache file
+     @details it writes a temporary file and renames it, so that
+     processes starting at the same time never see a partial cache
+     @returns 1 if it succeeded
+  */
+  static int write_cache(const char * cache_file, void * buf, size_t sz) {
+    char tmp[strlen(cache_file) + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d", cache_file, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return 0;
+    size_t w = 0;
+    while (w < sz) {
+      ssize_t r = write(fd, (char *)buf + w, sz - w);
+      if (r <= 0) break;
+      w += r;
+    }
+    int ok = (w == sz);
+    if (::close(fd) == -1) ok = 0;
+    if (ok && rename(tmp, cache_file) == -1) ok = 0;
+    if (!ok) unlink(tmp);
+    return ok;
   }
   /**
      @brief load training/validation data from the file 
      @param (lgr) logger
      @param (data_dir) directory where training/test data files are in
+     @param (max_data) the maximum number of data to use (-1 : all)
+     @param (mean) mean subtracted from pixel values (in [0,1])
+     @param (std) std pixel values are divided by
+     @param (train) 1 for the training data, 0 for the test data
+     @param (use_cache) 1 if the data are read from/written to a cache file
    */
   int load(logger& lgr, const char * data_dir, long max_data,
-           real mean, real std, int train) {
+           real mean, real std, int train, int use_cache) {
     lgr.log(1, "loading data from %s", data_dir);
     long data_dir_len = strlen(data_dir);
     char images_file[data_dir_len + 100];
     char labels_file[data_dir_len + 100];
+    char cache_file[data_dir_len + 100];
     int written = snprintf(images_file, sizeof(images_file),
                            "%s/%s-images-idx3-ubyte", data_dir, (train ? "train" : "t10k"));
     assert(written < (int)sizeof(images_file));
     written = snprintf(labels_file, sizeof(labels_file),
                        "%s/%s-labels-idx1-ubyte", data_dir, (train ? "train" : "t10k"));
     assert(written < (int)sizeof(labels_file));
-    pascal_vincent img_pv = read_pascal_vincent_format(images_file);
-    pascal_vincent label_pv = read_pascal_vincent_format(labels_file);
-    assert(label_pv.n_dims == 1);
-    n_data = label_pv.dim[0];
-    long n_img_dims = img_pv.n_dims;
-    /* 3 : grey scale (n, H, W), 4 : rgb-color (n, 3, H, W) */
-    assert(n_img_dims == 3 || n_img_dims == 4);
-    assert(img_pv.dim[0] == n_data);
-    assert(img_pv.dim[n_img_dims - 2] == H);
-    assert(img_pv.dim[n_img_dims - 1] == W);
-    assert(img_pv.data_sz == n_data * IC * H * W);
-
-    data = new data_item<IC,H,W>[n_data];
-    typedef unsigned char rgb_t[IC][H][W];
-    rgb_t * imgs = (rgb_t *)img_pv.data;
-    char * labels = (char *)label_pv.data;
-
-    for (int k = 0; k < n_data; k++) {
-      data[k].index = k;
-      data[k].label = labels[k];
-      for (idx_t c = 0; c < IC; c++) {
-        for (idx_t i = 0; i < H; i++) {
-          for (idx_t j = 0; j < W; j++) {
-            unsigned char p = imgs[k][c][i][j];
-            data[k].rgb[c][i][j] = p;
-            data[k](c,i,j) = ((p / 255.0) - mean) / std;
-          }
+    written = snprintf(cache_file, sizeof(cache_file), "%s.cache", images_file);
+    assert(written < (int)sizeof(cache_file));
+    struct stat st, lst;
+    if (stat(images_file, &st) == -1) err(1, "%s", images_file);
+    if (stat(labels_file, &lst) == -1) err(1, "%s", labels_file);
+    /* the number of images is in the header of the images file */
+    FILE * fp = fopen(images_file, "rb");
+    if (!fp) err(1, "%s", images_file);
+    (void)read_int32(fp);
+    long n = read_int32(fp);
+    fclose(fp);
+    mnist_cache_header h = cache_header(st, lst, n, mean, std);
+    if (use_cache && map_cache(cache_file, h)) {
+      lgr.log(1, "mapped %s", cache_file);
+    } else {
+      pascal_vincent img_pv = read_pascal_vincent_format(images_file);
+      pascal_vincent label_pv = read_pascal_vincent_format(labels_file);
+      assert(label_pv.n_dims == 1);
+      long n_img_dims = img_pv.n_dims;
+      /* 3 : grey scale (n, H, W), 4 : rgb-color (n, 3, H, W) */
+      assert(n_img_dims == 3 || n_img_dims == 4);
+      assert(label_pv.dim[0] == n);
+      assert(img_pv.dim[0] == n);
+      assert(img_pv.dim[n_img_dims - 2] == H);
+      assert(img_pv.dim[n_img_dims - 1] == W);
+      assert(img_pv.data_sz == n * IC * H * W);
+      /* build the image of the cache file in memory */
+      size_t sz = h.imgs_off + sizeof(real) * n * IC * H * W;
+      char * buf = (char *)aligned_alloc(64, (sz + 63) / 64 * 64);
+      if (!buf) err(1, "aligned_alloc");
+      memset(buf, 0, h.imgs_off);
+      memcpy(buf, &h, sizeof(h));
+      memcpy(buf + h.labels_off, label_pv.data, n);
+      const unsigned char * src = (const unsigned char *)img_pv.data;
+      real * dst = (real *)(buf + h.imgs_off);
+      for (long k = 0; k < n * IC * H * W; k++) {
+        dst[k] = ((src[k] / 255.0) - mean) / std;
+      }
+      free(img_pv.data);
+      delete[] img_pv.dim;
+      free(label_pv.data);
+      delete[] label_pv.dim;
+      if (use_cache && write_cache(cache_file, buf, sz) && map_cache(cache_file, h)) {
+        lgr.log(1, "wrote %s", cache_file);
+        free(buf);
+      } else {
+        if (use_cache) {
+          lgr.log(1, "could not write %s; data are kept in memory", cache_file);
         }
+        base = buf;
+        base_sz = 0;
+        labels = (const unsigned char *)buf + h.labels_off;
+        imgs = (const real *)(buf + h.imgs_off);
       }
     }
-    long n_used_data = (max_data < 0 ? n_data : min_i(n_data, max_data));
-    lgr.log(1, "use %ld data items out of %ld", n_used_data, n_data);
+    long n_used_data = (max_data < 0 ? n : min_i(n, max_data));
+    lgr.log(1, "use %ld data items out of %ld", n_used_data, n);
     n_data = n_used_data;
     cur = 0;
-
-    free(img_pv.data);
-    delete[] img_pv.dim;
-    free(label_pv.data);
-    delete[] label_pv.dim;
+    perm = new long[n_data];
+    for (long k = 0; k < n_data; k++) {
+      perm[k] = k;
+    }
+    shuffle = 0;
+    shard = 0;
+    n_shards = 1;
+#if __CUDACC__
+    imgs_dev = 0;
+#endif
     return 1;
   }
 
@@ -193,50 +367,355 @@ struct mnist_dataset {
      @brief close
    */
   void close() {
-    delete[] data;
-    data = 0;
+    if (base_sz) {
+      munmap(base, base_sz);
+    } else {
+      free(base);
+    }
+    base = 0;
+    base_sz = 0;
+    imgs = 0;
+    labels = 0;
+    delete[] perm;
+    perm = 0;
+#if __CUDACC__
+    if (imgs_dev) {
+      dev_free(imgs_dev);
+      imgs_dev = 0;
+    }
+#endif
+  }
+  /**
+     @brief copy the (used) images to the device once, for get_data_dev
+  */
+  void to_dev_data() {
+#if __CUDACC__
+    if (!imgs_dev) {
+      size_t sz = sizeof(real) * n_data * IC * H * W;
+      imgs_dev = (real *)dev_malloc(sz);
+      ::to_dev(imgs_dev, (void *)imgs, sz);
+    }
+#endif
   }
   
   /**
-     @brief get next batch from the beginning
+     @brief get next batch from the beginning (in a new order if shuffling)
    */
   void rewind() {
     cur = 0;
+    if (shuffle) {
+      /* Fisher-Yates */
+      for (long k = n_data - 1; k > 0; k--) {
+        long j = rg.randi(0, k + 1);
+        long p = perm[k]; perm[k] = perm[j]; perm[j] = p;
+      }
+    }
+  }
+  /**
+     @brief set t and idxs to labels and indexes of the next B data
+     (this replica's part of them; see set_shard)
+     @returns the actual number of data
+     @details the last batch is dropped if it has fewer data than
+     replicas, so that all replicas take the same number of batches
+  */
+  idx_t next_indexes(tensor<idx_t,maxB>& t, tensor<idx_t,maxB>& idxs, idx_t B) {
+    assert(B <= maxB);
+    idx_t global_B = (n_data - cur < B ? n_data - cur : B);
+    if (global_B < n_shards) global_B = 0;
+    const long lo = global_B * shard / n_shards;
+    const long hi = global_B * (shard + 1) / n_shards;
+    idx_t actual_B = hi - lo;
+    t.set_n0(actual_B);
+    idxs.set_n0(actual_B);
+    for (long b = 0; b < actual_B; b++) {
+      long idx = perm[cur + lo + b];
+      idxs(b) = idx;
+      t(b) = labels[idx];
+    }
+    cur += global_B;
+    return actual_B;
   }
   
   /**
      @brief load x and t with the a mini batch of B images
      @param (x) array to load images into
      @param (t) array to load true labels into
+     @param (idxs) array to load indexes of images into
      @param (B) the number of data to get
+     @param (cuda_algo) 1 if x, t and idxs are sent to the device
      @return the actual number of data returned
    */
   idx_t get_data(tensor<real,maxB,IC,H,W>& x, tensor<idx_t,maxB>& t, tensor<idx_t,maxB>& idxs,
                  idx_t B, int cuda_algo) {
-    assert(B <= maxB);
-    idx_t actual_B = (n_data - cur < B ? n_data - cur : B);
+    idx_t actual_B = next_indexes(t, idxs, B);
     x.set_n0(actual_B);
-    t.set_n0(actual_B);
-    idxs.set_n0(actual_B);
+    /* gather images */
+    const long img_sz = IC * H * W;
     for (long b = 0; b < actual_B; b++) {
-      long idx = cur;
-      data_item<IC,H,W>& itm = data[idx];
-      idxs(b) = itm.index;
-      t(b) = itm.label;
-      for (idx_t ic = 0; ic < IC; ic++) {
-        for (idx_t i = 0; i < H; i++) {
-          for (idx_t j = 0; j < W; j++) {
-            x(b,ic,i,j) = itm(ic,i,j);
-          }
-        }
-      }
-      cur++;
+      memcpy(&x(b), imgs + idxs(b) * img_sz, sizeof(real) * img_sz);
     }
     to_dev(&x, cuda_algo);
     to_dev(&t, cuda_algo);
     to_dev(&idxs, cuda_algo);
     return actual_B;
   }
+#if __CUDACC__
+  /**
+     @brief the device version of get_data; only labels and indexes
+     are sent to the device, and images are gathered on the device
+     from the copy made by to_dev_data
+     @param (x) array to load images into (only its device shadow and n0 are set)
+     @param (t) array to load true labels into
+     @param (idxs) array to load indexes of images into
+     @param (B) the number of data to get
+     @param (s) the stream on which copies and the gather are issued
+     @return the actual number of data returned
+     @details the caller must synchronize with s before using x.dev
+   */
+  idx_t get_data_dev(tensor<real,maxB,IC,H,W>& x, tensor<idx_t,maxB>& t, tensor<idx_t,maxB>& idxs,
+                     idx_t B, cudaStream_t s) {
+    assert(imgs_dev);
+    idx_t actual_B = next_indexes(t, idxs, B);
+    x.set_n0(actual_B);
+    ::to_dev_async(t.dev, &t, sizeof(t), s);
+    ::to_dev_async(idxs.dev, &idxs, sizeof(idxs), s);
+    if (actual_B > 0) {
+      check_launch_error((gather_images_global<maxB,IC,H,W><<<actual_B,256,0,s>>>(x.dev, imgs_dev, idxs.dev, actual_B)));
+    }
+    return actual_B;
+  }
+#endif
+};
+
+/**
+   @brief a mini batch prepared by mnist_loader
+*/
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W>
+struct mnist_batch {
+  tensor<real,maxB,IC,H,W> x;   /**< input images */
+  tensor<idx_t,maxB> t;         /**< true labels of images */
+  tensor<idx_t,maxB> idxs;      /**< indexes of images */
+  idx_t n;                      /**< the number of images (0 after the last batch) */
+};
+
+/**
+   @brief a loader that prepares mini batches of a dataset,
+   optionally in a background thread
+   @details with prefetch = 0, next() fills a single batch by
+   get_data on the calling thread, just like calling get_data
+   directly.  with prefetch = P > 0, a thread started by start()
+   fills a ring of P + 1 batches ahead of the consumer; it can get up to
+   P batches ahead while the consumer works on the one next()
+   returned last.  under a CUDA algorithm the images are copied to
+   the device once (mnist_dataset::to_dev_data); the batches are in
+   pinned memory and, for each batch, the thread only sends the
+   labels and indexes (cudaMemcpyAsync on its own stream) and gathers
+   the images on the device (get_data_dev) before handing it over,
+   so preparing batch k+1 overlaps with computing on batch k.
+   the batches and their order are the same regardless of prefetch.
+
+   usage:
+   mnist_loader<maxB,IC,H,W> ld;
+   ld.init(&data, B, opt.prefetch, opt.cuda_algo);
+   ld.start();
+   while (mnist_batch<maxB,IC,H,W> * b = ld.next()) { ... use b->x, b->t ... }
+   ...
+   ld.fini();
+*/
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W>
+struct mnist_loader {
+  typedef mnist_batch<maxB,IC,H,W> batch_t;
+  mnist_dataset<maxB,IC,H,W> * data; /**< the dataset */
+  idx_t B;                      /**< batch size */
+  int prefetch;                 /**< the number of batches prepared ahead */
+  int cuda_algo;                /**< 1 if batches go to the device */
+  int n_slots;                  /**< the number of batches in the ring (prefetch + 1) */
+  batch_t ** slots;             /**< the ring of batches */
+  long n_filled;                /**< the number of batches the thread filled */
+  long n_taken;                 /**< the number of batches next() returned */
+  long n_released;              /**< the number of batches the consumer is done with */
+  int running;                  /**< 1 if the thread is running */
+  int stop;                     /**< set to ask the thread to quit */
+  pthread_t th;                 /**< the loader thread */
+  pthread_mutex_t mx;           /**< protects the counters above */
+  pthread_cond_t cv;            /**< signaled when a counter changes */
+#if __CUDACC__
+  cudaStream_t stream;          /**< the stream for uploads */
+#endif
+  /**
+     @brief initialize
+     @param (data) the dataset
+     @param (B) batch size
+     @param (prefetch) the number of batches prepared ahead (0 : no thread)
+     @param (cuda_algo) 1 if the batches are sent to the device
+  */
+  void init(mnist_dataset<maxB,IC,H,W> * data, idx_t B, int prefetch, int cuda_algo) {
+    assert(prefetch >= 0);
+    this->data = data;
+    this->B = B;
+    this->prefetch = prefetch;
+    this->cuda_algo = cuda_algo;
+    n_slots = prefetch + 1;
+    slots = new batch_t*[n_slots];
+    for (int k = 0; k < n_slots; k++) {
+      slots[k] = alloc_batch();
+    }
+    n_filled = n_taken = n_released = 0;
+    running = 0;
+    stop = 0;
+    pthread_mutex_init(&mx, 0);
+    pthread_cond_init(&cv, 0);
+#if __CUDACC__
+    if (cuda_algo) {
+      check_api_error(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+      data->to_dev_data();
+    }
+#endif
+  }
+  /**
+     @brief allocate a zero-filled batch (in pinned memory, with
+     device shadows, under a CUDA algorithm)
+  */
+  batch_t * alloc_batch() {
+#if __CUDACC__
+    if (cuda_algo) {
+      batch_t * b = (batch_t *)host_malloc(sizeof(batch_t));
+      memset(b, 0, sizeof(batch_t));
+      make_dev(&b->x, cuda_algo);
+      make_dev(&b->t, cuda_algo);
+      make_dev(&b->idxs, cuda_algo);
+      return b;
+    }
+#endif
+    return new batch_t();
+  }
+  /**
+     @brief free a batch allocated by alloc_batch
+  */
+  void free_batch(batch_t * b) {
+#if __CUDACC__
+    if (cuda_algo) {
+      del_dev(&b->x, cuda_algo);
+      del_dev(&b->t, cuda_algo);
+      del_dev(&b->idxs, cuda_algo);
+      host_free(b);
+      return;
+    }
+#endif
+    delete b;
+  }
+  /**
+     @brief fill a batch with the next B data and send it to the device
+     @returns the number of data in the batch
+  */
+  idx_t fill(batch_t * b) {
+#if __CUDACC__
+    if (cuda_algo) {
+      b->n = data->get_data_dev(b->x, b->t, b->idxs, B, stream);
+      check_api_error(cudaStreamSynchronize(stream));
+      return b->n;
+    }
+#endif
+    b->n = data->get_data(b->x, b->t, b->idxs, B, 0);
+    return b->n;
+  }
+  /**
+     @brief the body of the loader thread
+  */
+  void produce() {
+    while (1) {
+      pthread_mutex_lock(&mx);
+      while (!stop && n_filled - n_released >= n_slots) {
+        pthread_cond_wait(&cv, &mx);
+      }
+      int quit = stop;
+      pthread_mutex_unlock(&mx);
+      if (quit) break;
+      idx_t n = fill(slots[n_filled % n_slots]);
+      pthread_mutex_lock(&mx);
+      n_filled++;
+      pthread_cond_broadcast(&cv);
+      pthread_mutex_unlock(&mx);
+      if (n == 0) break;
+    }
+  }
+  /**
+     @brief the entry point of the loader thread
+  */
+  static void * produce_(void * arg) {
+    ((mnist_loader<maxB,IC,H,W> *)arg)->produce();
+    return 0;
+  }
+  /**
+     @brief start a pass over the dataset from the beginning
+  */
+  void start() {
+    finish();
+    data->rewind();
+    n_filled = n_taken = n_released = 0;
+    stop = 0;
+    if (prefetch) {
+      if (pthread_create(&th, 0, produce_, this)) err(1, "pthread_create");
+      running = 1;
+    }
+  }
+  /**
+     @brief get the next batch
+     @returns the next batch, or null after the last batch.
+     the batch stays valid until the next call to next()
+  */
+  batch_t * next() {
+    if (!prefetch) {
+      batch_t * b = slots[0];
+      return (fill(b) ? b : 0);
+    }
+    pthread_mutex_lock(&mx);
+    /* the consumer is done with the batch it got last */
+    n_released = n_taken;
+    pthread_cond_broadcast(&cv);
+    while (n_filled == n_taken) {
+      pthread_cond_wait(&cv, &mx);
+    }
+    batch_t * b = slots[n_taken % n_slots];
+    n_taken++;
+    pthread_mutex_unlock(&mx);
+    if (b->n == 0) {
+      finish();
+      return 0;
+    }
+    return b;
+  }
+  /**
+     @brief stop the loader thread, if any
+  */
+  void finish() {
+    if (running) {
+      pthread_mutex_lock(&mx);
+      stop = 1;
+      pthread_cond_broadcast(&cv);
+      pthread_mutex_unlock(&mx);
+      pthread_join(th, 0);
+      running = 0;
+    }
+  }
+  /**
+     @brief stop the thread and free all batches
+  */
+  void fini() {
+    finish();
+    for (int k = 0; k < n_slots; k++) {
+      free_batch(slots[k]);
+    }
+    delete[] slots;
+    slots = 0;
+#if __CUDACC__
+    if (cuda_algo) {
+      check_api_error(cudaStreamDestroy(stream));
+    }
+#endif
+    pthread_cond_destroy(&cv);
+    pthread_mutex_destroy(&mx);
+  }
 };
 
 /**
@@ -256,7 +735,7 @@ int mnist_data_main(int argc, char ** argv) {
   mnist_dataset<maxB,C,H,W> ds;
   real mean = 0.1307;
   real std = 0.3081;
-  ds.load(lgr, opt.data_dir, opt.train_data_size, mean, std, 1);
+  ds.load(lgr, opt.data_dir, opt.train_data_size, mean, std, 1, opt.data_cache);
   tensor<real,maxB,C,H,W> x;
   tensor<idx_t,maxB> t;
   tensor<idx_t,maxB> idxs;
@@ -265,7 +744,7 @@ int mnist_data_main(int argc, char ** argv) {
   idxs.init_const(B, 0);
   ds.get_data(x, t, idxs, B, opt.cuda_algo);
   lgr.end_log();
-  delete[] ds.data;
+  ds.close();
   return 0;
 }
 
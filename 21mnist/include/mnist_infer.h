@@ -0,0 +1,944 @@
+/**
+   @file mnist_infer.h
+   @brief inference-only MNIST network (MNIST<maxB,C,H,W,nC,0>) and
+   its forward-only layers
+ */
+#pragma once
+
+#include <math.h>
+#include "mnist_util.h"
+#include "tensor.h"
+#include "gemm.h"
+#include "mnist.h"
+#include "quant.h"
+
+/**
+   @brief the number of threads of a block of the inference kernels
+   (a thread computes an output element)
+ */
+static const int infer_threads = 256;
+
+/**
+   @brief forward-only convolution, y = relu(w ＊ x + b) (relu = 1)
+   or w ＊ x + b (relu = 0)
+
+   @param (maxB) the maximum number of images (batch size)
+   @param (IC) the number of input channels
+   @param (H) height of an input image
+   @param (W) width of an input image
+   @param (K) convolution kernel size
+   @param (OC) the number of output channels
+   @param (relu) 1 if relu is applied to the output
+
+   @details Convolution2D without gradients, optimizer states and the
+   state of other algorithms.  on CPU it is im2col and the packed gemm
+   of cpu_blas_like (with the micro-kernel of cpu_intrin under -a
+   cpu_intrin); the bias is the initial value of the gemm output and
+   relu is applied to the output of each image right after its gemm,
+   while it is in cache.  under CUDA algorithms a thread computes an
+   output element
+ */
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t K,idx_t OC,int relu>
+struct InferConv2D {
+#if __CUDACC__
+  InferConv2D<maxB,IC,H,W,K,OC,relu> * dev; /**< device shadow */
+#endif
+  static const idx_t OH = H - K + 1; /**< output height */
+  static const idx_t OW = W - K + 1; /**< output width */
+  cmdline_opt opt;                   /**< command line option */
+  logger * lgr;                      /**< logger */
+  tensor<real,OC,IC,K,K> w;          /**< weight */
+  tensor<real,OC> b;                 /**< bias */
+  tensor<real,maxB,OC,OH,OW> y;      /**< layer output */
+  heap_tensor<real,IC*K*K,1,1,OH*OW> col; /**< im2col buffer (cpu only) */
+  gemm_kernel_t gemm_kern;           /**< micro-kernel of the packed gemm */
+  /**
+     @brief initialize the layer (weights as Convolution2D::init)
+     @param (opt) command line options
+     @param (lgr) logger
+     @param (rg) random number generator for initializing weights
+  */
+  void init(cmdline_opt opt, logger * lgr, rnd_gen_t& rg) {
+    this->opt = opt;
+    this->lgr = lgr;
+    real bound = 1.0 / sqrt(IC * K * K);
+    w.init_uniform(OC, rg, -bound, bound);
+    b.init_uniform(OC, rg, -bound, bound);
+    if (!opt.cuda_algo) {
+      col.alloc(IC * K * K);
+    }
+    gemm_kern = gemm_kernel_for(opt);
+  }
+  /**
+     @brief set the device pointer for this and all subobjects
+  */
+  void set_dev(InferConv2D<maxB,IC,H,W,K,OC,relu> * dev) {
+#if __CUDACC__
+    this->dev = dev;
+    w.set_dev(dev ? &dev->w : 0);
+    b.set_dev(dev ? &dev->b : 0);
+    y.set_dev(dev ? &dev->y : 0);
+#else
+    (void)dev;
+#endif
+  }
+  /**
+     @brief im2col of sample s of x (as Convolution2D::im2col)
+  */
+  void im2col(tensor<real,maxB,IC,H,W>& x, idx_t s, real * c) {
+#pragma omp parallel for collapse(3)
+    for (idx_t ic = 0; ic < IC; ic++) {
+      for (idx_t di = 0; di < K; di++) {
+        for (idx_t dj = 0; dj < K; dj++) {
+          real * c_r = c + ((ic * K + di) * K + dj) * col.ld;
+          for (idx_t i = 0; i < OH; i++) {
+#pragma omp simd
+            for (idx_t j = 0; j < OW; j++) {
+              c_r[i * OW + j] = x(s,ic,i+di,j+dj);
+            }
+          }
+        }
+      }
+    }
+  }
+  /**
+     @brief forward on CPU, an image at a time
+  */
+  void forward_cpu(tensor<real,maxB,IC,H,W>& x) {
+    const idx_t B = x.n0;
+    const idx_t P = OH * OW;
+    const idx_t R = IC * K * K;
+    y.set_n0(B);
+    real * c = col.w;
+    const real * w_ = &w.w[0][0][0][0];
+    for (idx_t s = 0; s < B; s++) {
+      real * y_s = &y.w[s][0][0][0];
+      im2col(x, s, c);
+#pragma omp parallel for
+      for (idx_t oc = 0; oc < OC; oc++) {
+        const real b_oc = b(oc);
+#pragma omp simd
+        for (idx_t p = 0; p < P; p++) {
+          y_s[oc * P + p] = b_oc;
+        }
+      }
+      gemm<OC,OH*OW,IC*K*K>(OC, P, R, w_, R, 1, c, col.ld, 1, y_s, P, 1, gemm_kern);
+      if (relu) {
+#pragma omp parallel for simd
+        for (idx_t k = 0; k < OC * P; k++) {
+          y_s[k] = (y_s[k] > 0 ? y_s[k] : 0);
+        }
+      }
+    }
+  }
+#if __CUDACC__
+  /**
+     @brief the device function of forward_cuda (an output element a thread)
+  */
+  __device__
+  void forward_cuda_fast_device(tensor<real,maxB,IC,H,W>& x, int training) {
+    (void)training;
+    const idx_t B = x.n0;
+    const long k = blockIdx.x * (long)blockDim.x + threadIdx.x;
+    if (k == 0) y.set_n0(B);
+    if (k >= (long)B * OC * OH * OW) return;
+    const idx_t j = k % OW;
+    const idx_t i = (k / OW) % OH;
+    const idx_t oc = (k / (OW * OH)) % OC;
+    const idx_t s = k / (OW * OH * OC);
+    real v = b.w[oc][0][0][0];
+    for (idx_t ic = 0; ic < IC; ic++) {
+      for (idx_t di = 0; di < K; di++) {
+        for (idx_t dj = 0; dj < K; dj++) {
+          v += w.w[oc][ic][di][dj] * x.w[s][ic][i+di][j+dj];
+        }
+      }
+    }
+    y.w[s][oc][i][j] = (relu && v < 0 ? 0 : v);
+  }
+#endif
+  /**
+     @brief forward on the device
+  */
+  void forward_cuda(tensor<real,maxB,IC,H,W>& x) {
+#if __CUDACC__
+    const long n = (long)x.n0 * OC * OH * OW;
+    y.set_n0(x.n0);
+    if (n == 0) return;
+    launch_and_sync((forward_cuda_fast_global<<<(n + infer_threads - 1) / infer_threads,infer_threads>>>(dev, x.dev, 0)));
+#else
+    (void)x;
+    err_cuda_code_non_cuda_compiler(opt.algo_s);
+#endif
+  }
+  /**
+     @brief forward phase of the layer
+     @param (x) input images
+  */
+  tensor<real,maxB,OC,OH,OW>& forward(tensor<real,maxB,IC,H,W>& x) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    if (opt.cuda_algo) {
+      forward_cuda(x);
+    } else {
+      forward_cpu(x);
+    }
+    tsc_t t1 = get_tsc();
+    log_end_kernel(lgr, t0, t1, prof_forward, x.n0,
+                   2.0 * x.n0 * OC * OH * OW * IC * K * K,
+                   1.0 * sizeof(real) * (x.n0 * IC * H * W + OC * IC * K * K + x.n0 * OC * OH * OW));
+    return y;
+  }
+};
+
+/**
+   @brief forward-only max pooling (no argmax, which only backward needs)
+   @param (maxB) the maximum number of images (batch size)
+   @param (C) the number of channels
+   @param (H) height of an input image
+   @param (W) width of an input image
+   @param (S) shrink factor
+ */
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t S>
+struct InferMaxPool2D {
+#if __CUDACC__
+  InferMaxPool2D<maxB,C,H,W,S> * dev; /**< device shadow */
+#endif
+  cmdline_opt opt;                  /**< command line option */
+  logger * lgr;                     /**< logger */
+  tensor<real,maxB,C,H/S,W/S> y;    /**< output of the forward */
+  /**
+     @brief initialize the layer
+  */
+  void init(cmdline_opt opt, logger * lgr) {
+    this->opt = opt;
+    this->lgr = lgr;
+  }
+  /**
+     @brief set the device pointer for this and all subobjects
+  */
+  void set_dev(InferMaxPool2D<maxB,C,H,W,S> * dev) {
+#if __CUDACC__
+    this->dev = dev;
+    y.set_dev(dev ? &dev->y : 0);
+#else
+    (void)dev;
+#endif
+  }
+  /**
+     @brief the maximum of the window of output pixel (i,j) of (s,c)
+  */
+  __device__ __host__
+  real window_max(tensor<real,maxB,C,H,W>& x, idx_t s, idx_t c, idx_t i, idx_t j) {
+    real v = x.w[s][c][S*i][S*j];
+    for (idx_t di = 0; di < S; di++) {
+      for (idx_t dj = 0; dj < S; dj++) {
+        const real u = x.w[s][c][S*i+di][S*j+dj];
+        v = (u > v ? u : v);
+      }
+    }
+    return v;
+  }
+  /**
+     @brief forward on CPU
+  */
+  void forward_cpu(tensor<real,maxB,C,H,W>& x) {
+    const idx_t B = x.n0;
+    y.set_n0(B);
+#pragma omp parallel for collapse(2)
+    for (idx_t s = 0; s < B; s++) {
+      for (idx_t c = 0; c < C; c++) {
+        for (idx_t i = 0; i < H/S; i++) {
+          for (idx_t j = 0; j < W/S; j++) {
+            y.w[s][c][i][j] = window_max(x, s, c, i, j);
+          }
+        }
+      }
+    }
+  }
+#if __CUDACC__
+  /**
+     @brief the device function of forward_cuda (an output element a thread)
+  */
+  __device__
+  void forward_cuda_fast_device(tensor<real,maxB,C,H,W>& x, int training) {
+    (void)training;
+    const idx_t B = x.n0;
+    const long k = blockIdx.x * (long)blockDim.x + threadIdx.x;
+    if (k == 0) y.set_n0(B);
+    if (k >= (long)B * C * (H/S) * (W/S)) return;
+    const idx_t j = k % (W/S);
+    const idx_t i = (k / (W/S)) % (H/S);
+    const idx_t c = (k / ((W/S) * (H/S))) % C;
+    const idx_t s = k / ((W/S) * (H/S) * C);
+    y.w[s][c][i][j] = window_max(x, s, c, i, j);
+  }
+#endif
+  /**
+     @brief forward on the device
+  */
+  void forward_cuda(tensor<real,maxB,C,H,W>& x) {
+#if __CUDACC__
+    const long n = (long)x.n0 * C * (H/S) * (W/S);
+    y.set_n0(x.n0);
+    if (n == 0) return;
+    launch_and_sync((forward_cuda_fast_global<<<(n + infer_threads - 1) / infer_threads,infer_threads>>>(dev, x.dev, 0)));
+#else
+    (void)x;
+    err_cuda_code_non_cuda_compiler(opt.algo_s);
+#endif
+  }
+  /**
+     @brief forward phase of the layer
+     @param (x) input images
+  */
+  tensor<real,maxB,C,H/S,W/S>& forward(tensor<real,maxB,C,H,W>& x) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    if (opt.cuda_algo) {
+      forward_cuda(x);
+    } else {
+      forward_cpu(x);
+    }
+    tsc_t t1 = get_tsc();
+    log_end_kernel(lgr, t0, t1, prof_forward, x.n0,
+                   1.0 * x.n0 * C * H * W,
+                   1.0 * sizeof(real) * x.n0 * C * (H * W + (H/S) * (W/S)));
+    return y;
+  }
+};
+
+/**
+   @brief forward-only linear layer, y = relu(x w + b) (relu = 1) or
+   x w + b (relu = 0)
+   @param (M) the maximum number of rows (batch size)
+   @param (N) the number of outputs of a row
+   @param (K0,K1,K2) the shape of an input row
+   @param (relu) 1 if relu is applied to the output
+   @details Linear without gradients and optimizer states.  on CPU it
+   is the packed gemm of cpu_blas_like with relu applied to the
+   output right after it.  a batch of at most small_rows rows (e.g.,
+   a single image) instead streams w once, row by row, into all the
+   rows of partial sums of y (which stay in L1), skipping zero inputs (about half of
+   them after relu); packing w for the gemm would read and write all
+   of it for a few rows of output.  under CUDA algorithms a thread
+   computes an output element
+ */
+template<idx_t M,idx_t N,idx_t K0,idx_t K1,idx_t K2,int relu>
+struct InferLinear {
+#if __CUDACC__
+  InferLinear<M,N,K0,K1,K2,relu> * dev; /**< device shadow */
+#endif
+  cmdline_opt opt;              /**< command line option */
+  logger * lgr;                 /**< logger */
+  tensor<real,K0,K1,K2,N> w;    /**< weight */
+  tensor<real,N> b;             /**< bias */
+  tensor<real,M,N> y;           /**< output of the forward */
+  gemm_kernel_t gemm_kern;      /**< micro-kernel of the packed gemm */
+  static const idx_t small_rows = 8; /**< batches up to this many rows skip the gemm */
+  /**
+     @brief initialize the layer (weights as Linear::init)
+  */
+  void init(cmdline_opt opt, logger * lgr, rnd_gen_t& rg) {
+    this->opt = opt;
+    this->lgr = lgr;
+    real bound = 1.0 / sqrt(K0 * K1 * K2);
+    w.init_uniform(K0, rg, -bound, bound);
+    b.init_uniform(N, rg, -bound, bound);
+    gemm_kern = gemm_kernel_for(opt);
+  }
+  /**
+     @brief set the device pointer for this and all subobjects
+  */
+  void set_dev(InferLinear<M,N,K0,K1,K2,relu> * dev) {
+#if __CUDACC__
+    this->dev = dev;
+    w.set_dev(dev ? &dev->w : 0);
+    b.set_dev(dev ? &dev->b : 0);
+    y.set_dev(dev ? &dev->y : 0);
+#else
+    (void)dev;
+#endif
+  }
+  /**
+     @brief y += x w for a few rows of x, a row of w at a time
+     @details threads take contiguous ranges of rows of w and add
+     their partial sums to y at the end
+  */
+  void forward_cpu_small(tensor<real,M,K0,K1,K2>& x) {
+    const idx_t m = x.n0;
+    const idx_t KK = K0 * K1 * K2;
+    const real * x_ = &x.w[0][0][0][0];
+    const real * w_ = &w.w[0][0][0][0];
+    real * y_ = &y.w[0][0][0][0];
+#pragma omp parallel
+    {
+      real part[small_rows * N];
+      for (idx_t k = 0; k < m * N; k++) {
+        part[k] = 0;
+      }
+#pragma omp for schedule(static) nowait
+      for (idx_t k = 0; k < KK; k++) {
+        const real * w_k = w_ + k * N;
+        for (idx_t i = 0; i < m; i++) {
+          const real x_ik = x_[i * KK + k];
+          if (x_ik == 0) continue;
+          real * p_i = part + i * N;
+#pragma omp simd
+          for (idx_t j = 0; j < N; j++) {
+            p_i[j] += x_ik * w_k[j];
+          }
+        }
+      }
+#pragma omp critical
+      for (idx_t k = 0; k < m * N; k++) {
+        y_[k] += part[k];
+      }
+    }
+  }
+  /**
+     @brief forward on CPU
+  */
+  void forward_cpu(tensor<real,M,K0,K1,K2>& x) {
+    const idx_t m = x.n0;
+    const idx_t KK = K0 * K1 * K2;
+    y.set_n0(m);
+    for (idx_t i = 0; i < m; i++) {
+#pragma omp simd
+      for (idx_t j = 0; j < N; j++) {
+        y(i,j) = b(j);
+      }
+    }
+    if (m <= small_rows) {
+      forward_cpu_small(x);
+    } else {
+      gemm<M,N,K0*K1*K2>(m, N, KK, &x.w[0][0][0][0], KK, 1,
+                         &w.w[0][0][0][0], N, 1, &y.w[0][0][0][0], N, 1, gemm_kern);
+    }
+    if (relu) {
+      real * y_ = &y.w[0][0][0][0];
+#pragma omp simd
+      for (idx_t k = 0; k < m * N; k++) {
+        y_[k] = (y_[k] > 0 ? y_[k] : 0);
+      }
+    }
+  }
+#if __CUDACC__
+  /**
+     @brief the device function of forward_cuda (an output element a thread)
+  */
+  __device__
+  void forward_cuda_fast_device(tensor<real,M,K0,K1,K2>& x, int training) {
+    (void)training;
+    const idx_t m = x.n0;
+    const idx_t KK = K0 * K1 * K2;
+    const long k = blockIdx.x * (long)blockDim.x + threadIdx.x;
+    if (k == 0) y.set_n0(m);
+    if (k >= (long)m * N) return;
+    const idx_t i = k / N, j = k % N;
+    const real * x_i = &x.w[i][0][0][0];
+    const real * w_ = &w.w[0][0][0][0];
+    real v = b.w[j][0][0][0];
+    for (idx_t p = 0; p < KK; p++) {
+      v += x_i[p] * w_[p * N + j];
+    }
+    y.w[i][j][0][0] = (relu && v < 0 ? 0 : v);
+  }
+#endif
+  /**
+     @brief forward on the device
+  */
+  void forward_cuda(tensor<real,M,K0,K1,K2>& x) {
+#if __CUDACC__
+    const long n = (long)x.n0 * N;
+    y.set_n0(x.n0);
+    if (n == 0) return;
+    launch_and_sync((forward_cuda_fast_global<<<(n + infer_threads - 1) / infer_threads,infer_threads>>>(dev, x.dev, 0)));
+#else
+    (void)x;
+    err_cuda_code_non_cuda_compiler(opt.algo_s);
+#endif
+  }
+  /**
+     @brief forward phase of the layer
+     @param (x) input
+  */
+  tensor<real,M,N>& forward(tensor<real,M,K0,K1,K2>& x) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    if (opt.cuda_algo) {
+      forward_cuda(x);
+    } else {
+      forward_cpu(x);
+    }
+    tsc_t t1 = get_tsc();
+    log_end_kernel(lgr, t0, t1, prof_forward, x.n0,
+                   2.0 * x.n0 * N * K0 * K1 * K2,
+                   1.0 * sizeof(real) * (x.n0 * K0 * K1 * K2 + K0 * K1 * K2 * N + x.n0 * N));
+    return y;
+  }
+};
+
+/**
+   @brief inference-only MNIST network (forward with training = 0)
+
+   @details the specialization of MNIST for train = 0.  it has the
+   weights and biases of conv1, conv2, fc1 and fc2 and the outputs of
+   layers, but no gradients, optimizer states, dropout state or
+   buffers of other algorithms.  relu1, relu2 and relu3 are fused into
+   the epilogue of conv1, conv2 and fc1, dropout1 and dropout2
+   (identities when training = 0) are left out, and max pooling keeps
+   no argmax.  infer takes the class of the largest score of fc2
+   (what log softmax would choose) and forward computes the loss with
+   log softmax of fc2 on the host only when labels are given.  weights
+   come from a training network (copy_weights_from), e.g., one loaded
+   from a checkpoint.
+
+   under -a cpu_int8, after calibrate has seen some batches and
+   quantize has quantized the weights, logits runs conv2, max pooling,
+   fc1 and fc2 in int8 (quant.h): per-channel int8 weights, uint8
+   activations requantized between layers with the ranges calibrate
+   recorded, and int32 dot products.  conv1 (a single input channel,
+   3 percent of the flops) stays in real, and its output is quantized
+   as conv2 takes it.  until then (and after copy_weights_from, which
+   discards the quantized weights) logits runs in real
+
+   usage:
+   MNIST<maxB,C,H,W,nC,0> * m = new MNIST<maxB,C,H,W,nC,0>();
+   m->init(opt, &lgr, rg, cfg);
+   to_dev(m, opt.cuda_algo);
+   m->copy_weights_from(*trained);
+   m->infer(x, m->pred);
+ */
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC>
+struct MNIST<maxB,C,H,W,nC,0> {
+#if __CUDACC__
+  MNIST<maxB,C,H,W,nC,0>* dev;  /**< device shadow */
+#endif
+  typedef MNIST<maxB,C,H,W,nC,1> train_t; /**< the training network of the same shape */
+  static const idx_t K = train_t::K;
+  static const idx_t H1 = train_t::H1, W1 = train_t::W1;
+  static const idx_t H2 = train_t::H2, W2 = train_t::W2;
+  static const idx_t H3 = train_t::H3, W3 = train_t::W3;
+  static const idx_t C1 = train_t::C1;
+  static const idx_t C2 = train_t::C2;
+  static const idx_t nF = train_t::nF;
+  cmdline_opt opt;              /**< command line option */
+  logger * lgr;                 /**< logger */
+  tensor<real,maxB,C,H,W> x;    /**< input images */
+  tensor<idx_t,maxB> pred;      /**< predicted labels of images */
+  tensor<real,maxB> l;          /**< the loss of each image (forward with labels) */
+  InferConv2D<maxB,C,H,W,K,C1,1> conv1;        /**< conv1 and relu1 */
+  InferConv2D<maxB,C1,H1,W1,K,C2,1> conv2;     /**< conv2 and relu2 */
+  InferMaxPool2D<maxB,C2,H2,W2,2> max_pooling_2d; /**< max_pooling_2d (dropout1 is the identity) */
+  InferLinear<maxB,nF,C2,H3,W3,1> fc1;         /**< fc1 and relu3 (dropout2 is the identity) */
+  InferLinear<maxB,nC,nF,1,1,0> fc2;           /**< fc2 */
+  int quantized;                               /**< 1 if logits runs in int8 */
+  q8_range range1;                             /**< calibrated range of the output of conv1 (relu1) */
+  q8_range range2;                             /**< of conv2 (relu2) */
+  q8_range range3;                             /**< of fc1 (relu3) */
+  Q8Conv2D<maxB,C1,H1,W1,K,C2> q_conv2;        /**< conv2 and relu2 in int8 */
+  Q8MaxPool2D<maxB,C2,H2,W2,2> q_max_pooling_2d; /**< max_pooling_2d in uint8 */
+  Q8Linear<maxB,nF,C2*H3*W3> q_fc1;            /**< fc1 and relu3 in int8 */
+  Q8Linear<maxB,nC,nF> q_fc2;                  /**< fc2 in int8 */
+  /**
+     @brief 1 if the network implements algorithm a
+     @details its layers have a single CPU version (whose gemm
+     micro kernel cpu_intrin replaces; gemm_kernel_for) and a single
+     CUDA version, besides int8; other algorithms run those
+  */
+  static int has_algo(algo_t a) {
+    switch (a) {
+    case algo_cpu_base:
+    case algo_cuda_base:
+    case algo_cpu_intrin:
+    case algo_cpu_int8:
+      return 1;
+    default:
+      return 0;
+    }
+  }
+  /**
+     @brief initialize everything
+     @param (opt) command line options
+     @param (lgr) logger
+     @param (rg) random number generator for initializing weights
+     @param (cfg) configuration parameters (nothing of it matters for inference)
+  */
+  void init(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, MNISTCfg cfg) {
+    (void)cfg;
+    this->opt = opt;
+    this->lgr = lgr;
+    conv1.init(opt, lgr, rg);
+    conv2.init(opt, lgr, rg);
+    max_pooling_2d.init(opt, lgr);
+    fc1.init(opt, lgr, rg);
+    fc2.init(opt, lgr, rg);
+    lgr->prof.name(&conv1, "conv1");
+    lgr->prof.name(&conv2, "conv2");
+    lgr->prof.name(&max_pooling_2d, "max_pooling_2d");
+    lgr->prof.name(&fc1, "fc1");
+    lgr->prof.name(&fc2, "fc2");
+    size_t col_bytes = (opt.cuda_algo ? 0 :
+                        conv1.col.bytes(conv1.col.cap0) + conv2.col.bytes(conv2.col.cap0));
+    quantized = 0;
+    reset_calibration();
+    if (opt.algo == algo_cpu_int8) {
+      const idx_t B = min_i(maxB, opt.batch_size);
+      q_conv2.init(opt, lgr, B);
+      q_max_pooling_2d.init(opt, lgr, B);
+      q_fc1.init(opt, lgr, B);
+      q_fc2.init(opt, lgr, B);
+      lgr->prof.name(&q_conv2, "conv2.int8");
+      lgr->prof.name(&q_max_pooling_2d, "max_pooling_2d.int8");
+      lgr->prof.name(&q_fc1, "fc1.int8");
+      lgr->prof.name(&q_fc2, "fc2.int8");
+      const char * name;
+      q8_select(opt, &name);
+      lgr->log(1, "int8: %s dot kernel", name);
+      col_bytes += (q_conv2.xq.bytes(B) + q_conv2.col.bytes(q_conv2.col.cap0) + q_conv2.y.bytes(B)
+                    + q_max_pooling_2d.y.bytes(B) + q_fc1.y.bytes(B)
+                    + q_conv2.q.bytes() + q_fc1.q.bytes() + q_fc2.q.bytes());
+    }
+    lgr->log(1, "inference network: %ld bytes (training network: %ld bytes)",
+             (long)(sizeof(*this) + col_bytes), (long)sizeof(train_t));
+  }
+  /**
+     @brief set the device pointer for this and all subobjects
+  */
+  void set_dev(MNIST<maxB,C,H,W,nC,0>* dev) {
+#if __CUDACC__
+    this->dev = dev;
+    x.set_dev(dev ? &dev->x : 0);
+    pred.set_dev(dev ? &dev->pred : 0);
+    l.set_dev(dev ? &dev->l : 0);
+    conv1.set_dev(dev ? &dev->conv1 : 0);
+    conv2.set_dev(dev ? &dev->conv2 : 0);
+    max_pooling_2d.set_dev(dev ? &dev->max_pooling_2d : 0);
+    fc1.set_dev(dev ? &dev->fc1 : 0);
+    fc2.set_dev(dev ? &dev->fc2 : 0);
+#else
+    (void)dev;
+#endif
+  }
+  /**
+     @brief copy a weight or bias tensor of a training network
+     (device to device under CUDA algorithms)
+  */
+  template<typename T>
+  void copy_param(T& dst, T& src) {
+    if (opt.cuda_algo) {
+#if __CUDACC__
+      check_api_error(cudaMemcpy(&dst.dev->w[0][0][0][0], &src.dev->w[0][0][0][0],
+                                 sizeof(dst.w), cudaMemcpyDeviceToDevice));
+#else
+      err_cuda_code_non_cuda_compiler("copy_param");
+#endif
+    } else {
+      memcpy(&dst.w[0][0][0][0], &src.w[0][0][0][0], dst.bytes(dst.capacity()));
+    }
+  }
+  /**
+     @brief copy the weights of a training network (a snapshot for
+     --eval-async, or the network to serve)
+     @param (src) the network to copy from (on the device if this is)
+     @details under CUDA algorithms the copy is complete when it returns
+  */
+  void copy_weights_from(train_t& src) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    src.hybrid_sync(1);         /* the weights of a stage --hybrid puts on the CPU are on the host */
+    copy_param(conv1.w, src.conv1.w);
+    copy_param(conv1.b, src.conv1.b);
+    copy_param(conv2.w, src.conv2.w);
+    copy_param(conv2.b, src.conv2.b);
+    copy_param(fc1.w, src.fc1.w);
+    copy_param(fc1.b, src.fc1.b);
+    copy_param(fc2.w, src.fc2.w);
+    copy_param(fc2.b, src.fc2.b);
+    quantized = 0;
+    reset_calibration();
+#if __CUDACC__
+    /* device-to-device copies may return early; the network may run on another stream */
+    if (opt.cuda_algo) dev_sync();
+#endif
+    tsc_t t1 = get_tsc();
+    log_end_fun(lgr, t0, t1);
+  }
+  /**
+     @brief forget the ranges calibrate recorded
+  */
+  void reset_calibration() {
+    range1.reset();
+    range2.reset();
+    range3.reset();
+  }
+  /**
+     @brief run a batch in real and record the ranges of activations
+     the int8 layers take (the outputs of relu1, relu2 and relu3)
+     @param (x) input images (e.g., a batch of the training data)
+  */
+  void calibrate(tensor<real,maxB,C,H,W>& x) {
+    quantized = 0;
+    logits(x);
+    const idx_t B = x.n0;
+    range1.add(&conv1.y.w[0][0][0][0], (long)B * C1 * H1 * W1);
+    range2.add(&conv2.y.w[0][0][0][0], (long)B * C2 * H2 * W2);
+    range3.add(&fc1.y.w[0][0][0][0], (long)B * nF);
+  }
+  /**
+     @brief quantize the weights of conv2, fc1 and fc2, so that logits
+     runs in int8 (-a cpu_int8 only, after calibrate)
+  */
+  void quantize() {
+    if (opt.algo != algo_cpu_int8) {
+      errx(1, "quantize: the int8 layers exist only under -a cpu_int8");
+    }
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    q_conv2.quantize(conv2.w, conv2.b);
+    q_fc1.quantize(&fc1.w.w[0][0][0][0], fc1.b);
+    q_fc2.quantize(&fc2.w.w[0][0][0][0], fc2.b);
+    quantized = 1;
+    lgr->log(1, "int8: activation ranges conv1 [0,%f] conv2 [0,%f] fc1 [0,%f]",
+             range1.max, range2.max, range3.max);
+    tsc_t t1 = get_tsc();
+    log_end_fun(lgr, t0, t1);
+  }
+  /**
+     @brief forward up to fc2 in int8 (but conv1)
+  */
+  tensor<real,maxB,nC>& logits_int8(tensor<real,maxB,C,H,W>& x) {
+    tensor<real,maxB,C1,H1,W1>& x2 = conv1.forward(x);
+    heap_tensor<uint8_t,maxB,C2,1,H2*W2>& x4 = q_conv2.forward(x2, range1.scale(), range2.scale());
+    heap_tensor<uint8_t,maxB,1,1,C2*H3*W3>& x5 = q_max_pooling_2d.forward(x4);
+    heap_tensor<uint8_t,maxB,1,1,nF>& x8 = q_fc1.forward8(x5, range2.scale(), range3.scale());
+    return q_fc2.forward(x8, range3.scale(), fc2.y);
+  }
+  /**
+     @brief forward up to fc2
+     @param (x) input images
+     @returns the scores of classes for each image (before log softmax)
+  */
+  tensor<real,maxB,nC>& logits(tensor<real,maxB,C,H,W>& x) {
+    if (quantized) {
+      return logits_int8(x);
+    }
+    tensor<real,maxB,C1,H1,W1>& x2  = conv1.forward(x);
+    tensor<real,maxB,C2,H2,W2>& x4  = conv2.forward(x2);
+    tensor<real,maxB,C2,H3,W3>& x5  = max_pooling_2d.forward(x4);
+    tensor<real,maxB,nF>&       x8  = fc1.forward(x5);
+    tensor<real,maxB,nC>&       x10 = fc2.forward(x8);
+    return x10;
+  }
+  /**
+     @brief the loss of each image (negative log softmax of the true class)
+     @param (y) the scores of classes (on the host)
+     @param (t) true labels (on the host)
+  */
+  tensor<real,maxB>& loss(tensor<real,maxB,nC>& y, tensor<idx_t,maxB>& t) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    const idx_t B = y.n0;
+    l.set_n0(B);
+    for (idx_t s = 0; s < B; s++) {
+      real m = y(s,0);
+      for (idx_t c = 1; c < nC; c++) {
+        m = max_r(m, y(s,c));
+      }
+      real e = 0.0;
+      for (idx_t c = 0; c < nC; c++) {
+        e += exp(y(s,c) - m);
+      }
+      l(s) = m + log(e) - y(s,t(s));
+    }
+    to_dev(&l, opt.cuda_algo);
+    tsc_t t1 = get_tsc();
+    log_end_kernel(lgr, t0, t1, prof_forward, B,
+                   3.0 * B * nC,
+                   1.0 * sizeof(real) * B * (nC + 1));
+    return l;
+  }
+  /**
+     @brief forward phase of the network with labels (the loss, as
+     MNIST::forward with training = 0)
+     @param (x) input images
+     @param (t) true labels (on the host)
+     @param (training) must be 0
+  */
+  tensor<real,maxB>& forward(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t, int training) {
+    assert(!training);
+    (void)training;
+    tensor<real,maxB,nC>& y = logits(x);
+    to_host(&y, opt.cuda_algo);
+    return loss(y, t);
+  }
+  /**
+     @brief write the predicted class of all samples of the batch
+     forward has seen into pred
+  */
+  void predict(tensor<idx_t,maxB>& pred) {
+    tensor<real,maxB,nC>& y = fc2.y;
+    to_host(&y, opt.cuda_algo);
+    classify(y, pred);
+  }
+  /**
+     @brief predict the classes of images, without labels or the loss
+     @param (x) input images (their device shadow under CUDA algorithms)
+     @param (pred) the vector to which the predicted classes are written to
+  */
+  void infer(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& pred) {
+    batch_stats_of<maxB,nC>(logits(x), 0, 0, pred, 0, opt.cuda_algo, 1);
+  }
+  /**
+     @brief predictions (pred), the sum of losses and the number of
+     correct predictions of the batch forward has just seen (as
+     MNIST::batch_stats)
+     @details forward has brought the scores back for the loss, so
+     they are taken on the host
+  */
+  batch_stats_t batch_stats(tensor<idx_t,maxB>& t, int with_pred) {
+    (void)with_pred;
+    return batch_stats_of(fc2.y, &l, &t, pred, 0, 0, 1);
+  }
+  /**
+     @brief forward a test batch and take its batch_stats (as MNIST::test_batch)
+  */
+  batch_stats_t test_batch(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t, int with_pred) {
+    forward(x, t, 0);
+    return batch_stats(t, with_pred);
+  }
+  /**
+     @brief write the class of the largest score of each sample in y into pred
+  */
+  void classify(tensor<real,maxB,nC>& y, tensor<idx_t,maxB>& pred) {
+    pred.set_n0(y.n0);
+    batch_classify(y, pred, 0, 1);
+  }
+  /**
+     @brief write the predicted classes into the log and returns the
+     number of correctly predicted samples (as MNIST::log_prediction)
+  */
+  idx_t log_prediction(idx_t start_offset,
+                       tensor<idx_t,maxB>& pred, tensor<idx_t,maxB>& t,
+                       tensor<idx_t,maxB>& idxs) {
+    const idx_t B = t.n0;
+    idx_t correct = 0;
+    for (idx_t s = 0; s < B; s++) {
+      lgr->log(3, "sample %d image %d pred %d truth %d",
+               start_offset + s, idxs(s), pred(s), t(s));
+      if (pred(s) == t(s)) {
+        correct++;
+      }
+    }
+    return correct;
+  }
+};
+
+/**
+   @brief check the inference-only network against the training one
+   (or benchmark both with --bench)
+   @param (argc) the number of command line args
+   @param (argv) command line args
+   @details if this header file is included from a main C++ file and
+   define mnist_infer_main to be main (e.g., with
+   -Dmnist_infer_main=main), then this function becomes the main
+   function of the executable.  each of -m iterations copies the
+   weights of a new (randomly initialized) training network into an
+   inference-only network, runs both forward (training = 0) on the
+   same random images and labels, and reports the relative error of
+   the losses and the number of images whose predictions differ.
+   under -a cpu_int8, the training network runs int8_train_algo and
+   the inference-only one is calibrated on the same images and runs
+   in int8, so the error is that of quantization.
+   with --bench, it measures MNIST::infer of both ("mnist.infer" and
+   "mnist_infer")
+*/
+int mnist_infer_main(int argc, char ** argv) {
+  cmdline_opt opt = parse_args(argc, argv);
+  const idx_t maxB = MAX_BATCH_SIZE;
+  const idx_t B = min_i(maxB, opt.batch_size);
+  const int C = 1;
+  const int H = 28;
+  const int W = 28;
+  const int nC = 10;
+  const int n_checks = opt.epochs;
+  logger lgr;
+  lgr.start_log(opt);
+  rnd_gen_t rg;
+  rg.seed(opt.weight_seed);
+  MNISTCfg cfg = {
+    .conv1 = {},
+    .relu1 = { .inplace = opt.inplace },
+    .conv2 = {},
+    .relu2 = { .inplace = opt.inplace },
+    .max_pooling_2d = {},
+    .dropout1 = { .ratio = 0.25f * (opt.dropout_seed_1 != 0), .seed = opt.dropout_seed_1, .inplace = opt.inplace },
+    .fc1 = {},
+    .relu3 = { .inplace = opt.inplace },
+    .dropout2 = { .ratio =  0.5f * (opt.dropout_seed_2 != 0), .seed = opt.dropout_seed_2, .inplace = opt.inplace },
+    .fc2 = {},
+    .nll_softmax = {}
+  };
+  typedef MNIST<maxB,C,H,W,nC,1> train_t;
+  typedef MNIST<maxB,C,H,W,nC,0> infer_t;
+  cmdline_opt train_opt = opt;
+  if (algo_is_inference_only(opt.algo)) {
+    train_opt.algo = int8_train_algo;
+    train_opt.algo_s = algo_name(int8_train_algo);
+  }
+  if (strlen(opt.bench)) {
+    bench_infer<train_t,tensor<real,maxB,C,H,W>,MNISTCfg>(train_opt, &lgr, rg, cfg, "mnist.infer", maxB);
+    bench_infer<infer_t,tensor<real,maxB,C,H,W>,MNISTCfg>(opt, &lgr, rg, cfg, "mnist_infer", maxB);
+    lgr.end_log();
+    return 0;
+  }
+  double max_e = 0.0;
+  for (int iter = 0; iter < n_checks; iter++) {
+    printf("==== %d ====\n", iter);
+    train_t * tn = new train_t();
+    tn->init(train_opt, &lgr, rg, cfg);
+    infer_t * in = new infer_t();
+    in->init(opt, &lgr, rg, cfg);
+    tensor<real,maxB,C,H,W> * x = new tensor<real,maxB,C,H,W>();
+    x->init_uniform(B, rg, -1.0, 1.0);
+    tensor<idx_t,maxB> * t = new tensor<idx_t,maxB>();
+    t->init_uniform_i(B, rg, 0, nC);
+    to_dev(tn, opt.cuda_algo);
+    to_dev(in, opt.cuda_algo);
+    to_dev(x, opt.cuda_algo);
+    to_dev(t, opt.cuda_algo);
+    in->copy_weights_from(*tn);
+    if (opt.algo == algo_cpu_int8) {
+      in->calibrate(*x);
+      in->quantize();
+    }
+    tensor<real,maxB>& l0 = tn->forward(*x, *t, 0);
+    to_host(&l0, opt.cuda_algo);
+    tn->predict(tn->pred);
+    tensor<real,maxB>& l1 = in->forward(*x, *t, 0);
+    to_host(&l1, opt.cuda_algo);
+    in->predict(in->pred);
+    tensor<real,maxB> d = l1;
+    d.add_(-1.0, l0);
+    const double e = sqrt(d.dot(d) / fmax(l0.dot(l0), 1.0e-30));
+    long n_diff = 0;
+    for (idx_t s = 0; s < B; s++) {
+      n_diff += (tn->pred(s) != in->pred(s));
+    }
+    printf("relative error of losses = %.9f, predictions differ in %ld/%ld images\n",
+           e, n_diff, (long)B);
+    max_e = max_r(max_e, e);
+    del_dev(tn, opt.cuda_algo);
+    del_dev(in, opt.cuda_algo);
+    del_dev(x, opt.cuda_algo);
+    del_dev(t, opt.cuda_algo);
+    delete tn;
+    delete in;
+    delete x;
+    delete t;
+  }
+  printf("max relative error = %.9f\n", max_e);
+  lgr.end_log();
+  return grad_check_verdict(opt, max_e);
+}
@@ -0,0 +1,432 @@
+/**
+   @file mnist_server.h
+   @brief serve predictions of a (trained) MNIST network, coalescing
+   requests into micro batches
+ */
+#pragma once
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "mnist_util.h"
+#include "mnist.h"
+#include "mnist_infer.h"
+
+/**
+   @brief set by SIGINT/SIGTERM to stop a server
+ */
+static volatile sig_atomic_t mnist_server_stop = 0;
+
+/**
+   @brief the handler of SIGINT/SIGTERM while serving
+ */
+static void mnist_server_on_signal(int sig) {
+  (void)sig;
+  mnist_server_stop = 1;
+}
+
+/**
+   @brief a server of predictions
+   @details a client sends images, each C x H x W bytes of pixels
+   (0..255, row major, as in MNIST idx files), and gets a line
+   "<class>\n" for each image, in the order it sent them.
+   with --serve -, the only client is stdin/stdout and the server
+   ends at the end of stdin; with --serve PORT, any number of clients
+   connect to TCP PORT, and the server ends on SIGINT or SIGTERM.
+
+   a reader thread for each client queues its requests. run takes
+   the oldest request and waits until B requests are queued or the
+   oldest has waited deadline (--serve-deadline-us), then predicts
+   them in a single forward of the inference-only network
+   (MNIST<maxB,C,H,W,nC,0>::infer: no labels, no loss) and answers
+   them.  so under a light load a request waits at most deadline
+   for company, and under a heavy load batches are
+   full and wait for nothing.  latencies (from when a request has
+   been read to when its answer has been written) are reported
+   as p50/p99 along with the throughput (QPS).
+
+   usage:
+   mnist_server<maxB,C,H,W,nC> sv;
+   sv.init(mnist, &lgr, opt, mean, std);
+   sv.run();
+   sv.fini();
+ */
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC>
+struct mnist_server {
+  static const long img_sz = C * H * W; /**< bytes of a request */
+  static const int max_conns = 64;      /**< the maximum number of clients at a time */
+  static const long max_queue = 16 * maxB; /**< the maximum number of queued requests */
+  /**
+     @brief a request
+  */
+  struct request_t {
+    unsigned char px[img_sz];   /**< pixels */
+    int conn;                   /**< the client (index of conns) */
+    long t;                     /**< the time it has been read (ns) */
+  };
+  /**
+     @brief a client
+  */
+  struct conn_t {
+    mnist_server * sv;          /**< the server */
+    int in_fd;                  /**< requests come from */
+    int out_fd;                 /**< answers go to */
+    int used;                   /**< 1 if this slot is a client */
+    int eof;                    /**< 1 if no more requests come */
+    int broken;                 /**< 1 if answers could not be written */
+    long n_pending;             /**< requests not answered yet */
+  };
+  MNIST<maxB,C,H,W,nC,0> * mnist; /**< the network (inference-only) */
+  logger * lgr;                 /**< logger */
+  int cuda_algo;                /**< 1 if the network is on the device */
+  int stdio;                    /**< 1 if serving stdin/stdout */
+  real mean;                    /**< mean subtracted from pixels (in [0,1]) */
+  real std;                     /**< pixels are divided by this */
+  idx_t B;                      /**< the maximum number of requests in a micro batch */
+  long deadline_ns;             /**< the maximum time the oldest request waits for others */
+  request_t * queue;            /**< a ring of requests */
+  long head;                    /**< the number of requests taken from queue */
+  long tail;                    /**< the number of requests put into queue */
+  conn_t conns[max_conns];      /**< clients */
+  int n_open;                   /**< clients that may still send requests */
+  int listen_fd;                /**< the listening socket (-1 for stdin/stdout) */
+  pthread_mutex_t mx;           /**< protects the queue and the clients */
+  pthread_cond_t cv;            /**< signaled when they change */
+  long * lat;                   /**< latencies of answered requests (ns) */
+  long n_lat;                   /**< the number of answered requests */
+  long cap_lat;                 /**< the capacity of lat */
+  long n_batches;               /**< the number of micro batches */
+  long t_first;                 /**< the time the first request has been read */
+  long t_last;                  /**< the time the last answer has been written */
+
+  /**
+     @brief initialize a server (start listening if --serve PORT)
+     @param (mnist) the network (weights should have been copied from a trained one)
+     @param (lgr) logger
+     @param (opt) command line options
+     @param (mean) mean subtracted from pixels (as in the training data)
+     @param (std) pixels are divided by this
+  */
+  void init(MNIST<maxB,C,H,W,nC,0> * mnist, logger * lgr, cmdline_opt& opt, real mean, real std) {
+    this->mnist = mnist;
+    this->lgr = lgr;
+    this->cuda_algo = opt.cuda_algo;
+    this->mean = mean;
+    this->std = std;
+    B = min_i(opt.batch_size, maxB);
+    deadline_ns = opt.serve_deadline_us * 1000;
+    queue = new request_t[max_queue];
+    head = tail = 0;
+    memset(conns, 0, sizeof(conns));
+    n_open = 0;
+    pthread_mutex_init(&mx, 0);
+    pthread_cond_init(&cv, 0);
+    cap_lat = 1024;
+    lat = (long *)malloc(sizeof(long) * cap_lat);
+    n_lat = 0;
+    n_batches = 0;
+    t_first = t_last = 0;
+    stdio = (strcmp(opt.serve, "-") == 0);
+    listen_fd = -1;
+    if (!stdio) {
+      listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (listen_fd == -1) err(1, "socket");
+      int one = 1;
+      setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      struct sockaddr_in a;
+      memset(&a, 0, sizeof(a));
+      a.sin_family = AF_INET;
+      a.sin_addr.s_addr = htonl(INADDR_ANY);
+      a.sin_port = htons(atoi(opt.serve));
+      if (bind(listen_fd, (struct sockaddr *)&a, sizeof(a)) == -1) err(1, "bind %s", opt.serve);
+      if (listen(listen_fd, 64) == -1) err(1, "listen");
+      socklen_t len = sizeof(a);
+      getsockname(listen_fd, (struct sockaddr *)&a, &len);
+      lgr->log(1, "serving on TCP port %d", (int)ntohs(a.sin_port));
+    }
+    /* a client that went away must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = mnist_server_on_signal;
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+  }
+  /**
+     @brief release the resources
+  */
+  void fini() {
+    if (listen_fd != -1) close(listen_fd);
+    delete[] queue;
+    free(lat);
+    pthread_mutex_destroy(&mx);
+    pthread_cond_destroy(&cv);
+  }
+  /**
+     @brief read exactly n bytes from fd
+     @returns 1 if it did, 0 at the end of file (or on an error)
+  */
+  static int read_full(int fd, void * buf, long n) {
+    long r = 0;
+    while (r < n) {
+      ssize_t k = read(fd, (char *)buf + r, n - r);
+      if (k == -1 && errno == EINTR) continue;
+      if (k <= 0) return 0;
+      r += k;
+    }
+    return 1;
+  }
+  /**
+     @brief write exactly n bytes to fd
+     @returns 1 if it did
+  */
+  static int write_full(int fd, const void * buf, long n) {
+    long w = 0;
+    while (w < n) {
+      ssize_t k = write(fd, (const char *)buf + w, n - w);
+      if (k == -1 && errno == EINTR) continue;
+      if (k <= 0) return 0;
+      w += k;
+    }
+    return 1;
+  }
+  /**
+     @brief take a slot of conns for a client (call it with mx held)
+     @returns the index of the slot or -1 if there are too many clients
+  */
+  int add_conn(int in_fd, int out_fd) {
+    for (int c = 0; c < max_conns; c++) {
+      conn_t& k = conns[c];
+      if (!k.used) {
+        k.sv = this;
+        k.in_fd = in_fd;
+        k.out_fd = out_fd;
+        k.used = 1;
+        k.eof = 0;
+        k.broken = 0;
+        k.n_pending = 0;
+        n_open++;
+        return c;
+      }
+    }
+    return -1;
+  }
+  /**
+     @brief free the slot of a client who sends no more and has got all answers
+     (call it with mx held)
+  */
+  void close_conn_if_done(int c) {
+    conn_t& k = conns[c];
+    if (k.used && k.eof && k.n_pending == 0) {
+      if (!stdio) close(k.in_fd);
+      k.used = 0;
+    }
+  }
+  /**
+     @brief the body of the reader thread of a client
+  */
+  void read_requests(int c) {
+    conn_t& k = conns[c];
+    unsigned char px[img_sz];
+    while (read_full(k.in_fd, px, img_sz)) {
+      long t = get_tsc().ns;
+      pthread_mutex_lock(&mx);
+      while (tail - head >= max_queue && !mnist_server_stop) {
+        pthread_cond_wait(&cv, &mx);
+      }
+      if (mnist_server_stop) {
+        pthread_mutex_unlock(&mx);
+        break;
+      }
+      request_t& r = queue[tail % max_queue];
+      memcpy(r.px, px, img_sz);
+      r.conn = c;
+      r.t = t;
+      if (t_first == 0) t_first = t;
+      tail++;
+      k.n_pending++;
+      pthread_cond_broadcast(&cv);
+      pthread_mutex_unlock(&mx);
+    }
+    pthread_mutex_lock(&mx);
+    k.eof = 1;
+    n_open--;
+    close_conn_if_done(c);
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mx);
+  }
+  /**
+     @brief the entry point of the reader thread
+  */
+  static void * read_requests_(void * arg) {
+    conn_t * k = (conn_t *)arg;
+    k->sv->read_requests(k - k->sv->conns);
+    return 0;
+  }
+  /**
+     @brief start the reader thread of client c
+  */
+  void start_reader(int c) {
+    pthread_t th;
+    if (pthread_create(&th, 0, read_requests_, &conns[c])) err(1, "pthread_create");
+    pthread_detach(th);
+  }
+  /**
+     @brief the body of the thread accepting TCP clients
+  */
+  void accept_clients() {
+    while (!mnist_server_stop) {
+      int fd = accept(listen_fd, 0, 0);
+      if (fd == -1) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        break;
+      }
+      pthread_mutex_lock(&mx);
+      int c = add_conn(fd, fd);
+      pthread_mutex_unlock(&mx);
+      if (c == -1) {
+        lgr->log(1, "too many clients (%d); refused one", max_conns);
+        close(fd);
+      } else {
+        start_reader(c);
+      }
+    }
+  }
+  /**
+     @brief the entry point of the thread accepting TCP clients
+  */
+  static void * accept_clients_(void * arg) {
+    ((mnist_server *)arg)->accept_clients();
+    return 0;
+  }
+  /**
+     @brief 1 if no more requests will come (call it with mx held)
+  */
+  int finished() {
+    return mnist_server_stop || (stdio && n_open == 0);
+  }
+  /**
+     @brief wait on cv until t (ns, the clock of get_tsc) at the latest
+  */
+  void wait_until(long t) {
+    struct timespec ts;
+    ts.tv_sec = t / 1000000000L;
+    ts.tv_nsec = t % 1000000000L;
+    pthread_cond_timedwait(&cv, &mx, &ts);
+  }
+  /**
+     @brief serve requests until no more come (stdin/stdout) or
+     SIGINT/SIGTERM (TCP), and report latencies
+  */
+  void run() {
+    pthread_mutex_lock(&mx);
+    if (stdio) {
+      start_reader(add_conn(0, 1));
+    } else {
+      pthread_t th;
+      if (pthread_create(&th, 0, accept_clients_, this)) err(1, "pthread_create");
+      pthread_detach(th);
+    }
+    int conn_of[maxB];
+    long t_of[maxB];
+    long t_report = get_tsc().ns;
+    while (1) {
+      while (tail == head && !finished()) {
+        wait_until(get_tsc().ns + 100 * 1000 * 1000);
+      }
+      if (tail == head || mnist_server_stop) break;
+      /* wait for company until the oldest request is due */
+      const long due = queue[head % max_queue].t + deadline_ns;
+      while (tail - head < B && !finished() && get_tsc().ns < due) {
+        wait_until(due);
+      }
+      const idx_t n = min_i(tail - head, B);
+      tensor<real,maxB,C,H,W>& x = mnist->x;
+      x.set_n0(n);
+      for (idx_t b = 0; b < n; b++) {
+        request_t& r = queue[(head + b) % max_queue];
+        real * xb = &x(b);
+        for (long k = 0; k < img_sz; k++) {
+          xb[k] = ((r.px[k] / 255.0) - mean) / std;
+        }
+        conn_of[b] = r.conn;
+        t_of[b] = r.t;
+      }
+      head += n;
+      pthread_cond_broadcast(&cv);
+      pthread_mutex_unlock(&mx);
+      /* predict and answer */
+      to_dev(&x, cuda_algo);
+      mnist->infer(x, mnist->pred);
+      for (idx_t b = 0; b < n; b++) {
+        conn_t& k = conns[conn_of[b]];
+        char line[16];
+        int len = snprintf(line, sizeof(line), "%d\n", (int)mnist->pred(b));
+        if (!k.broken && !write_full(k.out_fd, line, len)) k.broken = 1;
+      }
+      const long t = get_tsc().ns;
+      pthread_mutex_lock(&mx);
+      for (idx_t b = 0; b < n; b++) {
+        add_latency(t - t_of[b]);
+        conns[conn_of[b]].n_pending--;
+        close_conn_if_done(conn_of[b]);
+      }
+      n_batches++;
+      t_last = t;
+      if (t - t_report > 10L * 1000 * 1000 * 1000) {
+        report();
+        t_report = t;
+      }
+    }
+    pthread_mutex_unlock(&mx);
+    report();
+  }
+  /**
+     @brief record the latency of a request
+  */
+  void add_latency(long dt) {
+    if (n_lat == cap_lat) {
+      cap_lat *= 2;
+      lat = (long *)realloc(lat, sizeof(long) * cap_lat);
+      if (!lat) err(1, "realloc");
+    }
+    lat[n_lat++] = dt;
+  }
+  /**
+     @brief compare latencies for qsort
+  */
+  static int cmp_long(const void * a, const void * b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x < y ? -1 : x > y);
+  }
+  /**
+     @brief log (and, with stdin/stdout, print to stderr) the number of
+     requests, micro batches, QPS and p50/p99 latencies so far
+  */
+  void report() {
+    if (n_lat == 0) {
+      lgr->log(1, "served no requests");
+      return;
+    }
+    long * s = (long *)malloc(sizeof(long) * n_lat);
+    if (!s) err(1, "malloc");
+    memcpy(s, lat, sizeof(long) * n_lat);
+    qsort(s, n_lat, sizeof(long), cmp_long);
+    const double p50 = s[(n_lat - 1) * 50 / 100] * 1.0e-6;
+    const double p99 = s[(n_lat - 1) * 99 / 100] * 1.0e-6;
+    free(s);
+    const double dt = (t_last - t_first) * 1.0e-9;
+    const double qps = (dt > 0 ? n_lat / dt : 0.0);
+    char msg[256];
+    snprintf(msg, sizeof(msg),
+             "served %ld requests in %ld micro batches (%.1f per batch),"
+             " %.1f QPS, latency p50 %.3f ms p99 %.3f ms",
+             n_lat, n_batches, (double)n_lat / n_batches, qps, p50, p99);
+    lgr->log(1, "%s", msg);
+    if (stdio) fprintf(stderr, "%s\n", msg);
+  }
+};
@@ -14,6 +14,9 @@
 #include <stdint.h>
 #include <time.h>
 #include <unistd.h>
+
+#include "profiler.h"
+
 #if 0
 #include <ieee754.h>
 #endif
@@ -61,6 +64,7 @@ static void bail() {
    @brief signal a fatal error when a CUDA GPU function gets called when it is not compiled 
    by CUDA-enabled compiler setting
  */
+__attribute__((unused))
 static void err_cuda_code_non_cuda_compiler_(const char * file, int line, const char * algo_s) {
   fprintf(stderr,
           "error:%s:%d: a supposedly CUDA function (%s) compiled by non-CUDA compiler and gets called\n",
@@ -87,6 +91,14 @@ typedef enum {
   algo_cpu_cl_vec,
   algo_cpu_omp_simd,
   algo_cuda_fast,
+  algo_cpu_gemm,
+  algo_cpu_blas_like,
+  algo_cpu_winograd,
+  algo_cuda_tc,
+  algo_cpu_nchwc,               /* activations in blocks of channels (tensor::blk) */
+  algo_cpu_intrin,              /* intrinsic kernels of the ISA chosen at startup (intrin.h) */
+  algo_cpu_int8,                /* int8 inference after training in real (quant.h) */
+  algo_auto,                    /* each layer gets the fastest algorithm (autotune.h) */
   /* algo_cpu_simd? */
   /* algo_cpu_omp */
   /* algo_cpu_simd_omp? */
@@ -118,17 +130,68 @@ static algo_t parse_algo(const char * s) {
   else if (strcmp(s, "cpu_omp_simd") == 0) {
     return algo_cpu_omp_simd;
   }
+  else if (strcmp(s, "cpu_gemm") == 0) {
+    return algo_cpu_gemm;
+  }
+  else if (strcmp(s, "cpu_blas_like") == 0) {
+    return algo_cpu_blas_like;
+  }
+  else if (strcmp(s, "cpu_winograd") == 0) {
+    return algo_cpu_winograd;
+  }
+  else if (strcmp(s, "cpu_nchwc") == 0) {
+    return algo_cpu_nchwc;
+  }
+  else if (strcmp(s, "cpu_intrin") == 0) {
+    return algo_cpu_intrin;
+  }
+  else if (strcmp(s, "cpu_int8") == 0) {
+    return algo_cpu_int8;
+  }
   else if (strcmp(s, "cuda_base") == 0) {
     return algo_cuda_base;
   } 
   else if (strcmp(s, "cuda_fast") == 0) {
     return algo_cuda_fast;
   }
+  else if (strcmp(s, "cuda_tc") == 0) {
+    return algo_cuda_tc;
+  }
+  else if (strcmp(s, "auto") == 0) {
+    return algo_auto;
+  }
   else {
     return algo_invalid;
   }
 }
 
+/**
+   @brief the name of an algorithm (the inverse of parse_algo)
+   @details when you add your algorithm, add its name here too,
+   so that --bench sweeps it
+ */
+__attribute__((unused))
+static const char * algo_name(algo_t a) {
+  switch (a) {
+  case algo_cpu_base:      return "cpu_base";
+  case algo_cuda_base:     return "cuda_base";
+  case algo_cpu_omp:       return "cpu_omp";
+  case algo_cpu_simd:      return "cpu_simd";
+  case algo_cpu_cl_vec:    return "cpu_cl_vec";
+  case algo_cpu_omp_simd:  return "cpu_omp_simd";
+  case algo_cuda_fast:     return "cuda_fast";
+  case algo_cpu_gemm:      return "cpu_gemm";
+  case algo_cpu_blas_like: return "cpu_blas_like";
+  case algo_cpu_winograd:  return "cpu_winograd";
+  case algo_cuda_tc:       return "cuda_tc";
+  case algo_cpu_nchwc:     return "cpu_nchwc";
+  case algo_cpu_intrin:    return "cpu_intrin";
+  case algo_cpu_int8:      return "cpu_int8";
+  case algo_auto:          return "auto";
+  default:                 return "invalid";
+  }
+}
+
 /**
    @brief return 1 if the algorithm name (s) or its
    enum value (a) is a CUDA algorithm 
@@ -150,6 +213,46 @@ static int algo_is_cuda(const char * s, algo_t a) {
   }
 }
 
+/**
+   @brief return 1 if the algorithm computes with operands of
+   less precision than real (e.g., FP16 on tensor cores)
+   @details grad_check uses larger perturbations for such algorithms,
+   since a perturbation of 1.0e-3 is below the resolution of FP16
+  */
+__attribute__((unused))
+static int algo_is_reduced_precision(algo_t a) {
+  return a == algo_cuda_tc;
+}
+
+/**
+   @brief return 1 if the algorithm lays out activations and their
+   gradients in blocks of channels (tensor::blk) instead of (b,c,i,j)
+   @details all layers of a network must then use it, as they
+   exchange tensors in that layout; --algo auto does not choose it
+   for a layer alone
+  */
+__attribute__((unused))
+static int algo_is_blocked(algo_t a) {
+  return a == algo_cpu_nchwc;
+}
+
+/**
+   @brief return 1 if the algorithm is only for the inference-only
+   network (MNIST<...,0>)
+   @details the training network runs int8_train_algo instead;
+   --bench and --algo auto do not measure it for training layers
+  */
+__attribute__((unused))
+static int algo_is_inference_only(algo_t a) {
+  return a == algo_cpu_int8;
+}
+
+/**
+   @brief the algorithm the training network runs under an
+   inference-only algorithm (-a cpu_int8)
+  */
+static const algo_t int8_train_algo = algo_cpu_intrin;
+
 /**
    @brief command line options
 */
@@ -165,7 +268,45 @@ struct cmdline_opt {
   long weight_seed;             /**< random seed to initialize weights and dropout */
   long dropout_seed_1;          /**< random seed to determine which elements to drop dropout layer 1 */
   long dropout_seed_2;          /**< random seed to determine which elements to drop dropout layer 2 */
+  long shuffle_seed;            /**< random seed to shuffle training data at each epoch (0 : no shuffling) */
   int grad_dbg;                 /**< 1 if we debug gradient */
+  double grad_tol;              /**< grad checks fail if the max relative error exceeds this (0 : just report) */
+  real loss_scale;              /**< the loss is multiplied by this in backward and gradients are divided by it in update */
+  int fuse;                     /**< 1 if conv2-relu2-max_pooling_2d-dropout1 are fused */
+  int inplace;                  /**< 1 if relu and dropout layers of MNIST work in place */
+  int prefetch;                 /**< the number of mini batches a loader thread reads ahead (0 : no loader thread) */
+  int data_cache;               /**< 1 if normalized data are cached in a file next to the data files */
+  int cuda_exec;                /**< 0 : sync after each kernel, 1 : stream-ordered, 2 : replay a CUDA graph of each training step */
+  long dp_bucket_kb;            /**< data-parallel replicas all-reduce gradients in buckets of about this many KB */
+  const char * save;            /**< file to save checkpoints to ("" : none) */
+  const char * load;            /**< checkpoint to start training or serving from ("" : none) */
+  long checkpoint_every;        /**< save a checkpoint every this epochs (0 : only at the end) */
+  const char * serve;           /**< serve predictions instead of training ("" : train, "-" : stdin/stdout, otherwise a TCP port) */
+  long serve_deadline_us;       /**< a request waits at most this long (us) for others to fill a micro batch */
+  long prof_events;             /**< the profiler keeps this many latest kernel events */
+  const char * prof_csv;        /**< file to write kernel events to as CSV ("" : none) */
+  const char * prof_trace;      /**< file to write kernel events to as a Chrome trace ("" : none) */
+  int kernel_log;               /**< 1 if the start and end of each kernel are also written to the log as text */
+  double peak_gflops;           /**< peak GFLOP/s of the machine for the roofline in the profile (0 : unknown) */
+  double peak_gbs;              /**< peak memory bandwidth (GB/s) of the machine for the roofline in the profile (0 : unknown) */
+  const char * bench;           /**< *_main functions benchmark the layer and append results to this file as CSV, instead of checking gradients ("" : no) */
+  const char * bench_algos;     /**< comma-separated algorithms --bench sweeps ("" : all this build can run) */
+  int bench_warmup;             /**< --bench runs each configuration this many times before measuring */
+  int bench_reps;               /**< --bench measures each configuration this many times */
+  const char * tune_file;       /**< --algo auto caches the algorithms it chose for layers in this file ("" : no cache) */
+  int tune_reps;                /**< --algo auto measures each candidate algorithm of a layer this many times */
+  const char * isa;             /**< instruction set of the cpu_intrin kernels (auto, generic, avx2, avx512 or neon) */
+  int numa;                     /**< 1 if OpenMP threads are pinned and activations and gradients first touched by the threads that compute them (cpu only) */
+  int eval_every;               /**< evaluate the test data every this many epochs (and after the last) */
+  int eval_async;               /**< 1 if the test data is evaluated on a snapshot of weights while the next epoch trains */
+  int eval_threads;             /**< the number of OpenMP threads of the asynchronous evaluation (cpu only) */
+  int int8_calib;               /**< -a cpu_int8 records activation ranges on this many training batches */
+  int accum_steps;              /**< weights are updated once every this many batches, with the sum of their gradients */
+  int log_pred;                 /**< 1 if the prediction of each sample is written to the log (0 : only per-batch sums come back from the GPU) */
+  int hybrid;                   /**< 1 : conv1 .. dropout1 on the GPU and fc1 .. nll_softmax on the CPU; 2 : the reverse; 0 : all layers on the device of --algo */
+  const char * hybrid_algo_s;   /**< the CPU algorithm of the layers --hybrid puts on the CPU */
+  algo_t hybrid_algo;           /**< parse_algo(hybrid_algo_s) */
+  int hybrid_micro;             /**< --hybrid streams each test batch through the two stages in this many micro batches */
   const char * algo_s;          /**< string passed to --algo */
   algo_t algo;                  /**< parse_algo(algo_s)  */
   int cuda_algo;                 /**< 1 if this is a CUDA algorithm  */
@@ -187,7 +328,45 @@ struct cmdline_opt {
     weight_seed  = 45678901234523L;
     dropout_seed_1 = 56789012345234L;
     dropout_seed_2 = 67890123452345L;
+    shuffle_seed = 0;
     grad_dbg = 0;
+    grad_tol = 0.0;
+    loss_scale = 1.0;
+    fuse = 0;
+    inplace = 0;
+    prefetch = 2;
+    data_cache = 1;
+    cuda_exec = 0;
+    dp_bucket_kb = 1024;
+    save = "";
+    load = "";
+    checkpoint_every = 0;
+    serve = "";
+    serve_deadline_us = 1000;
+    prof_events = 65536;
+    prof_csv = "";
+    prof_trace = "";
+    kernel_log = 0;
+    peak_gflops = 0.0;
+    peak_gbs = 0.0;
+    bench = "";
+    bench_algos = "";
+    bench_warmup = 2;
+    bench_reps = 10;
+    tune_file = "mnist.tune";
+    tune_reps = 3;
+    isa = "auto";
+    numa = 0;
+    eval_every = 1;
+    eval_async = 0;
+    eval_threads = 1;
+    int8_calib = 16;
+    accum_steps = 1;
+    log_pred = 1;
+    hybrid = 0;
+    hybrid_algo_s = algo_name(int8_train_algo);
+    hybrid_algo = algo_invalid;
+    hybrid_micro = 4;
 #if __CUDACC__    
     algo_s = "cuda_base";
     cuda_algo = 1;
@@ -217,7 +396,44 @@ static struct option long_options[] = {
   {"weight-seed",       required_argument, 0,  0  },
   {"dropout-seed-1",    required_argument, 0,  0  },
   {"dropout-seed-2",    required_argument, 0,  0  },
+  {"shuffle-seed",      required_argument, 0,  0  },
   {"grad-dbg",          required_argument, 0,  0  },
+  {"grad-tol",          required_argument, 0,  0  },
+  {"loss-scale",        required_argument, 0,  0  },
+  {"fuse",              required_argument, 0,  0  },
+  {"inplace",           required_argument, 0,  0  },
+  {"prefetch",          required_argument, 0,  0  },
+  {"data-cache",        required_argument, 0,  0  },
+  {"cuda-exec",         required_argument, 0,  0  },
+  {"dp-bucket-kb",      required_argument, 0,  0  },
+  {"save",              required_argument, 0,  0  },
+  {"load",              required_argument, 0,  0  },
+  {"checkpoint-every",  required_argument, 0,  0  },
+  {"serve",             required_argument, 0,  0  },
+  {"serve-deadline-us", required_argument, 0,  0  },
+  {"prof-events",       required_argument, 0,  0  },
+  {"prof-csv",          required_argument, 0,  0  },
+  {"prof-trace",        required_argument, 0,  0  },
+  {"kernel-log",        required_argument, 0,  0  },
+  {"peak-gflops",       required_argument, 0,  0  },
+  {"peak-gbs",          required_argument, 0,  0  },
+  {"bench",             required_argument, 0,  0  },
+  {"bench-algos",       required_argument, 0,  0  },
+  {"bench-warmup",      required_argument, 0,  0  },
+  {"bench-reps",        required_argument, 0,  0  },
+  {"tune-file",         required_argument, 0,  0  },
+  {"tune-reps",         required_argument, 0,  0  },
+  {"isa",               required_argument, 0,  0  },
+  {"numa",              required_argument, 0,  0  },
+  {"eval-every",        required_argument, 0,  0  },
+  {"eval-async",        required_argument, 0,  0  },
+  {"eval-threads",      required_argument, 0,  0  },
+  {"int8-calib",        required_argument, 0,  0  },
+  {"accum-steps",       required_argument, 0,  0  },
+  {"log-pred",          required_argument, 0,  0  },
+  {"hybrid",            required_argument, 0,  0  },
+  {"hybrid-algo",       required_argument, 0,  0  },
+  {"hybrid-micro",      required_argument, 0,  0  },
   {"algo",              required_argument, 0, 'a' },
   {"log",               required_argument, 0,  0  },
   {"help",              required_argument, 0, 'h' },
@@ -237,7 +453,7 @@ static void usage(const char * prog) {
           " -d,--data-dir D : read data from D [%s]\n"
           " -m,--epochs N : run N epochs [%ld]\n"
           " -b,--batch-size N : set batch size to N [%d]\n"
-          " -a,--algo ALGORITHM : set the algorithm (implementation) used [%s]\n"
+          " -a,--algo ALGORITHM : set the algorithm (implementation) used (auto : the fastest for each layer) [%s]\n"
           " -v,--verbose L : set verbosity level to L [%d]\n"
           " -l,--lr ETA : set learning rate to ETA [%f]\n"
           " --train-data-size N : set training data size to N [%d]\n"
@@ -245,8 +461,45 @@ static void usage(const char * prog) {
           " --log-interval N : show progress every N batches [%ld]\n"
           " --dropout-seed-1 S : set seed for dropout layer 1 to S [%ld]\n"
           " --dropout-seed-2 S : set seed for dropout layer 2 to S [%ld]\n"
+          " --shuffle-seed S : shuffle training data at each epoch with seed S (0 : no shuffling) [%ld]\n"
           " --weight-seed S : set seed for initial weights to S [%ld]\n"
           " --grad-dbg 0/1 : debug gradient computation [%d]\n"
+          " --grad-tol E : gradient checks fail if the max relative error exceeds E (0 : no verdict) [%g]\n"
+          " --loss-scale S : scale the loss by S in backward (e.g., 128 for cuda_tc) [%f]\n"
+          " --fuse 0/1 : fuse conv2, relu2, max_pooling_2d and dropout1 (cpu only) [%d]\n"
+          " --inplace 0/1 : relu and dropout overwrite their inputs (cpu only) [%d]\n"
+          " --prefetch N : a loader thread prepares up to N mini batches ahead (0 : none) [%d]\n"
+          " --data-cache 0/1 : map normalized data from a cache file written next to the data files [%d]\n"
+          " --cuda-exec 0/1/2 : sync after each kernel (0), only when results come back (1), or replay a CUDA graph of each training step (2) [%d]\n"
+          " --dp-bucket-kb N : data-parallel replicas (-DUSE_MPI=1 builds) all-reduce gradients in buckets of about N KB [%ld]\n"
+          " --save FILE : save checkpoints (weights and optimizer states) to FILE [%s]\n"
+          " --load FILE : resume training (or serve) from the checkpoint FILE [%s]\n"
+          " --checkpoint-every N : with --save, save a checkpoint every N epochs (0 : only at the end) [%ld]\n"
+          " --serve -/PORT : serve predictions of images from stdin (-) or TCP PORT instead of training [%s]\n"
+          " --serve-deadline-us N : a request waits at most N us for others to fill a micro batch [%ld]\n"
+          " --prof-events N : the profiler keeps the latest N kernel events [%ld]\n"
+          " --prof-csv FILE : write kernel events to FILE as CSV [%s]\n"
+          " --prof-trace FILE : write kernel events to FILE as a Chrome trace (chrome://tracing, ui.perfetto.dev) [%s]\n"
+          " --kernel-log 0/1 : also write the start and end of each kernel to the log (for mnist_viewer) [%d]\n"
+          " --peak-gflops G : peak GFLOP/s of the machine for the roofline in the kernel profile (0 : unknown) [%g]\n"
+          " --peak-gbs G : peak memory bandwidth (GB/s) of the machine for the roofline in the kernel profile (0 : unknown) [%g]\n"
+          " --bench FILE : (*_main of layers) benchmark the layer over algorithms, batch sizes and threads and append results to FILE as CSV [%s]\n"
+          " --bench-algos A,B,.. : algorithms --bench sweeps (empty : all this build can run) [%s]\n"
+          " --bench-warmup N : --bench runs each configuration N times before measuring [%d]\n"
+          " --bench-reps N : --bench measures each configuration N times [%d]\n"
+          " --tune-file FILE : -a auto caches the algorithms it chose for layers in FILE (empty : no cache) [%s]\n"
+          " --tune-reps N : -a auto measures each candidate algorithm of a layer N times [%d]\n"
+          " --isa I : instruction set of -a cpu_intrin kernels (auto : the widest the CPU has, generic, avx2, avx512, neon) [%s]\n"
+          " --numa 0/1 : pin OpenMP threads node by node and first touch activations and gradients from the threads that compute them (cpu only) [%d]\n"
+          " --eval-every N : evaluate the test data every N epochs and after the last [%d]\n"
+          " --eval-async 0/1 : evaluate the test data on a snapshot of weights while the next epoch trains [%d]\n"
+          " --eval-threads N : the number of OpenMP threads of --eval-async 1 (cpu only) [%d]\n"
+          " --int8-calib N : -a cpu_int8 calibrates activation ranges on N training batches [%d]\n"
+          " --accum-steps N : accumulate gradients of N batches before each update (a virtual batch of N x B) [%d]\n"
+          " --log-pred 0/1 : write the prediction of each sample to the log (0 : only the loss and the number of correct predictions of each batch come back from the GPU) [%d]\n"
+          " --hybrid 0/1/2 : run conv1..dropout1 on the GPU and fc1..nll_softmax (and their updates) on the CPU (1), the reverse (2), or all layers on the device of --algo (0) [%d]\n"
+          " --hybrid-algo ALGORITHM : the CPU algorithm of the layers --hybrid puts on the CPU [%s]\n"
+          " --hybrid-micro N : --hybrid streams each test batch through the two stages in N micro batches [%d]\n"
           " --log FILE : write log to FILE [%s]\n"
           " -h,--help\n",
           prog,
@@ -261,8 +514,45 @@ static void usage(const char * prog) {
           o.log_interval,
           o.dropout_seed_1,
           o.dropout_seed_2,
+          o.shuffle_seed,
           o.weight_seed,
           o.grad_dbg,
+          o.grad_tol,
+          o.loss_scale,
+          o.fuse,
+          o.inplace,
+          o.prefetch,
+          o.data_cache,
+          o.cuda_exec,
+          o.dp_bucket_kb,
+          o.save,
+          o.load,
+          o.checkpoint_every,
+          o.serve,
+          o.serve_deadline_us,
+          o.prof_events,
+          o.prof_csv,
+          o.prof_trace,
+          o.kernel_log,
+          o.peak_gflops,
+          o.peak_gbs,
+          o.bench,
+          o.bench_algos,
+          o.bench_warmup,
+          o.bench_reps,
+          o.tune_file,
+          o.tune_reps,
+          o.isa,
+          o.numa,
+          o.eval_every,
+          o.eval_async,
+          o.eval_threads,
+          o.int8_calib,
+          o.accum_steps,
+          o.log_pred,
+          o.hybrid,
+          o.hybrid_algo_s,
+          o.hybrid_micro,
           o.log
           );
   exit(1);
@@ -295,8 +585,82 @@ static cmdline_opt parse_args(int argc, char ** argv) {
           opt.dropout_seed_1 = atol(optarg);
         } else if (strcmp(o, "dropout-seed-2") == 0) {
           opt.dropout_seed_2 = atol(optarg);
+        } else if (strcmp(o, "shuffle-seed") == 0) {
+          opt.shuffle_seed = atol(optarg);
         } else if (strcmp(o, "grad-dbg") == 0) {
           opt.grad_dbg = atoi(optarg);
+        } else if (strcmp(o, "grad-tol") == 0) {
+          opt.grad_tol = atof(optarg);
+        } else if (strcmp(o, "loss-scale") == 0) {
+          opt.loss_scale = atof(optarg);
+        } else if (strcmp(o, "fuse") == 0) {
+          opt.fuse = atoi(optarg);
+        } else if (strcmp(o, "inplace") == 0) {
+          opt.inplace = atoi(optarg);
+        } else if (strcmp(o, "prefetch") == 0) {
+          opt.prefetch = atoi(optarg);
+        } else if (strcmp(o, "data-cache") == 0) {
+          opt.data_cache = atoi(optarg);
+        } else if (strcmp(o, "cuda-exec") == 0) {
+          opt.cuda_exec = atoi(optarg);
+        } else if (strcmp(o, "dp-bucket-kb") == 0) {
+          opt.dp_bucket_kb = atol(optarg);
+        } else if (strcmp(o, "save") == 0) {
+          opt.save = strdup(optarg);
+        } else if (strcmp(o, "load") == 0) {
+          opt.load = strdup(optarg);
+        } else if (strcmp(o, "checkpoint-every") == 0) {
+          opt.checkpoint_every = atol(optarg);
+        } else if (strcmp(o, "serve") == 0) {
+          opt.serve = strdup(optarg);
+        } else if (strcmp(o, "serve-deadline-us") == 0) {
+          opt.serve_deadline_us = atol(optarg);
+        } else if (strcmp(o, "prof-events") == 0) {
+          opt.prof_events = atol(optarg);
+        } else if (strcmp(o, "prof-csv") == 0) {
+          opt.prof_csv = strdup(optarg);
+        } else if (strcmp(o, "prof-trace") == 0) {
+          opt.prof_trace = strdup(optarg);
+        } else if (strcmp(o, "kernel-log") == 0) {
+          opt.kernel_log = atoi(optarg);
+        } else if (strcmp(o, "peak-gflops") == 0) {
+          opt.peak_gflops = atof(optarg);
+        } else if (strcmp(o, "peak-gbs") == 0) {
+          opt.peak_gbs = atof(optarg);
+        } else if (strcmp(o, "bench") == 0) {
+          opt.bench = strdup(optarg);
+        } else if (strcmp(o, "bench-algos") == 0) {
+          opt.bench_algos = strdup(optarg);
+        } else if (strcmp(o, "bench-warmup") == 0) {
+          opt.bench_warmup = atoi(optarg);
+        } else if (strcmp(o, "bench-reps") == 0) {
+          opt.bench_reps = atoi(optarg);
+        } else if (strcmp(o, "tune-file") == 0) {
+          opt.tune_file = strdup(optarg);
+        } else if (strcmp(o, "tune-reps") == 0) {
+          opt.tune_reps = atoi(optarg);
+        } else if (strcmp(o, "isa") == 0) {
+          opt.isa = strdup(optarg);
+        } else if (strcmp(o, "numa") == 0) {
+          opt.numa = atoi(optarg);
+        } else if (strcmp(o, "eval-every") == 0) {
+          opt.eval_every = atoi(optarg);
+        } else if (strcmp(o, "eval-async") == 0) {
+          opt.eval_async = atoi(optarg);
+        } else if (strcmp(o, "eval-threads") == 0) {
+          opt.eval_threads = atoi(optarg);
+        } else if (strcmp(o, "int8-calib") == 0) {
+          opt.int8_calib = atoi(optarg);
+        } else if (strcmp(o, "accum-steps") == 0) {
+          opt.accum_steps = atoi(optarg);
+        } else if (strcmp(o, "log-pred") == 0) {
+          opt.log_pred = atoi(optarg);
+        } else if (strcmp(o, "hybrid") == 0) {
+          opt.hybrid = atoi(optarg);
+        } else if (strcmp(o, "hybrid-algo") == 0) {
+          opt.hybrid_algo_s = strdup(optarg);
+        } else if (strcmp(o, "hybrid-micro") == 0) {
+          opt.hybrid_micro = atoi(optarg);
         } else if (strcmp(o, "log") == 0) {
           opt.log = strdup(optarg);
         } else {
@@ -341,6 +705,28 @@ static cmdline_opt parse_args(int argc, char ** argv) {
     opt.error = 1;
     return opt;
   }
+  if (opt.int8_calib < 1) {
+    fprintf(stderr, "error: --int8-calib (%d) must be >= 1\n", opt.int8_calib);
+    opt.error = 1;
+    return opt;
+  }
+  if (opt.accum_steps < 1) {
+    fprintf(stderr, "error: --accum-steps (%d) must be >= 1\n", opt.accum_steps);
+    opt.error = 1;
+    return opt;
+  }
+  if (opt.accum_steps > 1 && opt.cuda_exec == 2) {
+    fprintf(stderr, "error: --accum-steps > 1 cannot be used with --cuda-exec 2"
+            " (a graph would capture an update every batch)\n");
+    opt.error = 1;
+    return opt;
+  }
+  if (opt.eval_every < 1 || opt.eval_threads < 1) {
+    fprintf(stderr, "error: --eval-every (%d) and --eval-threads (%d) must be >= 1\n",
+            opt.eval_every, opt.eval_threads);
+    opt.error = 1;
+    return opt;
+  }
   opt.algo = parse_algo(opt.algo_s);
   if (opt.algo == algo_invalid) {
     fprintf(stderr, "error: invalid algorithm (%s)\n", opt.algo_s);
@@ -348,6 +734,10 @@ static cmdline_opt parse_args(int argc, char ** argv) {
     return opt;
   }
   opt.cuda_algo = algo_is_cuda(opt.algo_s, opt.algo);
+#if __CUDACC__
+  /* auto chooses among CUDA algorithms in CUDA builds */
+  if (opt.algo == algo_auto) opt.cuda_algo = 1;
+#endif
 #if !__CUDACC__
   if (opt.cuda_algo) {
     fprintf(stderr, "error: --cuda-base 1 allowed only with nvcc\n");
@@ -355,6 +745,35 @@ static cmdline_opt parse_args(int argc, char ** argv) {
     return opt;
   }
 #endif
+  if (opt.hybrid) {
+    if (opt.hybrid < 0 || opt.hybrid > 2 || opt.hybrid_micro < 1) {
+      fprintf(stderr, "error: --hybrid (%d) must be 0, 1 or 2 and --hybrid-micro (%d) >= 1\n",
+              opt.hybrid, opt.hybrid_micro);
+      opt.error = 1;
+      return opt;
+    }
+    if (!opt.cuda_algo) {
+      fprintf(stderr, "error: --hybrid splits layers between the GPU and the CPU; it needs a CUDA algorithm (-a %s)\n",
+              opt.algo_s);
+      opt.error = 1;
+      return opt;
+    }
+    opt.hybrid_algo = parse_algo(opt.hybrid_algo_s);
+    if (opt.hybrid_algo == algo_invalid || opt.hybrid_algo == algo_auto
+        || algo_is_cuda(opt.hybrid_algo_s, opt.hybrid_algo)
+        || algo_is_blocked(opt.hybrid_algo) || algo_is_inference_only(opt.hybrid_algo)) {
+      fprintf(stderr, "error: --hybrid-algo (%s) must be a CPU algorithm of the standard layout that trains\n",
+              opt.hybrid_algo_s);
+      opt.error = 1;
+      return opt;
+    }
+    if (opt.accum_steps > 1 || opt.cuda_exec == 2) {
+      fprintf(stderr, "error: --hybrid cannot be used with --accum-steps > 1 or --cuda-exec 2"
+              " (gradients and graphs would span both devices)\n");
+      opt.error = 1;
+      return opt;
+    }
+  }
   return opt;
 }
 
@@ -502,6 +921,60 @@ struct rnd_gen_t {
   }
 };
 
+/**
+   @brief counter-based pseudo random number generator (Philox-4x32-10)
+   @details unlike rnd_gen_t, it has no state that advances;
+   a random number is a pure function of (key, i, j).  threads can
+   therefore generate numbers for any elements in any order, the
+   result does not depend on the number of threads, and the same
+   number can be regenerated later (e.g., in backward) without
+   replaying the sequence.  it is the generator of
+   J. K. Salmon et al., Parallel Random Numbers: As Easy as 1, 2, 3 (SC'11).
+*/
+struct philox_t {
+  /**
+     @brief one round of Philox-4x32
+   */
+  __device__ __host__
+  static inline void round(uint32_t c[4], const uint32_t k[2]) {
+    const uint64_t p0 = (uint64_t)0xD2511F53u * c[0];
+    const uint64_t p1 = (uint64_t)0xCD9E8D57u * c[2];
+    const uint32_t c0 = (uint32_t)(p1 >> 32) ^ c[1] ^ k[0];
+    const uint32_t c2 = (uint32_t)(p0 >> 32) ^ c[3] ^ k[1];
+    c[1] = (uint32_t)p1;
+    c[3] = (uint32_t)p0;
+    c[0] = c0;
+    c[2] = c2;
+  }
+  /**
+     @brief return a 32 bit random number for key and counter (i, j)
+     @param (key) the key (e.g., seed)
+     @param (i) the first counter (e.g., index in the batch)
+     @param (j) the second counter (e.g., index of the element)
+   */
+  __device__ __host__
+  static inline uint32_t rand32(uint64_t key, uint64_t i, uint64_t j) {
+    uint32_t c[4] = { (uint32_t)j, (uint32_t)(j >> 32),
+                      (uint32_t)i, (uint32_t)(i >> 32) };
+    uint32_t k[2] = { (uint32_t)key, (uint32_t)(key >> 32) };
+    for (int r = 0; r < 10; r++) {
+      if (r > 0) {
+        k[0] += 0x9E3779B9u;
+        k[1] += 0xBB67AE85u;
+      }
+      round(c, k);
+    }
+    return c[0];
+  }
+  /**
+     @brief return a random number between 0 and 1 for key and counter (i, j)
+   */
+  __device__ __host__
+  static inline double rand01(uint64_t key, uint64_t i, uint64_t j) {
+    return rand32(key, i, j) / (double)(1UL << 32);
+  }
+};
+
 /**
    @brief if the algorithm is a CUDA algorithm, allocate a device shadow 
    of this object and set dev field of this and all subobjects. otherwise
@@ -645,6 +1118,7 @@ struct logger {
   cmdline_opt opt;              /**< command line options */
   FILE * log_fp;                /**< log file object */
   tsc_t t0;                     /**< the start time stamp */
+  profiler prof;                /**< kernel events and totals */
   /**
      @brief return the current time string like "Wed Jun 30 21:49:08 1993"
    */
@@ -668,22 +1142,27 @@ struct logger {
   int log(int level, const char * format, ...) {
     tsc_t t = get_tsc();
     long dt = t.ns - t0.ns;
+    /* lock the streams, so lines of threads (--eval-async) do not mix */
     if (log_fp) {
       va_list ap;
+      flockfile(log_fp);
       fprintf(log_fp, "%ld: ", dt);
       va_start(ap, format);
       vfprintf(log_fp, format, ap);
       va_end(ap);
       fprintf(log_fp, "\n");
+      funlockfile(log_fp);
     }
     if (opt.verbose>=level) {
       va_list ap;
+      flockfile(stdout);
       fprintf(stdout, "%ld: ", dt);
       va_start(ap, format);
       vfprintf(stdout, format, ap);
       va_end(ap);
       fprintf(stdout, "\n");
       fflush(stdout);
+      funlockfile(stdout);
     }
     return 1;
   }
@@ -696,6 +1175,7 @@ struct logger {
     log_fp = fopen(opt.log, "wb");
     if (!log_fp) { perror("fopen"); exit(1); }
     t0 = get_tsc();
+    prof.init(opt.prof_events > 0 ? opt.prof_events : 0);
     log(2, "open a log %s", cur_time_str());
     log_opt();
     log_host();
@@ -707,6 +1187,14 @@ struct logger {
    */
   int end_log() {
     if (log_fp) {
+      log_profile();
+      if (strlen(opt.prof_csv)) {
+        if (!prof.write_csv(opt.prof_csv, t0.ns)) perror(opt.prof_csv);
+      }
+      if (strlen(opt.prof_trace)) {
+        if (!prof.write_trace(opt.prof_trace, t0.ns)) perror(opt.prof_trace);
+      }
+      prof.fini();
       log(2, "close a log %s", cur_time_str());
       fclose(log_fp);
       log_fp = 0;
@@ -727,7 +1215,43 @@ struct logger {
     log(2, "weight-seed=%ld", opt.weight_seed);
     log(2, "dropout-seed-1=%ld", opt.dropout_seed_1);
     log(2, "dropout-seed-2=%ld", opt.dropout_seed_2);
+    log(2, "shuffle-seed=%ld", opt.shuffle_seed);
     log(2, "grad-dbg=%d", opt.grad_dbg);
+    log(2, "loss-scale=%f", opt.loss_scale);
+    log(2, "fuse=%d", opt.fuse);
+    log(2, "inplace=%d", opt.inplace);
+    log(2, "prefetch=%d", opt.prefetch);
+    log(2, "data_cache=%d", opt.data_cache);
+    log(2, "cuda_exec=%d", opt.cuda_exec);
+    log(2, "dp_bucket_kb=%ld", opt.dp_bucket_kb);
+    log(2, "save=%s", opt.save);
+    log(2, "load=%s", opt.load);
+    log(2, "checkpoint_every=%ld", opt.checkpoint_every);
+    log(2, "serve=%s", opt.serve);
+    log(2, "serve_deadline_us=%ld", opt.serve_deadline_us);
+    log(2, "prof_events=%ld", opt.prof_events);
+    log(2, "prof_csv=%s", opt.prof_csv);
+    log(2, "prof_trace=%s", opt.prof_trace);
+    log(2, "kernel_log=%d", opt.kernel_log);
+    log(2, "peak_gflops=%f", opt.peak_gflops);
+    log(2, "peak_gbs=%f", opt.peak_gbs);
+    log(2, "bench=%s", opt.bench);
+    log(2, "bench_algos=%s", opt.bench_algos);
+    log(2, "bench_warmup=%d", opt.bench_warmup);
+    log(2, "bench_reps=%d", opt.bench_reps);
+    log(2, "tune_file=%s", opt.tune_file);
+    log(2, "tune_reps=%d", opt.tune_reps);
+    log(2, "isa=%s", opt.isa);
+    log(2, "numa=%d", opt.numa);
+    log(2, "eval_every=%d", opt.eval_every);
+    log(2, "eval_async=%d", opt.eval_async);
+    log(2, "eval_threads=%d", opt.eval_threads);
+    log(2, "int8_calib=%d", opt.int8_calib);
+    log(2, "accum_steps=%d", opt.accum_steps);
+    log(2, "log_pred=%d", opt.log_pred);
+    log(2, "hybrid=%d", opt.hybrid);
+    log(2, "hybrid_algo_s=%s", opt.hybrid_algo_s);
+    log(2, "hybrid_micro=%d", opt.hybrid_micro);
     log(2, "algo=%d", opt.algo);
     log(2, "algo_s=%s", opt.algo_s);       // added
     log(2, "cuda_algo=%d", opt.cuda_algo); // added
@@ -796,13 +1320,51 @@ struct logger {
      @brief log the start of a function (f) 
    */
   void log_start_fun_(const char * f) {
-    log(4, "%s: starts", f);
+    if (opt.kernel_log) log(4, "%s: starts", f);
   }
   /**
-     @brief log the end of a function (f) 
+     @brief log the end of a function (f) called on obj
+     @details the call goes to the profiler; it is also written to
+     the log as text only with --kernel-log 1
    */
-  void log_end_fun_(const char * f, tsc_t t0, tsc_t t1) {
-    log(4, "%s: ends. took %ld nsec", f, t1.ns - t0.ns);
+  void log_end_fun_(const char * f, const void * obj, tsc_t t0, tsc_t t1,
+                    prof_phase_t phase, long B, double flops, double bytes) {
+    prof.record(f, obj, phase, B, t0.ns, t1.ns, flops, bytes);
+    if (opt.kernel_log) log(4, "%s: ends. took %ld nsec", f, t1.ns - t0.ns);
+  }
+  /**
+     @brief log a table of time, GFLOP/s and GB/s of each kernel
+     @details with --peak-gflops and --peak-gbs, it also shows the
+     roofline of each kernel (min(peak GFLOP/s, AI x peak GB/s), where
+     AI = flops / bytes) and how close to it the kernel ran
+   */
+  void log_profile() {
+    if (prof.n_kernels == 0) return;
+    const int roof = (opt.peak_gflops > 0 && opt.peak_gbs > 0);
+    log(1, "kernel profile (%ld calls%s):", prof.n,
+        (prof.n_kernels == profiler::max_kernels ? ", some kernels not counted" : ""));
+    log(1, "%-40s %-8s %8s %10s %10s %8s %8s %6s%s", "kernel", "phase",
+        "calls", "total ms", "avg us", "GFLOP/s", "GB/s", "AI",
+        (roof ? "     roof      %" : ""));
+    for (int i = 0; i < prof.n_kernels; i++) {
+      profiler::kernel_t& k = prof.kernels[i];
+      char lb[160];
+      prof.label(k.fun, k.obj, lb, sizeof(lb));
+      const double sec = k.ns * 1.0e-9;
+      const double gflops = (sec > 0 ? k.flops / sec * 1.0e-9 : 0.0);
+      const double gbs = (sec > 0 ? k.bytes / sec * 1.0e-9 : 0.0);
+      const double ai = (k.bytes > 0 ? k.flops / k.bytes : 0.0);
+      if (roof && k.flops > 0) {
+        const double r = fmin(opt.peak_gflops, ai * opt.peak_gbs);
+        log(1, "%-40s %-8s %8ld %10.3f %10.3f %8.2f %8.2f %6.2f %8.2f %5.1f%%",
+            lb, prof_phase_names[k.phase], k.n_calls, k.ns * 1.0e-6,
+            k.ns * 1.0e-3 / k.n_calls, gflops, gbs, ai, r, 100.0 * gflops / r);
+      } else {
+        log(1, "%-40s %-8s %8ld %10.3f %10.3f %8.2f %8.2f %6.2f",
+            lb, prof_phase_names[k.phase], k.n_calls, k.ns * 1.0e-6,
+            k.ns * 1.0e-3 / k.n_calls, gflops, gbs, ai);
+      }
+    }
   }
 };
 
@@ -817,7 +1379,15 @@ struct logger {
    @details just log_end_fun(lgr, t0, t1) and you get the caller's function
    name to the log along with its execution time
   */
-#define log_end_fun(lgr, t0, t1)   lgr->log_end_fun_(__PRETTY_FUNCTION__, t0, t1)
+#define log_end_fun(lgr, t0, t1)   lgr->log_end_fun_(__PRETTY_FUNCTION__, this, t0, t1, prof_other, 0, 0.0, 0.0)
+/**
+   @brief log the end of the current function as a kernel of a layer
+   @details like log_end_fun, but also gives the profiler what the
+   call did: the phase (prof_forward etc.), the batch size, and the
+   floating point operations and bytes of memory traffic it needed
+  */
+#define log_end_kernel(lgr, t0, t1, phase, B, flops, bytes) \
+  lgr->log_end_fun_(__PRETTY_FUNCTION__, this, t0, t1, phase, B, flops, bytes)
 
 /**
    @brief entry point
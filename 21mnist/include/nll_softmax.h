@@ -8,6 +8,7 @@
 #include "mnist_util.h"
 #include "tensor.h"
 #include "grad_check.h"
+#include "bench.h"
 
 /**
    @brief configuration data for NLLSoftmaxCfg
@@ -188,6 +189,21 @@ struct NLLSoftmax {
   void forward_cpu_base(tensor<real,maxB,nC>& x, tensor<idx_t,maxB>& t, int training) {
     forward_base(x, t, training);
   }
+  /**
+     @brief 1 if this layer has its own implementation of algorithm a
+     @details forward and backward fall back to the baseline for
+     others; when you add a case for your algorithm to them, add it
+     here too (--algo auto measures only these)
+  */
+  static int has_algo(algo_t a) {
+    switch (a) {
+    case algo_cpu_base:
+    case algo_cuda_base:
+      return 1;
+    default:
+      return 0;
+    }
+  }
   /**
      @brief forward phase of the layer
      @param (x) input images
@@ -218,7 +234,9 @@ struct NLLSoftmax {
       }        
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_forward, x.n0,
+                   4.0 * x.n0 * nC,
+                   sizeof(real) * x.n0 * (nC + 1));
     return l;
   }
   /**
@@ -324,7 +342,9 @@ struct NLLSoftmax {
       }        
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_backward, gy.n0,
+                   3.0 * gy.n0 * nC,
+                   sizeof(real) * gy.n0 * (nC + 1));
     return gx;
   }
   /**
@@ -395,6 +415,15 @@ int nll_softmax_main(int argc, char ** argv) {
   double max_e = 0.0;
   double sum_e = 0.0;
   NLLSoftmaxCfg cfg;
+  if (strlen(opt.bench)) {
+    int r = bench_layer_loss<NLLSoftmax<maxB,nC>,
+                             tensor<real,maxB,nC>,
+                             tensor<idx_t,maxB>,
+                             tensor<real,maxB>,
+                             NLLSoftmaxCfg>(opt, &lgr, rg, cfg, "nll_softmax", maxB, nC);
+    lgr.end_log();
+    return r;
+  }
   for (int iter = 0; iter < n_checks; iter++) {
     printf("==== %d ====\n", iter);
     double e = grad_check_loss<NLLSoftmax<maxB,nC>,
@@ -408,6 +437,6 @@ int nll_softmax_main(int argc, char ** argv) {
   printf("max relative error = %.9f\n", max_e);
   printf("avg relative error = %.9f\n", sum_e / n_checks);
   lgr.end_log();
-  return 0;
+  return grad_check_verdict(opt, max_e);
 }
 
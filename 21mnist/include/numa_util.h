@@ -0,0 +1,222 @@
+/**
+   @file numa_util.h
+   @brief NUMA mode (--numa 1): pinning OpenMP threads node by node
+   and first-touch placement of buffers
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if __linux__
+#include <sched.h>
+#endif
+#include "mnist_util.h"
+
+/**
+   @brief the processors this process may run on, grouped by NUMA node
+ */
+struct numa_topo_t {
+  static const int max_cpus = 1024; /**< the maximum number of processors */
+  int n_nodes;                      /**< the number of nodes with some of the processors */
+  int n_cpus;                       /**< the number of processors */
+  int cpu[max_cpus];                /**< processors, in the order of nodes (cpu[0..] on the first node, ...) */
+  int node[max_cpus];               /**< node[k] is the node of cpu[k] */
+};
+
+/**
+   @brief parse a cpulist of sysfs (e.g., "0-15,32-47") into a mask
+   @returns the number of processors in it
+ */
+static int numa_parse_cpulist(const char * s, char * mask, int n) {
+  int c = 0;
+  while (*s && *s != '\n') {
+    char * e;
+    long a = strtol(s, &e, 10);
+    if (e == s) break;
+    long b = a;
+    if (*e == '-') {
+      s = e + 1;
+      b = strtol(s, &e, 10);
+    }
+    for (long i = a; i <= b && i < n; i++) {
+      if (i >= 0 && !mask[i]) {
+        mask[i] = 1;
+        c++;
+      }
+    }
+    s = (*e == ',' ? e + 1 : e);
+  }
+  return c;
+}
+
+/**
+   @brief the topology of the processors the process may run on
+   @details nodes are those of /sys/devices/system/node; without it
+   (or not on Linux), all processors are on a single node
+ */
+static numa_topo_t numa_topology() {
+  numa_topo_t t;
+  t.n_nodes = 0;
+  t.n_cpus = 0;
+  const int n = numa_topo_t::max_cpus;
+  char * allowed = (char *)calloc(n, 1);
+  char * seen = (char *)calloc(n, 1);
+#if __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int c = 0; c < n && c < CPU_SETSIZE; c++) {
+      allowed[c] = CPU_ISSET(c, &set) ? 1 : 0;
+    }
+  }
+  for (int nd = 0; nd < n; nd++) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nd);
+    FILE * fp = fopen(path, "rb");
+    if (!fp) {
+      if (nd > 0 || t.n_cpus > 0) break;
+      continue;
+    }
+    char line[4096];
+    char * mask = (char *)calloc(n, 1);
+    if (fgets(line, sizeof(line), fp)) numa_parse_cpulist(line, mask, n);
+    fclose(fp);
+    const int c0 = t.n_cpus;
+    for (int c = 0; c < n; c++) {
+      if (mask[c] && allowed[c] && !seen[c]) {
+        seen[c] = 1;
+        t.cpu[t.n_cpus] = c;
+        t.node[t.n_cpus] = nd;
+        t.n_cpus++;
+      }
+    }
+    if (t.n_cpus > c0) t.n_nodes++;
+    free(mask);
+  }
+#endif
+  /* processors in no node list (or no sysfs): one more node */
+  const int c0 = t.n_cpus;
+  for (int c = 0; c < n; c++) {
+    if (allowed[c] && !seen[c]) {
+      t.cpu[t.n_cpus] = c;
+      t.node[t.n_cpus] = t.n_nodes;
+      t.n_cpus++;
+    }
+  }
+  if (t.n_cpus > c0 || t.n_cpus == 0) t.n_nodes++;
+  if (t.n_cpus == 0) {
+    t.cpu[0] = 0;
+    t.node[0] = 0;
+    t.n_cpus = 1;
+  }
+  free(allowed);
+  free(seen);
+  return t;
+}
+
+/**
+   @brief pin the threads of an OpenMP team to processors and log the topology
+   @param (lgr) logger
+   @details thread k of n gets processor cpu[k * n_cpus / n] of
+   numa_topology, so consecutive threads share a node, and the
+   contiguous chunks schedule(static) gives them (e.g., of collapsed
+   loops over a batch) are on the same node.  nothing is pinned
+   if OMP_PROC_BIND or OMP_PLACES is set (the OpenMP runtime already
+   binds threads), but the placement is logged anyway.  a thread keeps
+   its processor in later parallel regions of the same number of
+   threads (runtimes reuse the team)
+ */
+__attribute__((unused))
+static void numa_pin_threads(logger * lgr) {
+  numa_topo_t t = numa_topology();
+  lgr->log(1, "numa: %d node(s), %d processor(s)", t.n_nodes, t.n_cpus);
+  for (int nd = 0; nd < t.n_nodes; nd++) {
+    char buf[512];
+    int len = 0;
+    for (int k = 0; k < t.n_cpus && len < (int)sizeof(buf) - 16; k++) {
+      if (t.node[k] == nd) len += snprintf(buf + len, sizeof(buf) - len, " %d", t.cpu[k]);
+    }
+    lgr->log(2, "numa: node %d:%s", nd, (len ? buf : " -"));
+  }
+#if __linux__
+  const int bound = (getenv("OMP_PROC_BIND") || getenv("OMP_PLACES"));
+  if (bound) lgr->log(1, "numa: OMP_PROC_BIND/OMP_PLACES is set; threads are left where OpenMP put them");
+#pragma omp parallel
+  {
+#ifdef _OPENMP
+    const int k = omp_get_thread_num();
+    const int nth = omp_get_num_threads();
+#else
+    const int k = 0;
+    const int nth = 1;
+#endif
+    if (!bound) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(t.cpu[(long)k * t.n_cpus / nth], &set);
+      if (sched_setaffinity(0, sizeof(set), &set) != 0) perror("sched_setaffinity");
+    }
+    const int cpu = sched_getcpu();
+#pragma omp critical
+    {
+      int nd = -1;
+      for (int j = 0; j < t.n_cpus; j++) {
+        if (t.cpu[j] == cpu) nd = t.node[j];
+      }
+      lgr->log(2, "numa: thread %d/%d on processor %d (node %d)", k, nth, cpu, nd);
+    }
+  }
+#else
+  lgr->log(1, "numa: pinning threads is not supported on this OS");
+#endif
+}
+
+/**
+   @brief zero a buffer from the threads of an OpenMP team, so that
+   its pages are placed (first touched) on the nodes of the threads
+   that will use them
+   @param (p) the buffer
+   @param (bytes) its size
+   @details the buffer is split into as many contiguous chunks as
+   threads by schedule(static), the partitioning the element-wise and
+   collapsed loops of layers use, so the chunk a thread computes on is
+   (up to page boundaries) the one it touched
+ */
+static void numa_first_touch(void * p, size_t bytes) {
+  char * a = (char *)p;
+  const long pg = sysconf(_SC_PAGESIZE) > 0 ? sysconf(_SC_PAGESIZE) : 4096;
+  const long n_pages = (long)((bytes + pg - 1) / pg);
+#pragma omp parallel for schedule(static)
+  for (long i = 0; i < n_pages; i++) {
+    const size_t b = i * pg;
+    const size_t e = (b + pg < bytes ? b + pg : bytes);
+    memset(a + b, 0, e - b);
+  }
+}
+
+/**
+   @brief first touch the first n0 rows of a tensor (the rows a batch
+   of n0 uses), as numa_first_touch
+ */
+template<typename T>
+static void numa_first_touch_rows(T& a, idx_t n0) {
+  numa_first_touch((void *)a.w, n0 * sizeof(a.w[0]));
+}
+
+/**
+   @brief the number of threads numa_first_touch splits buffers
+   among (1 without OpenMP)
+ */
+__attribute__((unused))
+static int numa_n_threads() {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
@@ -0,0 +1,249 @@
+/**
+   @file profiler.h
+   @brief an in-memory profile of kernels (calls of layers' forward,
+   backward and update): a ring of fixed-size events and totals per
+   kernel, written out once at the end
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+   @brief what a profiled call does
+ */
+typedef enum {
+  prof_other,
+  prof_forward,
+  prof_backward,
+  prof_update,
+  prof_n_phases,
+} prof_phase_t;
+
+/**
+   @brief names of prof_phase_t
+ */
+static const char * const prof_phase_names[prof_n_phases] = {
+  "other", "forward", "backward", "update"
+};
+
+/**
+   @brief a profiled call
+ */
+struct prof_event_t {
+  const char * fun;             /**< the function (__PRETTY_FUNCTION__; only the pointer is kept) */
+  const void * obj;             /**< the object (layer) it was called on */
+  int phase;                    /**< prof_phase_t */
+  int B;                        /**< batch size */
+  long t0;                      /**< start time (ns) */
+  long t1;                      /**< end time (ns) */
+  double flops;                 /**< floating point operations it performed */
+  double bytes;                 /**< bytes it had to read and write at least */
+};
+
+/**
+   @brief a profile of kernels
+   @details record costs no formatting or I/O: it stores an event
+   into a ring of cap events (the oldest are overwritten) and adds
+   its time, flops and bytes to the totals of its kernel (a function
+   on an object), so totals cover all calls even if the ring wraps.
+   write_csv and write_trace (Chrome trace, viewable in
+   chrome://tracing or ui.perfetto.dev) write the events the ring has.
+   the caller should not record from several threads at a time
+ */
+struct profiler {
+  static const int max_kernels = 64; /**< the maximum number of distinct kernels */
+  /**
+     @brief totals of a kernel
+  */
+  struct kernel_t {
+    const char * fun;           /**< the function */
+    const void * obj;           /**< the object */
+    int phase;                  /**< prof_phase_t */
+    long n_calls;               /**< the number of calls */
+    long ns;                    /**< total time */
+    double flops;               /**< total flops */
+    double bytes;               /**< total bytes */
+  };
+  /**
+     @brief the name of an object
+  */
+  struct name_t {
+    const void * obj;           /**< the object */
+    const char * name;          /**< its name (e.g., "conv1") */
+  };
+  prof_event_t * ring;          /**< the ring of events */
+  long cap;                     /**< the capacity of ring */
+  long n;                       /**< the number of events recorded (event k is in ring[k % cap]) */
+  kernel_t kernels[max_kernels]; /**< totals of kernels */
+  int n_kernels;                 /**< the number of kernels */
+  name_t names[max_kernels];     /**< names of objects */
+  int n_names;                   /**< the number of names */
+  double total_flops;            /**< flops of all calls recorded */
+  double total_bytes;            /**< bytes of all calls recorded */
+  /**
+     @brief initialize
+     @param (cap) the number of events the ring keeps (0 : only totals)
+  */
+  void init(long cap) {
+    this->cap = cap;
+    ring = (cap > 0 ? (prof_event_t *)malloc(sizeof(prof_event_t) * cap) : 0);
+    if (cap > 0 && !ring) {
+      perror("malloc");
+      exit(1);
+    }
+    n = 0;
+    n_kernels = 0;
+    n_names = 0;
+    total_flops = 0.0;
+    total_bytes = 0.0;
+  }
+  /**
+     @brief release the ring
+  */
+  void fini() {
+    free(ring);
+    ring = 0;
+    cap = 0;
+  }
+  /**
+     @brief give a name to an object (e.g., conv1 for the first convolution)
+  */
+  void name(const void * obj, const char * nm) {
+    if (n_names < max_kernels) {
+      names[n_names++] = { obj, nm };
+    }
+  }
+  /**
+     @brief the name of an object (0 if it has none)
+  */
+  const char * name_of(const void * obj) {
+    for (int i = 0; i < n_names; i++) {
+      if (names[i].obj == obj) return names[i].name;
+    }
+    return 0;
+  }
+  /**
+     @brief record a call
+  */
+  void record(const char * fun, const void * obj, int phase, long B,
+              long t0, long t1, double flops, double bytes) {
+    if (cap > 0) {
+      ring[n % cap] = { fun, obj, phase, (int)B, t0, t1, flops, bytes };
+    }
+    n++;
+    total_flops += flops;
+    total_bytes += bytes;
+    int i = 0;
+    while (i < n_kernels && (kernels[i].fun != fun || kernels[i].obj != obj)) i++;
+    if (i == n_kernels) {
+      if (n_kernels == max_kernels) return;
+      kernels[n_kernels++] = { fun, obj, phase, 0, 0, 0.0, 0.0 };
+    }
+    kernel_t& k = kernels[i];
+    k.n_calls++;
+    k.ns += t1 - t0;
+    k.flops += flops;
+    k.bytes += bytes;
+  }
+  /**
+     @brief write "Class::method" of a __PRETTY_FUNCTION__ string
+     (e.g., "Convolution2D::forward") into buf
+  */
+  static void short_name(const char * fun, char * buf, size_t sz) {
+    /* the '(' of the parameters, outside template arguments */
+    const char * paren = 0;
+    int depth = 0;
+    for (const char * q = fun; *q; q++) {
+      if (*q == '<') depth++;
+      else if (*q == '>') depth--;
+      else if (*q == '(' && depth == 0) { paren = q; break; }
+    }
+    if (!paren) {
+      snprintf(buf, sz, "%s", fun);
+      return;
+    }
+    /* the method name before it and the class (without template arguments) before that */
+    const char * m = paren;
+    while (m > fun && m[-1] != ':' && m[-1] != ' ') m--;
+    const char * c_end = m;
+    if (c_end - fun >= 2 && c_end[-1] == ':' && c_end[-2] == ':') {
+      c_end -= 2;
+      if (c_end > fun && c_end[-1] == '>') {
+        depth = 0;
+        do {
+          c_end--;
+          if (*c_end == '>') depth++;
+          else if (*c_end == '<') depth--;
+        } while (c_end > fun && depth > 0);
+      }
+      const char * c = c_end;
+      while (c > fun && c[-1] != ' ' && c[-1] != ':' && c[-1] != '*' && c[-1] != '&') c--;
+      snprintf(buf, sz, "%.*s::%.*s", (int)(c_end - c), c, (int)(paren - m), m);
+    } else {
+      snprintf(buf, sz, "%.*s", (int)(paren - m), m);
+    }
+  }
+  /**
+     @brief "name Class::method" (or "Class::method") of a kernel into buf
+  */
+  void label(const char * fun, const void * obj, char * buf, size_t sz) {
+    char s[128];
+    short_name(fun, s, sizeof(s));
+    const char * nm = name_of(obj);
+    if (nm) {
+      snprintf(buf, sz, "%s %s", nm, s);
+    } else {
+      snprintf(buf, sz, "%s", s);
+    }
+  }
+  /**
+     @brief the first event (index) the ring still has
+  */
+  long first_event() {
+    return (n > cap ? n - cap : 0);
+  }
+  /**
+     @brief write events as CSV
+     @param (path) the file
+     @param (origin) times are written relative to this (ns)
+     @returns 1 if it succeeded
+  */
+  int write_csv(const char * path, long origin) {
+    FILE * fp = fopen(path, "wb");
+    if (!fp) return 0;
+    fprintf(fp, "kernel,phase,B,t0_ns,t1_ns,dt_ns,flops,bytes\n");
+    for (long k = first_event(); k < n; k++) {
+      prof_event_t& e = ring[k % cap];
+      char lb[160];
+      label(e.fun, e.obj, lb, sizeof(lb));
+      fprintf(fp, "%s,%s,%d,%ld,%ld,%ld,%.0f,%.0f\n",
+              lb, prof_phase_names[e.phase], e.B, e.t0 - origin, e.t1 - origin,
+              e.t1 - e.t0, e.flops, e.bytes);
+    }
+    return fclose(fp) == 0;
+  }
+  /**
+     @brief write events in the Chrome trace event format (JSON)
+     @param (path) the file
+     @param (origin) times are written relative to this (ns)
+     @returns 1 if it succeeded
+  */
+  int write_trace(const char * path, long origin) {
+    FILE * fp = fopen(path, "wb");
+    if (!fp) return 0;
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (long k = first_event(); k < n; k++) {
+      prof_event_t& e = ring[k % cap];
+      char lb[160];
+      label(e.fun, e.obj, lb, sizeof(lb));
+      fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":0,"
+              "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"B\":%d,\"flops\":%.0f,\"bytes\":%.0f}}\n",
+              (k == first_event() ? "" : ","), lb, prof_phase_names[e.phase],
+              (e.t0 - origin) * 1.0e-3, (e.t1 - e.t0) * 1.0e-3, e.B, e.flops, e.bytes);
+    }
+    fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(fp) == 0;
+  }
+};
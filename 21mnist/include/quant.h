@@ -0,0 +1,542 @@
+/**
+   @file quant.h
+   @brief int8 post-training quantization of the inference-only
+   network (-a cpu_int8): per-channel int8 weights, uint8 activations
+   and int32 dot products
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <err.h>
+#include "mnist_util.h"
+#include "tensor.h"
+#include "intrin.h"
+
+/**
+   @brief the maximum number of rows (of activations) and of blocks of
+   16 columns (of weights) a dot kernel computes at a time
+ */
+static const idx_t q8_mr = 6;
+static const idx_t q8_nb = 4;
+
+/**
+   @brief a dot kernel: acc[r][l] = sum_k x[r][k] w[k][l] for r < rows
+   (<= q8_mr) and the 16 * nbw columns l of nbw (<= q8_nb) consecutive
+   blocks of packed weights
+   @param (rows) the number of rows of x
+   @param (nbw) the number of blocks of weights
+   @param (k4) the number of groups of 4 elements of a row of x
+   @param (x) uint8 activations (rows of 4 * k4 elements)
+   @param (ldx) the distance between consecutive rows of x
+   @param (wb) the first block of int8 weights, each [k4][16][4] (q8_weights::wp)
+   @param (acc) the output, rows x (16 * q8_nb) int32
+ */
+typedef void (*q8_kernel_t)(idx_t rows, idx_t nbw, idx_t k4, const uint8_t * x, idx_t ldx,
+                            const int8_t * wb, int32_t * acc);
+
+/**
+   @brief the dot kernel without intrinsics
+ */
+static void q8_dot_generic(idx_t rows, idx_t nbw, idx_t k4, const uint8_t * x, idx_t ldx,
+                           const int8_t * wb, int32_t * acc) {
+  for (idx_t r = 0; r < rows; r++) {
+    const uint8_t * x_r = x + r * ldx;
+    for (idx_t j = 0; j < nbw; j++) {
+      int32_t a[16] = { 0 };
+      for (idx_t k = 0; k < k4; k++) {
+        const int8_t * w = wb + (j * k4 + k) * 64;
+        for (idx_t l = 0; l < 16; l++) {
+          a[l] += (x_r[4*k]   * w[4*l]   + x_r[4*k+1] * w[4*l+1] +
+                   x_r[4*k+2] * w[4*l+2] + x_r[4*k+3] * w[4*l+3]);
+        }
+      }
+      memcpy(acc + r * 16 * q8_nb + 16 * j, a, sizeof(a));
+    }
+  }
+}
+
+#if INTRIN_X86
+/**
+   @brief the dot kernel of R rows and NB blocks, AVX-512 VNNI: 16
+   columns of a block in a zmm, 4 bytes of a row of x broadcast to all
+   of them (vpdpbusd, which adds the four u8 x s8 products of each
+   int32 lane without saturation); R x NB accumulators
+ */
+template<int R,int NB>
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static inline void q8_dot_avx512vnni_rn(idx_t k4, const uint8_t * x, idx_t ldx,
+                                        const int8_t * wb, int32_t * acc) {
+  __m512i a[R][NB];
+  for (int r = 0; r < R; r++) {
+    for (int j = 0; j < NB; j++) {
+      a[r][j] = _mm512_setzero_si512();
+    }
+  }
+  for (idx_t k = 0; k < k4; k++) {
+    __m512i w[NB];
+    for (int j = 0; j < NB; j++) {
+      w[j] = _mm512_load_si512((const void *)(wb + (j * k4 + k) * 64));
+    }
+    for (int r = 0; r < R; r++) {
+      int32_t x4;
+      memcpy(&x4, x + r * ldx + 4 * k, 4);
+      const __m512i xb = _mm512_set1_epi32(x4);
+      for (int j = 0; j < NB; j++) {
+        a[r][j] = _mm512_dpbusd_epi32(a[r][j], xb, w[j]);
+      }
+    }
+  }
+  for (int r = 0; r < R; r++) {
+    for (int j = 0; j < NB; j++) {
+      _mm512_storeu_si512((void *)(acc + r * 16 * q8_nb + 16 * j), a[r][j]);
+    }
+  }
+}
+
+/**
+   @brief the dot kernel of R rows, AVX-512 VNNI
+ */
+template<int R>
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void q8_dot_avx512vnni_r(idx_t nbw, idx_t k4, const uint8_t * x, idx_t ldx,
+                                const int8_t * wb, int32_t * acc) {
+  switch (nbw) {
+  case 1: q8_dot_avx512vnni_rn<R,1>(k4, x, ldx, wb, acc); break;
+  case 2: q8_dot_avx512vnni_rn<R,2>(k4, x, ldx, wb, acc); break;
+  case 3: q8_dot_avx512vnni_rn<R,3>(k4, x, ldx, wb, acc); break;
+  default: q8_dot_avx512vnni_rn<R,4>(k4, x, ldx, wb, acc); break;
+  }
+}
+
+/**
+   @brief the dot kernel, AVX-512 VNNI (a weight load is shared by all
+   rows, a broadcast of x by all blocks)
+ */
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void q8_dot_avx512vnni(idx_t rows, idx_t nbw, idx_t k4, const uint8_t * x, idx_t ldx,
+                              const int8_t * wb, int32_t * acc) {
+  static_assert(q8_mr == 6 && q8_nb == 4, "the kernel is for 6 x 4 blocks");
+  switch (rows) {
+  case 1: q8_dot_avx512vnni_r<1>(nbw, k4, x, ldx, wb, acc); break;
+  case 2: q8_dot_avx512vnni_r<2>(nbw, k4, x, ldx, wb, acc); break;
+  case 3: q8_dot_avx512vnni_r<3>(nbw, k4, x, ldx, wb, acc); break;
+  case 4: q8_dot_avx512vnni_r<4>(nbw, k4, x, ldx, wb, acc); break;
+  case 5: q8_dot_avx512vnni_r<5>(nbw, k4, x, ldx, wb, acc); break;
+  default: q8_dot_avx512vnni_r<6>(nbw, k4, x, ldx, wb, acc); break;
+  }
+}
+#endif
+
+/**
+   @brief the dot kernel to run
+   @param (opt) command line options (--isa)
+   @param (name) set to the name of the kernel
+   @details the VNNI kernel if --isa selects avx512 and the processor
+   has AVX-512 VNNI, the generic one otherwise
+ */
+static q8_kernel_t q8_select(cmdline_opt opt, const char ** name) {
+#if INTRIN_X86
+  if (isa_select(opt.isa) == isa_avx512 && __builtin_cpu_supports("avx512vnni")
+      && __builtin_cpu_supports("avx512bw")) {
+    *name = "avx512vnni";
+    return q8_dot_avx512vnni;
+  }
+#else
+  (void)opt;
+#endif
+  *name = "generic";
+  return q8_dot_generic;
+}
+
+/**
+   @brief a real (>= 0) in units of scale s (inv_s = 1/s), rounded and
+   clamped to uint8
+   @details clamped as floats (maxss/minss) rather than with branches
+   on the result: about half of the values are zeros of relu, in no
+   predictable order
+ */
+static inline uint8_t q8_u8(real v, float inv_s) {
+  float q = (float)v * inv_s + 0.5f;
+  q = (q > 0.0f ? q : 0.0f);
+  q = (q < 255.0f ? q : 255.0f);
+  return (uint8_t)(int)q;
+}
+
+/**
+   @brief the range of an activation seen in calibration
+   @details activations quantized by it are outputs of relu, so the
+   range is [0,max] and uint8 q stands for q * max / 255
+ */
+struct q8_range {
+  real max;                     /**< the largest value seen */
+  /** @brief forget everything seen */
+  void reset() {
+    max = 0.0;
+  }
+  /** @brief see n values of a */
+  void add(const real * a, long n) {
+    real m = max;
+#pragma omp parallel for reduction(max:m)
+    for (long k = 0; k < n; k++) {
+      m = (a[k] > m ? a[k] : m);
+    }
+    max = m;
+  }
+  /** @brief the value of a unit of uint8 */
+  float scale() const {
+    return (max > 0 ? (float)max / 255.0f : 1.0f);
+  }
+};
+
+/**
+   @brief int8 weights of y = x w + b (w is K x N), packed for the dot kernels
+   @param (K) the number of rows of w (a multiple of 4)
+   @param (N) the number of columns of w (outputs)
+   @details column n is quantized symmetrically with scale sw[n] =
+   max_k |w[k][n]| / 127.  columns are packed in blocks of 16 (the
+   last one padded with zeros), each [K/4][16][4], so a zmm load of
+   64 bytes has 4 consecutive k of 16 outputs
+ */
+template<idx_t K,idx_t N>
+struct q8_weights {
+  static_assert(K % 4 == 0, "K must be a multiple of 4");
+  static const idx_t K4 = K / 4;               /**< groups of 4 rows */
+  static const idx_t NB = (N + 15) / 16;       /**< blocks of 16 columns */
+  heap_tensor<int8_t,NB,K4,1,64> wp;           /**< packed weights */
+  float sw[N];                                 /**< scales of columns */
+  real b[N];                                   /**< bias */
+  /**
+     @brief quantize weights
+     @param (w) weights, w[k][n] at w[k * rs + n * cs]
+     @param (rs) the distance between rows of w
+     @param (cs) the distance between columns of w
+     @param (bias) bias (N elements)
+  */
+  void quantize(const real * w, idx_t rs, idx_t cs, const real * bias) {
+    for (idx_t n = 0; n < N; n++) {
+      real m = 0.0;
+      for (idx_t k = 0; k < K; k++) {
+        m = max_r(m, fabs(w[k * rs + n * cs]));
+      }
+      sw[n] = (m > 0 ? (float)m / 127.0f : 1.0f);
+      b[n] = bias[n];
+    }
+    wp.alloc(NB);
+    wp.set_n0(NB);
+    for (idx_t nb = 0; nb < NB; nb++) {
+      for (idx_t k = 0; k < K4; k++) {
+        int8_t * p = wp.row(nb, k);
+        for (idx_t l = 0; l < 16; l++) {
+          const idx_t n = nb * 16 + l;
+          for (idx_t q = 0; q < 4; q++) {
+            long v = 0;
+            if (n < N) {
+              v = lrintf((float)w[(4 * k + q) * rs + n * cs] / sw[n]);
+              v = (v > 127 ? 127 : (v < -127 ? -127 : v));
+            }
+            p[4 * l + q] = (int8_t)v;
+          }
+        }
+      }
+    }
+  }
+  /**
+     @brief x w + b for m rows of x, given to out(i, n0, nc, v) for
+     columns n0 <= n < n0 + nc of row i (v[n - n0]), from several threads
+     @param (kern) the dot kernel
+     @param (m) the number of rows of x
+     @param (x) uint8 activations (rows of K elements)
+     @param (ldx) the distance between consecutive rows of x
+     @param (sx) the scale of x
+     @param (out) the epilogue
+     @details a task is q8_mr rows and q8_nb blocks of columns, or a
+     block if there are fewer rows than q8_mr (e.g., a single image),
+     so that threads still have columns to split.  the int32 result is
+     dequantized with sx * sw[n]
+  */
+  template<typename F>
+  void run(q8_kernel_t kern, idx_t m, const uint8_t * x, idx_t ldx, float sx, F out) {
+    const idx_t n_rb = (m + q8_mr - 1) / q8_mr;
+    const idx_t nbw = (m >= q8_mr ? q8_nb : 1);
+    const idx_t n_cb = (NB + nbw - 1) / nbw;
+#pragma omp parallel for collapse(2) schedule(static)
+    for (idx_t rb = 0; rb < n_rb; rb++) {
+      for (idx_t cb = 0; cb < n_cb; cb++) {
+        const idx_t i0 = rb * q8_mr;
+        const idx_t rows = (m - i0 < q8_mr ? m - i0 : q8_mr);
+        const idx_t nb0 = cb * nbw;
+        const idx_t nbs = (NB - nb0 < nbw ? NB - nb0 : nbw);
+        const idx_t n0 = nb0 * 16;
+        const idx_t nc = (N - n0 < nbs * 16 ? N - n0 : nbs * 16);
+        int32_t acc[q8_mr * q8_nb * 16];
+        kern(rows, nbs, K4, x + i0 * ldx, ldx, wp.row(nb0), acc);
+        for (idx_t r = 0; r < rows; r++) {
+          real v[q8_nb * 16];
+          const int32_t * acc_r = acc + r * q8_nb * 16;
+#pragma omp simd
+          for (idx_t l = 0; l < nc; l++) {
+            v[l] = (real)(acc_r[l] * (sx * sw[n0 + l])) + b[n0 + l];
+          }
+          out(i0 + r, n0, nc, v);
+        }
+      }
+    }
+  }
+  /**
+     @brief bytes of packed weights, scales and bias
+  */
+  static size_t bytes() {
+    return decltype(wp)::bytes(NB) + sizeof(float) * N + sizeof(real) * N;
+  }
+};
+
+/**
+   @brief int8 convolution, y = relu(w ＊ x + b) in uint8
+   @param (maxB) the maximum number of images (batch size)
+   @param (IC) the number of input channels
+   @param (H) height of an input image
+   @param (W) width of an input image
+   @param (K) convolution kernel size
+   @param (OC) the number of output channels
+   @details the input is real (the output of an FP32 layer); it is
+   quantized into xq first (in a vectorized loop) and im2col copies
+   bytes of it into rows of a pixel (P x IC*K*K), which are the rows
+   of x of the dot kernels.  the output is requantized to uint8 with
+   the scale of the next layer's input, as (b,c,pixel); a row of
+   channels of a pixel is requantized into a buffer before it is
+   scattered to the channels, so that the conversions vectorize
+ */
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t K,idx_t OC>
+struct Q8Conv2D {
+  static const idx_t OH = H - K + 1; /**< output height */
+  static const idx_t OW = W - K + 1; /**< output width */
+  cmdline_opt opt;                   /**< command line option */
+  logger * lgr;                      /**< logger */
+  q8_kernel_t kern;                  /**< dot kernel */
+  q8_weights<IC*K*K,OC> q;           /**< weights */
+  heap_tensor<uint8_t,maxB,IC,1,H*W> xq;     /**< the input quantized */
+  heap_tensor<uint8_t,OH*OW,1,1,IC*K*K> col; /**< im2col buffer of an image (pixel x IC*K*K) */
+  heap_tensor<uint8_t,maxB,OC,1,OH*OW> y;    /**< layer output */
+  /**
+     @brief initialize the layer (it has no weights until quantize)
+     @param (opt) command line options
+     @param (lgr) logger
+     @param (B) the number of images to allocate the output for
+  */
+  void init(cmdline_opt opt, logger * lgr, idx_t B) {
+    this->opt = opt;
+    this->lgr = lgr;
+    const char * name;
+    kern = q8_select(opt, &name);
+    xq.alloc(B);
+    col.alloc(OH * OW);
+    y.alloc(B);
+  }
+  /**
+     @brief quantize weights w (OC x IC x K x K) and keep bias b
+  */
+  void quantize(tensor<real,OC,IC,K,K>& w, tensor<real,OC>& b) {
+    q.quantize(&w.w[0][0][0][0], 1, IC * K * K, &b.w[0][0][0][0]);
+  }
+  /**
+     @brief forward
+     @param (x) input images
+     @param (sx) the scale in which x is quantized
+     @param (sy) the scale in which y is quantized
+  */
+  heap_tensor<uint8_t,maxB,OC,1,OH*OW>& forward(tensor<real,maxB,IC,H,W>& x, float sx, float sy) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    const idx_t B = x.n0;
+    const idx_t P = OH * OW;
+    const float inv_sx = 1.0f / sx;
+    const float inv_sy = 1.0f / sy;
+    y.set_n0(B);
+    xq.set_n0(B);
+    col.set_n0(P);
+#pragma omp parallel for collapse(2)
+    for (idx_t s = 0; s < B; s++) {
+      for (idx_t ic = 0; ic < IC; ic++) {
+        const real * x_c = &x.w[s][ic][0][0];
+        uint8_t * q_c = xq.row(s, ic);
+#pragma omp simd
+        for (idx_t k = 0; k < H * W; k++) {
+          q_c[k] = q8_u8(x_c[k], inv_sx);
+        }
+      }
+    }
+    for (idx_t s = 0; s < B; s++) {
+#pragma omp parallel for
+      for (idx_t p = 0; p < P; p++) {
+        const idx_t i = p / OW, j = p % OW;
+        uint8_t * c = col.row(p);
+        for (idx_t ic = 0; ic < IC; ic++) {
+          const uint8_t * q_c = xq.row(s, ic);
+          for (idx_t di = 0; di < K; di++) {
+            for (idx_t dj = 0; dj < K; dj++) {
+              c[(ic * K + di) * K + dj] = q_c[(i + di) * W + j + dj];
+            }
+          }
+        }
+      }
+      uint8_t * y_s = y.row(s);
+      q.run(kern, P, col.w, col.ld, sx,
+            [&](idx_t p, idx_t oc0, idx_t nc, const real * v) {
+              uint8_t t[q8_nb * 16];
+#pragma omp simd
+              for (idx_t l = 0; l < nc; l++) {
+                t[l] = q8_u8(v[l], inv_sy);
+              }
+              for (idx_t l = 0; l < nc; l++) {
+                y_s[(oc0 + l) * y.ld + p] = t[l];
+              }
+            });
+    }
+    tsc_t t1 = get_tsc();
+    log_end_kernel(lgr, t0, t1, prof_forward, B,
+                   2.0 * B * OC * P * IC * K * K,
+                   1.0 * B * (sizeof(real) * IC * H * W + OC * P) + q.bytes());
+    return y;
+  }
+};
+
+/**
+   @brief max pooling of uint8 activations (max commutes with
+   quantization, so the output has the scale of the input)
+   @param (maxB) the maximum number of images (batch size)
+   @param (C) the number of channels
+   @param (H) height of an input image
+   @param (W) width of an input image
+   @param (S) shrink factor
+   @details the output is a row of C*(H/S)*(W/S) an image, the input of Q8Linear
+ */
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t S>
+struct Q8MaxPool2D {
+  static const idx_t OH = H / S;    /**< output height */
+  static const idx_t OW = W / S;    /**< output width */
+  cmdline_opt opt;                  /**< command line option */
+  logger * lgr;                     /**< logger */
+  heap_tensor<uint8_t,maxB,1,1,C*OH*OW> y; /**< output of the forward */
+  /**
+     @brief initialize the layer
+  */
+  void init(cmdline_opt opt, logger * lgr, idx_t B) {
+    this->opt = opt;
+    this->lgr = lgr;
+    y.alloc(B);
+  }
+  /**
+     @brief forward
+  */
+  heap_tensor<uint8_t,maxB,1,1,C*OH*OW>& forward(heap_tensor<uint8_t,maxB,C,1,H*W>& x) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    const idx_t B = x.n0;
+    y.set_n0(B);
+#pragma omp parallel for collapse(2)
+    for (idx_t s = 0; s < B; s++) {
+      for (idx_t c = 0; c < C; c++) {
+        const uint8_t * x_c = x.row(s, c);
+        uint8_t * y_c = y.row(s) + c * OH * OW;
+        for (idx_t i = 0; i < OH; i++) {
+          for (idx_t j = 0; j < OW; j++) {
+            uint8_t v = 0;
+            for (idx_t di = 0; di < S; di++) {
+              for (idx_t dj = 0; dj < S; dj++) {
+                const uint8_t u = x_c[(S*i+di) * W + S*j+dj];
+                v = (u > v ? u : v);
+              }
+            }
+            y_c[i * OW + j] = v;
+          }
+        }
+      }
+    }
+    tsc_t t1 = get_tsc();
+    log_end_kernel(lgr, t0, t1, prof_forward, B,
+                   1.0 * B * C * H * W,
+                   1.0 * B * C * (H * W + OH * OW));
+    return y;
+  }
+};
+
+/**
+   @brief int8 linear layer, y = x w + b
+   @param (maxB) the maximum number of rows (batch size)
+   @param (N) the number of outputs of a row
+   @param (K) the number of inputs of a row
+   @details forward8 applies relu and requantizes y to uint8 for the
+   next int8 layer; forward dequantizes it into real (the last layer)
+ */
+template<idx_t maxB,idx_t N,idx_t K>
+struct Q8Linear {
+  cmdline_opt opt;              /**< command line option */
+  logger * lgr;                 /**< logger */
+  q8_kernel_t kern;             /**< dot kernel */
+  q8_weights<K,N> q;            /**< weights */
+  heap_tensor<uint8_t,maxB,1,1,N> y; /**< output of forward8 */
+  /**
+     @brief initialize the layer (it has no weights until quantize)
+  */
+  void init(cmdline_opt opt, logger * lgr, idx_t B) {
+    this->opt = opt;
+    this->lgr = lgr;
+    const char * name;
+    kern = q8_select(opt, &name);
+    y.alloc(B);
+  }
+  /**
+     @brief quantize weights w (K x N, as Linear::w) and keep bias b
+  */
+  void quantize(const real * w, tensor<real,N>& b) {
+    q.quantize(w, N, 1, &b.w[0][0][0][0]);
+  }
+  /**
+     @brief y = relu(x w + b) in uint8 of scale sy
+     @param (x) input (scale sx)
+  */
+  heap_tensor<uint8_t,maxB,1,1,N>& forward8(heap_tensor<uint8_t,maxB,1,1,K>& x, float sx, float sy) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    const idx_t B = x.n0;
+    const float inv_sy = 1.0f / sy;
+    y.set_n0(B);
+    q.run(kern, B, x.w, x.ld, sx,
+          [&](idx_t i, idx_t n0, idx_t nc, const real * v) {
+            uint8_t * y_i = y.row(i) + n0;
+#pragma omp simd
+            for (idx_t l = 0; l < nc; l++) {
+              y_i[l] = q8_u8(v[l], inv_sy);
+            }
+          });
+    tsc_t t1 = get_tsc();
+    log_end_kernel(lgr, t0, t1, prof_forward, B,
+                   2.0 * B * N * K,
+                   1.0 * B * (K + N) + q.bytes());
+    return y;
+  }
+  /**
+     @brief z = x w + b in real
+     @param (x) input (scale sx)
+     @param (z) the output
+  */
+  tensor<real,maxB,N>& forward(heap_tensor<uint8_t,maxB,1,1,K>& x, float sx, tensor<real,maxB,N>& z) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    const idx_t B = x.n0;
+    z.set_n0(B);
+    q.run(kern, B, x.w, x.ld, sx,
+          [&](idx_t i, idx_t n0, idx_t nc, const real * v) {
+            for (idx_t l = 0; l < nc; l++) {
+              z(i,n0 + l) = v[l];
+            }
+          });
+    tsc_t t1 = get_tsc();
+    log_end_kernel(lgr, t0, t1, prof_forward, B,
+                   2.0 * B * N * K,
+                   1.0 * B * (K + sizeof(real) * N) + q.bytes());
+    return z;
+  }
+};
@@ -6,13 +6,17 @@
 
 #include "mnist_util.h"
 #include "tensor.h"
+#include "intrin.h"
 #include "grad_check.h"
+#include "bench.h"
 
 /**
    @brief configuration data for Relu
    @details no configuration currently exist
 */
-struct ReluCfg { };
+struct ReluCfg {
+  int inplace;                  /**< 1 if y overwrites x (and gx overwrites gy); cpu only */
+};
 
 /**
    @brief rectified linear layer (y_i = max(0, x_i))
@@ -36,6 +40,8 @@ struct Relu {
   tensor<real,N0,N1,N2,N3>* x_ptr; /**< pointer to input passed to forward */
   tensor<real,N0,N1,N2,N3> y;      /**< output of the forward */
   tensor<real,N0,N1,N2,N3> gx;     /**< gradient of loss wrt input x */
+  int inplace;                     /**< 1 if forward/backward work in place (ReluCfg::inplace) */
+  intrin_kernels<real> kern;       /**< intrinsic kernels (cpu_intrin) */
   /**
      @brief initialize the layer
      @param (opt) command line options
@@ -47,7 +53,9 @@ struct Relu {
     this->opt = opt;
     this->lgr = lgr;
     (void)rg;
-    (void)cfg;
+    this->inplace = cfg.inplace && !opt.cuda_algo;
+    kern = intrin_kernels<real>::get(isa_generic);
+    if (opt.algo == algo_cpu_intrin) kern = intrin_select(opt);
   }
   /**
      @brief set the device pointer for this and all subobjects
@@ -160,6 +168,68 @@ struct Relu {
   void forward_cpu_base(tensor<real,N0,N1,N2,N3>& x, int training) {
     forward_base(x, training);
   }
+  /**
+     @brief in-place forward (x = max(0, x))
+     @param (x) input images, overwritten by the output
+     @param (training) 1 if it is called in training not testing
+     @details legal when nobody reads x after this layer, which
+     holds for all relus of MNIST (the layers before them do not
+     use their outputs in backward).  backward then sees the output
+     instead of the input and passes the gradient where it is > 0
+     @sa backward_inplace
+  */
+  void forward_inplace(tensor<real,N0,N1,N2,N3>& x, int training) {
+    (void)training;
+    const idx_t n0 = x.n0;
+    const idx_t n = N1 * N2 * N3;
+    x_ptr = &x;
+#pragma omp parallel for
+    for (idx_t i0 = 0; i0 < n0; i0++) {
+      real * x_i = &x.w[i0][0][0][0];
+#pragma omp simd
+      for (idx_t j = 0; j < n; j++) {
+        x_i[j] = max_r(0, x_i[j]);
+      }
+    }
+  }
+  /**
+     @brief forward with the intrinsic kernel (cpu_intrin; cpu_omp if
+     the flavor has none)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @sa intrin_kernels
+  */
+  void forward_cpu_intrin(tensor<real,N0,N1,N2,N3>& x, int training) {
+    if (!kern.relu) {
+      forward_cpu_omp(x, training);
+      return;
+    }
+    const idx_t n0 = x.n0;
+    y.set_n0(n0);
+    x_ptr = &x;
+#pragma omp parallel for
+    for (idx_t i0 = 0; i0 < n0; i0++) {
+      kern.relu(N1 * N2 * N3, &x.w[i0][0][0][0], &y.w[i0][0][0][0]);
+    }
+  }
+  /**
+     @brief 1 if this layer has its own implementation of algorithm a
+     @details forward and backward fall back to the baseline for
+     others; when you add a case for your algorithm to them, add it
+     here too (--algo auto measures only these)
+  */
+  static int has_algo(algo_t a) {
+    switch (a) {
+    case algo_cpu_base:
+    case algo_cuda_base:
+    case algo_cpu_omp:
+    case algo_cpu_nchwc:
+    case algo_cpu_intrin:
+      return 1;
+    default:
+      return 0;
+    }
+  }
   /**
      @brief forward phase of the layer
      @param (x) input images
@@ -175,9 +245,20 @@ struct Relu {
   tensor<real,N0,N1,N2,N3>& forward(tensor<real,N0,N1,N2,N3>& x, int training) {
     log_start_fun(lgr);
     tsc_t t0 = get_tsc();
+    if (inplace) {
+      forward_inplace(x, training);
+      tsc_t t1 = get_tsc();
+      log_end_kernel(lgr, t0, t1, prof_forward, x.n0,
+                     1.0 * x.n0 * N1 * N2 * N3,
+                     2.0 * sizeof(real) * x.n0 * N1 * N2 * N3);
+      return x;
+    }
     switch (opt.algo) {
       /* add case for your implementations here */
+    case algo_cpu_intrin:
+      forward_cpu_intrin(x, training); break;
     case algo_cpu_omp:
+    case algo_cpu_nchwc:        // elementwise, hence any layout
       forward_cpu_omp(x, training); break;
     case algo_cpu_base:
       forward_cpu_base(x, training); break;
@@ -191,7 +272,9 @@ struct Relu {
       }        
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_forward, x.n0,
+                   1.0 * x.n0 * N1 * N2 * N3,
+                   2.0 * sizeof(real) * x.n0 * N1 * N2 * N3);
     return y;
   }
   /**
@@ -279,6 +362,45 @@ struct Relu {
   void backward_cpu_base(tensor<real,N0,N1,N2,N3>& gy) {
     backward_base(gy);
   }
+  /**
+     @brief backward with the intrinsic kernel (cpu_intrin; cpu_omp if
+     the flavor has none)
+     @param (gy) gradient of loss with respect to the output
+     @sa intrin_kernels
+  */
+  void backward_cpu_intrin(tensor<real,N0,N1,N2,N3>& gy) {
+    if (!kern.relu_grad) {
+      backward_cpu_omp(gy);
+      return;
+    }
+    const idx_t n0 = gy.n0;
+    gx.set_n0(n0);
+    tensor<real,N0,N1,N2,N3>& x = *x_ptr;
+#pragma omp parallel for
+    for (idx_t i0 = 0; i0 < n0; i0++) {
+      kern.relu_grad(N1 * N2 * N3, &x.w[i0][0][0][0], &gy.w[i0][0][0][0], &gx.w[i0][0][0][0]);
+    }
+  }
+  /**
+     @brief in-place backward (gy = gy where the output > 0, 0 elsewhere)
+     @param (gy) gradient of loss with respect to the output,
+     overwritten by the gradient wrt the input
+     @sa forward_inplace
+  */
+  void backward_inplace(tensor<real,N0,N1,N2,N3>& gy) {
+    const idx_t n0 = gy.n0;
+    const idx_t n = N1 * N2 * N3;
+    tensor<real,N0,N1,N2,N3>& x = *x_ptr; // holds the output of forward
+#pragma omp parallel for
+    for (idx_t i0 = 0; i0 < n0; i0++) {
+      const real * y_i = &x.w[i0][0][0][0];
+      real * g_i = &gy.w[i0][0][0][0];
+#pragma omp simd
+      for (idx_t j = 0; j < n; j++) {
+        g_i[j] = (y_i[j] > 0 ? g_i[j] : 0);
+      }
+    }
+  }
   /**
      @brief calc the gradient of loss wrt the input (x)
      @param (gy) gradient of loss with respect to the output
@@ -298,9 +420,20 @@ struct Relu {
   tensor<real,N0,N1,N2,N3>& backward(tensor<real,N0,N1,N2,N3>& gy) {
     log_start_fun(lgr);
     tsc_t t0 = get_tsc();
+    if (inplace) {
+      backward_inplace(gy);
+      tsc_t t1 = get_tsc();
+      log_end_kernel(lgr, t0, t1, prof_backward, gy.n0,
+                     1.0 * gy.n0 * N1 * N2 * N3,
+                     3.0 * sizeof(real) * gy.n0 * N1 * N2 * N3);
+      return gy;
+    }
     switch (opt.algo) {
       /* add case for your implementations here */
+    case algo_cpu_intrin:
+      backward_cpu_intrin(gy); break;
     case algo_cpu_omp:
+    case algo_cpu_nchwc:        // elementwise, hence any layout
       backward_cpu_omp(gy); break;
     case algo_cpu_base:
       backward_cpu_base(gy); break;
@@ -314,7 +447,9 @@ struct Relu {
       }        
     }
     tsc_t t1 = get_tsc();
-    log_end_fun(lgr, t0, t1);
+    log_end_kernel(lgr, t0, t1, prof_backward, gy.n0,
+                   1.0 * gy.n0 * N1 * N2 * N3,
+                   3.0 * sizeof(real) * gy.n0 * N1 * N2 * N3);
     return gx;
   }
 
@@ -386,7 +521,15 @@ int relu_main(int argc, char ** argv) {
   /* check errors */
   double max_e = 0.0;
   double sum_e = 0.0;
-  ReluCfg cfg;
+  ReluCfg cfg = { .inplace = 0 };
+  if (strlen(opt.bench)) {
+    int r = bench_layer<Relu<maxB,C,H,W>,
+                        tensor<real,maxB,C,H,W>,
+                        tensor<real,maxB,C,H,W>,
+                        ReluCfg>(opt, &lgr, rg, cfg, "relu", maxB);
+    lgr.end_log();
+    return r;
+  }
   for (int iter = 0; iter < n_checks; iter++) {
     printf("==== %d ====\n", iter);
     double e = grad_check<Relu<maxB,C,H,W>,
@@ -399,6 +542,6 @@ int relu_main(int argc, char ** argv) {
   printf("max relative error = %.9f\n", max_e);
   printf("avg relative error = %.9f\n", sum_e / n_checks);
   lgr.end_log();
-  return 0;
+  return grad_check_verdict(opt, max_e);
 }
 
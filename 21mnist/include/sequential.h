@@ -0,0 +1,362 @@
+/**
+   @file sequential.h
+   @brief a chain of layers described at compile time
+   @details Sequential<X, S0, S1, ...> is the chain of layers made
+   by specs S0, S1, ... from input tensor type X.  each spec (e.g.,
+   seq_conv2d<3,32>) is a layer template waiting for its input
+   shape: the shape of the input of a layer is that of the output
+   (y) of the previous one, so shapes are derived by the compiler
+   and a mismatch is a compile error.  forward, backward, update,
+   set_dev and the gradient-check members of the chain are those of
+   its layers in order (recursively, so calls are resolved at
+   compile time and inlined); for_each calls a function on each layer.
+
+   the chain itself has the interface of a layer (init, forward,
+   backward, update, set_dev, rand_grad, ...), so grad_check, bench_layer,
+   to_dev etc. take it as they are.
+
+   a chain of conv1 ... fc2 of the MNIST network:
+
+   Sequential<tensor<real,maxB,1,28,28>,
+              seq_conv2d<3,32>, seq_relu,
+              seq_conv2d<3,64>, seq_relu, seq_max_pooling_2d<2>, seq_dropout,
+              seq_linear<128>, seq_relu, seq_dropout,
+              seq_linear<10>>
+ */
+#pragma once
+
+#include <type_traits>
+#include "mnist_util.h"
+#include "tensor.h"
+#include "convolution.h"
+#include "relu.h"
+#include "max_pooling.h"
+#include "dropout.h"
+#include "linear.h"
+#include "grad_check.h"
+#include "bench.h"
+#include "autotune.h"
+
+/**
+   @brief dimensions of a tensor type
+ */
+template<typename X>
+struct seq_shape;
+
+template<typename T,idx_t N0,idx_t N1,idx_t N2,idx_t N3>
+struct seq_shape<tensor<T,N0,N1,N2,N3>> {
+  static constexpr idx_t n0 = N0; /**< the maximum batch size */
+  static constexpr idx_t n1 = N1; /**< channels */
+  static constexpr idx_t n2 = N2; /**< height */
+  static constexpr idx_t n3 = N3; /**< width */
+};
+
+/**
+   @brief spec of a convolution (K x K kernel, OC output channels)
+ */
+template<idx_t K,idx_t OC>
+struct seq_conv2d {
+  typedef Convolution2DCfg cfg_t;
+  template<typename X, typename s = seq_shape<X>>
+  using layer = Convolution2D<s::n0,s::n1,s::n2,s::n3,K,OC>;
+};
+
+/**
+   @brief spec of a relu
+ */
+struct seq_relu {
+  typedef ReluCfg cfg_t;
+  template<typename X, typename s = seq_shape<X>>
+  using layer = Relu<s::n0,s::n1,s::n2,s::n3>;
+};
+
+/**
+   @brief spec of a max pooling (S x S windows)
+ */
+template<idx_t S>
+struct seq_max_pooling_2d {
+  typedef MaxPooling2DCfg cfg_t;
+  template<typename X, typename s = seq_shape<X>>
+  using layer = MaxPooling2D<s::n0,s::n1,s::n2,s::n3,S>;
+};
+
+/**
+   @brief spec of a dropout
+ */
+struct seq_dropout {
+  typedef DropoutCfg cfg_t;
+  template<typename X, typename s = seq_shape<X>>
+  using layer = Dropout<s::n0,s::n1,s::n2,s::n3>;
+};
+
+/**
+   @brief spec of a linear layer (N outputs per sample)
+ */
+template<idx_t N>
+struct seq_linear {
+  typedef LinearCfg cfg_t;
+  template<typename X, typename s = seq_shape<X>>
+  using layer = Linear<s::n0,N,s::n1,s::n2,s::n3>;
+};
+
+template<typename X, typename... S>
+struct Sequential;
+
+/**
+   @brief the empty chain (the end of a chain); its output is its input
+ */
+template<typename X>
+struct Sequential<X> {
+#if __CUDACC__
+  Sequential<X> * dev;          /**< device shadow */
+#endif
+  typedef X input_t;            /**< input */
+  typedef X output_t;           /**< output */
+  static const int n_layers = 0; /**< the number of layers */
+  /**
+     @brief configuration parameters (none)
+  */
+  struct cfg_t { };
+  static cfg_t cfg() { return {}; }
+  static int has_algo(algo_t a) {
+    (void)a;
+    return 1;
+  }
+  void init(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, cfg_t cfg) {
+    (void)opt;
+    (void)lgr;
+    (void)rg;
+    (void)cfg;
+  }
+  void init(autotuner& tn, const char * const * names, logger * lgr, rnd_gen_t& rg, cfg_t cfg) {
+    (void)tn;
+    (void)names;
+    (void)lgr;
+    (void)rg;
+    (void)cfg;
+  }
+  void set_dev(Sequential<X> * dev) {
+#if __CUDACC__
+    this->dev = dev;
+#else
+    (void)dev;
+#endif
+  }
+  X& forward(X& x, int training) {
+    (void)training;
+    return x;
+  }
+  X& backward(X& gy) {
+    return gy;
+  }
+  void update() { }
+  template<typename F>
+  void for_each(F f, int i = 0) {
+    (void)f;
+    (void)i;
+  }
+  void copy_grad(Sequential<X>& o) {
+    (void)o;
+  }
+  double grad_dot_grad(Sequential<X>& o) {
+    (void)o;
+    return 0.0;
+  }
+};
+
+/**
+   @brief a chain of layers: the layer of S (head) followed by the
+   chain of the rest (tail)
+   @param (X) the input tensor type
+   @param (S) the spec of the first layer
+   @param (Rest) specs of the other layers
+ */
+template<typename X, typename S, typename... Rest>
+struct Sequential<X,S,Rest...> {
+  typedef typename S::template layer<X> head_t; /**< the first layer */
+  typedef decltype(head_t::y) mid_t;            /**< the output of the first layer */
+  typedef Sequential<mid_t,Rest...> tail_t;     /**< the other layers */
+  typedef X input_t;                            /**< input */
+  typedef typename tail_t::output_t output_t;   /**< output (that of the last layer) */
+  static const int n_layers = 1 + tail_t::n_layers; /**< the number of layers */
+  static_assert(std::is_same<decltype(head_t::gx), X>::value,
+                "the layer a spec makes must take the input type of the chain");
+#if __CUDACC__
+  Sequential<X,S,Rest...> * dev; /**< device shadow */
+#endif
+  head_t head;                  /**< the first layer */
+  tail_t tail;                  /**< the other layers */
+  /**
+     @brief configuration parameters of all layers
+  */
+  struct cfg_t {
+    typename S::cfg_t head;
+    typename tail_t::cfg_t tail;
+  };
+  /**
+     @brief make configuration parameters from those of each layer (in order)
+  */
+  static cfg_t cfg(typename S::cfg_t c, typename Rest::cfg_t... cs) {
+    return { c, tail_t::cfg(cs...) };
+  }
+  /**
+     @brief 1 if all layers implement algorithm a
+  */
+  static int has_algo(algo_t a) {
+    return head_t::has_algo(a) && tail_t::has_algo(a);
+  }
+  /**
+     @brief initialize all layers with the same options
+     @param (opt) command line options
+     @param (lgr) logger
+     @param (rg) random number generator for initializing weights
+     @param (cfg) configuration parameters
+  */
+  void init(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, cfg_t cfg) {
+    head.init(opt, lgr, rg, cfg.head);
+    tail.init(opt, lgr, rg, cfg.tail);
+  }
+  /**
+     @brief initialize all layers, each with the algorithm tn chooses (--algo auto)
+     @param (tn) the autotuner
+     @param (names) the names of layers, for the profiler and the tune file
+     @param (lgr) logger
+     @param (rg) random number generator for initializing weights
+     @param (cfg) configuration parameters
+  */
+  void init(autotuner& tn, const char * const * names, logger * lgr, rnd_gen_t& rg, cfg_t cfg) {
+    head.init(tn.template choose<head_t,X,mid_t>(names[0], cfg.head), lgr, rg, cfg.head);
+    lgr->prof.name(&head, names[0]);
+    tail.init(tn, names + 1, lgr, rg, cfg.tail);
+  }
+  /**
+     @brief set the device pointer for this and all subobjects
+     @param (dev) a device memory or null
+  */
+  void set_dev(Sequential<X,S,Rest...> * dev) {
+#if __CUDACC__
+    this->dev = dev;
+    head.set_dev(dev ? &dev->head : 0);
+    tail.set_dev(dev ? &dev->tail : 0);
+#else
+    (void)dev;
+#endif
+  }
+  /**
+     @brief forward of all layers in order
+     @param (x) input
+     @param (training) 1 if it is called in training not testing
+  */
+  output_t& forward(X& x, int training) {
+    return tail.forward(head.forward(x, training), training);
+  }
+  /**
+     @brief backward of all layers in reverse order
+     @param (gy) gradient of loss wrt the output
+  */
+  X& backward(output_t& gy) {
+    return head.backward(tail.backward(gy));
+  }
+  /**
+     @brief update of all layers that have weights
+  */
+  void update() {
+    bench_update(&head, 0);
+    tail.update();
+  }
+  /**
+     @brief call f(layer, index) on each layer in order
+     @param (f) a function (e.g., a generic lambda) taking any layer
+     @param (i) the index of the first layer
+  */
+  template<typename F>
+  void for_each(F f, int i = 0) {
+    f(head, i);
+    tail.for_each(f, i + 1);
+  }
+  /**
+     @brief randomly set all gradients to values between p and q
+  */
+  void rand_grad(rnd_gen_t& rg, real p, real q) {
+    for_each([&](auto& l, int) { l.rand_grad(rg, p, q); });
+  }
+  /**
+     @brief set all gradients to gradients of another object o
+  */
+  void copy_grad(Sequential<X,S,Rest...>& o) {
+    head.copy_grad(o.head);
+    tail.copy_grad(o.tail);
+  }
+  /**
+     @brief w += alpha * gw
+  */
+  void add_grad(real alpha) {
+    for_each([&](auto& l, int) { l.add_grad(alpha); });
+  }
+  /**
+     @brief take the inner product of gradients
+  */
+  double grad_dot_grad(Sequential<X,S,Rest...>& o) {
+    return head.grad_dot_grad(o.head) + tail.grad_dot_grad(o.tail);
+  }
+};
+
+/**
+   @brief entry point of this header file
+   @param (argc) the number of command line args
+   @param (argv) command line args
+   @sa grad_check
+   @details it makes conv1 ... fc2 of the MNIST network as a
+   Sequential, checks (at compile time) that its layers have the
+   types MNIST spells out, and calls grad_check repeatedly to test
+   backward of the whole chain
+*/
+int sequential_main(int argc, char ** argv) {
+  cmdline_opt opt = parse_args(argc, argv);
+  const idx_t maxB = MAX_BATCH_SIZE;
+  const idx_t B = min_i(maxB, opt.batch_size);
+  const int n_checks = opt.epochs;
+  typedef Sequential<tensor<real,maxB,1,28,28>,
+                     seq_conv2d<3,32>, seq_relu,
+                     seq_conv2d<3,64>, seq_relu, seq_max_pooling_2d<2>, seq_dropout,
+                     seq_linear<128>, seq_relu, seq_dropout,
+                     seq_linear<10>> net_t;
+  static_assert(net_t::n_layers == 10, "conv1 ... fc2");
+  static_assert(std::is_same<decltype(net_t::head), Convolution2D<maxB,1,28,28,3,32>>::value, "conv1");
+  static_assert(std::is_same<decltype(net_t::tail_t::tail_t::head), Convolution2D<maxB,32,26,26,3,64>>::value, "conv2");
+  static_assert(std::is_same<net_t::tail_t::tail_t::tail_t::tail_t::tail_t::tail_t::head_t,
+                Linear<maxB,128,64,12,12>>::value, "fc1");
+  static_assert(std::is_same<net_t::output_t, tensor<real,maxB,10>>::value, "fc2");
+  /* logger */
+  logger lgr;
+  lgr.start_log(opt);
+  /* initialize random number generator */
+  rnd_gen_t rg;
+  rg.seed(opt.weight_seed);
+  /* check errors */
+  double max_e = 0.0;
+  double sum_e = 0.0;
+  long seed1 = opt.dropout_seed_1;
+  long seed2 = opt.dropout_seed_2;
+  net_t::cfg_t cfg = net_t::cfg({}, { .inplace = 0 },
+                                {}, { .inplace = 0 }, {},
+                                { .ratio = 0.25f * (seed1 != 0), .seed = seed1, .inplace = 0 },
+                                {}, { .inplace = 0 },
+                                { .ratio = 0.5f * (seed2 != 0), .seed = seed2, .inplace = 0 },
+                                {});
+  if (strlen(opt.bench)) {
+    int r = bench_layer<net_t, net_t::input_t, net_t::output_t, net_t::cfg_t>(opt, &lgr, rg, cfg, "sequential", maxB);
+    lgr.end_log();
+    return r;
+  }
+  for (int iter = 0; iter < n_checks; iter++) {
+    printf("==== %d ====\n", iter);
+    double e = grad_check<net_t, net_t::input_t, net_t::output_t, net_t::cfg_t>(opt, &lgr, rg, cfg, B);
+    max_e = max_r(max_e, e);
+    sum_e += e;
+  }
+  printf("max relative error = %.9f\n", max_e);
+  printf("avg relative error = %.9f\n", sum_e / n_checks);
+  lgr.end_log();
+  return grad_check_verdict(opt, max_e);
+}
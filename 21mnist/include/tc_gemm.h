@@ -0,0 +1,133 @@
+/**
+   @file tc_gemm.h
+   @brief a matrix multiply on tensor cores (WMMA) with FP16/BF16
+   operands and FP32 accumulation, used by the cuda_tc layers
+ */
+#pragma once
+
+#include "mnist_util.h"
+
+/**
+   @brief warps of a block along rows of C
+   @details a block computes a (16 TC_WARPS_M) x (16 TC_WARPS_N) tile
+   of C, each warp a 16 x 16 fragment of it
+ */
+#ifndef TC_WARPS_M
+#define TC_WARPS_M 2
+#endif
+/**
+   @brief warps of a block along columns of C
+ */
+#ifndef TC_WARPS_N
+#define TC_WARPS_N 2
+#endif
+/**
+   @brief 1 if operands are rounded to bfloat16 instead of half
+   @details bfloat16 has the exponent range of float (so gradients
+   hardly underflow and loss scaling is less critical) but only 8 bits
+   of mantissa; it needs sm_80
+ */
+#ifndef TC_BF16
+#define TC_BF16 0
+#endif
+
+static const idx_t tc_bm = 16 * TC_WARPS_M;           /**< rows of C per block */
+static const idx_t tc_bn = 16 * TC_WARPS_N;           /**< columns of C per block */
+static const idx_t tc_bk = 16;                        /**< inner dimension staged at a time */
+static const int tc_threads = 32 * TC_WARPS_M * TC_WARPS_N; /**< threads per block */
+
+#if __CUDACC__
+#include <mma.h>
+#if TC_BF16
+#include <cuda_bf16.h>
+/**
+   @brief type of operands given to tensor cores
+ */
+typedef __nv_bfloat16 tc_real;
+/**
+   @brief round a real to tc_real
+ */
+__device__ inline tc_real to_tc(real a) {
+  return __float2bfloat16((float)a);
+}
+#else
+#include <cuda_fp16.h>
+typedef __half tc_real;
+__device__ inline tc_real to_tc(real a) {
+  return __float2half((float)a);
+}
+#endif
+
+/**
+   @brief the number of blocks along columns (x) and rows (y) of the
+   grid to compute an M x N matrix with tc_gemm_block
+ */
+static dim3 tc_grid(idx_t M, idx_t N) {
+  return dim3((N + tc_bn - 1) / tc_bn, (M + tc_bm - 1) / tc_bm);
+}
+
+/**
+   @brief a block of C = A B on tensor cores (call from all tc_threads threads of a block)
+   @param (M) rows of C
+   @param (N) columns of C
+   @param (K) the inner dimension
+   @param (a) a(i,k) gives A(i,k) (0 <= i < M, 0 <= k < K)
+   @param (b) b(k,j) gives B(k,j) (0 <= k < K, 0 <= j < N)
+   @param (c) c(i,j,v) is called with v = C(i,j) for each (i,j) of the tile
+   @details the block at (blockIdx.y, blockIdx.x) computes rows
+   tc_bm blockIdx.y ... and columns tc_bn blockIdx.x ... of C.
+   operands are taken through a and b so that callers can give
+   matrices that are never formed (e.g., im2col of an image);
+   tc_bk columns of A and rows of B of the tile are
+   rounded to tc_real into shared memory (0 outside the matrix), and
+   each warp multiplies its 16 x 16 fragment with FP32 accumulators.
+   a block whose tile is outside C (e.g., when M or N depend on the
+   batch size and the grid was made for the maximum) returns without
+   calling c
+ */
+template<typename FA, typename FB, typename FC>
+__device__ void tc_gemm_block(idx_t M, idx_t N, idx_t K, FA a, FB b, FC c) {
+  using namespace nvcuda;
+  /* 8 and 4 elements of padding keep leading dimensions a multiple
+     of 16 bytes (required by load/store_matrix_sync) and spread banks */
+  const idx_t lda = tc_bk + 8, ldb = tc_bn + 8, ldc = tc_bn + 4;
+  __shared__ tc_real as[tc_bm * lda];
+  __shared__ tc_real bs[tc_bk * ldb];
+  __shared__ float cs[tc_bm * ldc];
+  const idx_t i0 = blockIdx.y * tc_bm, j0 = blockIdx.x * tc_bn;
+  if (i0 >= M || j0 >= N) return;
+  const idx_t tid = threadIdx.x;
+  const idx_t warp = tid / 32;
+  const idx_t wi = warp / TC_WARPS_N, wj = warp % TC_WARPS_N;
+  wmma::fragment<wmma::accumulator,16,16,16,float> acc;
+  wmma::fill_fragment(acc, 0.0f);
+  for (idx_t k0 = 0; k0 < K; k0 += tc_bk) {
+    for (idx_t q = tid; q < tc_bm * tc_bk; q += tc_threads) {
+      const idx_t ii = q / tc_bk, kk = q % tc_bk;
+      const idx_t i = i0 + ii, k = k0 + kk;
+      as[ii * lda + kk] = to_tc(i < M && k < K ? a(i, k) : (real)0);
+    }
+    for (idx_t q = tid; q < tc_bk * tc_bn; q += tc_threads) {
+      const idx_t kk = q / tc_bn, jj = q % tc_bn;
+      const idx_t k = k0 + kk, j = j0 + jj;
+      bs[kk * ldb + jj] = to_tc(k < K && j < N ? b(k, j) : (real)0);
+    }
+    __syncthreads();
+    wmma::fragment<wmma::matrix_a,16,16,16,tc_real,wmma::row_major> af;
+    wmma::fragment<wmma::matrix_b,16,16,16,tc_real,wmma::row_major> bf;
+    wmma::load_matrix_sync(af, &as[(wi * 16) * lda], lda);
+    wmma::load_matrix_sync(bf, &bs[wj * 16], ldb);
+    wmma::mma_sync(acc, af, bf, acc);
+    __syncthreads();
+  }
+  wmma::store_matrix_sync(&cs[(wi * 16) * ldc + wj * 16], acc, ldc, wmma::mem_row_major);
+  __syncthreads();
+  for (idx_t q = tid; q < tc_bm * tc_bn; q += tc_threads) {
+    const idx_t ii = q / tc_bn, jj = q % tc_bn;
+    const idx_t i = i0 + ii, j = j0 + jj;
+    if (i < M && j < N) {
+      c(i, j, (real)cs[ii * ldc + jj]);
+    }
+  }
+}
+#endif
@@ -5,8 +5,11 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdio.h>
+#ifdef _OPENMP
 #include <omp.h>
+#endif
 
 #ifndef ARRAY_INDEX_CHECK
 #define ARRAY_INDEX_CHECK 1
@@ -69,6 +72,53 @@ static void range_chk_(idx_t a, idx_t x, idx_t b,
 #define range_chk(a, x, b) 
 #endif
 
+#ifndef CBLOCK
+/**
+   @brief channels per block in the blocked layout of activations
+   (cpu_nchwc); 16 floats fill an AVX-512 register (two AVX2 ones).
+   give a number larger than all channel counts (e.g., -DCBLOCK=1024)
+   for NHWC
+*/
+#define CBLOCK 16
+#endif
+
+/**
+   @brief the number of channels per block when C channels are
+   laid out in blocks (tensor::blk)
+   @param (C) the number of channels
+   @details CBLOCK if it divides C, otherwise C (a single block, i.e., NHWC)
+ */
+constexpr idx_t tensor_cblock(idx_t C) {
+  return (C % CBLOCK == 0 ? CBLOCK : C);
+}
+
+#ifndef TENSOR_ALIGN
+/** 
+    @brief alignment (in bytes) of the elements of tensor (TENSOR_HEAP)
+    and of the elements and rows of heap_tensor
+*/
+#define TENSOR_ALIGN 64
+#endif
+
+#ifndef TENSOR_HEAP
+#if __CUDACC__
+/**
+   @brief 1 if the elements of tensor are on the heap (tensor::alloc,
+   tensor::attach), 0 if they are embedded in the object.  CUDA
+   builds embed them, as layers and networks go to their device
+   shadows as a whole (to_dev of mnist_util.h)
+*/
+#define TENSOR_HEAP 0
+#else
+/**
+   @brief 1 if the elements of tensor are on the heap (tensor::alloc,
+   tensor::attach), 0 if they are embedded in the object.  CUDA
+   builds embed them, as layers and networks go to their device
+   shadows as a whole (to_dev of mnist_util.h)
+*/
+#define TENSOR_HEAP 1
+#endif
+#endif
 
 /**
    @brief tensor (multi-dimensional array), up to four dimensions
@@ -81,14 +131,97 @@ static void range_chk_(idx_t a, idx_t x, idx_t b,
    throughout the MNIST network, is is used to represent a mini-batch
    of images (B images, each image of which has C channels, each channel
    of which has HxW pixels.
+   the same elements can instead be laid out in blocks of CB
+   channels (blk), as algo_cpu_nchwc does: sample i0 is then a
+   (N1/CB) x N2 x N3 x CB array, so the CB channels of a pixel are
+   contiguous.
+   with TENSOR_HEAP (builds without CUDA), the elements are on the
+   heap and have room for cap0 rows: N0 when constructed (zero-filled),
+   fewer when a network gives its activations memory for the actual
+   batch size (alloc, or attach to memory of an arena_t).  w is then
+   a pointer to rows, so w[i0][i1][i2][i3] and sizeof(w[0]) mean the
+   same as with the embedded array.  a copy gets its own elements.
 */
 template<typename T,idx_t N0,idx_t N1=1,idx_t N2=1,idx_t N3=1>
 struct tensor {
+  static const idx_t CB = tensor_cblock(N1); /**< channels per block in the blocked layout */
 #if __CUDACC__
   tensor<T,N0,N1,N2,N3> * dev;     /**< pointer to the device shadow */
 #endif
   idx_t n0;                      /**< actual number of elements across the first dimension */
+#if TENSOR_HEAP
+  idx_t cap0;                    /**< the number of rows the elements have room for */
+  T (*w)[N1][N2][N3];            /**< elements (cap0 rows) */
+  void * mem;                    /**< the memory alloc got (freed by this), or null if w is attached */
+  tensor() : n0(0), cap0(0), w(0), mem(0) {
+    alloc(N0);
+  }
+  tensor(const tensor<T,N0,N1,N2,N3>& o) : n0(0), cap0(0), w(0), mem(0) {
+    *this = o;
+  }
+  ~tensor() {
+    free(mem);
+  }
+  tensor<T,N0,N1,N2,N3>& operator=(const tensor<T,N0,N1,N2,N3>& o) {
+    if (this != &o) {
+      if (cap0 < o.cap0) alloc(o.cap0);
+      if (o.cap0 > 0) memcpy(w, o.w, bytes(o.cap0));
+      n0 = o.n0;
+    }
+    return *this;
+  }
+  /**
+     @brief allocate (zero-filled) elements for cap0 rows
+     @param (cap0) the number of rows (<= N0)
+     @details the previous elements, if any, are discarded.
+     pages of a large allocation are left for the first touch
+  */
+  void alloc(idx_t cap0) {
+    attach(0, 0);
+    if (cap0 > 0) {
+      mem = calloc(bytes(cap0) + TENSOR_ALIGN, 1);
+      if (!mem) {
+        perror("calloc"); bail();
+      }
+      uintptr_t a = ((uintptr_t)mem + TENSOR_ALIGN - 1) / TENSOR_ALIGN * TENSOR_ALIGN;
+      w = (T (*)[N1][N2][N3])a;
+      this->cap0 = cap0;
+    }
+  }
+  /**
+     @brief use memory that somebody else owns (e.g., an arena_t) for cap0 rows
+     @param (p) the memory of at least bytes(cap0) bytes (may be null if cap0 is 0)
+     @param (cap0) the number of rows (<= N0)
+     @details the previous elements, if any, are discarded
+  */
+  void attach(T * p, idx_t cap0) {
+    assert(cap0 <= N0);
+    free(mem);
+    mem = 0;
+    w = (T (*)[N1][N2][N3])p;
+    this->cap0 = cap0;
+    this->n0 = 0;
+  }
+#else
   T w[N0][N1][N2][N3];           /**< elements */
+#endif
+  /**
+     @brief the number of bytes of n0 rows
+  */
+  static size_t bytes(idx_t n0) {
+    return sizeof(T) * n0 * N1 * N2 * N3;
+  }
+  /**
+     @brief the number of rows the elements have room for
+  */
+  __device__ __host__
+  idx_t capacity() const {
+#if TENSOR_HEAP
+    return cap0;
+#else
+    return N0;
+#endif
+  }
   /**
      @brief access the (b,c,i,j) element
      @param (b) the first index (image index in a mini batch)
@@ -104,13 +237,85 @@ struct tensor {
     range_chk(0, i3, N3);
     return w[i0][i1][i2][i3];
   }
+  /**
+     @brief access the (b,c,i,j) element in the blocked layout
+     @details it is at [b][c/CB][i][j][c%CB] of the elements of
+     sample b seen as a (N1/CB) x N2 x N3 x CB array
+     @sa blk_ptr
+  */
+  __device__ __host__
+  T& blk(idx_t i0, idx_t i1, idx_t i2=0, idx_t i3=0) {
+    range_chk(0, i0, n0);
+    range_chk(0, i1, N1);
+    range_chk(0, i2, N2);
+    range_chk(0, i3, N3);
+    return (&w[i0][0][0][0])[((i1 / CB * N2 + i2) * N3 + i3) * CB + i1 % CB];
+  }
+  /**
+     @brief the address of the CB channels of block cb of pixel (i,j)
+     of sample b in the blocked layout (contiguous)
+     @sa blk
+  */
+  __device__ __host__
+  T * blk_ptr(idx_t i0, idx_t cb, idx_t i2=0, idx_t i3=0) {
+    range_chk(0, i0, n0);
+    range_chk(0, cb, N1 / CB);
+    range_chk(0, i2, N2);
+    range_chk(0, i3, N3);
+    return (&w[i0][0][0][0]) + ((cb * N2 + i2) * N3 + i3) * CB;
+  }
+  /**
+     @brief 1 if the blocked layout is the same as the standard one
+     (one block or one pixel per channel)
+  */
+  static constexpr int blk_is_identity() {
+    return CB == 1 || N2 * N3 == 1;
+  }
+  /**
+     @brief b = this in the blocked layout
+     @param (b) the array that gets the elements in the blocked layout (not this)
+     @sa from_blk
+  */
+  void to_blk(tensor<T,N0,N1,N2,N3>& b) {
+    tensor<T,N0,N1,N2,N3>& a = *this;
+    b.set_n0(n0);
+    #pragma omp parallel for collapse(3)
+    for (idx_t i0 = 0; i0 < n0; i0++) {
+      for (idx_t i1 = 0; i1 < N1; i1++) {
+        for (idx_t i2 = 0; i2 < N2; i2++) {
+          for (idx_t i3 = 0; i3 < N3; i3++) {
+            b.blk(i0,i1,i2,i3) = a(i0,i1,i2,i3);
+          }
+        }
+      }
+    }
+  }
+  /**
+     @brief this = b, which is in the blocked layout
+     @param (b) the array in the blocked layout (not this)
+     @sa to_blk
+  */
+  void from_blk(tensor<T,N0,N1,N2,N3>& b) {
+    tensor<T,N0,N1,N2,N3>& a = *this;
+    set_n0(b.n0);
+    #pragma omp parallel for collapse(3)
+    for (idx_t i0 = 0; i0 < n0; i0++) {
+      for (idx_t i1 = 0; i1 < N1; i1++) {
+        for (idx_t i2 = 0; i2 < N2; i2++) {
+          for (idx_t i3 = 0; i3 < N3; i3++) {
+            a(i0,i1,i2,i3) = b.blk(i0,i1,i2,i3);
+          }
+        }
+      }
+    }
+  }
   /**
      @brief set the number of elements along the first dimension
      @param (N) the number of elements specified
   */
   __device__ __host__ 
   void set_n0(idx_t n0) {
-    assert(n0 <= N0);
+    assert(n0 <= capacity());
     this->n0 = n0;
   }
   /**
@@ -388,6 +593,223 @@ struct tensor {
     (void)dev;
 #endif
   }
+#if !TENSOR_HEAP
+  /**
+     @brief bytes of the object before the elements (the device
+     pointer and n0)
+   */
+  static size_t head_bytes() {
+    return offsetof(tensor, w);
+  }
+  /**
+     @brief bytes of the object up to the end of row n0-1 (the
+     whole object if n0 is out of range, e.g., never set)
+   */
+  size_t live_bytes() {
+    if (n0 < 0 || n0 > N0) return sizeof(*this);
+    return head_bytes() + sizeof(w[0]) * n0;
+  }
+#endif
+};
+
+/**
+   @brief send a tensor to its device shadow, only up to its live
+   rows (n0), if the algorithm is a CUDA algorithm
+   @details more specialized than to_dev of mnist_util.h, so it is
+   the one chosen for (standalone) tensors; layers and networks
+   containing tensors are still sent whole.  rows n0 or later of the
+   device shadow are left as they were.  with maxB = 64 and a batch of
+   one image, it is 64 times fewer bytes
+   @sa to_host
+*/
+template<typename T,idx_t N0,idx_t N1,idx_t N2,idx_t N3>
+void to_dev(tensor<T,N0,N1,N2,N3> * a, int cuda_algo) {
+#if __CUDACC__
+  if (cuda_algo) {
+    tensor<T,N0,N1,N2,N3> * dev_ = a->dev;
+    if (!dev_) {
+      dev_ = make_dev(a, cuda_algo);
+    }
+    ::to_dev(dev_, a, a->live_bytes());
+  }
+#else
+  (void)cuda_algo;
+  (void)a;
+#endif
+}
+
+/**
+   @brief get a tensor back from its device shadow, only up to its
+   live rows, if the algorithm is a CUDA algorithm
+   @details kernels may have changed n0 of the device shadow, so
+   n0 comes first and then that many rows (two transfers)
+   @sa to_dev
+*/
+template<typename T,idx_t N0,idx_t N1,idx_t N2,idx_t N3>
+void to_host(tensor<T,N0,N1,N2,N3> * a, int cuda_algo) {
+#if __CUDACC__
+  if (cuda_algo) {
+    tensor<T,N0,N1,N2,N3> * dev_ = a->dev;
+    assert(dev_);
+    ::to_host(a, dev_, a->head_bytes());
+    const size_t sz = a->live_bytes() - a->head_bytes();
+    if (sz > 0) {
+      ::to_host(&a->w[0], &dev_->w[0], sz);
+    }
+  }
+#else
+  (void)cuda_algo;
+  (void)a;
+#endif
+}
+
+/**
+   @brief the number of elements of a row of n elements of type T,
+   padded so that the row size is a multiple of TENSOR_ALIGN bytes
+   @param (n) the number of elements of a row
+ */
+template<typename T>
+constexpr idx_t tensor_padded(idx_t n) {
+  return (idx_t)((n * sizeof(T) + TENSOR_ALIGN - 1)
+                 / TENSOR_ALIGN * TENSOR_ALIGN / sizeof(T));
+}
+
+/**
+   @brief tensor whose elements are on the heap, 64 byte
+   aligned and whose rows are padded
+   @param (N0) the maximum number of elements along the first dimension
+   @param (N1) the number of elements along the second dimension
+   @param (N2) the number of elements along the third dimension
+   @param (N3) the number of elements along the fourth dimension
+   @param (L3) the distance between consecutive rows (i3 = 0 of
+   consecutive i2's), in elements; N3 rounded up to TENSOR_ALIGN bytes
+   by default
+   @details the shape is static as in tensor and element (i0,i1,i2,i3)
+   is w[((i0 * N1 + i1) * N2 + i2) * L3 + i3].  the storage for
+   the first dimension is allocated at runtime (alloc), so it takes
+   memory only for the number of rows actually used (e.g., the batch
+   size given on the command line rather than maxB), even in CUDA
+   builds, and unlike tensor every row starts at a TENSOR_ALIGN byte
+   boundary, which lets SIMD loops and gemm use aligned loads.  copying it copies
+   the elements (make_copy (new T(*layer)) of a layer having
+   heap_tensors gets its own buffers), unless the elements are
+   in memory given by attach (e.g., an arena_t), in which case
+   the copy refers to the same memory.
+   the elements are not visible from the GPU, so only use it for
+   CPU-only buffers; tensors that go to the device shadow must
+   remain tensor, whose elements CUDA builds embed in the object.
+*/
+template<typename T,idx_t N0,idx_t N1=1,idx_t N2=1,idx_t N3=1,
+         idx_t L3=tensor_padded<T>(N3)>
+struct heap_tensor {
+  static_assert(L3 >= N3, "L3 must be >= N3");
+  static const idx_t ld = L3;   /**< the distance between consecutive rows */
+  idx_t n0;                     /**< actual number of elements across the first dimension */
+  idx_t cap0;                   /**< the number of elements allocated across the first dimension */
+  T * w;                        /**< elements */
+  int own;                      /**< 1 if w was allocated by alloc (and is freed by this) */
+  heap_tensor() : n0(0), cap0(0), w(0), own(0) { }
+  heap_tensor(const heap_tensor<T,N0,N1,N2,N3,L3>& o) : n0(0), cap0(0), w(0), own(0) {
+    *this = o;
+  }
+  ~heap_tensor() {
+    if (own) free(w);
+  }
+  heap_tensor<T,N0,N1,N2,N3,L3>& operator=(const heap_tensor<T,N0,N1,N2,N3,L3>& o) {
+    if (this != &o) {
+      if (o.own) {
+        alloc(o.cap0);
+        memcpy(w, o.w, bytes(cap0));
+      } else {
+        attach(o.w, o.cap0);
+      }
+      n0 = o.n0;
+    }
+    return *this;
+  }
+  /**
+     @brief the number of bytes for cap0 rows along the first dimension
+  */
+  static size_t bytes(idx_t cap0) {
+    return sizeof(T) * cap0 * N1 * N2 * L3;
+  }
+  /**
+     @brief allocate (zero-filled) elements for cap0 rows along the first dimension
+     @param (cap0) the number of rows (<= N0)
+     @details the previous elements, if any, are discarded
+  */
+  void alloc(idx_t cap0) {
+    attach(0, 0);
+    this->cap0 = cap0;
+    if (cap0 > 0) {
+      size_t sz = (bytes(cap0) + TENSOR_ALIGN - 1) / TENSOR_ALIGN * TENSOR_ALIGN;
+      w = (T *)aligned_alloc(TENSOR_ALIGN, sz);
+      if (!w) {
+        perror("aligned_alloc"); bail();
+      }
+      memset(w, 0, sz);
+      own = 1;
+    }
+  }
+  /**
+     @brief use memory that somebody else owns for cap0 rows
+     @param (p) the memory of at least bytes(cap0) bytes, aligned
+     to TENSOR_ALIGN bytes
+     @param (cap0) the number of rows (<= N0)
+     @details the previous elements, if any, are discarded
+  */
+  void attach(T * p, idx_t cap0) {
+    assert(cap0 <= N0);
+    assert(((uintptr_t)p) % TENSOR_ALIGN == 0);
+    if (own) free(w);
+    w = p;
+    own = 0;
+    this->cap0 = cap0;
+    this->n0 = 0;
+  }
+  /**
+     @brief access the (i0,i1,i2,i3) element
+  */
+  T& operator()(idx_t i0, idx_t i1=0, idx_t i2=0, idx_t i3=0) {
+    range_chk(0, i0, n0);
+    range_chk(0, i1, N1);
+    range_chk(0, i2, N2);
+    range_chk(0, i3, N3);
+    return w[((i0 * N1 + i1) * N2 + i2) * L3 + i3];
+  }
+  /**
+     @brief the address of the row (i0,i1,i2), i.e., element (i0,i1,i2,0)
+  */
+  T * row(idx_t i0, idx_t i1=0, idx_t i2=0) {
+    range_chk(0, i0, cap0);
+    return w + ((i0 * N1 + i1) * N2 + i2) * L3;
+  }
+  /**
+     @brief set the number of elements along the first dimension
+     @param (N) the number of elements specified
+  */
+  void set_n0(idx_t n0) {
+    assert(n0 <= cap0);
+    this->n0 = n0;
+  }
+  /**
+     @brief initialize elements of the array  to a single constant value
+     @param (B) the number of rows to initialize
+     @param (x) the value of each element
+  */
+  void init_const(idx_t n0, T x) {
+    set_n0(n0);
+    heap_tensor<T,N0,N1,N2,N3,L3>& a = *this;
+    for (idx_t i0 = 0; i0 < n0; i0++) {
+      for (idx_t i1 = 0; i1 < N1; i1++) {
+        for (idx_t i2 = 0; i2 < N2; i2++) {
+          for (idx_t i3 = 0; i3 < N3; i3++) {
+            a(i0,i1,i2,i3) = x;
+          }
+        }
+      }
+    }
+  }
 };
 
 /**
@@ -0,0 +1,396 @@
+/**
+   @file winograd.h
+   @brief Winograd F(2x2,3x3) convolution used by Convolution2D
+ */
+#pragma once
+
+#include "mnist_util.h"
+#include "tensor.h"
+#include "gemm.h"
+#include "arena.h"
+
+/**
+   @brief G of F(2x2,3x3) (U = G g G^T)
+ */
+static const real winograd_G[4][3]  = {
+  { 1.0,  0.0, 0.0 },
+  { 0.5,  0.5, 0.5 },
+  { 0.5, -0.5, 0.5 },
+  { 0.0,  0.0, 1.0 } };
+/**
+   @brief G^T of F(2x2,3x3)
+ */
+static const real winograd_GT[3][4] = {
+  { 1.0, 0.5,  0.5, 0.0 },
+  { 0.0, 0.5, -0.5, 0.0 },
+  { 0.0, 0.5,  0.5, 1.0 } };
+/**
+   @brief B^T of F(2x2,3x3) (V = B^T d B)
+ */
+static const real winograd_BT[4][4] = {
+  { 1.0,  0.0, -1.0,  0.0 },
+  { 0.0,  1.0,  1.0,  0.0 },
+  { 0.0, -1.0,  1.0,  0.0 },
+  { 0.0,  1.0,  0.0, -1.0 } };
+/**
+   @brief B of F(2x2,3x3)
+ */
+static const real winograd_B[4][4] = {
+  {  1.0, 0.0,  0.0,  0.0 },
+  {  0.0, 1.0, -1.0,  1.0 },
+  { -1.0, 1.0,  1.0,  0.0 },
+  {  0.0, 0.0,  0.0, -1.0 } };
+/**
+   @brief A^T of F(2x2,3x3) (Y = A^T M A)
+ */
+static const real winograd_AT[2][4] = {
+  { 1.0, 1.0,  1.0,  0.0 },
+  { 0.0, 1.0, -1.0, -1.0 } };
+/**
+   @brief A of F(2x2,3x3)
+ */
+static const real winograd_A[4][2] = {
+  { 1.0,  0.0 },
+  { 1.0,  1.0 },
+  { 1.0, -1.0 },
+  { 0.0, -1.0 } };
+
+/**
+   @brief Y = L X R for small constant matrices L and R
+   @param (L) R_ x P matrix
+   @param (X) P x Q matrix
+   @param (Rm) Q x C matrix
+   @param (Y) R_ x C result
+ */
+template<int R_,int P,int Q,int C>
+static inline void winograd_sandwich(const real (&L)[R_][P], const real (&X)[P][Q],
+                                     const real (&Rm)[Q][C], real (&Y)[R_][C]) {
+  real T[R_][Q];
+  for (int i = 0; i < R_; i++) {
+    for (int j = 0; j < Q; j++) {
+      real v = 0.0;
+      for (int p = 0; p < P; p++) {
+        v += L[i][p] * X[p][j];
+      }
+      T[i][j] = v;
+    }
+  }
+  for (int i = 0; i < R_; i++) {
+    for (int j = 0; j < C; j++) {
+      real v = 0.0;
+      for (int q = 0; q < Q; q++) {
+        v += T[i][q] * Rm[q][j];
+      }
+      Y[i][j] = v;
+    }
+  }
+}
+
+/**
+   @brief Winograd convolution of Convolution2D<maxB,IC,H,W,K,OC>
+   @details the primary template is for kernel sizes that have no
+   Winograd algorithm here (supported = 0); Convolution2D falls back
+   to the baseline for them.
+   @sa Convolution2DWinograd<maxB,IC,H,W,3,OC>
+ */
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t K,idx_t OC>
+struct Convolution2DWinograd {
+  static const int supported = 0; /**< 1 if Winograd is implemented for K */
+  /**
+     @brief allocate work buffers (nothing to do)
+  */
+  void init() {
+  }
+  /**
+     @brief add work buffers to an arena (nothing to do)
+  */
+  void plan_scratch(arena_t& a, const char * owner, uint64_t live) {
+    (void)a; (void)owner; (void)live;
+  }
+  /**
+     @brief move work buffers into an arena (nothing to do)
+  */
+  void attach_scratch(arena_t& a) {
+    (void)a;
+  }
+  /**
+     @brief transform weights (nothing to do)
+  */
+  void transform_weights(tensor<real,OC,IC,K,K>& w) {
+    (void)w;
+  }
+  /**
+     @brief forward (never called)
+  */
+  void forward(tensor<real,maxB,IC,H,W>& x, tensor<real,OC>& b,
+               tensor<real,maxB,OC,H-K+1,W-K+1>& y) {
+    (void)x; (void)b; (void)y;
+  }
+  /**
+     @brief backward (never called)
+  */
+  void backward(tensor<real,maxB,IC,H,W>& x, tensor<real,maxB,OC,H-K+1,W-K+1>& gy,
+                tensor<real,OC,IC,K,K>& gw, tensor<real,OC>& gb,
+                tensor<real,maxB,IC,H,W>& gx) {
+    (void)x; (void)gy; (void)gw; (void)gb; (void)gx;
+  }
+};
+
+/**
+   @brief Winograd F(2x2,3x3) convolution
+
+   @param (maxB) the maximum number of images (batch size)
+   @param (IC) the number of input channels
+   @param (H) height of an input image
+   @param (W) width of an input image
+   @param (OC) the number of output channels
+
+   @details the (H-2)x(W-2) output is covered by 2x2 tiles, each
+   computed from a 4x4 input tile d as A^T [(G g G^T) ⊙ (B^T d B)] A.
+   the elementwise product summed over input channels becomes, for
+   each of the 16 tile positions xi, a matrix multiply
+   M[xi] (OC x T) = U[xi] (OC x IC) V[xi] (IC x T), where T is the
+   number of tiles per image.  a 2x2 tile needs 16 multiplies instead
+   of 36.  tiles running past the bottom/right edge (odd H-2 or W-2)
+   read zeros and store only the valid outputs.
+
+   backward transposes each step: gM = A gY A^T, gU += gM V^T,
+   gV = U^T gM, gd = B gV B^T (added to gx), and finally
+   gw = G^T gU G.  U is recomputed by transform_weights whenever w
+   changes.
+ */
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t OC>
+struct Convolution2DWinograd<maxB,IC,H,W,3,OC> {
+  static const int supported = 1;       /**< 1 if Winograd is implemented for K */
+  static const idx_t OH = H - 2;        /**< output height */
+  static const idx_t OW = W - 2;        /**< output width */
+  static const idx_t TH = (OH + 1) / 2; /**< tiles along the height */
+  static const idx_t TW = (OW + 1) / 2; /**< tiles along the width */
+  static const idx_t T = TH * TW;       /**< tiles per image */
+  tensor<real,16,OC,IC> U;  /**< transformed weights G g G^T */
+  tensor<real,16,OC,IC> gU; /**< ∂L/∂U */
+  heap_tensor<real,16,IC,1,T> V; /**< transformed input tiles of an image (or ∂L/∂V) */
+  heap_tensor<real,16,OC,1,T> M; /**< products before the output transform (or ∂L/∂M) */
+  /**
+     @brief allocate work buffers
+  */
+  void init() {
+    V.alloc(16);
+    M.alloc(16);
+  }
+  int V_id;                 /**< index of V in the scratch arena (or -1) */
+  int M_id;                 /**< index of M in the scratch arena (or -1) */
+  /**
+     @brief add work buffers (V and M) to an arena
+     @param (a) the arena
+     @param (owner) the name of the convolution layer
+     @param (live) steps at which the layer runs
+  */
+  void plan_scratch(arena_t& a, const char * owner, uint64_t live) {
+    V_id = (V.cap0 ? a.add(owner, "winograd.V", V.bytes(V.cap0), live) : -1);
+    M_id = (M.cap0 ? a.add(owner, "winograd.M", M.bytes(M.cap0), live) : -1);
+  }
+  /**
+     @brief move work buffers into an arena after it is allocated
+     @param (a) the arena
+  */
+  void attach_scratch(arena_t& a) {
+    if (V_id >= 0) V.attach((real *)a.ptr(V_id), V.cap0);
+    if (M_id >= 0) M.attach((real *)a.ptr(M_id), M.cap0);
+  }
+  /**
+     @brief U = G w G^T for all (oc,ic)
+     @param (w) weights
+  */
+  void transform_weights(tensor<real,OC,IC,3,3>& w) {
+    U.set_n0(16);
+#pragma omp parallel for collapse(2)
+    for (idx_t oc = 0; oc < OC; oc++) {
+      for (idx_t ic = 0; ic < IC; ic++) {
+        real g[3][3];
+        real u[4][4];
+        for (idx_t i = 0; i < 3; i++) {
+          for (idx_t j = 0; j < 3; j++) {
+            g[i][j] = w(oc,ic,i,j);
+          }
+        }
+        winograd_sandwich(winograd_G, g, winograd_GT, u);
+        for (idx_t xi = 0; xi < 16; xi++) {
+          U(xi,oc,ic) = u[xi / 4][xi % 4];
+        }
+      }
+    }
+  }
+  /**
+     @brief V = B^T d B for all input tiles d of sample s
+     @param (x) input images
+     @param (s) the sample
+  */
+  void transform_input(tensor<real,maxB,IC,H,W>& x, idx_t s) {
+    V.set_n0(16);
+#pragma omp parallel for collapse(2)
+    for (idx_t ic = 0; ic < IC; ic++) {
+      for (idx_t th = 0; th < TH; th++) {
+        for (idx_t tw = 0; tw < TW; tw++) {
+          real d[4][4];
+          real v[4][4];
+          for (idx_t a = 0; a < 4; a++) {
+            for (idx_t c = 0; c < 4; c++) {
+              const idx_t i = 2 * th + a, j = 2 * tw + c;
+              d[a][c] = (i < H && j < W ? x(s,ic,i,j) : 0.0);
+            }
+          }
+          winograd_sandwich(winograd_BT, d, winograd_B, v);
+          for (idx_t xi = 0; xi < 16; xi++) {
+            V(xi,ic,0,th * TW + tw) = v[xi / 4][xi % 4];
+          }
+        }
+      }
+    }
+  }
+  /**
+     @brief forward
+     @param (x) input images
+     @param (b) bias
+     @param (y) output
+     @details U must be up to date (transform_weights)
+  */
+  void forward(tensor<real,maxB,IC,H,W>& x, tensor<real,OC>& b,
+               tensor<real,maxB,OC,OH,OW>& y) {
+    const idx_t B = x.n0;
+    M.set_n0(16);
+    for (idx_t s = 0; s < B; s++) {
+      transform_input(x, s);
+      for (idx_t xi = 0; xi < 16; xi++) {
+        gemm<OC,T,IC>(OC, T, IC, &U.w[xi][0][0][0], IC, 1,
+                      V.row(xi), V.ld, 1, M.row(xi), M.ld, 0);
+      }
+#pragma omp parallel for collapse(2)
+      for (idx_t oc = 0; oc < OC; oc++) {
+        for (idx_t th = 0; th < TH; th++) {
+          for (idx_t tw = 0; tw < TW; tw++) {
+            real m[4][4];
+            real o[2][2];
+            for (idx_t xi = 0; xi < 16; xi++) {
+              m[xi / 4][xi % 4] = M(xi,oc,0,th * TW + tw);
+            }
+            winograd_sandwich(winograd_AT, m, winograd_A, o);
+            for (idx_t a = 0; a < 2; a++) {
+              for (idx_t c = 0; c < 2; c++) {
+                const idx_t i = 2 * th + a, j = 2 * tw + c;
+                if (i < OH && j < OW) {
+                  y(s,oc,i,j) = o[a][c] + b(oc);
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  /**
+     @brief backward
+     @param (x) input images given to forward
+     @param (gy) ∂L/∂y
+     @param (gw) ∂L/∂w (output)
+     @param (gb) ∂L/∂b (output)
+     @param (gx) ∂L/∂x (output)
+  */
+  void backward(tensor<real,maxB,IC,H,W>& x, tensor<real,maxB,OC,OH,OW>& gy,
+                tensor<real,OC,IC,3,3>& gw, tensor<real,OC>& gb,
+                tensor<real,maxB,IC,H,W>& gx) {
+    const idx_t B = gy.n0;
+    M.set_n0(16);
+    gU.set_n0(16);
+#pragma omp parallel for
+    for (idx_t oc = 0; oc < OC; oc++) {
+      real v = 0.0;
+      for (idx_t s = 0; s < B; s++) {
+        for (idx_t i = 0; i < OH; i++) {
+          for (idx_t j = 0; j < OW; j++) {
+            v += gy(s,oc,i,j);
+          }
+        }
+      }
+      gb(oc) = v;
+    }
+    if (B == 0) {
+      gU.init_const(16, 0.0);
+    }
+    for (idx_t s = 0; s < B; s++) {
+      transform_input(x, s);
+      /* gM = A gY A^T */
+#pragma omp parallel for collapse(2)
+      for (idx_t oc = 0; oc < OC; oc++) {
+        for (idx_t th = 0; th < TH; th++) {
+          for (idx_t tw = 0; tw < TW; tw++) {
+            real g[2][2];
+            real m[4][4];
+            for (idx_t a = 0; a < 2; a++) {
+              for (idx_t c = 0; c < 2; c++) {
+                const idx_t i = 2 * th + a, j = 2 * tw + c;
+                g[a][c] = (i < OH && j < OW ? gy(s,oc,i,j) : 0.0);
+              }
+            }
+            winograd_sandwich(winograd_A, g, winograd_AT, m);
+            for (idx_t xi = 0; xi < 16; xi++) {
+              M(xi,oc,0,th * TW + tw) = m[xi / 4][xi % 4];
+            }
+          }
+        }
+      }
+      for (idx_t xi = 0; xi < 16; xi++) {
+        /* gU[xi] (+)= gM[xi] V[xi]^T */
+        gemm<OC,IC,T>(OC, IC, T, M.row(xi), M.ld, 1,
+                      V.row(xi), 1, V.ld, &gU.w[xi][0][0][0], IC, s > 0);
+        /* gV[xi] = U[xi]^T gM[xi] (overwrites V[xi]) */
+        gemm<IC,T,OC>(IC, T, OC, &U.w[xi][0][0][0], 1, IC,
+                      M.row(xi), M.ld, 1, V.row(xi), V.ld, 0);
+      }
+      /* gd = B gV B^T, added up into gx */
+#pragma omp parallel for
+      for (idx_t ic = 0; ic < IC; ic++) {
+        for (idx_t i = 0; i < H; i++) {
+          for (idx_t j = 0; j < W; j++) {
+            gx(s,ic,i,j) = 0.0;
+          }
+        }
+        for (idx_t th = 0; th < TH; th++) {
+          for (idx_t tw = 0; tw < TW; tw++) {
+            real v[4][4];
+            real d[4][4];
+            for (idx_t xi = 0; xi < 16; xi++) {
+              v[xi / 4][xi % 4] = V(xi,ic,0,th * TW + tw);
+            }
+            winograd_sandwich(winograd_B, v, winograd_BT, d);
+            for (idx_t a = 0; a < 4; a++) {
+              for (idx_t c = 0; c < 4; c++) {
+                const idx_t i = 2 * th + a, j = 2 * tw + c;
+                if (i < H && j < W) {
+                  gx(s,ic,i,j) += d[a][c];
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+    /* gw = G^T gU G */
+#pragma omp parallel for collapse(2)
+    for (idx_t oc = 0; oc < OC; oc++) {
+      for (idx_t ic = 0; ic < IC; ic++) {
+        real u[4][4];
+        real g[3][3];
+        for (idx_t xi = 0; xi < 16; xi++) {
+          u[xi / 4][xi % 4] = gU(xi,oc,ic);
+        }
+        winograd_sandwich(winograd_GT, u, winograd_G, g);
+        for (idx_t i = 0; i < 3; i++) {
+          for (idx_t j = 0; j < 3; j++) {
+            gw(oc,ic,i,j) = g[i][j];
+          }
+        }
+      }
+    }
+  }
+};
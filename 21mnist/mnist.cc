@@ -2,76 +2,226 @@
    @file mnist.cc --- a C++ implemention of MNIST
  */
 
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "include/mnist_util.h"
 #include "include/mnist_data.h"
 #include "include/mnist.h"
+#include "include/mnist_infer.h"
+#include "include/data_parallel.h"
+#include "include/mnist_server.h"
 
 
 
 /**
    @brief grab a mini batch (B training samples), forward, backward and update.
    @return the average loss of the mini batch.
+   @details with data-parallel replicas (dp), each replica works on its
+   part of mini batches, and losses and sample counts are summed over replicas
  */
 template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC>
 static void train(MNIST<maxB,C,H,W,nC> * mnist,
-                  mnist_dataset<maxB,C,H,W>& data, idx_t B,
-                  logger& lgr, int cuda_algo, long epoch, long log_interval) {
-  data.rewind();
+                  mnist_loader<maxB,C,H,W>& loader,
+                  logger& lgr, dp_env& dp, long epoch, long log_interval) {
+  mnist_dataset<maxB,C,H,W>& data = *loader.data;
+  loader.start();
   long n_samples = 0;
   lgr.log(2, "Train Epoch %ld starts", epoch);
-  for (long batch_idx = 0; data.get_data(mnist->x, mnist->t, mnist->idxs, B, cuda_algo); batch_idx++) {
+  mnist_batch<maxB,C,H,W> * b;
+  for (long batch_idx = 0; (b = loader.next()); batch_idx++) {
     lgr.log(2, "Train Epoch %ld batch %ld (samples %ld - %ld) starts",
-            epoch, batch_idx, n_samples, n_samples + mnist->x.n0);
-    real Lsum = mnist->forward_backward_update(mnist->x, mnist->t);
-    real L = Lsum / mnist->idxs.n0;
-    mnist->predict(mnist->pred);
-    mnist->log_prediction(n_samples, mnist->pred, mnist->t);
+            epoch, batch_idx, n_samples, n_samples + b->x.n0);
+    real Lsum = mnist->forward_backward_update(b->x, b->t);
+    /* loss and the number of samples of the (global) batch */
+    double s[2] = { Lsum, (double)b->idxs.n0 };
+    dp.sum(s, 2);
+    real L = s[0] / s[1];
+    if (mnist->opt.log_pred) {
+      mnist->log_prediction(n_samples, mnist->pred, b->t, b->idxs);
+    }
     if (batch_idx % log_interval == 0) {
       lgr.log(1, "Train Epoch: %ld [%ld/%ld (%.0f%%)]\tLoss: %.6f",
               epoch, n_samples, data.n_data,
               100. * n_samples / data.n_data, L);
     }
     lgr.log(2, "Train Epoch %ld batch %ld (samples %ld - %ld) ends",
-            epoch, batch_idx, n_samples, n_samples + mnist->x.n0);
-    n_samples += mnist->x.n0;
+            epoch, batch_idx, n_samples, n_samples + b->x.n0);
+    n_samples += (long)s[1];
   }
+  /* micro batches short of --accum-steps at the end of the epoch */
+  mnist->flush_grad_accum();
+  mnist->hybrid_report("Train Epoch", epoch);
   lgr.log(2, "Train Epoch %ld ends", epoch);
 }
 
 /**
    @brief forward compute B_validate validation samples 
    (taking several mini batches if necessary)
-   @return the average loss of the validation data
+   @return the accuracy (the fraction of correctly predicted samples)
+   @details mnist is the training network or the inference-only one
  */
-template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC>
-static void test(MNIST<maxB,C,H,W,nC> * mnist,
-                 mnist_dataset<maxB,C,H,W>& data, idx_t B,
-                 logger& lgr, int cuda_algo, long epoch) {
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC,int train>
+static double test(MNIST<maxB,C,H,W,nC,train> * mnist,
+                 mnist_loader<maxB,C,H,W>& loader,
+                 logger& lgr, dp_env& dp, long epoch) {
+  mnist_dataset<maxB,C,H,W>& data = *loader.data;
   real Lsum = 0.0;
   long n_samples = 0;
   long n_correct = 0;
-  data.rewind();
+  loader.start();
   lgr.log(2, "Test Epoch %ld starts", epoch);
-  for (long batch_idx = 0; data.get_data(mnist->x, mnist->t, mnist->idxs, B, cuda_algo); batch_idx++) {
+  mnist_batch<maxB,C,H,W> * b;
+  for (long batch_idx = 0; (b = loader.next()); batch_idx++) {
     lgr.log(2, "Test Epoch %ld batch %ld (samples %ld - %ld) starts",
-            epoch, batch_idx, n_samples, n_samples + mnist->x.n0);
-    tensor<real,maxB>& y = mnist->forward(mnist->x, mnist->t, 0);
-    to_host(&y, cuda_algo);
-    mnist->predict(mnist->pred);
-    Lsum += y.sum();
-    n_samples += mnist->x.n0;
-    n_correct += mnist->log_prediction(n_samples, mnist->pred, mnist->t);
+            epoch, batch_idx, n_samples, n_samples + b->x.n0);
+    /* only the sums (and predictions, to log them) come back from the GPU */
+    batch_stats_t st = mnist->test_batch(b->x, b->t, mnist->opt.log_pred);
+    Lsum += st.loss;
+    n_samples += b->x.n0;
+    n_correct += st.correct;
+    if (mnist->opt.log_pred) {
+      mnist->log_prediction(n_samples, mnist->pred, b->t, b->idxs);
+    }
     lgr.log(2, "Test Epoch %ld batch %ld (samples %ld - %ld) ends",
-            epoch, batch_idx, n_samples, n_samples + mnist->x.n0);
+            epoch, batch_idx, n_samples, n_samples + b->x.n0);
   }
-  assert(n_samples == data.n_data);
+  double s[3] = { Lsum, (double)n_samples, (double)n_correct };
+  dp.sum(s, 3);
+  Lsum = s[0];
+  n_samples = s[1];
+  n_correct = s[2];
+  /* all data but a last batch smaller than the number of replicas */
+  assert(n_samples == data.cur);
+  assert(dp.size > 1 || n_samples == data.n_data);
   if (n_samples > 0) {
     lgr.log(1, "Test set: Average loss: %.4f, Accuracy: %ld/%ld (%.0f%%)",
             Lsum / n_samples, n_correct, n_samples, (100. * n_correct) / n_samples);
   }
   lgr.log(2, "Test Epoch %ld ends", epoch);
+  return (n_samples > 0 ? (double)n_correct / n_samples : 0.0);
 }
 
+/**
+   @brief record activation ranges of an inference-only network on
+   n_batches mini batches of loader (the training data) and quantize
+   it (-a cpu_int8)
+ */
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC>
+static void calibrate(MNIST<maxB,C,H,W,nC,0> * net,
+                      mnist_loader<maxB,C,H,W>& loader,
+                      logger& lgr, long n_batches) {
+  loader.start();
+  lgr.log(1, "int8 calibration starts");
+  long n_samples = 0;
+  mnist_batch<maxB,C,H,W> * b;
+  for (long batch_idx = 0; batch_idx < n_batches && (b = loader.next()); batch_idx++) {
+    net->calibrate(b->x);
+    n_samples += b->x.n0;
+  }
+  loader.finish();
+  lgr.log(1, "int8 calibration ends (%ld samples)", n_samples);
+  net->quantize();
+}
+
+/**
+   @brief evaluate the test data on a snapshot of weights in a thread
+   of its own, while the next epoch trains (--eval-async 1)
+   @details the snapshot goes into the inference-only network
+   (MNIST<maxB,C,H,W,nC,0>).  the thread runs with
+   --eval-threads OpenMP threads of its own on CPU, and on its own
+   default stream (--default-stream per-thread) under CUDA.  it logs
+   to a logger of its own (the same log file, but a profiler of its
+   own, as a profiler is not thread-safe), whose kernel profile is
+   logged at the end.  at most one evaluation is in flight; start
+   waits for the previous one
+ */
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC>
+struct async_eval {
+  MNIST<maxB,C,H,W,nC,0> * net; /**< the network evaluated (the snapshot) */
+  mnist_loader<maxB,C,H,W> * loader; /**< the loader of the test data */
+  logger lgr;                   /**< the logger of the evaluation */
+  dp_env * dp;                  /**< replicas (a single one) */
+  int cuda_algo;                /**< 1 if the network runs on the device */
+  int threads;                  /**< the number of OpenMP threads of the evaluation */
+  long epoch;                   /**< the epoch of the snapshot being evaluated */
+  pthread_t th;                 /**< the thread */
+  int running;                  /**< 1 if th has not been joined */
+  /**
+     @brief initialize
+     @param (opt) command line option
+     @param (main_lgr) the logger of training (the log file is shared)
+     @param (cfg) the configuration the trained network was built with
+     @param (loader) the loader of the test data
+     @param (dp) replicas
+  */
+  void init(cmdline_opt opt, logger& main_lgr, MNISTCfg cfg,
+            mnist_loader<maxB,C,H,W> * loader, dp_env * dp) {
+    lgr = main_lgr;
+    lgr.prof.init(0);
+    opt.numa = 0;               /* do not re-pin the threads of training */
+    lgr.opt = opt;
+    rnd_gen_t rg;               /* weights are overwritten by snapshots */
+    rg.seed(opt.weight_seed);
+    net = new MNIST<maxB,C,H,W,nC,0>();
+    net->init(opt, &lgr, rg, cfg);
+    to_dev(net, opt.cuda_algo);
+    this->loader = loader;
+    this->dp = dp;
+    cuda_algo = opt.cuda_algo;
+    threads = opt.eval_threads;
+    running = 0;
+  }
+  /**
+     @brief the entry point of the thread
+  */
+  static void * run_(void * arg) {
+    async_eval * e = (async_eval *)arg;
+#ifdef _OPENMP
+    omp_set_num_threads(e->threads);
+#endif
+    e->lgr.log(2, "async eval of epoch %ld starts", e->epoch);
+    test(e->net, *e->loader, e->lgr, *e->dp, e->epoch);
+    e->lgr.log(2, "async eval of epoch %ld ends", e->epoch);
+    return 0;
+  }
+  /**
+     @brief wait for the evaluation in flight, if any
+  */
+  void wait() {
+    if (running) {
+      pthread_join(th, 0);
+      running = 0;
+    }
+  }
+  /**
+     @brief take a snapshot of the weights of src and start evaluating it
+     @param (src) the network being trained
+     @param (epoch) the number of epochs src has been trained
+  */
+  void start(MNIST<maxB,C,H,W,nC> * src, long epoch) {
+    wait();
+    net->copy_weights_from(*src);
+    this->epoch = epoch;
+    if (pthread_create(&th, 0, run_, this)) err(1, "pthread_create");
+    running = 1;
+  }
+  /**
+     @brief wait for the evaluation in flight and release resources
+  */
+  void fini() {
+    wait();
+    if (lgr.prof.n_kernels) {
+      lgr.log(1, "async eval:");
+      lgr.log_profile();
+    }
+    lgr.prof.fini();
+    del_dev(net, cuda_algo);
+    delete net;
+  }
+};
+
 /**
    @brief main function of MNIST
    @details Train MNIST network with data from the file specified by
@@ -84,8 +234,36 @@ static void test(MNIST<maxB,C,H,W,nC> * mnist,
    @return the average loss of the validation data
  */
 int main(int argc, char ** argv) {
+  /* data-parallel replicas (a single one unless built with -DUSE_MPI=1) */
+  dp_env dp;
+  dp.init(&argc, &argv);
   cmdline_opt opt = parse_args(argc, argv);
   if (opt.error || opt.help) usage(argv[0]);
+  if (dp.size > 1) {
+    if (opt.cuda_algo && opt.cuda_exec == 2) {
+      fprintf(stderr, "error: --cuda-exec 2 cannot capture all-reduces of data-parallel training\n");
+      exit(1);
+    }
+    /* replicas other than 0 only write their own logs */
+    if (dp.rank > 0) {
+      char * log = (char *)malloc(strlen(opt.log) + 16);
+      sprintf(log, "%s.%d", opt.log, dp.rank);
+      opt.log = log;
+      opt.verbose = 0;
+    }
+    if (opt.serve[0]) {
+      fprintf(stderr, "error: --serve runs a single process\n");
+      exit(1);
+    }
+    if (opt.hybrid) {
+      fprintf(stderr, "error: --hybrid runs a single replica\n");
+      exit(1);
+    }
+  }
+  /* answers go to stdout, so the log must not */
+  if (strcmp(opt.serve, "-") == 0) {
+    opt.verbose = -1;
+  }
   const idx_t maxB = MAX_BATCH_SIZE;  /**< max batch size (constant) */
   const idx_t C = 1;                  /**< channels in input */
   const idx_t H = 28;                 /**< input image height */
@@ -101,44 +279,172 @@ int main(int argc, char ** argv) {
   rg.seed(opt.weight_seed);
   /* build model and initialize weights */
   lgr.log(1, "model building starts");
-  long seed1 = opt.dropout_seed_1;
-  long seed2 = opt.dropout_seed_2;
+  /* replicas drop different elements (replica 0 those of a single process) */
+  long seed1 = opt.dropout_seed_1 + (opt.dropout_seed_1 != 0) * 7919L * dp.rank;
+  long seed2 = opt.dropout_seed_2 + (opt.dropout_seed_2 != 0) * 7919L * dp.rank;
   MNISTCfg cfg = {
     .conv1 = {},
-    .relu1 = {},
+    .relu1 = { .inplace = opt.inplace },
     .conv2 = {},
-    .relu2 = {},
+    .relu2 = { .inplace = opt.inplace },
     .max_pooling_2d = {},
-    .dropout1 = { .ratio = 0.25f * (seed1 != 0), .seed = seed1 },
+    .dropout1 = { .ratio = 0.25f * (seed1 != 0), .seed = seed1, .inplace = opt.inplace },
     .fc1 = {},
-    .relu3 = {},
-    .dropout2 = { .ratio =  0.5f * (seed2 != 0), .seed = seed2 },
+    .relu3 = { .inplace = opt.inplace },
+    .dropout2 = { .ratio =  0.5f * (seed2 != 0), .seed = seed2, .inplace = opt.inplace },
     .fc2 = {},
     .nll_softmax = {}
   };
+  /* an inference-only algorithm (-a cpu_int8) trains in real */
+  cmdline_opt train_opt = opt;
+  if (algo_is_inference_only(opt.algo)) {
+    train_opt.algo = int8_train_algo;
+    train_opt.algo_s = algo_name(int8_train_algo);
+    lgr.log(1, "training network runs -a %s (-a %s is for inference)", train_opt.algo_s, opt.algo_s);
+  }
   MNIST<maxB,C,H,W,nC> * mnist = new MNIST<maxB,C,H,W,nC>();
-  mnist->init(opt, &lgr, rg, cfg);
+  mnist->init(train_opt, &lgr, rg, cfg);
   to_dev(mnist, opt.cuda_algo);
+  /* resume from a checkpoint (after to_dev, so that it goes straight to the device) */
+  long epoch0 = 0;
+  if (opt.load[0]) {
+    epoch0 = mnist->load(opt.load);
+  }
+  grad_sync gsync;
+  gsync.init(&dp, &lgr, opt.cuda_algo, opt.dp_bucket_kb * 1024);
+  if (dp.size > 1) {
+    lgr.log(1, "data parallel: replica %d of %d (local %d)", dp.rank, dp.size, dp.local_rank);
+    mnist->set_grad_sync(&gsync);
+  }
   lgr.log(1, "model building ends");
+  real mean = 0.1307;           // pytorch
+  real std = 0.3081;            // pytorch
+  /* serve predictions instead of training */
+  if (opt.serve[0]) {
+    if (!opt.load[0]) {
+      lgr.log(0, "warning: serving untrained weights (no --load)");
+    }
+    /* serve from the inference-only network */
+    MNIST<maxB,C,H,W,nC,0> * net = new MNIST<maxB,C,H,W,nC,0>();
+    net->init(opt, &lgr, rg, cfg);
+    to_dev(net, opt.cuda_algo);
+    net->copy_weights_from(*mnist);
+    if (algo_is_inference_only(opt.algo)) {
+      /* activation ranges of int8 layers come from (some of) the training data */
+      const long n_calib = (long)opt.int8_calib * B;
+      mnist_dataset<maxB,C,H,W> calib_data;
+      calib_data.load(lgr, opt.data_dir,
+                      (opt.train_data_size < 0 || opt.train_data_size > n_calib ? n_calib : opt.train_data_size),
+                      mean, std, 1, opt.data_cache);
+      calib_data.set_seed(opt.shuffle_seed);
+      mnist_loader<maxB,C,H,W> calib_loader;
+      calib_loader.init(&calib_data, B, opt.prefetch, opt.cuda_algo);
+      calibrate(net, calib_loader, lgr, opt.int8_calib);
+      calib_loader.fini();
+      calib_data.close();
+    }
+    mnist_server<maxB,C,H,W,nC> server;
+    server.init(net, &lgr, opt, mean, std);
+    server.run();
+    server.fini();
+    lgr.end_log();
+    del_dev(net, opt.cuda_algo);
+    delete net;
+    delete mnist;
+    dp.fini();
+    return 0;
+  }
   /* load data */
   mnist_dataset<maxB,C,H,W> train_data;
   mnist_dataset<maxB,C,H,W> test_data;
-  real mean = 0.1307;           // pytorch
-  real std = 0.3081;            // pytorch
-  train_data.load(lgr, opt.data_dir, opt.train_data_size, mean, std, 1);
-  test_data.load(lgr, opt.data_dir, opt.test_data_size, mean, std, 0);
+  train_data.load(lgr, opt.data_dir, opt.train_data_size, mean, std, 1, opt.data_cache);
+  test_data.load(lgr, opt.data_dir, opt.test_data_size, mean, std, 0, opt.data_cache);
+  train_data.set_seed(opt.shuffle_seed);
+  /* the orders of epochs already trained (so a resumed run sees the same orders) */
+  for (long i = 0; i < epoch0; i++) {
+    train_data.rewind();
+  }
+  train_data.set_shard(dp.rank, dp.size);
+  test_data.set_shard(dp.rank, dp.size);
+  mnist_loader<maxB,C,H,W> train_loader;
+  mnist_loader<maxB,C,H,W> test_loader;
+  train_loader.init(&train_data, B, opt.prefetch, opt.cuda_algo);
+  test_loader.init(&test_data, B, opt.prefetch, opt.cuda_algo);
+  /* several batches per update (--accum-steps) */
+  grad_accum gacc;
+  gacc.init(&lgr, opt.cuda_algo, opt.accum_steps);
+  if (opt.accum_steps > 1) {
+    lgr.log(1, "virtual batch size %ld (%d x %ld)", (long)opt.accum_steps * B, opt.accum_steps, (long)B);
+    mnist->set_grad_accum(&gacc);
+  }
   /* training loop */
   lgr.log(1, "training starts");
-  for (long i = 0; i < opt.epochs; i++) {
-    train(mnist, train_data, B, lgr, opt.cuda_algo, i + 1, opt.log_interval);
-    test(mnist, test_data, B, lgr, opt.cuda_algo, i + 1);
+  if (epoch0 > 0) {
+    lgr.log(1, "resume after epoch %ld", epoch0);
+  }
+  /* evaluate while the next epoch trains; all-reduces of replicas would need MPI_THREAD_MULTIPLE */
+  int eval_async = opt.eval_async;
+  if (eval_async && dp.size > 1) {
+    lgr.log(1, "--eval-async is ignored with data-parallel replicas");
+    eval_async = 0;
+  }
+  async_eval<maxB,C,H,W,nC> ev;
+  if (eval_async) {
+    ev.init(opt, lgr, cfg, &test_loader, &dp);
+  }
+  long saved = (opt.load[0] ? epoch0 : -1); /* the epoch of the last checkpoint */
+  for (long i = epoch0; i < opt.epochs; i++) {
+    train(mnist, train_loader, lgr, dp, i + 1, opt.log_interval);
+    if ((i + 1) % opt.eval_every == 0 || i + 1 == opt.epochs) {
+      if (eval_async) {
+        ev.start(mnist, i + 1);
+      } else {
+        test(mnist, test_loader, lgr, dp, i + 1);
+        mnist->hybrid_report("Test Epoch", i + 1);
+      }
+    }
+    if (dp.size > 1 && !dp.same(mnist->weight_digest())) {
+      lgr.log(0, "warning: weights of replicas differ after epoch %ld", i + 1);
+    }
+    if (opt.save[0] && opt.checkpoint_every > 0 && (i + 1) % opt.checkpoint_every == 0) {
+      if (dp.rank == 0) mnist->save(opt.save, i + 1);
+      saved = i + 1;
+    }
+  }
+  if (eval_async) {
+    ev.fini();
   }
   lgr.log(1, "training ends");
+  const long epochs = (epoch0 > opt.epochs ? epoch0 : opt.epochs);
+  /* int8 inference of the trained weights against real */
+  if (algo_is_inference_only(opt.algo)) {
+    MNIST<maxB,C,H,W,nC,0> * net = new MNIST<maxB,C,H,W,nC,0>();
+    net->init(opt, &lgr, rg, cfg);
+    to_dev(net, opt.cuda_algo);
+    net->copy_weights_from(*mnist);
+    lgr.log(1, "int8: test in real");
+    const double acc_real = test(net, test_loader, lgr, dp, epochs);
+    calibrate(net, train_loader, lgr, opt.int8_calib);
+    lgr.log(1, "int8: test in int8");
+    const double acc_int8 = test(net, test_loader, lgr, dp, epochs);
+    lgr.log(1, "int8: accuracy %.2f%% (real %.2f%%, delta %+.2f points)",
+            100.0 * acc_int8, 100.0 * acc_real, 100.0 * (acc_int8 - acc_real));
+    del_dev(net, opt.cuda_algo);
+    delete net;
+  }
+  if (opt.save[0] && saved != epochs && dp.rank == 0) {
+    mnist->save(opt.save, epochs);
+  }
   lgr.end_log();
 
+  train_loader.fini();
+  test_loader.fini();
   train_data.close();
   test_data.close();
+  if (dp.size > 1) gsync.fini();
+  gacc.fini();
   delete mnist;
+  dp.fini();
   return 0;
 }
 